@@ -0,0 +1,198 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Size and speed of the compressed log format against the others, on traffic
+ * shaped like a real vehicle bus: a fixed set of periodic IDs with stamping
+ * jitter, a third of them protected by a rolling counter and checksum, a third
+ * carrying slowly moving signals and the rest repeating the same payload.
+ *
+ *   ./bench_canbus_blocklog [frames] [dir]
+ *
+ * Every format is written with canbus_log_write_frames and read back with
+ * canbus_log_read_frames; the compressed log is checked frame by frame
+ * against what was written. Each log is then torn as a crash would leave it
+ * and canbus_log_recover timed on it, and the CRC32C kernels that commit the
+ * compressed blocks are measured on their own.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "canbus.h"
+#include "canbus_log.h"
+#include "canbus_crc32c.h"
+
+#define BENCH_DEFAULT_FRAMES 1000000
+#define BENCH_IDS            64
+#define BENCH_KIND_E2E       0
+#define BENCH_KIND_SIGNAL    1
+#define BENCH_KIND_STATIC    2
+#define BENCH_CRC_LEN        (1024 * 1024)
+#define BENCH_CRC_ROUNDS     256
+
+typedef struct {
+  uint32_t id;
+  uint64_t period_ns;
+  uint64_t next_ns;
+  uint8_t len;
+  uint8_t data[CAN_MAX_DLEN];
+  uint8_t counter;
+  uint8_t kind;             // BENCH_KIND_*
+} bench_signal;
+
+static double bench_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_traffic(canbus_frame *frames, unsigned long nframes) {
+  static const uint64_t periods_ms[] = { 10, 10, 20, 20, 50, 100, 100, 200, 500, 1000 };
+  bench_signal ids[BENCH_IDS];
+  unsigned long n;
+  int i, j;
+
+  for(i=0; i<BENCH_IDS; i++) {
+    ids[i].id = 0x100 + random() % 0x600;
+    ids[i].period_ns = periods_ms[random() % 10] * 1000000ULL;
+    ids[i].next_ns = random() % ids[i].period_ns;
+    ids[i].len = (i % 5 == 0) ? 4 + random() % 5 : CAN_MAX_DLEN;
+    for(j=0; j<ids[i].len; j++) {
+      ids[i].data[j] = (random() % 3 == 0) ? random() : 0;
+    }
+    ids[i].counter = 0;
+    ids[i].kind = i % 3;
+  }
+
+  memset(frames, 0, sizeof(canbus_frame) * nframes);
+  for(n=0; n<nframes; n++) {
+    // the next ID due on the bus
+    bench_signal *s = &ids[0];
+    for(i=1; i<BENCH_IDS; i++) {
+      if(ids[i].next_ns < s->next_ns) s = &ids[i];
+    }
+    uint64_t ts = 1480000000ULL * 1000000000ULL + s->next_ns + random() % 50000;  // arbitration and stamping jitter
+    s->next_ns += s->period_ns;
+
+    if(s->kind == BENCH_KIND_E2E && s->len > 2) {
+      s->counter = (s->counter + 1) & 0x0f;
+      s->data[0] = (s->data[0] & 0xf0) | s->counter;
+      uint8_t sum = 0;
+      for(j=0; j<s->len - 1; j++) sum += s->data[j];
+      s->data[s->len - 1] = sum;
+    }
+    else if(s->kind == BENCH_KIND_SIGNAL && random() % 4 == 0) {
+      s->data[1] += (random() % 3) - 1;
+    }
+
+    frames[n].ts.tv_sec = ts / 1000000000ULL;
+    frames[n].ts.tv_nsec = ts % 1000000000ULL;
+    frames[n].frame.can_id = s->id;
+    frames[n].frame.len = s->len;
+    memcpy(frames[n].frame.data, s->data, s->len);
+  }
+}
+
+static int bench_same(canbus_frame *a, canbus_frame *b) {
+  return a->ts.tv_sec == b->ts.tv_sec && a->ts.tv_nsec == b->ts.tv_nsec && a->frame.can_id == b->frame.can_id &&
+    a->frame.len == b->frame.len && memcmp(a->frame.data, b->frame.data, a->frame.len) == 0;
+}
+
+int main(int argc, char **argv) {
+  unsigned long nframes = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_DEFAULT_FRAMES;
+  const char *dir = argc > 2 ? argv[2] : "/tmp";
+  canbus_frame batch[CANBUS_BATCH_SIZE];
+  char filename[CANBUS_LOG_FILENAME_LEN];
+  unsigned long i, read;
+  off_t binary_size = 0, dropped;
+  struct stat st;
+  canbus_log log;
+  double start, write_s, read_s, recover_s;
+  int format, n, k;
+
+  canbus_frame *frames = malloc(sizeof(canbus_frame) * nframes);
+  if(frames == NULL) return 1;
+  srandom(1);
+  bench_traffic(frames, nframes);
+
+  printf("%lu frames, %d periodic IDs\n", nframes, BENCH_IDS);
+  for(format=0; format<CANBUS_LOG_FORMATS; format++) {
+    const canbus_log_backend *backend = canbus_log_backend_get(format);
+    snprintf(filename, sizeof(filename), "%s/bench_blocklog%s", dir, backend->ext);
+
+    start = bench_now();
+    if(canbus_log_create(&log, filename, format, "can0", false) != 0) return 1;
+    for(i=0; i<nframes; i+=CANBUS_BATCH_SIZE) {
+      canbus_log_write_frames(&log, &frames[i], nframes - i < CANBUS_BATCH_SIZE ? nframes - i : CANBUS_BATCH_SIZE);
+    }
+    canbus_log_close(&log);
+    write_s = bench_now() - start;
+
+    start = bench_now();
+    if(canbus_log_load(&log, filename) != 0) return 1;
+    read = 0;
+    while((n = canbus_log_read_frames(&log, batch, CANBUS_BATCH_SIZE)) > 0) {
+      for(k=0; k<n && format == CANBUS_LOG_FORMAT_COMPRESSED; k++) {
+        if(!bench_same(&batch[k], &frames[read + k])) {
+          fprintf(stderr, "frame %lu differs after decompression\n", read + k);
+          return 1;
+        }
+      }
+      read += n;
+    }
+    canbus_log_close(&log);
+    read_s = bench_now() - start;
+
+    stat(filename, &st);
+    if(format == CANBUS_LOG_FORMAT_BINARY) binary_size = st.st_size;
+
+    // cut mid record, as a crash during a write would
+    if(truncate(filename, st.st_size - 1001) != 0) return 1;
+    start = bench_now();
+    canbus_log_recover(filename, &dropped);
+    recover_s = bench_now() - start;
+
+    printf("%-10s %10lld bytes %6.2f B/frame %6.1fx vs binary  write %6.2f M frames/s  read %6.2f M frames/s  recover %6.2f ms%s\n",
+      backend->name, (long long)st.st_size, (double)st.st_size / nframes,
+      binary_size > 0 ? (double)binary_size / st.st_size : 0.0,
+      nframes / write_s / 1e6, read / read_s / 1e6, recover_s * 1e3, read == nframes ? "" : "  (short read)");
+  }
+
+  uint8_t *buf = malloc(BENCH_CRC_LEN);
+  if(buf == NULL) return 1;
+  for(i=0; i<BENCH_CRC_LEN; i++) buf[i] = random();
+  for(k=CANBUS_CRC32C_TABLE; k<=CANBUS_CRC32C_ARMV8; k++) {
+    if(canbus_crc32c_kernel(k) != k) continue;
+    uint32_t crc = 0;
+    start = bench_now();
+    for(n=0; n<BENCH_CRC_ROUNDS; n++) {
+      crc = canbus_crc32c(crc, buf, BENCH_CRC_LEN);
+    }
+    printf("crc32c %-7s %6.2f GB/s (%08x)\n", canbus_crc32c_kernel_name(k),
+      (double)BENCH_CRC_LEN * BENCH_CRC_ROUNDS / (bench_now() - start) / 1e9, crc);
+  }
+  canbus_crc32c_kernel(CANBUS_CRC32C_AUTO);
+  free(buf);
+
+  free(frames);
+  return 0;
+}
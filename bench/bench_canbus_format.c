@@ -0,0 +1,157 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Lines/s of the canbus_framecpy text layout: the sprintf implementation it
+ * replaced, canbus_format_frame per frame and canbus_format_frames per batch,
+ * for each hex kernel the CPU supports.
+ *
+ *   ./bench_canbus_format [frames]
+ *
+ * Two workloads: classic frames (0-8 bytes, some extended IDs and remote
+ * requests) and 64 byte CAN FD frames. Every frame is checked against the old
+ * output before anything is timed.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "canbus.h"
+#include "canbus_format.h"
+
+#define BENCH_DEFAULT_FRAMES 2000000
+#define BENCH_POOL           4096    // distinct frames cycled through
+
+static double bench_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// canbus_framecpy before canbus_format
+static void bench_sprintf_framecpy(canbus_frame *frame, char *buf) {
+  int i;
+  sprintf(buf, "(%ld.%06ld) %04x: ", (long)frame->ts.tv_sec, frame->ts.tv_nsec / 1000, frame->frame.can_id);
+  if(frame->flags & CANBUS_FRAME_FD) {
+    sprintf(buf + strlen(buf), "FD:%x ", frame->frame.flags);
+  }
+  else if(frame->frame.can_id & CAN_RTR_FLAG) {
+    strcat(buf, "remote request");
+    return;
+  }
+  sprintf(buf + strlen(buf), "[%d]", frame->frame.len);
+  for(i = 0; i < frame->frame.len; i++)
+    sprintf(buf + strlen(buf), " %02x", frame->frame.data[i]);
+}
+
+static void bench_fill(canbus_frame *frames, bool fd) {
+  int i, j;
+  memset(frames, 0, sizeof(canbus_frame) * BENCH_POOL);
+  for(i=0; i<BENCH_POOL; i++) {
+    canbus_frame *f = &frames[i];
+    f->ts.tv_sec = 1480000000 + i;
+    f->ts.tv_nsec = (random() % 1000000000);
+    if(fd) {
+      f->flags = CANBUS_FRAME_FD;
+      f->frame.can_id = random() % 0x800;
+      f->frame.flags = random() % 4;
+      f->frame.len = CANFD_MAX_DLEN;
+    }
+    else {
+      f->frame.can_id = (i % 8 == 0) ? ((random() & CAN_EFF_MASK) | CAN_EFF_FLAG) : random() % 0x800;
+      if(i % 50 == 0) f->frame.can_id |= CAN_RTR_FLAG;
+      f->frame.len = random() % (CAN_MAX_DLEN + 1);
+    }
+    for(j=0; j<f->frame.len; j++) {
+      f->frame.data[j] = random();
+    }
+  }
+}
+
+static int bench_verify(canbus_frame *frames) {
+  char a[CANBUS_FRAME_TEXT_LEN], b[CANBUS_FRAME_TEXT_LEN];
+  int i;
+  for(i=0; i<BENCH_POOL; i++) {
+    bench_sprintf_framecpy(&frames[i], a);
+    canbus_format_frame(&frames[i], b);
+    if(strcmp(a, b) != 0) {
+      fprintf(stderr, "mismatch:\n  %s\n  %s\n", a, b);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void bench_report(const char *workload, const char *name, unsigned long lines, double elapsed) {
+  printf("%-8s %-18s %8.2f M lines/s %7.1f ns/line\n", workload, name, lines / elapsed / 1e6, elapsed * 1e9 / lines);
+}
+
+static void bench_run(const char *workload, canbus_frame *frames, unsigned long nframes) {
+  char buf[CANBUS_BATCH_SIZE * CANBUS_FRAME_TEXT_LEN];
+  char name[32];
+  unsigned long i;
+  unsigned int nlines;
+  volatile size_t sink = 0;
+  double start;
+  int kernel;
+
+  start = bench_now();
+  for(i=0; i<nframes; i++) {
+    bench_sprintf_framecpy(&frames[i % BENCH_POOL], buf);
+    sink += buf[0];
+  }
+  bench_report(workload, "sprintf", nframes, bench_now() - start);
+
+  for(kernel=CANBUS_HEX_SCALAR; kernel<=CANBUS_HEX_AVX2; kernel++) {
+    if(canbus_hex_kernel(kernel) != kernel) continue;
+
+    start = bench_now();
+    for(i=0; i<nframes; i++) {
+      sink += canbus_format_frame(&frames[i % BENCH_POOL], buf);
+    }
+    snprintf(name, sizeof(name), "frame/%s", canbus_hex_kernel_name(kernel));
+    bench_report(workload, name, nframes, bench_now() - start);
+
+    start = bench_now();
+    for(i=0; i<nframes; i+=CANBUS_BATCH_SIZE) {
+      sink += canbus_format_frames(&frames[i % BENCH_POOL], CANBUS_BATCH_SIZE, buf, sizeof(buf), &nlines);
+    }
+    snprintf(name, sizeof(name), "batch/%s", canbus_hex_kernel_name(kernel));
+    bench_report(workload, name, i, bench_now() - start);
+  }
+  canbus_hex_kernel(CANBUS_HEX_AUTO);
+}
+
+int main(int argc, char **argv) {
+  unsigned long nframes = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_DEFAULT_FRAMES;
+  canbus_frame *frames = malloc(sizeof(canbus_frame) * BENCH_POOL);
+  if(frames == NULL) return 1;
+
+  srandom(1);
+  bench_fill(frames, false);
+  if(bench_verify(frames) != 0) return 1;
+  bench_run("classic", frames, nframes);
+
+  bench_fill(frames, true);
+  if(bench_verify(frames) != 0) return 1;
+  bench_run("fd", frames, nframes);
+
+  free(frames);
+  return 0;
+}
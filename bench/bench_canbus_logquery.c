@@ -0,0 +1,229 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Query speed of ecutools-logq: periodic traffic is written as indexed text,
+ * binary and compressed logs, then scanned with canbus_logquery_run for
+ * every frame, two ids, an id range, a payload pattern, the last minute of
+ * the log and a CSV extract, at one thread and at one per online CPU.
+ * A sequential canbus_log_read_filtered pass over each log, as
+ * ecutools-logconv does it, is the baseline.
+ *
+ *   ./bench_canbus_logquery [frames] [dir]
+ *
+ * The ID matching kernels are then measured on their own over frames
+ * already in memory.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "canbus.h"
+#include "canbus_log.h"
+#include "canbus_logquery.h"
+
+#define BENCH_DEFAULT_FRAMES 2000000
+#define BENCH_IDS            64
+#define BENCH_RULES          8
+#define BENCH_MATCH_ROUNDS   64
+
+static const uint8_t bench_formats[] = { CANBUS_LOG_FORMAT_TEXT, CANBUS_LOG_FORMAT_BINARY, CANBUS_LOG_FORMAT_COMPRESSED };
+
+typedef struct {
+  const char *name;
+  uint8_t action;
+  uint32_t ids[2];
+  uint32_t masks[2];
+  unsigned int nids;
+  bool pattern;
+  bool last;
+} bench_query;
+
+static double bench_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_traffic(canbus_frame *frames, unsigned long nframes, uint32_t *ids) {
+  static const uint64_t periods_ms[] = { 10, 10, 20, 20, 50, 100, 100, 200, 500, 1000 };
+  uint64_t period_ns[BENCH_IDS], next_ns[BENCH_IDS];
+  unsigned long n;
+  int i, j;
+
+  for(i=0; i<BENCH_IDS; i++) {
+    ids[i] = 0x100 + random() % 0x600;
+    period_ns[i] = periods_ms[random() % 10] * 1000000ULL;
+    next_ns[i] = random() % period_ns[i];
+  }
+
+  memset(frames, 0, sizeof(canbus_frame) * nframes);
+  for(n=0; n<nframes; n++) {
+    i = 0;
+    for(j=1; j<BENCH_IDS; j++) {
+      if(next_ns[j] < next_ns[i]) i = j;
+    }
+    uint64_t ts = 1480000000ULL * 1000000000ULL + next_ns[i];
+    next_ns[i] += period_ns[i];
+
+    frames[n].ts.tv_sec = ts / 1000000000ULL;
+    frames[n].ts.tv_nsec = ts % 1000000000ULL;
+    frames[n].frame.can_id = ids[i];
+    frames[n].frame.len = CAN_MAX_DLEN;
+    frames[n].frame.data[0] = n;
+    for(j=1; j<CAN_MAX_DLEN; j++) {
+      frames[n].frame.data[j] = (random() % 4 == 0) ? random() : 0;
+    }
+  }
+}
+
+static unsigned int bench_query_run(bench_query *q, const char *filename, unsigned int threads, double *secs, uint64_t *matched, uint64_t *bytes) {
+  static const uint8_t pattern[] = { 0x00, 0x00 };
+  canbus_logquery query;
+  unsigned int i, rc;
+
+  canbus_logquery_init(&query, q->action);
+  query.threads = threads;
+  for(i=0; i<q->nids; i++) {
+    canbus_logquery_add_id(&query, q->ids[i], q->masks[i]);
+  }
+  if(q->pattern) {
+    canbus_logquery_add_pattern(&query, 1, pattern, NULL, sizeof(pattern));
+  }
+  if(q->last) {
+    query.last.tv_sec = 60;
+  }
+  if(q->action == CANBUS_LOGQUERY_FRAMES) {
+    query.out = fopen("/dev/null", "w");
+    if(query.out == NULL) return 1;
+  }
+
+  double start = bench_now();
+  rc = canbus_logquery_run(&query, filename);
+  *secs = bench_now() - start;
+  *matched = canbus_logquery_matched(&query);
+  *bytes = query.bytes;
+
+  if(q->action == CANBUS_LOGQUERY_FRAMES) fclose(query.out);
+  canbus_logquery_free(&query);
+  return rc;
+}
+
+int main(int argc, char **argv) {
+  unsigned long nframes = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_DEFAULT_FRAMES;
+  const char *dir = argc > 2 ? argv[2] : "/tmp";
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  canbus_frame batch[CANBUS_BATCH_SIZE];
+  char filename[CANBUS_LOG_FILENAME_LEN];
+  uint32_t ids[BENCH_IDS];
+  uint16_t sel[CANBUS_LOGQUERY_BATCH];
+  unsigned long i;
+  struct stat st;
+  canbus_log log;
+  canbus_log_filter filter;
+  double start, secs;
+  uint64_t matched, bytes;
+  unsigned int f, q, t, k, threads[2];
+  int n;
+
+  canbus_frame *frames = malloc(sizeof(canbus_frame) * nframes);
+  if(frames == NULL) return 1;
+  srandom(1);
+  bench_traffic(frames, nframes, ids);
+
+  bench_query queries[] = {
+    { "count all",  CANBUS_LOGQUERY_COUNT,  { 0 }, { 0 }, 0, false, false },
+    { "two ids",    CANBUS_LOGQUERY_TOTAL,  { ids[0], ids[1] }, { CAN_SFF_MASK, CAN_SFF_MASK }, 2, false, false },
+    { "id range",   CANBUS_LOGQUERY_TOTAL,  { 0x400 }, { 0x700 }, 1, false, false },
+    { "pattern",    CANBUS_LOGQUERY_TOTAL,  { 0 }, { 0 }, 0, true, false },
+    { "last 60s",   CANBUS_LOGQUERY_COUNT,  { 0 }, { 0 }, 0, false, true },
+    { "csv two ids",CANBUS_LOGQUERY_FRAMES, { ids[0], ids[1] }, { CAN_SFF_MASK, CAN_SFF_MASK }, 2, false, false },
+  };
+
+  threads[0] = 1;
+  threads[1] = cpus > 1 ? cpus : 1;
+  printf("%lu frames, %d periodic IDs, %ld CPUs\n", nframes, BENCH_IDS, cpus);
+
+  for(f=0; f<sizeof(bench_formats); f++) {
+    const canbus_log_backend *backend = canbus_log_backend_get(bench_formats[f]);
+    snprintf(filename, sizeof(filename), "%s/bench_logquery%s", dir, backend->ext);
+
+    if(canbus_log_create(&log, filename, bench_formats[f], "can0", false) != 0) return 1;
+    canbus_log_index_create(&log);
+    for(i=0; i<nframes; i+=CANBUS_BATCH_SIZE) {
+      canbus_log_write_frames(&log, &frames[i], nframes - i < CANBUS_BATCH_SIZE ? nframes - i : CANBUS_BATCH_SIZE);
+    }
+    canbus_log_close(&log);
+    stat(filename, &st);
+
+    // what ecutools-logconv does for two ids: one thread through canbus_log_read_filtered
+    memset(&filter, 0, sizeof(filter));
+    filter.ids = ids;
+    filter.nids = 2;
+    matched = 0;
+    start = bench_now();
+    if(canbus_log_load(&log, filename) != 0) return 1;
+    while((n = canbus_log_read_filtered(&log, &filter, batch, CANBUS_BATCH_SIZE)) > 0) {
+      matched += n;
+    }
+    canbus_log_close(&log);
+    secs = bench_now() - start;
+    printf("%-10s %10lld bytes  %-11s %-2s %8.3f s %7.2f GB/s %7.2f M frames/s %9llu matched\n",
+      backend->name, (long long)st.st_size, "read_filter", "1", secs,
+      st.st_size / secs / 1e9, nframes / secs / 1e6, (unsigned long long)matched);
+
+    for(q=0; q<sizeof(queries) / sizeof(queries[0]); q++) {
+      for(t=0; t<2; t++) {
+        if(t == 1 && threads[1] == 1) break;
+        if(bench_query_run(&queries[q], filename, threads[t], &secs, &matched, &bytes) != 0) return 1;
+        printf("%-10s %10lld bytes  %-11s %-2u %8.3f s %7.2f GB/s %7.2f M frames/s %9llu matched\n",
+          backend->name, (long long)bytes, queries[q].name, threads[t], secs,
+          bytes / secs / 1e9, nframes / secs / 1e6, (unsigned long long)matched);
+      }
+    }
+  }
+
+  // ID kernels alone, on frames already parsed
+  canbus_logquery query;
+  for(k=CANBUS_LOGQUERY_SCALAR; k<=CANBUS_LOGQUERY_AVX2; k++) {
+    if(canbus_logquery_kernel(k) != (int)k) continue;
+    canbus_logquery_init(&query, CANBUS_LOGQUERY_TOTAL);
+    for(i=0; i<BENCH_RULES; i++) {
+      canbus_logquery_add_id(&query, ids[i * 3], CAN_SFF_MASK);
+    }
+    matched = 0;
+    start = bench_now();
+    for(n=0; n<BENCH_MATCH_ROUNDS; n++) {
+      for(i=0; i+CANBUS_LOGQUERY_BATCH<=nframes; i+=CANBUS_LOGQUERY_BATCH) {
+        matched += canbus_logquery_match(&query, &frames[i], CANBUS_LOGQUERY_BATCH, sel);
+      }
+    }
+    secs = bench_now() - start;
+    printf("match %-7s %d rules %8.1f M frames/s (%llu)\n", canbus_logquery_kernel_name(k), BENCH_RULES,
+      (double)(nframes / CANBUS_LOGQUERY_BATCH) * CANBUS_LOGQUERY_BATCH * BENCH_MATCH_ROUNDS / secs / 1e6,
+      (unsigned long long)matched);
+    canbus_logquery_free(&query);
+  }
+  canbus_logquery_kernel(CANBUS_LOGQUERY_AUTO);
+
+  free(frames);
+  return 0;
+}
@@ -0,0 +1,200 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Capture loss with slow storage: frames arrive at a fixed rate into an
+ * emulated socket receive queue, and a capture loop hands them to the file
+ * logger in batches, once writing synchronously through stdio as before and
+ * once through canbus_logwriter. Whatever arrives while the queue is full is
+ * lost, as it would be on the wire.
+ *
+ *   ./bench_canbus_logwriter [seconds] [frames/s] [stall ms] [dir]
+ *
+ * The storage stalls for the given time per CANBUS_LOG_BUFFER_LEN bytes
+ * written, the way SD cards and eMMC do while erasing, so both runs get the
+ * same throughput and only the thread that waits differs. Both logs are read
+ * back and counted.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "canbus.h"
+#include "canbus_log.h"
+#include "canbus_logwriter.h"
+
+#define BENCH_DEFAULT_SECONDS 3
+#define BENCH_DEFAULT_RATE    8000    // frames/s, a saturated 1 Mbit/s bus
+#define BENCH_DEFAULT_STALL   50      // ms per CANBUS_LOG_BUFFER_LEN bytes
+#define BENCH_QUEUE           256     // frames the socket receive queue holds
+#define BENCH_POOL            4096
+
+typedef struct {
+  const char *name;
+  uint64_t arrived;
+  uint64_t captured;
+  uint64_t overflowed;      // lost in the receive queue
+  uint64_t dropped;         // refused by the sink
+  uint64_t max_call_us;     // longest time the capture loop spent in the sink
+  uint64_t logged;          // frames read back from the file
+} bench_result;
+
+static unsigned int bench_stall_us;
+static size_t bench_unstalled;   // bytes written since the last stall
+
+static double bench_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_fill(canbus_frame *frames) {
+  int i, j;
+  memset(frames, 0, sizeof(canbus_frame) * BENCH_POOL);
+  for(i=0; i<BENCH_POOL; i++) {
+    canbus_frame *f = &frames[i];
+    f->ts.tv_sec = 1480000000 + i / 1000;
+    f->ts.tv_nsec = (i % 1000) * 1000000;
+    f->frame.can_id = random() % 0x800;
+    f->frame.len = CAN_MAX_DLEN;
+    for(j=0; j<f->frame.len; j++) {
+      f->frame.data[j] = random();
+    }
+  }
+}
+
+// stdio's write path on slow storage
+static ssize_t bench_slow_write(void *cookie, const char *buf, size_t len) {
+  for(bench_unstalled += len; bench_unstalled >= CANBUS_LOG_BUFFER_LEN; bench_unstalled -= CANBUS_LOG_BUFFER_LEN) {
+    usleep(bench_stall_us);
+  }
+  return write(*(int *)cookie, buf, len);
+}
+
+/**
+ * Paces arrivals in real time and feeds sink until seconds have passed.
+ */
+static void bench_capture(bench_result *r, canbus_frame *pool, unsigned int seconds, unsigned int rate,
+                          unsigned int (*sink)(void *arg, canbus_frame *frames, unsigned int n), void *arg) {
+  double start = bench_now(), now, called;
+  uint64_t taken = 0, queued, us;
+  unsigned int n;
+
+  while((now = bench_now()) - start < seconds) {
+    r->arrived = (uint64_t)((now - start) * rate);
+    queued = r->arrived - taken - r->overflowed;
+    if(queued > BENCH_QUEUE) {
+      r->overflowed += queued - BENCH_QUEUE;
+      queued = BENCH_QUEUE;
+    }
+    if(queued == 0) {
+      usleep(100);
+      continue;
+    }
+    n = queued < CANBUS_BATCH_SIZE ? queued : CANBUS_BATCH_SIZE;
+    called = bench_now();
+    r->dropped += sink(arg, &pool[taken % (BENCH_POOL - CANBUS_BATCH_SIZE)], n);
+    us = (bench_now() - called) * 1e6;
+    if(us > r->max_call_us) r->max_call_us = us;
+    taken += n;
+    r->captured += n;
+  }
+}
+
+static unsigned int bench_sink_sync(void *arg, canbus_frame *frames, unsigned int n) {
+  return canbus_log_write_frames((canbus_log *)arg, frames, n);
+}
+
+static unsigned int bench_sink_async(void *arg, canbus_frame *frames, unsigned int n) {
+  return canbus_logwriter_push((canbus_logwriter *)arg, frames, n);
+}
+
+static uint64_t bench_count(const char *filename) {
+  canbus_frame frames[CANBUS_BATCH_SIZE];
+  canbus_log log;
+  uint64_t total = 0;
+  int n;
+  if(canbus_log_load(&log, filename) != 0) return 0;
+  while((n = canbus_log_read_frames(&log, frames, CANBUS_BATCH_SIZE)) > 0) {
+    total += n;
+  }
+  canbus_log_close(&log);
+  return total;
+}
+
+static void bench_report(bench_result *r) {
+  printf("%-6s arrived=%-8llu captured=%-8llu overflowed=%-7llu dropped=%-6llu logged=%-8llu max_call=%.1f ms\n", r->name,
+    (unsigned long long)r->arrived, (unsigned long long)r->captured, (unsigned long long)r->overflowed,
+    (unsigned long long)r->dropped, (unsigned long long)r->logged, r->max_call_us / 1000.0);
+}
+
+int main(int argc, char **argv) {
+  unsigned int seconds = argc > 1 ? atoi(argv[1]) : BENCH_DEFAULT_SECONDS;
+  unsigned int rate = argc > 2 ? atoi(argv[2]) : BENCH_DEFAULT_RATE;
+  unsigned int stall_ms = argc > 3 ? atoi(argv[3]) : BENCH_DEFAULT_STALL;
+  const char *dir = argc > 4 ? argv[4] : "/tmp";
+  char filename[CANBUS_LOG_FILENAME_LEN];
+  bench_result sync = { .name = "sync" }, async = { .name = "async" };
+  canbus_logwriter writer;
+  canbus_log log;
+  int fd;
+
+  canbus_frame *pool = malloc(sizeof(canbus_frame) * BENCH_POOL);
+  if(pool == NULL) return 1;
+  srandom(1);
+  bench_fill(pool);
+  bench_stall_us = stall_ms * 1000;
+  printf("%u s at %u frames/s, %u ms stall per %u KB written, receive queue %u frames\n",
+    seconds, rate, stall_ms, CANBUS_LOG_BUFFER_LEN / 1024, BENCH_QUEUE);
+
+  // before: the reactor thread writes through stdio and waits out every stall
+  snprintf(filename, sizeof(filename), "%s/bench_logwriter_sync.log", dir);
+  if(canbus_log_create(&log, filename, CANBUS_LOG_FORMAT_TEXT, "vcan0", false) != 0) return 1;
+  fflush(log.file);
+  fd = fileno(log.file);
+  cookie_io_functions_t io = { .write = bench_slow_write };
+  FILE *file = log.file;
+  log.file = fopencookie(&fd, "w", io);
+  setvbuf(log.file, NULL, _IOFBF, CANBUS_LOG_BUFFER_LEN);
+  bench_capture(&sync, pool, seconds, rate, bench_sink_sync, &log);
+  canbus_log_close(&log);
+  fclose(file);
+  sync.logged = bench_count(filename);
+  bench_report(&sync);
+
+  // after: the reactor thread only copies batches into the writer's ring
+  snprintf(filename, sizeof(filename), "%s/bench_logwriter_async.log", dir);
+  if(canbus_log_create(&log, filename, CANBUS_LOG_FORMAT_TEXT, "vcan0", false) != 0) return 1;
+  if(canbus_logwriter_init(&writer, &log, CANBUS_LOGWRITER_SLOTS, 0) != 0) return 1;
+  writer.delay_us = bench_stall_us * (CANBUS_LOGWRITER_BUFFER_LEN / CANBUS_LOG_BUFFER_LEN);
+  if(canbus_logwriter_start(&writer) != 0) return 1;
+  bench_capture(&async, pool, seconds, rate, bench_sink_async, &writer);
+  canbus_logwriter_stop(&writer);
+  printf("       writer: io=%s, writes=%llu, bytes=%llu, max_write=%.1f ms, ring high watermark %u/%u\n",
+    writer.io == CANBUS_LOGWRITER_IO_URING ? "io_uring" : "pwritev", (unsigned long long)writer.stats.writes,
+    (unsigned long long)writer.stats.bytes, writer.stats.max_write_us / 1000.0, writer.stats.max_queued, writer.mask + 1);
+  canbus_logwriter_free(&writer);
+  canbus_log_close(&log);
+  async.logged = bench_count(filename);
+  bench_report(&async);
+
+  free(pool);
+  return async.overflowed == 0 && async.logged == async.captured - async.dropped ? 0 : 1;
+}
@@ -0,0 +1,244 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Compares one reader thread per interface against a single canbus_reactor
+ * thread servicing every interface.
+ *
+ *   sudo ./vcan0-up.sh   (repeat for vcan1..vcan3)
+ *   ./bench_canbus_reactor [iface,iface,...] [frames per iface]
+ *
+ * One writer thread per interface floods its bus. Reports aggregate frames/s,
+ * reader CPU and reader context switches for each mode.
+ */
+
+#define _GNU_SOURCE
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "canbus.h"
+#include "canbus_reactor.h"
+
+#define BENCH_DEFAULT_IFACES "vcan0,vcan1,vcan2,vcan3"
+#define BENCH_DEFAULT_FRAMES 250000
+#define BENCH_MAX_IFACES     CANBUS_REACTOR_MAX_HANDLERS
+#define BENCH_IDLE_SEC       1.0
+
+typedef struct {
+  canbus_client *canbus;
+  unsigned long frames;
+} bench_writer;
+
+typedef struct {
+  canbus_client *canbus;
+  canbus_reactor *reactor;
+  unsigned long received;
+  double cpu;
+  long csw;
+  double last;
+} bench_reader;
+
+static double bench_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_usage(double *cpu, long *csw) {
+  struct rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  *cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+  *csw = usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+void *bench_writer_thread(void *ptr) {
+  bench_writer *writer = (bench_writer *)ptr;
+  struct can_frame frame;
+  unsigned long i;
+
+  memset(&frame, 0, sizeof(struct can_frame));
+  frame.can_id = 0x7e8;
+  frame.can_dlc = 8;
+
+  for(i=0; i<writer->frames; i++) {
+    memcpy(frame.data, &i, sizeof(frame.data));
+    while(write(writer->canbus->socket, &frame, sizeof(struct can_frame)) == -1) {
+      if(errno != ENOBUFS) return NULL;
+      usleep(50);
+    }
+  }
+  return NULL;
+}
+
+void *bench_thread_reader(void *ptr) {
+  bench_reader *reader = (bench_reader *)ptr;
+  canbus_frame frames[CANBUS_BATCH_SIZE];
+  double cpu_start, cpu_end;
+  long csw_start, csw_end;
+  ssize_t n;
+
+  bench_usage(&cpu_start, &csw_start);
+  while((n = canbus_read_batch(reader->canbus, frames, CANBUS_BATCH_SIZE)) > 0) {
+    reader->received += n;
+    reader->last = bench_now();
+  }
+  bench_usage(&cpu_end, &csw_end);
+
+  reader->cpu = cpu_end - cpu_start;
+  reader->csw = csw_end - csw_start;
+  return NULL;
+}
+
+void bench_reactor_onread(canbus_client *canbus, canbus_frame *frames, unsigned int nframes, void *arg) {
+  bench_reader *reader = (bench_reader *)arg;
+  reader->received += nframes;
+  reader->last = bench_now();
+}
+
+void *bench_reactor_reader(void *ptr) {
+  bench_reader *reader = (bench_reader *)ptr;
+  double cpu_start, cpu_end;
+  long csw_start, csw_end;
+
+  bench_usage(&cpu_start, &csw_start);
+  canbus_reactor_run(reader->reactor);
+  bench_usage(&cpu_end, &csw_end);
+
+  reader->cpu = cpu_end - cpu_start;
+  reader->csw = csw_end - csw_start;
+  return NULL;
+}
+
+void bench_run(char **ifaces, unsigned int count, unsigned long frames, bool reactor) {
+
+  canbus_client readers[BENCH_MAX_IFACES], writers[BENCH_MAX_IFACES];
+  bench_writer w[BENCH_MAX_IFACES];
+  bench_reader r[BENCH_MAX_IFACES + 1];
+  pthread_t writer_threads[BENCH_MAX_IFACES], reader_threads[BENCH_MAX_IFACES];
+  canbus_reactor loop;
+  int i;
+
+  memset(r, 0, sizeof(r));
+  canbus_reactor_init(&loop);
+
+  for(i=0; i<count; i++) {
+    memset(&readers[i], 0, sizeof(canbus_client));
+    memset(&writers[i], 0, sizeof(canbus_client));
+    readers[i].iface = strdup(ifaces[i]);
+    writers[i].iface = strdup(ifaces[i]);
+    canbus_init(&readers[i]);
+    canbus_init(&writers[i]);
+    if(canbus_connect(&readers[i]) != 0 || canbus_connect(&writers[i]) != 0) {
+      fprintf(stderr, "unable to connect to %s\n", ifaces[i]);
+      exit(1);
+    }
+    r[i].canbus = &readers[i];
+    if(reactor) {
+      canbus_reactor_add(&loop, &readers[i], bench_reactor_onread, &r[i]);
+    }
+    else {
+      // stop reading once the writer is done and the socket stays idle
+      struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+      setsockopt(readers[i].socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+  }
+
+  double start = bench_now();
+
+  if(reactor) {
+    r[count].reactor = &loop;
+    pthread_create(&reader_threads[0], NULL, bench_reactor_reader, &r[count]);
+  }
+  else {
+    for(i=0; i<count; i++) {
+      pthread_create(&reader_threads[i], NULL, bench_thread_reader, &r[i]);
+    }
+  }
+
+  for(i=0; i<count; i++) {
+    w[i].canbus = &writers[i];
+    w[i].frames = frames;
+    r[i].last = start;
+    pthread_create(&writer_threads[i], NULL, bench_writer_thread, &w[i]);
+  }
+
+  for(i=0; i<count; i++) {
+    pthread_join(writer_threads[i], NULL);
+  }
+
+  double last = start;
+  if(reactor) {
+    bool idle = false;
+    while(!idle) {
+      usleep(100000);
+      idle = true;
+      for(i=0; i<count; i++) {
+        if(bench_now() - r[i].last < BENCH_IDLE_SEC) idle = false;
+      }
+    }
+    canbus_reactor_stop(&loop);
+    pthread_join(reader_threads[0], NULL);
+  }
+  else {
+    for(i=0; i<count; i++) {
+      pthread_join(reader_threads[i], NULL);
+    }
+  }
+
+  unsigned long received = 0;
+  double cpu = 0;
+  long csw = 0;
+  for(i=0; i<=count; i++) {
+    received += r[i].received;
+    cpu += r[i].cpu;
+    csw += r[i].csw;
+    if(i < count && r[i].last > last) last = r[i].last;
+  }
+
+  double elapsed = last - start;
+  unsigned long total = frames * count;
+  printf("%-8s ifaces=%u threads=%u frames=%lu/%lu lost=%lu elapsed=%.3fs rate=%.0f frames/s cpu=%.1f%% csw=%ld\n",
+    reactor ? "reactor" : "threads", count, reactor ? 1 : count, received, total, total - received, elapsed,
+    elapsed > 0 ? received / elapsed : 0, elapsed > 0 ? 100.0 * cpu / elapsed : 0, csw);
+
+  for(i=0; i<count; i++) {
+    canbus_close(&readers[i]);
+    canbus_close(&writers[i]);
+    free(readers[i].iface);
+    free(writers[i].iface);
+  }
+  canbus_reactor_free(&loop);
+}
+
+int main(int argc, char **argv) {
+  char *ifaces[BENCH_MAX_IFACES];
+  unsigned int count = canbus_iface_split(argc > 1 ? argv[1] : BENCH_DEFAULT_IFACES, ifaces, BENCH_MAX_IFACES);
+  unsigned long frames = argc > 2 ? strtoul(argv[2], NULL, 10) : BENCH_DEFAULT_FRAMES;
+
+  openlog("bench_canbus_reactor", LOG_CONS, LOG_USER);
+
+  bench_run(ifaces, count, frames, false);
+  bench_run(ifaces, count, frames, true);
+
+  int i;
+  for(i=0; i<count; i++) {
+    free(ifaces[i]);
+  }
+  closelog();
+  return 0;
+}
@@ -0,0 +1,178 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Compares canbus_read (one read() per frame) against canbus_read_batch
+ * (one recvmmsg() per batch) and the CANBUS_CAPTURE_MMAP ring on a virtual
+ * CAN interface.
+ *
+ *   sudo ./vcan0-up.sh
+ *   ./bench_canbus_read [iface] [frames]
+ *
+ * The mmap run needs CAP_NET_RAW and is skipped without it.
+ *
+ * A writer thread floods the interface from a second socket while the reader
+ * drains it. Reports received frames/s and the reader thread's CPU usage.
+ * Build once more with -DDLOG_LEVEL=LOG_DEBUG to see what debug logging costs.
+ */
+
+#define _GNU_SOURCE
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "canbus.h"
+
+#define BENCH_DEFAULT_FRAMES 500000
+#define BENCH_SENTINEL_ID    0x7ff  // last frame sent; ends the run without waiting for the idle timeout
+
+#define BENCH_MODE_SINGLE    0
+#define BENCH_MODE_BATCH     1
+#define BENCH_MODE_MMAP      2
+
+static const char *bench_modes[] = { "single", "batch", "mmap" };
+
+typedef struct {
+  canbus_client *canbus;
+  unsigned long frames;
+} bench_writer;
+
+static double bench_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench_cputime() {
+  struct rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+void *bench_writer_thread(void *ptr) {
+  bench_writer *writer = (bench_writer *)ptr;
+  struct can_frame frame;
+  unsigned long i;
+
+  memset(&frame, 0, sizeof(struct can_frame));
+  frame.can_id = 0x7e8;
+  frame.can_dlc = 8;
+
+  for(i=0; i<writer->frames; i++) {
+    memcpy(frame.data, &i, sizeof(frame.data));
+    while(write(writer->canbus->socket, &frame, sizeof(struct can_frame)) == -1) {
+      if(errno != ENOBUFS) return NULL;
+      usleep(50);
+    }
+  }
+  frame.can_id = BENCH_SENTINEL_ID;
+  write(writer->canbus->socket, &frame, sizeof(struct can_frame));
+  return NULL;
+}
+
+void bench_run(const char *iface, unsigned long frames, int mode) {
+
+  canbus_client reader, writer;
+  memset(&reader, 0, sizeof(canbus_client));
+  memset(&writer, 0, sizeof(canbus_client));
+  reader.iface = strdup(iface);
+  writer.iface = strdup(iface);
+
+  canbus_init(&reader);
+  canbus_init(&writer);
+  if(mode == BENCH_MODE_MMAP) {
+    reader.capture = CANBUS_CAPTURE_MMAP;
+    if(canbus_connect(&reader) != 0) {
+      printf("%-8s skipped: unable to open a packet ring on %s (needs CAP_NET_RAW)\n", bench_modes[mode], iface);
+      canbus_close(&reader);
+      free(reader.iface);
+      free(writer.iface);
+      return;
+    }
+  }
+  else if(canbus_connect(&reader) != 0) {
+    fprintf(stderr, "unable to connect to %s\n", iface);
+    exit(1);
+  }
+  if(canbus_connect(&writer) != 0) {
+    fprintf(stderr, "unable to connect to %s\n", iface);
+    exit(1);
+  }
+
+  // stop reading once the writer is done and the socket stays idle
+  struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+  setsockopt(reader.socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  bench_writer w = { .canbus = &writer, .frames = frames };
+  pthread_t thread;
+  pthread_create(&thread, NULL, bench_writer_thread, &w);
+
+  canbus_frame batch_frames[CANBUS_BATCH_SIZE];
+  unsigned long received = 0;
+  ssize_t n;
+
+  double cpu_start = bench_cputime();
+  double start = bench_now(), last = start;
+
+  if(mode == BENCH_MODE_SINGLE) {
+    while(canbus_read(&reader, &batch_frames[0]) == CAN_MTU && batch_frames[0].frame.can_id != BENCH_SENTINEL_ID) {
+      received++;
+      last = bench_now();
+    }
+  }
+  else {
+    bool done = false;
+    while(!done && (n = canbus_read_batch(&reader, batch_frames, CANBUS_BATCH_SIZE)) > 0) {
+      if(batch_frames[n - 1].frame.can_id == BENCH_SENTINEL_ID) {
+        done = true;
+        n--;
+      }
+      received += n;
+      last = bench_now();
+    }
+  }
+
+  double cpu = bench_cputime() - cpu_start;
+  double elapsed = last - start;
+  pthread_join(thread, NULL);
+
+  printf("%-8s frames=%lu/%lu lost=%lu elapsed=%.3fs rate=%.0f frames/s cpu=%.1f%%\n",
+    bench_modes[mode], received, frames, frames - received, elapsed,
+    elapsed > 0 ? received / elapsed : 0, elapsed > 0 ? 100.0 * cpu / elapsed : 0);
+
+  canbus_close(&reader);
+  canbus_close(&writer);
+  free(reader.iface);
+  free(writer.iface);
+}
+
+int main(int argc, char **argv) {
+  const char *iface = argc > 1 ? argv[1] : "vcan0";
+  unsigned long frames = argc > 2 ? strtoul(argv[2], NULL, 10) : BENCH_DEFAULT_FRAMES;
+
+  // canbus_read's per-frame DLOG_DEBUG costs nothing unless built with -DDLOG_LEVEL=LOG_DEBUG
+  openlog("bench_canbus_read", LOG_CONS, LOG_USER);
+  dlog_init(DLOG_SINK_SYSLOG, NULL);
+
+  bench_run(iface, frames, BENCH_MODE_SINGLE);
+  bench_run(iface, frames, BENCH_MODE_BATCH);
+  bench_run(iface, frames, BENCH_MODE_MMAP);
+
+  dlog_close();
+  closelog();
+  return 0;
+}
@@ -0,0 +1,101 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Per-call cost of the hot path debug log line in canbus_read, three ways:
+ * syslog() as before, DLOG_DEBUG queued to the dlog drainer, and DLOG_DEBUG
+ * compiled out (the default build).
+ *
+ *   ./bench_dlog [calls]
+ *
+ * Calls are timed in bursts of DLOG_RING_SLOTS / 2 with a dlog_flush between
+ * bursts, so the queued case measures the enqueue and not a full ring.
+ * Frames/s end to end: bench_canbus_read built with and without
+ * -DDLOG_LEVEL=LOG_DEBUG.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#undef DLOG_LEVEL
+#define DLOG_LEVEL LOG_DEBUG
+#include "dlog.h"
+
+#define BENCH_DEFAULT_CALLS 2000000
+#define BENCH_BURST         (DLOG_RING_SLOTS / 2)
+
+static double bench_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_syslog(int nbytes) {
+  syslog(LOG_DEBUG, "canbus_read: read %i byte CAN frame", nbytes);
+}
+
+static void bench_dlog(int nbytes) {
+  DLOG_DEBUG("canbus_read: read %i byte CAN frame", nbytes);
+}
+
+// everything below is built as the default build would see it
+#undef DLOG_LEVEL
+#define DLOG_LEVEL LOG_INFO
+
+static void bench_dlog_off(int nbytes) {
+  DLOG_DEBUG("canbus_read: read %i byte CAN frame", nbytes);
+}
+
+static void bench_run(const char *name, void (*fn)(int), unsigned long calls, bool flush) {
+  unsigned long i, j;
+  double elapsed = 0, start;
+
+  for(i=0; i<calls; i+=BENCH_BURST) {
+    start = bench_now();
+    for(j=0; j<BENCH_BURST; j++) {
+      fn(16);
+    }
+    elapsed += bench_now() - start;
+    if(flush) dlog_flush();
+  }
+
+  printf("%-10s calls=%lu %.1f ns/call\n", name, i, elapsed * 1e9 / i);
+}
+
+int main(int argc, char **argv) {
+  unsigned long calls = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_DEFAULT_CALLS;
+
+  openlog("bench_dlog", LOG_NDELAY, LOG_USER);
+  setlogmask(LOG_UPTO(LOG_DEBUG));
+
+  bench_run("syslog", bench_syslog, calls / 10, false);
+
+  // the drainer writes to /dev/null so the sink itself is not measured
+  if(dlog_init(DLOG_SINK_FILE, "/dev/null") != 0) {
+    fprintf(stderr, "unable to start dlog\n");
+    return 1;
+  }
+  bench_run("dlog", bench_dlog, calls, true);
+  bench_run("dlog-off", bench_dlog_off, calls, false);
+  printf("dropped=%llu\n", (unsigned long long)dlog_dropped());
+  dlog_close();
+
+  closelog();
+  return 0;
+}
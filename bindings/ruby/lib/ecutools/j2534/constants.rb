@@ -39,7 +39,7 @@ module Ecutools::J2534::Constants
   CAN_ID_BOTH         = (0 << 11)
   #Reserved for SAE          10
   CHECKSUM_DISABLED   = (0 << 9)
-  CAN_29BIT_ID        = (0 << 8)
+  CAN_29BIT_ID        = (1 << 8)
   #Reserved for SAE J2534-1  2-7
   #Reserved for SAE          1
   FULL_DUPLEX         = (0 << 0)
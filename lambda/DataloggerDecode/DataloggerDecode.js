@@ -0,0 +1,271 @@
+/**
+ * Decodes ecutools/datalogger payloads.
+ *
+ * A compressed payload is a whole block log (.cbl) as written by
+ * canbus_blocklog: a 64 byte header starting with "ECUCANBK" followed by
+ * committed, LZ4 compressed blocks of column encoded frames. Anything else
+ * is the text format, one candump style line per frame.
+ *
+ * Every 64 bit value is a BigInt, so this needs node 10.4 or later.
+ *
+ *   node DataloggerDecode.js payload.cbl   prints the frames as text lines
+ */
+
+var MAGIC = 'ECUCANBK';
+var VERSION = 2;
+var HEADER_LEN = 64;
+var BLOCK_LEN = 32;
+var COMMIT_LEN = 12;
+var SYNC = 0x4b4c4243;
+var COMMIT = 0x544d4f43;
+var STORED = 1 << 0;
+var COMMITTED = 1 << 1;
+var FRAME_FD = 1 << 0;
+var CAN_RTR_FLAG = 0x40000000;
+var CANFD_MAX_DLEN = 64;
+
+var crcTable = (function() {
+  var table = new Int32Array(256);
+  for(var i = 0; i < 256; i++) {
+    var c = i;
+    for(var k = 0; k < 8; k++) {
+      c = (c & 1) ? (c >>> 1) ^ 0x82f63b78 : c >>> 1;
+    }
+    table[i] = c;
+  }
+  return table;
+})();
+
+function crc32c(buf, start, end) {
+  var crc = -1;
+  for(var i = start; i < end; i++) {
+    crc = crcTable[(crc ^ buf[i]) & 0xff] ^ (crc >>> 8);
+  }
+  return (crc ^ -1) >>> 0;
+}
+
+function lz4Decompress(src, out) {
+  var s = 0, d = 0, n, len, offset;
+  while(s < src.length) {
+    var token = src[s++];
+    len = token >> 4;
+    if(len === 15) {
+      do {
+        if(s >= src.length) throw new Error('lz4: truncated literal length');
+        n = src[s++];
+        len += n;
+      } while(n === 255);
+    }
+    if(s + len > src.length || d + len > out.length) throw new Error('lz4: literals overrun');
+    src.copy(out, d, s, s + len);
+    s += len;
+    d += len;
+    if(s === src.length) break;
+
+    if(s + 2 > src.length) throw new Error('lz4: truncated offset');
+    offset = src[s] | (src[s + 1] << 8);
+    s += 2;
+    if(offset === 0 || offset > d) throw new Error('lz4: bad offset');
+    len = token & 0x0f;
+    if(len === 15) {
+      do {
+        if(s >= src.length) throw new Error('lz4: truncated match length');
+        n = src[s++];
+        len += n;
+      } while(n === 255);
+    }
+    len += 4;
+    if(d + len > out.length) throw new Error('lz4: match overrun');
+    // byte by byte, a match may overlap its own output
+    for(var i = 0; i < len; i++, d++) {
+      out[d] = out[d - offset];
+    }
+  }
+  return d;
+}
+
+function Reader(buf) {
+  this.buf = buf;
+  this.pos = 0;
+}
+
+Reader.prototype.varint = function() {
+  var v = 0n, shift = 0n, b;
+  do {
+    if(this.pos >= this.buf.length || shift > 63n) throw new Error('block: bad varint');
+    b = this.buf[this.pos++];
+    v |= BigInt(b & 0x7f) << shift;
+    shift += 7n;
+  } while(b & 0x80);
+  return BigInt.asUintN(64, v);
+};
+
+Reader.prototype.bytes = function(n) {
+  if(this.pos + n > this.buf.length) throw new Error('block: truncated columns');
+  var b = this.buf.slice(this.pos, this.pos + n);
+  this.pos += n;
+  return b;
+};
+
+function unzigzag(v) {
+  return (v >> 1n) ^ -(v & 1n);
+}
+
+function parseHeader(buf) {
+  if(buf.length < HEADER_LEN || buf.toString('latin1', 0, 8) !== MAGIC) {
+    throw new Error('header: not a block log');
+  }
+  var header = {
+    version: buf.readUInt16LE(8),
+    headerLen: buf.readUInt16LE(10),
+    fd: (buf.readUInt16LE(14) & 1) !== 0,
+    iface: buf.toString('latin1', 32, 48).replace(/\0.*$/, '')
+  };
+  if(header.version < 1 || header.version > VERSION || header.headerLen < HEADER_LEN || header.headerLen > buf.length) {
+    throw new Error('header: unsupported version ' + header.version);
+  }
+  return header;
+}
+
+function decodeBlock(buf, pos, frames) {
+  if(buf.length - pos < BLOCK_LEN || buf.readUInt32LE(pos) !== SYNC) {
+    throw new Error('block: no sync at ' + pos);
+  }
+  var compLen = buf.readUInt32LE(pos + 4);
+  var rawLen = buf.readUInt32LE(pos + 8);
+  var count = buf.readUInt16LE(pos + 12);
+  var flags = buf.readUInt16LE(pos + 14);
+  var ts = buf.readBigUInt64LE(pos + 16);
+  var payload = pos + BLOCK_LEN;
+  var end = payload + compLen;
+  var raw, i, j;
+
+  if(end > buf.length) throw new Error('block: truncated at ' + pos);
+  if(flags & COMMITTED) {
+    if(end + COMMIT_LEN > buf.length ||
+       buf.readUInt32LE(end) !== BLOCK_LEN + compLen ||
+       buf.readUInt32LE(end + 4) !== crc32c(buf, pos, end) ||
+       buf.readUInt32LE(end + 8) !== COMMIT) {
+      throw new Error('block: bad commit at ' + pos);
+    }
+    end += COMMIT_LEN;
+  }
+  if(flags & STORED) {
+    if(compLen !== rawLen) throw new Error('block: bad stored length at ' + pos);
+    raw = buf.slice(payload, payload + compLen);
+  }
+  else {
+    raw = Buffer.alloc(rawLen);
+    if(lz4Decompress(buf.slice(payload, payload + compLen), raw) !== rawLen) {
+      throw new Error('block: bad raw length at ' + pos);
+    }
+  }
+
+  var r = new Reader(raw);
+  var block = [];
+  for(i = 0; i < count; i++) {
+    ts = BigInt.asUintN(64, ts + unzigzag(r.varint()));
+    block.push({ sec: Number(ts / 1000000000n), nsec: Number(ts % 1000000000n) });
+  }
+  var id = 0;
+  for(i = 0; i < count; i++) {
+    id = (id + Number(BigInt.asIntN(32, unzigzag(r.varint())))) >>> 0;
+    block[i].id = id;
+  }
+  var frameFlags = r.bytes(count), fdFlags = r.bytes(count), lens = r.bytes(count);
+  var last = {};
+  for(i = 0; i < count; i++) {
+    var f = block[i], len = lens[i];
+    if(len > CANFD_MAX_DLEN) throw new Error('block: bad frame length at ' + pos);
+    var prev = last[f.id];
+    var data = Buffer.from(r.bytes(len));
+    for(j = 0; prev !== undefined && j < len && j < prev.length; j++) {
+      data[j] ^= prev[j];
+    }
+    last[f.id] = data;
+    f.flags = frameFlags[i];
+    f.fdFlags = fdFlags[i];
+    f.fd = (frameFlags[i] & FRAME_FD) !== 0;
+    f.data = data;
+    frames.push(f);
+  }
+  return end;
+}
+
+/**
+ * Decodes a compressed payload into { version, iface, fd, frames } where
+ * every frame is { sec, nsec, id, flags, fdFlags, fd, data }. Throws on
+ * anything malformed: the message is then better dropped than half read.
+ */
+function decode(buf) {
+  var header = parseHeader(buf);
+  var frames = [];
+  var pos = header.headerLen;
+  while(pos < buf.length) {
+    pos = decodeBlock(buf, pos, frames);
+  }
+  header.frames = frames;
+  return header;
+}
+
+function isCompressed(buf) {
+  return buf.length >= HEADER_LEN && buf.toString('latin1', 0, 8) === MAGIC;
+}
+
+function pad(s, n) {
+  while(s.length < n) s = '0' + s;
+  return s;
+}
+
+/**
+ * Formats a frame the way canbus_format_frame does, so decoded payloads
+ * compare line for line with the text format and ecutools-logconv.
+ */
+function format(frame) {
+  var line = '(' + frame.sec + '.' + pad(String(Math.floor(frame.nsec / 1000)), 6) + ') ' +
+    pad(frame.id.toString(16), 4) + ': ';
+  if(frame.fd) {
+    line += 'FD:' + frame.fdFlags.toString(16) + ' ';
+  }
+  else if(frame.id & CAN_RTR_FLAG) {
+    return line + 'remote request';
+  }
+  line += '[' + frame.data.length + ']';
+  for(var i = 0; i < frame.data.length; i++) {
+    line += ' ' + pad(frame.data[i].toString(16), 2);
+  }
+  return line;
+}
+
+exports.decode = decode;
+exports.isCompressed = isCompressed;
+exports.format = format;
+
+/**
+ * Invoked by the DataloggerDecode topic rule (iot-rule.json) with the
+ * payload base64 encoded, since the compressed format is not JSON.
+ */
+exports.handler = function(event, context, callback) {
+  var buf = Buffer.from(event.payload, 'base64');
+  var lines;
+
+  try {
+    lines = isCompressed(buf)
+      ? decode(buf).frames.map(format)
+      : buf.toString('latin1').split('\n').filter(function(line) { return line.length > 0; });
+  }
+  catch(err) {
+    console.log(event.topic, err.message);
+    callback(err);
+    return;
+  }
+  console.log(event.topic, lines.length + ' frames');
+  callback(null, { topic: event.topic, frames: lines.length });
+}
+
+if(require.main === module) {
+  var log = decode(require('fs').readFileSync(process.argv[2]));
+  log.frames.forEach(function(frame) {
+    console.log(format(frame));
+  });
+}
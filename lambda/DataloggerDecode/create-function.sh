@@ -0,0 +1,11 @@
+#!/bin/bash
+
+zip DataloggerDecode.zip DataloggerDecode.js
+aws lambda delete-function --function-name DataloggerDecode
+aws lambda create-function \
+  --function-name DataloggerDecode \
+  --zip-file fileb://DataloggerDecode.zip \
+  --role arn:aws:iam::899038310491:role/lambda-ecutools-execution-role \
+  --handler DataloggerDecode.handler \
+  --runtime nodejs20.x
+rm DataloggerDecode.zip
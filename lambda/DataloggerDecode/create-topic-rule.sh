@@ -0,0 +1,4 @@
+#!/bin/bash
+
+aws iot delete-topic-rule --rule-name DataloggerDecode
+aws iot create-topic-rule --rule-name DataloggerDecode --topic-rule-payload file://iot-rule.json
@@ -33,8 +33,13 @@
 // =================================================
 
 // MQTT PubSub
+// Both are set through MQTT_FLAGS in Makefile.am; every object has to agree on them as they size AWS_IoT_Client
+#ifndef AWS_IOT_MQTT_TX_BUF_LEN
 #define AWS_IOT_MQTT_TX_BUF_LEN 512 ///< Any time a message is sent out through the MQTT layer. The message is copied into this buffer anytime a publish is done. This will also be used in the case of Thing Shadow
+#endif
+#ifndef AWS_IOT_MQTT_RX_BUF_LEN
 #define AWS_IOT_MQTT_RX_BUF_LEN 512 ///< Any message that comes into the device should be less than this buffer size. If a received message is bigger than this buffer size the message will be dropped.
+#endif
 #define AWS_IOT_MQTT_NUM_SUBSCRIBE_HANDLERS 5 ///< Maximum number of topic filters the MQTT client can handle at any given time. This should be increased appropriately when using Thing Shadow
 
 // Thing Shadow specific configs
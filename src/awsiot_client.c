@@ -113,17 +113,33 @@ unsigned int awsiot_client_unsubscribe(awsiot_client *awsiot, const char *topic)
 }
 
 unsigned int awsiot_client_publish(awsiot_client *awsiot, const char *topic, char *payload) {
+  DLOG_DEBUG("awsiot_client_publish: topic=%s, payload=%s", topic, payload);
+  return awsiot_client_publish_data(awsiot, topic, payload, strlen(payload));
+}
+
+/**
+ * Publishes len bytes of payload at QoS 0. The PUBLISH, topic included, has
+ * to fit AWS_IOT_MQTT_TX_BUF_LEN.
+ */
+unsigned int awsiot_client_publish_data(awsiot_client *awsiot, const char *topic, const void *payload, size_t len) {
+  return awsiot_client_publish_qos(awsiot, topic, payload, len, QOS0);
+}
+
+/**
+ * Publishes len bytes of payload at qos. At QOS1 it only returns 0 once the
+ * broker has acknowledged the message.
+ */
+unsigned int awsiot_client_publish_qos(awsiot_client *awsiot, const char *topic, const void *payload, size_t len, QoS qos) {
 
-  int payload_len = strlen(payload);
-  syslog(LOG_DEBUG, "awsiot_client_publish: topic=%s, payload_len=%d, payload=%s", topic, payload_len, payload);
+  DLOG_DEBUG("awsiot_client_publish_qos: topic=%s, payload_len=%zu, qos=%d", topic, len, qos);
 
-  IoT_Publish_Message_Params paramsQOS0;
-  paramsQOS0.qos = QOS0;
-  paramsQOS0.payloadLen = payload_len;
-  paramsQOS0.payload = (void *) payload;
-  paramsQOS0.isRetained = 0;
+  IoT_Publish_Message_Params params;
+  params.qos = qos;
+  params.payloadLen = len;
+  params.payload = (void *) payload;
+  params.isRetained = 0;
 
-  awsiot->rc = aws_iot_mqtt_publish(awsiot->client, topic, strlen(topic), &paramsQOS0);
+  awsiot->rc = aws_iot_mqtt_publish(awsiot->client, topic, strlen(topic), &params);
   if(SUCCESS != awsiot->rc) {
     char errmsg[255];
     sprintf(errmsg, "awsiot_client_publish: error publishing to topic %s. IoT_Error_t: %d", topic, awsiot->rc);
@@ -28,6 +28,7 @@
 #include "aws_iot_src/include/aws_iot_version.h"
 #include "aws_iot_src/include/aws_iot_mqtt_client_interface.h"
 #include "aws_iot_config.h"
+#include "dlog.h"
 
 typedef struct _awsiot_client {
   char *clientId;
@@ -48,7 +49,10 @@ typedef struct _awsiot_client {
 unsigned int awsiot_client_connect(awsiot_client *awsiot);
 bool awsiot_client_isconnected();
 unsigned int awsiot_client_subscribe(awsiot_client *awsiot, const char *topic, void *pApplicationHandler, void *pApplicationHandlerData);
+unsigned int awsiot_client_unsubscribe(awsiot_client *awsiot, const char *topic);
 unsigned int awsiot_client_publish(awsiot_client *awsiot, const char *topic, char *payload);
+unsigned int awsiot_client_publish_data(awsiot_client *awsiot, const char *topic, const void *payload, size_t len);
+unsigned int awsiot_client_publish_qos(awsiot_client *awsiot, const char *topic, const void *payload, size_t len, QoS qos);
 void awsiot_client_close(awsiot_client *awsiot);
 bool awsiot_client_build_desired_json(char *pJsonDocument, size_t maxSizeOfJsonDocument, const char *pData, uint32_t pDataLen);
 
@@ -16,35 +16,22 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include "canbus.h"
+#include "canbus_mmap.h"
+#include "canbus_bcm.h"
+#include "canbus_format.h"
 
 bool reading = false;
 
-void canbus_print_frame(struct can_frame *frame) {
-  int i;
-  printf("%04x: ", frame->can_id);
-  if(frame->can_id & CAN_RTR_FLAG) {
-    printf("remote request");
-  }
-  else {
-    printf("[%d]", frame->can_dlc);
-    for(i = 0; i < frame->can_dlc; i++)
-      printf(" %02x", frame->data[i]);
-  }
-  printf("\n");
+void canbus_print_frame(canbus_frame *frame) {
+  char buf[CANBUS_FRAME_TEXT_LEN];
+  canbus_framecpy(frame, buf);
+  printf("%s\n", buf);
 }
 
-void canbus_framecpy(struct can_frame * frame, char *buf) {
-  int i;
-  sprintf(buf, "%04x: ", frame->can_id);
-  if(frame->can_id & CAN_RTR_FLAG) {
-    printf("remote request");
-  }
-  else {
-    sprintf(buf + strlen(buf), "[%d]", frame->can_dlc);
-    for(i = 0; i < frame->can_dlc; i++)
-      sprintf(buf + strlen(buf), " %02x", frame->data[i]);
-  }
+void canbus_framecpy(canbus_frame *frame, char *buf) {
+  canbus_format_frame(frame, buf);
 }
 
 unsigned int canbus_framecmp(struct can_frame *frame1, struct can_frame *frame2) {
@@ -55,8 +42,17 @@ unsigned int canbus_framecmp(struct can_frame *frame1, struct can_frame *frame2)
 void canbus_init(canbus_client *canbus) {
   syslog(LOG_DEBUG, "canbus_init: initializing canbus client. iface=%s", canbus->iface);
   canbus->socket = 0;
+  canbus->wakefd = -1;
   canbus->state = CANBUS_STATE_CLOSED;
   canbus->flags = 0;
+  canbus->tstamp = CANBUS_TSTAMP_NONE;
+  canbus->mtu = CAN_MTU;
+  canbus->capture = CANBUS_CAPTURE_SOCKET;
+  canbus->ring = NULL;
+  canbus->stats = NULL;
+  memset(canbus->drops, 0, sizeof(canbus->drops));
+  canbus->rxq_ovfl = 0;
+  canbus->rcvbuf = 0;
   canbus->reading = false;
   if(canbus->iface == NULL) {
     canbus->iface = malloc(6);
@@ -64,6 +60,30 @@ void canbus_init(canbus_client *canbus) {
   }
 }
 
+/**
+ * Closes the half set up CAN_RAW socket of a failed connect and returns rc.
+ */
+static unsigned int canbus_connect_abort(canbus_client *canbus, unsigned int rc) {
+  close(canbus->socket);
+  canbus->socket = 0;
+  return rc;
+}
+
+/**
+ * Last step of a connect that succeeded: the wakeup eventfd is only created
+ * once nothing can fail, so no error path has to close it.
+ */
+static unsigned int canbus_connect_done(canbus_client *canbus) {
+  if((canbus->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+    syslog(LOG_WARNING, "canbus_connect: unable to create wakeup eventfd, reads will not be cancelable: %s", strerror(errno));
+  }
+
+  pthread_mutex_lock(&canbus->lock);
+  canbus->state = CANBUS_STATE_CONNECTED;
+  pthread_mutex_unlock(&canbus->lock);
+  return 0;
+}
+
 unsigned int canbus_connect(canbus_client *canbus) {
 
   syslog(LOG_DEBUG, "canbus_connect: socket=%i, iface=%s", canbus->socket, canbus->iface);
@@ -86,6 +106,14 @@ unsigned int canbus_connect(canbus_client *canbus) {
   canbus->state = CANBUS_STATE_CONNECTING;
   pthread_mutex_unlock(&canbus->lock);
 
+  if(canbus->capture != CANBUS_CAPTURE_SOCKET) {
+    unsigned int rc = canbus->capture == CANBUS_CAPTURE_MMAP ? canbus_mmap_connect(canbus) : canbus_bcm_connect(canbus);
+    if(rc != 0) {
+      return rc + 10;
+    }
+    return canbus_connect_done(canbus);
+  }
+
   int recv_own_msgs = CANBUS_FLAG_RECV_OWN_MSGS;
   struct sockaddr_can addr;
   struct ifreq ifr;
@@ -99,7 +127,7 @@ unsigned int canbus_connect(canbus_client *canbus) {
   strcpy(ifr.ifr_name, canbus->iface);
   if(ioctl(canbus->socket, SIOCGIFINDEX, &ifr) < 0) {
 	  syslog(LOG_ERR, "canbus_connect: unable to find CAN interface %s", canbus->iface);
-	  return 5;
+	  return canbus_connect_abort(canbus, 5);
   }
 
   addr.can_family = AF_CAN;
@@ -107,75 +135,441 @@ unsigned int canbus_connect(canbus_client *canbus) {
 
   if(bind(canbus->socket, (struct sockaddr *)&addr, sizeof(addr)) < -1) {
     syslog(LOG_ERR, "canbus_connect: error in socket bind");
-    return 6;
+    return canbus_connect_abort(canbus, 6);
   }
 
   if(setsockopt(canbus->socket, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &err_mask, sizeof(err_mask)) == -1) {
     syslog(LOG_ERR, "canbus_connect: unable to set CAN_RAW_ERR_FILTER socket option: %s", strerror(errno));
-    return 7;
+    return canbus_connect_abort(canbus, 7);
   }
 
   if(setsockopt(canbus->socket, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS, &recv_own_msgs, sizeof(recv_own_msgs)) == -1) {
     syslog(LOG_ERR, "canbus_connect: unable to set CAN_RAW_RECV_OWN_MSGS socket option: %s", strerror(errno));
-    return 8;
+    return canbus_connect_abort(canbus, 8);
   }
 
-  syslog(LOG_DEBUG, "canbus_connect: %s socket=%i", ifr.ifr_name, canbus->socket);
+  // negotiate CAN FD when the interface is FD capable; classic frames still arrive as CAN_MTU
+  int enable_fd = 1;
+  canbus->mtu = CAN_MTU;
+  if(ioctl(canbus->socket, SIOCGIFMTU, &ifr) == 0 && ifr.ifr_mtu == CANFD_MTU) {
+    if(setsockopt(canbus->socket, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable_fd, sizeof(enable_fd)) == 0) {
+      canbus->mtu = CANFD_MTU;
+    }
+    else {
+      syslog(LOG_WARNING, "canbus_connect: unable to set CAN_RAW_FD_FRAMES socket option: %s", strerror(errno));
+    }
+  }
 
-  pthread_mutex_lock(&canbus->lock);
-  canbus->state = CANBUS_STATE_CONNECTED;
-  pthread_mutex_unlock(&canbus->lock);
+  int tstamp_flags = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+                     SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+  int tstampns = 1;
+  if(setsockopt(canbus->socket, SOL_SOCKET, SO_TIMESTAMPING, &tstamp_flags, sizeof(tstamp_flags)) == 0) {
+    canbus->tstamp = CANBUS_TSTAMP_TIMESTAMPING;
+  }
+  else if(setsockopt(canbus->socket, SOL_SOCKET, SO_TIMESTAMPNS, &tstampns, sizeof(tstampns)) == 0) {
+    canbus->tstamp = CANBUS_TSTAMP_TIMESTAMPNS;
+  }
+  else {
+    syslog(LOG_WARNING, "canbus_connect: kernel receive timestamps unavailable, falling back to userspace: %s", strerror(errno));
+    canbus->tstamp = CANBUS_TSTAMP_NONE;
+  }
 
-  return 0;
+  int rxq_ovfl = 1;
+  if(setsockopt(canbus->socket, SOL_SOCKET, SO_RXQ_OVFL, &rxq_ovfl, sizeof(rxq_ovfl)) == -1) {
+    syslog(LOG_WARNING, "canbus_connect: unable to set SO_RXQ_OVFL socket option, socket drops will not be counted: %s", strerror(errno));
+  }
+
+  if(canbus->rcvbuf > 0) {
+    canbus_set_rcvbuf(canbus, canbus->rcvbuf);
+  }
+
+  syslog(LOG_DEBUG, "canbus_connect: %s socket=%i, tstamp=%d, mtu=%d", ifr.ifr_name, canbus->socket, canbus->tstamp, canbus->mtu);
+
+  return canbus_connect_done(canbus);
 }
 
 bool canbus_isconnected(canbus_client *canbus) {
   return canbus->socket > 0 && (canbus->state & CANBUS_STATE_CONNECTED);
 }
 
-ssize_t canbus_read(canbus_client *canbus, struct can_frame *frame) {
+bool canbus_isfd(canbus_client *canbus) {
+  return canbus->mtu == CANFD_MTU;
+}
+
+/**
+ * Reads one frame through canbus_read_batch, so it carries the same kernel
+ * receive timestamp. Returns CAN_MTU or CANFD_MTU, 1 when not connected, 2 on
+ * a read error or 3 when the frame was incomplete.
+ */
+ssize_t canbus_read(canbus_client *canbus, canbus_frame *frame) {
   if((canbus->state & CANBUS_STATE_CONNECTED) == 0) {
     syslog(LOG_ERR, "canbus_read: CAN socket not connected");
     return 1;
   }
 
-  int nbytes = read(canbus->socket, frame, sizeof(struct can_frame));
-
-  if(nbytes < 0) {
-    syslog(LOG_CRIT, "canbus_read: %s", strerror(errno));
+  ssize_t n = canbus_read_batch(canbus, frame, 1);
+  if(n < 0) {
     return 2;
   }
-
-  if(nbytes < sizeof(struct can_frame)) {
-    syslog(LOG_CRIT, "canbus_read: received incomplete CAN frame");
+  if(n == 0) {
     return 3;
   }
 
-  syslog(LOG_DEBUG, "canbus_read: read %i byte CAN frame", nbytes);
+  DLOG_DEBUG("canbus_read: read %s CAN frame", (frame->flags & CANBUS_FRAME_FD) ? "FD" : "classic");
+
+  return (frame->flags & CANBUS_FRAME_FD) ? CANFD_MTU : CAN_MTU;
+}
+
+/**
+ * Waits up to timeout_ms (-1 = forever) for the socket to become readable.
+ * Returns 1 when it is, 0 on timeout, or -1 on error. A pending canbus_cancel
+ * takes precedence over queued frames and fails with ECANCELED.
+ */
+int canbus_poll(canbus_client *canbus, int timeout_ms) {
+  struct pollfd pfds[2] = {
+    { .fd = canbus->socket, .events = POLLIN, .revents = 0 },
+    { .fd = canbus->wakefd, .events = POLLIN, .revents = 0 }
+  };
+
+  int rc = poll(pfds, canbus->wakefd >= 0 ? 2 : 1, timeout_ms);
+  if(rc == -1) {
+    if(errno != EINTR) {
+      syslog(LOG_ERR, "canbus_poll: %s", strerror(errno));
+    }
+    return -1;
+  }
+
+  if(pfds[1].revents & POLLIN) {
+    errno = ECANCELED;
+    return -1;
+  }
+
+  return rc > 0 ? 1 : 0;
+}
+
+/**
+ * Same as canbus_read_batch, but gives up after timeout_ms and can be interrupted
+ * by canbus_cancel from another thread. Returns the number of frames read, 0 on
+ * timeout, or -1 on error (errno is ECANCELED once the client has been cancelled).
+ */
+ssize_t canbus_read_timeout(canbus_client *canbus, canbus_frame *frames, unsigned int vlen, int timeout_ms) {
+  if((canbus->state & CANBUS_STATE_CONNECTED) == 0) {
+    syslog(LOG_ERR, "canbus_read_timeout: CAN socket not connected");
+    return -1;
+  }
+
+  int rc = canbus_poll(canbus, timeout_ms);
+  if(rc <= 0) {
+    return rc;
+  }
+
+  return canbus_read_batch(canbus, frames, vlen);
+}
+
+/**
+ * Wakes every thread blocked in canbus_poll, canbus_read_timeout or an mmap/BCM
+ * read on this client. The cancel stays pending until canbus_close, so a reader
+ * that has not reached its poll yet is stopped as well.
+ */
+void canbus_cancel(canbus_client *canbus) {
+  uint64_t one = 1;
+  if(canbus->wakefd >= 0 && write(canbus->wakefd, &one, sizeof(one)) != sizeof(one)) {
+    syslog(LOG_ERR, "canbus_cancel: unable to signal %s reader: %s", canbus->iface, strerror(errno));
+  }
+}
+
+/**
+ * Sizes the socket receive buffer. SO_RCVBUFFORCE is tried first so root can go past
+ * net.core.rmem_max; otherwise the request is capped by the kernel. May be called on a
+ * live socket. Returns the size the kernel actually granted, or -1 on error.
+ */
+int canbus_set_rcvbuf(canbus_client *canbus, int bytes) {
+  int actual = 0;
+  socklen_t len = sizeof(actual);
+  if(setsockopt(canbus->socket, SOL_SOCKET, SO_RCVBUFFORCE, &bytes, sizeof(bytes)) == -1 &&
+     setsockopt(canbus->socket, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes)) == -1) {
+    syslog(LOG_ERR, "canbus_set_rcvbuf: unable to set SO_RCVBUF on %s: %s", canbus->iface, strerror(errno));
+    return -1;
+  }
+  if(getsockopt(canbus->socket, SOL_SOCKET, SO_RCVBUF, &actual, &len) == -1) {
+    syslog(LOG_ERR, "canbus_set_rcvbuf: unable to read SO_RCVBUF on %s: %s", canbus->iface, strerror(errno));
+    return -1;
+  }
+  canbus->rcvbuf = bytes;
+  syslog(LOG_DEBUG, "canbus_set_rcvbuf: %s requested=%d, actual=%d", canbus->iface, bytes, actual);
+  return actual;
+}
+
+/**
+ * Walks the ancillary data of a received message: picks up the kernel receive
+ * timestamp and, when SO_RXQ_OVFL is enabled, adds the frames the socket dropped
+ * since the previous message to drops[CANBUS_DROP_SOCKET].
+ */
+void canbus_cmsg_parse(canbus_client *canbus, struct msghdr *msg, struct timespec *ts) {
+  struct cmsghdr *cmsg;
+  for(cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if(cmsg->cmsg_level != SOL_SOCKET) continue;
+    if(cmsg->cmsg_type == SCM_TIMESTAMPING) {
+      // ts[0] = software, ts[2] = raw hardware
+      struct timespec *stamps = (struct timespec *)CMSG_DATA(cmsg);
+      *ts = (stamps[2].tv_sec || stamps[2].tv_nsec) ? stamps[2] : stamps[0];
+    }
+    else if(cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      memcpy(ts, CMSG_DATA(cmsg), sizeof(struct timespec));
+    }
+    else if(cmsg->cmsg_type == SO_RXQ_OVFL) {
+      uint32_t ovfl;
+      memcpy(&ovfl, CMSG_DATA(cmsg), sizeof(ovfl));
+      canbus_drop(canbus, CANBUS_DROP_SOCKET, (uint32_t)(ovfl - canbus->rxq_ovfl));
+      canbus->rxq_ovfl = ovfl;
+    }
+  }
+}
+
+/**
+ * Adds frames to a drop counter. The reader, the file writer thread and the
+ * publisher all count into the same client, so updates are atomic.
+ */
+void canbus_drop(canbus_client *canbus, unsigned int stage, uint64_t frames) {
+  if(frames > 0) {
+    __atomic_add_fetch(&canbus->drops[stage], frames, __ATOMIC_RELAXED);
+  }
+}
+
+uint64_t canbus_dropped(canbus_client *canbus, unsigned int stage) {
+  return __atomic_load_n(&canbus->drops[stage], __ATOMIC_RELAXED);
+}
+
+uint64_t canbus_drops(canbus_client *canbus) {
+  uint64_t total = 0;
+  unsigned int i;
+  for(i=0; i<CANBUS_DROP_STAGES; i++) {
+    total += canbus_dropped(canbus, i);
+  }
+  return total;
+}
+
+/**
+ * Reads up to vlen frames with a single recvmmsg call. Blocks until at least one
+ * frame is available, then returns whatever else is already queued on the socket
+ * without waiting (MSG_WAITFORONE). Each frame carries its kernel receive timestamp,
+ * or the time of the recvmmsg return when the socket has no timestamping enabled.
+ * Returns the number of frames copied into frames, or -1 on error.
+ */
+ssize_t canbus_read_batch(canbus_client *canbus, canbus_frame *frames, unsigned int vlen) {
+  if((canbus->state & CANBUS_STATE_CONNECTED) == 0) {
+    syslog(LOG_ERR, "canbus_read_batch: CAN socket not connected");
+    return -1;
+  }
+
+  if(canbus->ring != NULL) {
+    return canbus_mmap_read_batch(canbus, frames, vlen);
+  }
+
+  if(canbus->capture == CANBUS_CAPTURE_BCM) {
+    return canbus_bcm_read_batch(canbus, frames, vlen);
+  }
+
+  if(vlen > CANBUS_BATCH_SIZE) {
+    vlen = CANBUS_BATCH_SIZE;
+  }
+
+  struct mmsghdr msgs[CANBUS_BATCH_SIZE];
+  struct iovec iovs[CANBUS_BATCH_SIZE];
+  char cmsgbufs[CANBUS_BATCH_SIZE][CMSG_SPACE(sizeof(struct timespec) * 3) + CMSG_SPACE(sizeof(uint32_t))];
+  unsigned int i;
+
+  memset(msgs, 0, sizeof(struct mmsghdr) * vlen);
+  for(i=0; i<vlen; i++) {
+    iovs[i].iov_base = &frames[i].frame;
+    iovs[i].iov_len = canbus->mtu;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = cmsgbufs[i];
+    msgs[i].msg_hdr.msg_controllen = sizeof(cmsgbufs[i]);
+  }
+
+  int nmsgs = recvmmsg(canbus->socket, msgs, vlen, MSG_WAITFORONE, NULL);
+  if(nmsgs < 0) {
+    syslog(LOG_CRIT, "canbus_read_batch: %s", strerror(errno));
+    return -1;
+  }
+
+  struct timespec now = {0};
+  if(canbus->tstamp == CANBUS_TSTAMP_NONE) {
+    clock_gettime(CLOCK_REALTIME, &now);
+  }
+
+  // drop incomplete frames, keeping the array contiguous
+  unsigned int nframes = 0;
+  for(i=0; i<nmsgs; i++) {
+    if(msgs[i].msg_len != CAN_MTU && msgs[i].msg_len != CANFD_MTU) {
+      syslog(LOG_CRIT, "canbus_read_batch: received incomplete CAN frame");
+      canbus_drop(canbus, CANBUS_DROP_INCOMPLETE, 1);
+      continue;
+    }
+    frames[i].flags = (msgs[i].msg_len == CANFD_MTU) ? CANBUS_FRAME_FD : 0;
+    frames[i].ts = now;
+    canbus_cmsg_parse(canbus, &msgs[i].msg_hdr, &frames[i].ts);
+    if(nframes != i) {
+      memcpy(&frames[nframes], &frames[i], sizeof(canbus_frame));
+    }
+    nframes++;
+  }
+
+  return nframes;
+}
 
-  return nbytes;
+static long canbus_elapsed_ms(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
 }
 
-unsigned int canbus_write(canbus_client *canbus, struct can_frame *frame) {
+/**
+ * Waits for the interface to accept more frames after ENOBUFS/EAGAIN. POLLOUT only
+ * reflects the socket send buffer, not the qdisc, so a full device queue is also
+ * given an exponential backoff. Returns false once timeout_ms has elapsed.
+ */
+static bool canbus_write_wait(canbus_client *canbus, int err, struct timespec *start, int timeout_ms, unsigned int *backoff_us) {
+  long elapsed = canbus_elapsed_ms(start);
+  if(timeout_ms >= 0 && elapsed >= timeout_ms) {
+    return false;
+  }
+
+  struct pollfd pfd = { .fd = canbus->socket, .events = POLLOUT };
+  poll(&pfd, 1, timeout_ms >= 0 ? timeout_ms - elapsed : -1);
+
+  if(err == ENOBUFS) {
+    usleep(*backoff_us);
+    *backoff_us = (*backoff_us * 2 > CANBUS_TX_BACKOFF_MAX_US) ? CANBUS_TX_BACKOFF_MAX_US : *backoff_us * 2;
+  }
+  return true;
+}
+
+unsigned int canbus_write(canbus_client *canbus, canbus_frame *frame) {
   if((canbus->state & CANBUS_STATE_CONNECTED) == 0) {
     syslog(LOG_ERR, "canbus_write: CAN socket not connected");
     return 1;
   }
 
+  if(canbus->capture != CANBUS_CAPTURE_SOCKET) {
+    syslog(LOG_ERR, "canbus_write: %s is not a CAN_RAW connection", canbus->iface);
+    return 1;
+  }
+
+  if((frame->flags & CANBUS_FRAME_FD) && !canbus_isfd(canbus)) {
+    syslog(LOG_ERR, "canbus_write: CAN FD frame on a classic CAN socket");
+    return 1;
+  }
+
+  struct timespec start;
+  unsigned int backoff_us = CANBUS_TX_BACKOFF_MIN_US;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
   pthread_mutex_lock(&canbus->wlock);
 
-  int bytes = write(canbus->socket, frame, sizeof(struct can_frame));
-  if(bytes == -1) {
-    syslog(LOG_ERR, "canbus_write: %s", strerror(errno));
+  int bytes;
+  while((bytes = write(canbus->socket, &frame->frame, (frame->flags & CANBUS_FRAME_FD) ? CANFD_MTU : CAN_MTU)) == -1) {
+    int err = errno;
+    if(err != ENOBUFS && err != EAGAIN) {
+      syslog(LOG_ERR, "canbus_write: %s", strerror(err));
+      break;
+    }
+    pthread_mutex_unlock(&canbus->wlock);
+    bool waited = canbus_write_wait(canbus, err, &start, CANBUS_TX_TIMEOUT_MS, &backoff_us);
+    pthread_mutex_lock(&canbus->wlock);
+    if(!waited) {
+      syslog(LOG_ERR, "canbus_write: %s", strerror(err));
+      break;
+    }
   }
 
   pthread_mutex_unlock(&canbus->wlock);
 
-  syslog(LOG_DEBUG, "canbus_write: wrote %d byte CAN frame", bytes);
+  DLOG_DEBUG("canbus_write: wrote %d byte CAN frame", bytes);
 
   return bytes;
 }
 
+/**
+ * Writes count frames with as few sendmmsg calls as possible. When the interface TX
+ * queue is full the remainder is retried after waiting for room (see
+ * canbus_write_wait) until timeout_ms expires; -1 waits forever. Holds wlock while
+ * sending, so canbus_write from another thread cannot land in the middle of a
+ * sendmmsg run, but not while waiting, so a stalled bus does not block other writers.
+ * Returns the number of frames sent, which is less than count on timeout or a hard
+ * error, or -1 if nothing could be sent at all.
+ */
+ssize_t canbus_write_batch(canbus_client *canbus, canbus_frame *frames, unsigned int count, int timeout_ms) {
+  if((canbus->state & CANBUS_STATE_CONNECTED) == 0) {
+    syslog(LOG_ERR, "canbus_write_batch: CAN socket not connected");
+    return -1;
+  }
+
+  if(canbus->capture != CANBUS_CAPTURE_SOCKET) {
+    syslog(LOG_ERR, "canbus_write_batch: %s is not a CAN_RAW connection", canbus->iface);
+    return -1;
+  }
+
+  struct mmsghdr msgs[CANBUS_BATCH_SIZE];
+  struct iovec iovs[CANBUS_BATCH_SIZE];
+  struct timespec start;
+  unsigned int backoff_us = CANBUS_TX_BACKOFF_MIN_US;
+  unsigned int sent = 0, i;
+
+  for(i=0; i<count; i++) {
+    if((frames[i].flags & CANBUS_FRAME_FD) && !canbus_isfd(canbus)) {
+      syslog(LOG_ERR, "canbus_write_batch: CAN FD frame on a classic CAN socket");
+      count = i;
+      break;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  pthread_mutex_lock(&canbus->wlock);
+
+  while(sent < count) {
+
+    unsigned int vlen = (count - sent > CANBUS_BATCH_SIZE) ? CANBUS_BATCH_SIZE : count - sent;
+
+    memset(msgs, 0, sizeof(struct mmsghdr) * vlen);
+    for(i=0; i<vlen; i++) {
+      canbus_frame *frame = &frames[sent + i];
+      iovs[i].iov_base = &frame->frame;
+      iovs[i].iov_len = (frame->flags & CANBUS_FRAME_FD) ? CANFD_MTU : CAN_MTU;
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int nmsgs = sendmmsg(canbus->socket, msgs, vlen, MSG_DONTWAIT);
+    if(nmsgs > 0) {
+      sent += nmsgs;
+      backoff_us = CANBUS_TX_BACKOFF_MIN_US;
+      continue;
+    }
+
+    int err = errno;
+    if(err != ENOBUFS && err != EAGAIN) {
+      syslog(LOG_ERR, "canbus_write_batch: %s. sent=%u, count=%u", strerror(err), sent, count);
+      break;
+    }
+    // let other writers in while the bus drains
+    pthread_mutex_unlock(&canbus->wlock);
+    bool waited = canbus_write_wait(canbus, err, &start, timeout_ms, &backoff_us);
+    pthread_mutex_lock(&canbus->wlock);
+    if(!waited) {
+      syslog(LOG_ERR, "canbus_write_batch: %s. sent=%u, count=%u", strerror(err), sent, count);
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&canbus->wlock);
+
+  return sent ? (ssize_t)sent : -1;
+}
+
 int canbus_filter(canbus_client *canbus, struct can_filter *filters, unsigned int filter_len) {
   if((canbus->state & CANBUS_STATE_CONNECTED) == 0) {
     syslog(LOG_ERR, "canbus_write: CAN socket not connected");
@@ -210,6 +604,13 @@ void canbus_close(canbus_client *canbus) {
     canbus->socket = 0;
   }
 
+  canbus_mmap_close(canbus);
+
+  if(canbus->wakefd >= 0) {
+    close(canbus->wakefd);
+    canbus->wakefd = -1;
+  }
+
   syslog(LOG_DEBUG, "canbus_close: connection closed");
 
   pthread_mutex_lock(&canbus->lock);
@@ -217,6 +618,29 @@ void canbus_close(canbus_client *canbus) {
   pthread_mutex_unlock(&canbus->lock);
 }
 
+/**
+ * Splits a CANBUS_IFACE_DELIM separated interface list into at most max newly
+ * allocated names. Returns the number of names stored.
+ */
+unsigned int canbus_iface_split(const char *ifaces, char **names, unsigned int max) {
+  if(ifaces == NULL) return 0;
+  unsigned int count = 0;
+  char *saveptr = NULL;
+  char *list = strdup(ifaces);
+  char *name = strtok_r(list, CANBUS_IFACE_DELIM, &saveptr);
+  while(name != NULL && count < max) {
+    if(strlen(name) >= IFNAMSIZ) {
+      syslog(LOG_ERR, "canbus_iface_split: interface name too long: %s", name);
+    }
+    else {
+      names[count++] = strdup(name);
+    }
+    name = strtok_r(NULL, CANBUS_IFACE_DELIM, &saveptr);
+  }
+  free(list);
+  return count;
+}
+
 void canbus_free(canbus_client *canbus) {
   if(canbus->iface != NULL) {
     free(canbus->iface);
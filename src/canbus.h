@@ -31,9 +31,14 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <time.h>
 #include <pthread.h>
 #include <linux/can.h>
 #include <linux/can/raw.h>
+#include <linux/net_tstamp.h>
+#include "dlog.h"
 
 #define CANBUS_STATE_CONNECTING (1 << 0)
 #define CANBUS_STATE_CONNECTED  (1 << 1)
@@ -42,27 +47,85 @@
 
 #define CANBUS_FLAG_RECV_OWN_MSGS 0     // 0 = disable, 1 = enable
 
+#define CANBUS_BATCH_SIZE         32    // max frames returned by a single canbus_read_batch call
+
+#define CANBUS_TX_TIMEOUT_MS      1000  // how long a write waits for room in a full interface TX queue
+#define CANBUS_TX_BACKOFF_MIN_US  100   // first retry delay after ENOBUFS
+#define CANBUS_TX_BACKOFF_MAX_US  10000 // retry delay cap while the TX queue stays full
+
+#define CANBUS_FRAME_TEXT_LEN     240   // "(ssssssssss.uuuuuu) iiiiiiii: FD:f [64] dd .. dd" + NUL
+
+#define CANBUS_FRAME_FD           (1 << 0)  // canbus_frame holds a CAN FD frame
+
+#define CANBUS_TSTAMP_NONE        0     // no kernel timestamps; stamped in userspace after recv
+#define CANBUS_TSTAMP_TIMESTAMPNS 1     // SO_TIMESTAMPNS
+#define CANBUS_TSTAMP_TIMESTAMPING 2    // SO_TIMESTAMPING (hardware if the controller supports it, else software)
+
+#define CANBUS_CAPTURE_SOCKET     0     // CAN_RAW socket, one recvmmsg per batch
+#define CANBUS_CAPTURE_MMAP       1     // read only AF_PACKET TPACKET_V3 ring, see canbus_mmap.h
+#define CANBUS_CAPTURE_BCM        2     // CAN_BCM socket for cyclic TX and change-only RX, see canbus_bcm.h
+
+#define CANBUS_IFACE_DELIM        ","   // separates interface names in a list such as "can0,can1"
+
+#define CANBUS_DROP_SOCKET        0     // socket receive queue overflow (SO_RXQ_OVFL, or tp_drops on the mmap ring)
+#define CANBUS_DROP_INCOMPLETE    1     // short reads discarded by canbus_read_batch
+#define CANBUS_DROP_FILE          2     // frames the file logger failed to write
+#define CANBUS_DROP_PUBLISH       3     // frames the AWS IoT logger failed to publish
+#define CANBUS_DROP_STAGES        4
+
 typedef struct {
   char *iface;
   unsigned int socket;
+  int wakefd;               // eventfd signalled by canbus_cancel to wake a blocked reader
   uint8_t state;
   uint8_t flags;
+  uint8_t tstamp;
+  uint8_t mtu;              // CAN_MTU, or CANFD_MTU once CAN_RAW_FD_FRAMES has been negotiated
+  uint8_t capture;          // CANBUS_CAPTURE_*, chosen before canbus_connect
+  struct canbus_mmap_ring *ring;
+  struct canbus_stats *stats;  // updated by canbus_reactor_run when set, see canbus_stats.h
+  uint64_t drops[CANBUS_DROP_STAGES];  // frames lost between the wire and the sink, by CANBUS_DROP_* stage
+  uint32_t rxq_ovfl;        // last SO_RXQ_OVFL counter seen; the kernel value is cumulative and wraps
+  int rcvbuf;               // SO_RCVBUF applied at connect when > 0, see canbus_set_rcvbuf
   pthread_t thread;
   bool reading;
   pthread_mutex_t lock;
   pthread_mutex_t wlock;
 } canbus_client;
 
+/**
+ * Classic and FD frames share one representation; struct canfd_frame is a layout
+ * compatible superset of struct can_frame, so classic frames are read straight into
+ * it and CANBUS_FRAME_FD tells them apart.
+ */
+typedef struct {
+  struct timespec ts;       // kernel receive timestamp (CLOCK_REALTIME)
+  uint8_t flags;
+  struct canfd_frame frame;
+} canbus_frame;
+
 void canbus_init(canbus_client *canbus);
 unsigned int canbus_connect(canbus_client *canbus);
 bool canbus_isconnected(canbus_client *canbus);
-ssize_t canbus_read(canbus_client *canbus, struct can_frame *frame);
-unsigned int canbus_write(canbus_client *canbus, struct can_frame *frame);
+ssize_t canbus_read(canbus_client *canbus, canbus_frame *frame);
+ssize_t canbus_read_batch(canbus_client *canbus, canbus_frame *frames, unsigned int vlen);
+ssize_t canbus_read_timeout(canbus_client *canbus, canbus_frame *frames, unsigned int vlen, int timeout_ms);
+int canbus_poll(canbus_client *canbus, int timeout_ms);
+void canbus_cancel(canbus_client *canbus);
+unsigned int canbus_write(canbus_client *canbus, canbus_frame *frame);
+ssize_t canbus_write_batch(canbus_client *canbus, canbus_frame *frames, unsigned int count, int timeout_ms);
 int canbus_filter(canbus_client *canbus, struct can_filter *filters, unsigned int filter_len);
 void canbus_shutdown(canbus_client *canbus, int how);
 void canbus_close(canbus_client *canbus);
-void canbus_framecpy(struct can_frame * frame, char *buf);
+void canbus_framecpy(canbus_frame *frame, char *buf);
 unsigned int canbus_framecmp(struct can_frame *frame1, struct can_frame *frame2);
-void canbus_print_frame(struct can_frame * frame);
+void canbus_print_frame(canbus_frame *frame);
+bool canbus_isfd(canbus_client *canbus);
+void canbus_cmsg_parse(canbus_client *canbus, struct msghdr *msg, struct timespec *ts);
+int canbus_set_rcvbuf(canbus_client *canbus, int bytes);
+uint64_t canbus_drops(canbus_client *canbus);
+void canbus_drop(canbus_client *canbus, unsigned int stage, uint64_t frames);
+uint64_t canbus_dropped(canbus_client *canbus, unsigned int stage);
+unsigned int canbus_iface_split(const char *ifaces, char **names, unsigned int max);
 
 #endif
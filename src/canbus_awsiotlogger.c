@@ -16,11 +16,14 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <limits.h>
 #include "canbus_awsiotlogger.h"
+#include "canbus_format.h"
+#include "canbus_log.h"
 
 static const char *awsiotlogger_topic = "ecutools/datalogger";
 static awsiot_client *iotlogger;
-static pthread_t replay_thread;
+static bool iotlogger_connected;   // as last seen by the drain thread
 
 void canbus_awsiotlogger_onopen(awsiot_client *awsiot) {
   syslog(LOG_DEBUG, "canbus_awsiotlogger_onopen");
@@ -31,7 +34,7 @@ void canbus_awsiotlogger_onclose(awsiot_client *awsiot) {
 }
 
 void canbus_awsiotlogger_onerror(awsiot_client *awsiot, const char *message) {
-  syslog(LOG_DEBUG, "canbus_awsiotlogger_onerror: code:%i, message=%s", awsiot->rc, message);
+  DLOG_DEBUG("canbus_awsiotlogger_onerror: code:%i, message=%s", awsiot->rc, message);
 }
 
 void canbus_awsiotlogger_onmessage(AWS_IoT_Client *pClient, char *topicName, uint16_t topicNameLen, 
@@ -40,32 +43,518 @@ void canbus_awsiotlogger_onmessage(AWS_IoT_Client *pClient, char *topicName, uin
  syslog(LOG_DEBUG, "canbus_awsiotlogger_onmessage: code:%i, message=%s", 1, (char *)pData);
 }
 
+/**
+ * The frames of every interface a canbus_awsiotlogger_thread publishes.
+ */
+typedef struct {
+  canbus_logger *logger;
+  canbus_awsiotlogger_batch batches[CANBUS_LOGGER_MAX_IFACES];
+  canbus_spool spool;
+  bool spooling;            // spool is open
+  pthread_t drain_thread;
+  bool draining;            // drain_thread was started
+  bool stopping;            // tells drain_thread to finish
+  uint64_t replay_lost;     // frames of a replay that could neither be published nor spooled
+} canbus_awsiotlogger_session;
+
+static canbus_awsiotlogger_session *replay_session;
+
+static void canbus_awsiotlogger_batch_free(canbus_awsiotlogger_batch *batch) {
+  free(batch->buf);
+  free(batch->held);
+  batch->buf = NULL;
+  batch->held = NULL;
+}
+
+/**
+ * Sizes a batch for its topic from the logger's limits and
+ * AWS_IOT_MQTT_TX_BUF_LEN. Compressed batches need room for a whole block.
+ */
+static unsigned int canbus_awsiotlogger_batch_init(canbus_awsiotlogger_batch *batch, char *topic, canbus_client *canbus, canbus_logger *logger) {
+  size_t overhead = strlen(topic) + CANBUS_AWSIOTLOGGER_MQTT_OVERHEAD;
+
+  memset(batch, 0, sizeof(canbus_awsiotlogger_batch));
+  batch->topic = topic;
+  batch->canbus = canbus;
+  batch->max_frames = logger->publish_frames > 0 ? logger->publish_frames : CANBUS_AWSIOTLOGGER_BATCH_FRAMES;
+  batch->max_ms = logger->publish_ms > 0 ? logger->publish_ms : CANBUS_AWSIOTLOGGER_BATCH_MS;
+  batch->max = AWS_IOT_MQTT_TX_BUF_LEN > overhead ? AWS_IOT_MQTT_TX_BUF_LEN - overhead : 0;
+  if(batch->max > CANBUS_AWSIOTLOGGER_PAYLOAD_MAX) {
+    batch->max = CANBUS_AWSIOTLOGGER_PAYLOAD_MAX;
+  }
+
+  batch->format = CANBUS_LOG_FORMAT_TEXT;
+  if(logger->log_format == CANBUS_LOG_FORMAT_COMPRESSED) {
+    if(batch->max < sizeof(canbus_binlog_header) + CANBUS_BLOCKLOG_BLOCK_MAX) {
+      syslog(LOG_WARNING, "canbus_awsiotlogger_batch_init: AWS_IOT_MQTT_TX_BUF_LEN=%d is too small for compressed blocks on %s, publishing text",
+        AWS_IOT_MQTT_TX_BUF_LEN, topic);
+    }
+    else {
+      batch->format = CANBUS_LOG_FORMAT_COMPRESSED;
+    }
+  }
+  else if(logger->log_format != CANBUS_LOG_FORMAT_TEXT) {
+    syslog(LOG_WARNING, "canbus_awsiotlogger_batch_init: format %d is for files, publishing text on %s", logger->log_format, topic);
+  }
+  if(batch->format == CANBUS_LOG_FORMAT_TEXT && batch->max < CANBUS_FRAME_TEXT_LEN) {
+    syslog(LOG_WARNING, "canbus_awsiotlogger_batch_init: AWS_IOT_MQTT_TX_BUF_LEN=%d leaves %zu bytes for frames on %s, too few for long frames",
+      AWS_IOT_MQTT_TX_BUF_LEN, batch->max, topic);
+  }
+
+  batch->buf = malloc(batch->max);
+  if(batch->format == CANBUS_LOG_FORMAT_COMPRESSED) {
+    batch->held = malloc(CANBUS_BLOCKLOG_FRAMES * sizeof(canbus_frame));
+  }
+  if(batch->buf == NULL || (batch->format == CANBUS_LOG_FORMAT_COMPRESSED && batch->held == NULL)) {
+    syslog(LOG_ERR, "canbus_awsiotlogger_batch_init: unable to allocate %zu byte batch for %s", batch->max, topic);
+    canbus_awsiotlogger_batch_free(batch);
+    return ENOMEM;
+  }
+  return 0;
+}
+
+static long canbus_awsiotlogger_ms(const struct timespec *from, const struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1000 + (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/**
+ * Takes publish_lock for a live publish. With a spool to fall back on the
+ * reactor never waits for it; without one only the drain thread's keepalive
+ * takes it, for CANBUS_AWSIOTLOGGER_YIELD_MS at a time, and the wait is
+ * capped at CANBUS_AWSIOTLOGGER_LOCK_MS.
+ */
+static int canbus_awsiotlogger_lock(canbus_awsiotlogger_batch *batch) {
+  struct timespec deadline;
+  if(batch->spool != NULL) {
+    return pthread_mutex_trylock(&iotlogger->publish_lock);
+  }
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += CANBUS_AWSIOTLOGGER_LOCK_MS * 1000000L;
+  if(deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  return pthread_mutex_timedlock(&iotlogger->publish_lock, &deadline);
+}
+
+/**
+ * Publishes what is in buf, or spools it: always in write-ahead mode, and
+ * otherwise when the connection is down, the drain thread is using it, the
+ * publish fails or the spool still holds older batches. Live batches queue
+ * behind a backlog rather than overtake it, so the broker sees every
+ * interface's frames in order, at the drain rate until the spool is empty
+ * again. Returns the number of frames lost.
+ */
+static unsigned int canbus_awsiotlogger_publish(canbus_awsiotlogger_batch *batch) {
+  unsigned int rc = 1, failed = 0;
+  if(batch->nframes == 0) return 0;
+
+  if(batch->spool_mode != CANBUS_AWSIOTLOGGER_SPOOL_ALWAYS && __atomic_load_n(&iotlogger_connected, __ATOMIC_ACQUIRE) &&
+     (batch->spool == NULL || canbus_spool_frames(batch->spool) == 0) && canbus_awsiotlogger_lock(batch) == 0) {
+    rc = awsiot_client_publish_data(iotlogger, batch->topic, batch->buf, batch->len);
+    pthread_mutex_unlock(&iotlogger->publish_lock);
+  }
+  if(rc != 0 && (batch->spool == NULL ||
+     canbus_spool_append(batch->spool, batch->topic, batch->buf, batch->len, batch->nframes, batch->tag) != 0)) {
+    failed = batch->nframes;
+  }
+  batch->len = 0;
+  batch->nframes = 0;
+  return failed;
+}
+
+/**
+ * Compresses the frames held back into a block at the end of buf, behind
+ * the log header when buf is empty. What is in buf is published first when
+ * a block might not fit after it.
+ */
+static unsigned int canbus_awsiotlogger_encode_block(canbus_awsiotlogger_batch *batch) {
+  unsigned int failed = 0;
+  if(batch->nheld == 0) return 0;
+  if(batch->max - batch->len < CANBUS_BLOCKLOG_BLOCK_MAX) {
+    failed = canbus_awsiotlogger_publish(batch);
+  }
+  if(batch->len == 0) {
+    batch->len = canbus_blocklog_header((uint8_t *)batch->buf, batch->canbus != NULL ? batch->canbus->iface : NULL,
+      batch->canbus != NULL && canbus_isfd(batch->canbus));
+  }
+  batch->len += canbus_blocklog_encode(batch->held, batch->nheld, (uint8_t *)batch->buf + batch->len);
+  batch->nframes += batch->nheld;
+  batch->nheld = 0;
+  batch->held_raw_len = 0;
+  return failed;
+}
+
+/**
+ * Publishes everything the batch holds. Returns the number of frames lost.
+ */
+static unsigned int canbus_awsiotlogger_flush(canbus_awsiotlogger_batch *batch) {
+  unsigned int failed = canbus_awsiotlogger_encode_block(batch);
+  return failed + canbus_awsiotlogger_publish(batch);
+}
+
+/**
+ * Appends one frame as a line, publishing first when it would not fit.
+ */
+static unsigned int canbus_awsiotlogger_add_line(canbus_awsiotlogger_batch *batch, canbus_frame *frame) {
+  char line[CANBUS_FRAME_TEXT_LEN];
+  unsigned int failed = 0;
+  size_t len;
+
+  // in place while any line fits, the last few through line
+  if(batch->max - batch->len > CANBUS_FRAME_TEXT_LEN) {
+    len = canbus_format_frame(frame, batch->buf + batch->len);
+  }
+  else {
+    len = canbus_format_frame(frame, line);
+    if(batch->max - batch->len < len + 1) {
+      failed = canbus_awsiotlogger_publish(batch);
+      if(batch->max < len + 1) {
+        return failed + 1;   // longer than AWS_IOT_MQTT_TX_BUF_LEN allows
+      }
+    }
+    memcpy(batch->buf + batch->len, line, len);
+  }
+  batch->buf[batch->len + len] = '\n';
+  batch->len += len + 1;
+  batch->nframes++;
+  return failed;
+}
+
+/**
+ * Holds one frame back for the next compressed block, compressing the block
+ * when it is full the way the compressed file log does.
+ */
+static unsigned int canbus_awsiotlogger_add_block(canbus_awsiotlogger_batch *batch, canbus_frame *frame) {
+  unsigned int failed = 0;
+  size_t raw_len = canbus_blocklog_raw_len(frame, batch->nheld > 0 ? &batch->held[batch->nheld - 1] : NULL);
+
+  if(batch->nheld == CANBUS_BLOCKLOG_FRAMES || batch->held_raw_len + raw_len > CANBUS_BLOCKLOG_RAW_LEN) {
+    failed = canbus_awsiotlogger_encode_block(batch);
+    raw_len = canbus_blocklog_raw_len(frame, NULL);
+  }
+  batch->held[batch->nheld++] = *frame;
+  batch->held_raw_len += raw_len;
+  return failed;
+}
+
+/**
+ * Packs frames into the batch, publishing whenever it reaches max_frames or
+ * runs out of room. Returns the number of frames lost.
+ */
+static unsigned int canbus_awsiotlogger_batch_add(canbus_awsiotlogger_batch *batch, canbus_frame *frames, unsigned int nframes) {
+  unsigned int i, failed = 0;
+  for(i=0; i<nframes; i++) {
+
+    // error frames are decoded into canbus->stats by the reactor
+    if(frames[i].frame.can_id & CAN_ERR_FLAG) {
+      continue;
+    }
+
+    if(batch->nframes + batch->nheld == 0) {
+      clock_gettime(CLOCK_MONOTONIC, &batch->first);
+    }
+    if(batch->format == CANBUS_LOG_FORMAT_COMPRESSED) {
+      failed += canbus_awsiotlogger_add_block(batch, &frames[i]);
+    }
+    else {
+      failed += canbus_awsiotlogger_add_line(batch, &frames[i]);
+    }
+    if(batch->nframes + batch->nheld >= batch->max_frames) {
+      failed += canbus_awsiotlogger_flush(batch);
+    }
+  }
+  return failed;
+}
+
+void canbus_awsiotlogger_onread(canbus_client *canbus, canbus_frame *frames, unsigned int nframes, void *arg) {
+  canbus_drop(canbus, CANBUS_DROP_PUBLISH, canbus_awsiotlogger_batch_add((canbus_awsiotlogger_batch *)arg, frames, nframes));
+}
+
+/**
+ * Reactor tick: publishes batches that have waited max_ms and has the reactor
+ * wake up again when the oldest remaining one is due.
+ */
+static void canbus_awsiotlogger_tick(void *arg) {
+
+  canbus_awsiotlogger_session *session = (canbus_awsiotlogger_session *)arg;
+  canbus_logger *logger = session->logger;
+  int i, timeout_ms = CANBUS_REACTOR_TIMEOUT_MS;
+  struct timespec now;
+
+  canbus_logger_tick(logger);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for(i=0; i<logger->canbus_count; i++) {
+    canbus_awsiotlogger_batch *batch = &session->batches[i];
+    if(batch->buf == NULL || batch->nframes + batch->nheld == 0) continue;
+    long waited_ms = canbus_awsiotlogger_ms(&batch->first, &now);
+    if(waited_ms >= (long)batch->max_ms) {
+      canbus_drop(batch->canbus, CANBUS_DROP_PUBLISH, canbus_awsiotlogger_flush(batch));
+      continue;
+    }
+    if(batch->max_ms - waited_ms < timeout_ms) {
+      timeout_ms = batch->max_ms - waited_ms;
+    }
+  }
+  logger->reactor.timeout_ms = timeout_ms;
+}
+
+static void canbus_awsiotlogger_ondrop(void *arg, uint8_t tag, unsigned int frames) {
+  canbus_awsiotlogger_session *session = (canbus_awsiotlogger_session *)arg;
+  if(tag == CANBUS_AWSIOTLOGGER_TAG_REPLAY) {
+    session->replay_lost += frames;
+  }
+  else if(tag < session->logger->canbus_count) {
+    canbus_drop(session->logger->canbus[tag], CANBUS_DROP_PUBLISH, frames);
+  }
+}
+
+/**
+ * Lets the SDK read from the connection and send its keepalive, or, with the
+ * connection gone, tries to reconnect once *retry has passed, backing off up
+ * to CANBUS_AWSIOTLOGGER_RECONNECT_MAX_MS. The SDK's own reconnects give up
+ * after AWS_IOT_MQTT_MAX_RECONNECT_WAIT_INTERVAL, far sooner than a drive
+ * through a dead zone ends, so they are turned off. Returns whether the
+ * connection is up.
+ */
+static bool canbus_awsiotlogger_keepalive(struct timespec *retry, unsigned int *retry_ms) {
+  struct timespec now;
+  bool connected;
+
+  pthread_mutex_lock(&iotlogger->publish_lock);
+  if(aws_iot_mqtt_is_client_connected(iotlogger->client)) {
+    aws_iot_mqtt_yield(iotlogger->client, CANBUS_AWSIOTLOGGER_YIELD_MS);
+  }
+  connected = aws_iot_mqtt_is_client_connected(iotlogger->client);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if(!connected && canbus_awsiotlogger_ms(retry, &now) >= 0) {
+    __atomic_store_n(&iotlogger_connected, false, __ATOMIC_RELEASE);
+    aws_iot_mqtt_attempt_reconnect(iotlogger->client);
+    connected = aws_iot_mqtt_is_client_connected(iotlogger->client);
+    if(!connected) {
+      *retry = now;
+      retry->tv_sec += *retry_ms / 1000;
+      retry->tv_nsec += (*retry_ms % 1000) * 1000000;
+      if(retry->tv_nsec >= 1000000000) {
+        retry->tv_sec++;
+        retry->tv_nsec -= 1000000000;
+      }
+      *retry_ms = *retry_ms * 2 < CANBUS_AWSIOTLOGGER_RECONNECT_MAX_MS ? *retry_ms * 2 : CANBUS_AWSIOTLOGGER_RECONNECT_MAX_MS;
+    }
+  }
+  if(connected) {
+    *retry = now;
+    *retry_ms = CANBUS_AWSIOTLOGGER_RECONNECT_MS;
+  }
+  pthread_mutex_unlock(&iotlogger->publish_lock);
+  return connected;
+}
+
+/**
+ * Keeps the connection up and sends what the spool holds. The SDK is not
+ * built thread safe, so every call into it is made under publish_lock.
+ * Spooled messages go out at QoS 1 and only leave the spool once the broker
+ * has acknowledged them; a crash or a connection lost in between sends one
+ * again rather than losing it. The drain is held to spool_rate bytes per
+ * second so a long backlog does not saturate the uplink; live batches queue
+ * behind it meanwhile, so spool_rate has to stay above the live data rate for
+ * the spool to empty.
+ */
+static void *canbus_awsiotlogger_drain_thread(void *ptr) {
+
+  canbus_awsiotlogger_session *session = (canbus_awsiotlogger_session *)ptr;
+  canbus_logger *logger = session->logger;
+  double rate = logger->spool_rate > 0 ? logger->spool_rate : CANBUS_AWSIOTLOGGER_DRAIN_RATE;
+  double burst = rate > CANBUS_AWSIOTLOGGER_PAYLOAD_MAX ? rate : CANBUS_AWSIOTLOGGER_PAYLOAD_MAX;
+  double tokens = rate;     // bytes the rate allows right now
+  unsigned int retry_ms = CANBUS_AWSIOTLOGGER_RECONNECT_MS;
+  struct timespec now, polled, synced, refilled, retry;
+  char topic[CANBUS_SPOOL_TOPIC_LEN];
+  uint8_t *payload = NULL;
+  bool connected = false;
+  uint64_t sent = 0;
+  ssize_t len;
+
+  syslog(LOG_DEBUG, "canbus_awsiotlogger_drain_thread: running");
+
+  if(session->spooling && (payload = malloc(CANBUS_AWSIOTLOGGER_PAYLOAD_MAX)) == NULL) {
+    syslog(LOG_ERR, "canbus_awsiotlogger_drain_thread: unable to allocate drain buffer, the spool will only fill");
+  }
+  pthread_mutex_lock(&iotlogger->publish_lock);
+  aws_iot_mqtt_autoreconnect_set_status(iotlogger->client, false);
+  pthread_mutex_unlock(&iotlogger->publish_lock);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  polled = synced = refilled = retry = now;
+  polled.tv_sec--;
+
+  while(logger->isrunning && !__atomic_load_n(&session->stopping, __ATOMIC_ACQUIRE)) {
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(canbus_awsiotlogger_ms(&polled, &now) >= CANBUS_AWSIOTLOGGER_POLL_MS) {
+      polled = now;
+      connected = canbus_awsiotlogger_keepalive(&retry, &retry_ms);
+      if(connected != __atomic_load_n(&iotlogger_connected, __ATOMIC_ACQUIRE)) {
+        syslog(LOG_INFO, "canbus_awsiotlogger_drain_thread: %s, %llu frames spooled", connected ? "connected" : "disconnected",
+          (unsigned long long)(session->spooling ? canbus_spool_frames(&session->spool) : 0));
+        __atomic_store_n(&iotlogger_connected, connected, __ATOMIC_RELEASE);
+      }
+    }
+    if(session->spooling && canbus_awsiotlogger_ms(&synced, &now) >= CANBUS_AWSIOTLOGGER_SYNC_MS) {
+      synced = now;
+      canbus_spool_sync(&session->spool);
+    }
+
+    tokens += rate * canbus_awsiotlogger_ms(&refilled, &now) / 1000;
+    if(tokens > burst) tokens = burst;
+    refilled = now;
+
+    if(payload == NULL || !connected) {
+      usleep(CANBUS_AWSIOTLOGGER_POLL_MS * 1000);
+      continue;
+    }
+    if(tokens < 0) {
+      long wait_ms = -tokens * 1000 / rate + 1;
+      usleep((wait_ms < CANBUS_AWSIOTLOGGER_POLL_MS ? wait_ms : CANBUS_AWSIOTLOGGER_POLL_MS) * 1000);
+      continue;
+    }
+    if(!canbus_spool_wait(&session->spool, CANBUS_AWSIOTLOGGER_POLL_MS) ||
+       (len = canbus_spool_peek(&session->spool, topic, payload, CANBUS_AWSIOTLOGGER_PAYLOAD_MAX)) <= 0) {
+      continue;
+    }
+
+    pthread_mutex_lock(&iotlogger->publish_lock);
+    unsigned int rc = awsiot_client_publish_qos(iotlogger, topic, payload, len, QOS1);
+    IoT_Error_t error = iotlogger->rc;
+    pthread_mutex_unlock(&iotlogger->publish_lock);
+
+    if(rc == 0) {
+      canbus_spool_consume(&session->spool);
+      tokens -= len;
+      sent++;
+    }
+    else if(error == MQTT_TX_BUFFER_TOO_SHORT_ERROR) {
+      // will never fit this build's AWS_IOT_MQTT_TX_BUF_LEN
+      syslog(LOG_ERR, "canbus_awsiotlogger_drain_thread: dropping %zd byte message for %s, too long to publish", len, topic);
+      canbus_spool_consume(&session->spool);
+    }
+    else {
+      // have the connection checked before trying again
+      polled.tv_sec--;
+      usleep(CANBUS_AWSIOTLOGGER_POLL_MS * 1000);
+    }
+  }
+
+  free(payload);
+  syslog(LOG_DEBUG, "canbus_awsiotlogger_drain_thread: stopping, sent %llu spooled messages", (unsigned long long)sent);
+  return NULL;
+}
+
+/**
+ * Opens the spool, when the logger has one, and starts the drain thread that
+ * keeps the connection up for the live and the replay thread alike.
+ */
+static void canbus_awsiotlogger_session_open(canbus_awsiotlogger_session *session, canbus_logger *logger) {
+  session->logger = logger;
+  session->spooling = false;
+  session->draining = false;
+  session->stopping = false;
+  session->replay_lost = 0;
+
+  if(logger->spool_mode != CANBUS_AWSIOTLOGGER_SPOOL_OFF) {
+    char dir[CANBUS_SPOOL_FILENAME_LEN];
+    snprintf(dir, sizeof(dir), "%s/%s", logger->cacheDir != NULL ? logger->cacheDir : logger->logdir, CANBUS_AWSIOTLOGGER_SPOOL_DIR);
+    if(canbus_spool_open(&session->spool, dir,
+         logger->spool_bytes > 0 ? logger->spool_bytes : (uint64_t)CANBUS_AWSIOTLOGGER_SPOOL_MB * 1024 * 1024) == 0) {
+      session->spool.ondrop = canbus_awsiotlogger_ondrop;
+      session->spool.ondrop_arg = session;
+      session->spooling = true;
+    }
+    else {
+      syslog(LOG_ERR, "canbus_awsiotlogger_session_open: unable to open spool in %s, publishing without one", dir);
+    }
+  }
+
+  if(pthread_create(&session->drain_thread, NULL, canbus_awsiotlogger_drain_thread, session) == 0) {
+    session->draining = true;
+  }
+  else {
+    syslog(LOG_ERR, "canbus_awsiotlogger_session_open: unable to start drain thread. error=%s", strerror(errno));
+  }
+}
+
+/**
+ * Has the batch fall back on the session's spool, if it has one.
+ */
+static void canbus_awsiotlogger_session_attach(canbus_awsiotlogger_session *session, canbus_awsiotlogger_batch *batch, uint8_t tag) {
+  if(session->spooling) {
+    batch->spool = &session->spool;
+    batch->spool_mode = session->logger->spool_mode;
+  }
+  batch->tag = tag;
+}
+
+static void canbus_awsiotlogger_session_close(canbus_awsiotlogger_session *session) {
+  if(session->draining) {
+    __atomic_store_n(&session->stopping, true, __ATOMIC_RELEASE);
+    pthread_join(session->drain_thread, NULL);
+  }
+  if(session->spooling) {
+    syslog(LOG_INFO, "canbus_awsiotlogger_session_close: %llu frames left in the spool", (unsigned long long)canbus_spool_frames(&session->spool));
+    canbus_spool_close(&session->spool);
+  }
+}
+
+/**
+ * A single interface publishes to awsiotlogger_topic as before; with several
+ * interfaces each one gets its own awsiotlogger_topic/<iface> subtopic.
+ */
 void *canbus_awsiotlogger_thread(void *ptr) {
 
   syslog(LOG_DEBUG, "canbus_awsiotlogger_thread: running");
 
   canbus_logger *pLogger = (canbus_logger *)ptr;
+  canbus_awsiotlogger_session session;
 
-  int can_frame_len = sizeof(struct can_frame);
-  struct can_frame frame;
-  memset(&frame, 0, can_frame_len);
+  int i;
+  char *topics[CANBUS_LOGGER_MAX_IFACES];
+  void *args[CANBUS_LOGGER_MAX_IFACES];
 
-  int data_len = can_frame_len + 25;
-  char data[data_len];
-  memset(data, 0, data_len);
+  canbus_awsiotlogger_session_open(&session, pLogger);
 
-  while(canbus_isconnected(pLogger->canbus) && canbus_read(pLogger->canbus, &frame) > 0 && pLogger->isrunning) {
+  for(i=0; i<pLogger->canbus_count; i++) {
+    session.batches[i].buf = NULL;
+    args[i] = NULL;
+    if(pLogger->canbus_count == 1) {
+      topics[i] = strdup(awsiotlogger_topic);
+    }
+    else {
+      size_t topic_len = strlen(awsiotlogger_topic) + strlen(pLogger->canbus[i]->iface) + 2;
+      topics[i] = malloc(topic_len);
+      snprintf(topics[i], topic_len, "%s/%s", awsiotlogger_topic, pLogger->canbus[i]->iface);
+    }
+    if(canbus_awsiotlogger_batch_init(&session.batches[i], topics[i], pLogger->canbus[i], pLogger) == 0) {
+      canbus_awsiotlogger_session_attach(&session, &session.batches[i], i);
+      args[i] = &session.batches[i];
+    }
+  }
 
-    memset(data, 0, data_len);
-    canbus_framecpy(&frame, data);
+  if(canbus_logger_add_handlers(pLogger, canbus_awsiotlogger_onread, args) > 0) {
+    pLogger->reactor.ontick = canbus_awsiotlogger_tick;
+    pLogger->reactor.tick_arg = &session;
+    canbus_reactor_run(&pLogger->reactor);
+  }
 
-    if(frame.can_id & CAN_ERR_FLAG) {
-      syslog(LOG_ERR, "canbus_awsiotlogger_thread: CAN ERROR: %s", data);
-      continue;
+  // what is left goes out now or waits in the spool for the next session
+  for(i=0; i<pLogger->canbus_count; i++) {
+    if(session.batches[i].buf != NULL) {
+      canbus_drop(pLogger->canbus[i], CANBUS_DROP_PUBLISH, canbus_awsiotlogger_flush(&session.batches[i]));
+      canbus_awsiotlogger_batch_free(&session.batches[i]);
     }
-
-    awsiot_client_publish(iotlogger, awsiotlogger_topic, data);
+    free(topics[i]);
   }
+  canbus_awsiotlogger_session_close(&session);
 
   syslog(LOG_DEBUG, "canbus_awsiotlogger_thread: stopping");
   pLogger->canbus_thread_state = CANBUS_LOGTHREAD_STOPPED;
@@ -74,22 +563,47 @@ void *canbus_awsiotlogger_thread(void *ptr) {
   return NULL;
 }
 
+/**
+ * Publishes a log file. The drain thread keeps the connection up meanwhile
+ * and a replay waits out a disconnect rather than lose the rest of the file;
+ * publishes that still fail go to the spool, or are counted and reported
+ * when there is none.
+ */
 void *canbus_awsiotlogger_replay_thread(void *ptr) {
 
   syslog(LOG_DEBUG, "canbus_awsiotlogger_replay_thread: running");
 
   canbus_logger *pLogger = (canbus_logger *)ptr;
+  canbus_awsiotlogger_session session;
+  canbus_awsiotlogger_batch *batch = &session.batches[0];
+
+  canbus_awsiotlogger_session_open(&session, pLogger);
+
+  // a replay is not waiting on the bus, so batches only go out full
+  canbus_log log;
+  if(canbus_awsiotlogger_batch_init(batch, (char *)awsiotlogger_topic, NULL, pLogger) == 0) {
+    batch->max_frames = UINT_MAX;
+    canbus_awsiotlogger_session_attach(&session, batch, CANBUS_AWSIOTLOGGER_TAG_REPLAY);
+    replay_session = &session;
+    if(canbus_log_open(&log, pLogger, NULL, "r") == 0) {
+      canbus_log_read(&log, pLogger);
+      canbus_log_close(&log);
+    }
+    session.replay_lost += canbus_awsiotlogger_flush(batch);
+    canbus_awsiotlogger_batch_free(batch);
+    replay_session = NULL;
+  }
 
-  canbus_log_open(pLogger, "r");
-  unsigned int rc;
-  do {
-    rc = canbus_log_read(pLogger);
-  } while(rc != 0 && pLogger->isrunning);
-  canbus_log_close();
+  canbus_awsiotlogger_session_close(&session);
+  if(session.replay_lost > 0) {
+    syslog(LOG_WARNING, "canbus_awsiotlogger_replay_thread: %llu frames could not be published", (unsigned long long)session.replay_lost);
+  }
 
   syslog(LOG_DEBUG, "canbus_awsiotlogger_replay_thread: stopping");
   pLogger->canbus_thread_state = CANBUS_LOGTHREAD_STOPPED;
   canbus_iotlogger_close();
+
+  return NULL;
 }
 
 unsigned int canbus_awsiotlogger_init(canbus_logger *logger) {
@@ -102,7 +616,8 @@ unsigned int canbus_awsiotlogger_init(canbus_logger *logger) {
   iotlogger->onerror = &canbus_awsiotlogger_onerror;
   iotlogger->ondisconnect = NULL;
   iotlogger->certDir = logger->certDir;
-  awsiot_client_connect(iotlogger);
+  pthread_mutex_init(&iotlogger->publish_lock, NULL);
+  iotlogger_connected = awsiot_client_connect(iotlogger) == 0;
   logger->isrunning = true;
 }
 
@@ -112,19 +627,25 @@ unsigned int canbus_awsiotlogger_run(canbus_logger *logger) {
   return 0;
 }
 
-void canbus_awsiotlogger_onread(const char *line) {
-  awsiot_client_publish(iotlogger, awsiotlogger_topic, line);
+void canbus_awsiotlogger_replay_onframes(canbus_frame *frames, unsigned int nframes) {
+  canbus_awsiotlogger_session *session = replay_session;
+  // the file will still be there; wait for the drain thread to reconnect
+  while(!__atomic_load_n(&iotlogger_connected, __ATOMIC_ACQUIRE) && session->logger->isrunning && session->draining) {
+    usleep(CANBUS_AWSIOTLOGGER_POLL_MS * 1000);
+  }
+  session->replay_lost += canbus_awsiotlogger_batch_add(&session->batches[0], frames, nframes);
 }
 
 unsigned int canbus_awsiotlogger_replay(canbus_logger *logger) {
   canbus_awsiotlogger_init(logger);
-  logger->onread = &canbus_awsiotlogger_onread;
-  pthread_create(&replay_thread, NULL, canbus_awsiotlogger_replay_thread, (void *)logger);
+  logger->onreplay = &canbus_awsiotlogger_replay_onframes;
+  pthread_create(&logger->canbus_thread, NULL, canbus_awsiotlogger_replay_thread, (void *)logger);
   return 0;
 }
 
 void canbus_iotlogger_close() {
   awsiot_client_close(iotlogger);
+  pthread_mutex_destroy(&iotlogger->publish_lock);
   free(iotlogger->client);
   free(iotlogger);
   iotlogger = NULL;
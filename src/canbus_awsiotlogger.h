@@ -19,8 +19,56 @@
 #ifndef CANBUSawsiotlogger_H
 #define CANBUSawsiotlogger_H
 
+#include "canbus.h"
 #include "canbus_logger.h"
 #include "awsiot_client.h"
+#include "canbus_spool.h"
+
+#define CANBUS_AWSIOTLOGGER_BATCH_FRAMES  1000     // frames per publish unless canbus_logger.publish_frames says otherwise
+#define CANBUS_AWSIOTLOGGER_BATCH_MS      1000     // longest a batch waits unless canbus_logger.publish_ms says otherwise
+#define CANBUS_AWSIOTLOGGER_PAYLOAD_MAX   131072   // largest message AWS IoT accepts
+#define CANBUS_AWSIOTLOGGER_MQTT_OVERHEAD 9        // PUBLISH fixed header, remaining length, topic length and QoS 1 packet id
+
+#define CANBUS_AWSIOTLOGGER_SPOOL_OFF     0        // a failed publish loses its frames
+#define CANBUS_AWSIOTLOGGER_SPOOL_OUTAGE  1        // batches that cannot be published now, or would overtake spooled ones, go to the spool
+#define CANBUS_AWSIOTLOGGER_SPOOL_ALWAYS  2        // every batch goes through the spool, a write-ahead log
+#define CANBUS_AWSIOTLOGGER_SPOOL_DIR     "spool"  // under canbus_logger.cacheDir
+#define CANBUS_AWSIOTLOGGER_TAG_REPLAY    0xff     // spool tag of replayed batches, which have no interface to count drops against
+#define CANBUS_AWSIOTLOGGER_SPOOL_MB      64       // spool size unless canbus_logger.spool_bytes says otherwise
+#define CANBUS_AWSIOTLOGGER_DRAIN_RATE    262144   // bytes per second the spool drains at unless canbus_logger.spool_rate says otherwise
+#define CANBUS_AWSIOTLOGGER_POLL_MS       100      // drain thread wakeups for keepalive, reconnects and stopping
+#define CANBUS_AWSIOTLOGGER_YIELD_MS      10       // longest the drain thread holds the connection to read from it
+#define CANBUS_AWSIOTLOGGER_LOCK_MS       50       // longest a live publish without a spool waits for the connection
+#define CANBUS_AWSIOTLOGGER_SYNC_MS       1000     // spool fdatasync interval
+#define CANBUS_AWSIOTLOGGER_RECONNECT_MS  1000     // first reconnect attempt, doubling from there
+#define CANBUS_AWSIOTLOGGER_RECONNECT_MAX_MS 30000
+
+/**
+ * Frames waiting to go out in one publish, one batch per topic. The payload
+ * is either newline terminated canbus_framecpy lines (CANBUS_LOG_FORMAT_TEXT)
+ * or a complete compressed log (CANBUS_LOG_FORMAT_COMPRESSED): a versioned
+ * canbus_binlog_header followed by committed canbus_blocklog blocks, which
+ * ecutools-logconv reads as is. lambda/DataloggerDecode has a decoder for
+ * the cloud side.
+ */
+typedef struct {
+  char *topic;
+  canbus_client *canbus;    // drops are counted against it, NULL when replaying
+  uint8_t format;           // CANBUS_LOG_FORMAT_TEXT or CANBUS_LOG_FORMAT_COMPRESSED
+  canbus_spool *spool;      // NULL unless the logger spools
+  uint8_t spool_mode;       // CANBUS_AWSIOTLOGGER_SPOOL_*
+  uint8_t tag;              // index of the interface, recorded with spooled batches
+  char *buf;
+  size_t len;
+  size_t max;               // payload that fits AWS_IOT_MQTT_TX_BUF_LEN next to the topic
+  unsigned int nframes;     // in buf
+  unsigned int max_frames;
+  unsigned int max_ms;
+  struct timespec first;    // CLOCK_MONOTONIC when the first frame was packed
+  canbus_frame *held;       // frames held back for the next compressed block
+  unsigned int nheld;
+  size_t held_raw_len;      // their delta encoded size
+} canbus_awsiotlogger_batch;
 
 unsigned int canbus_awsiotlogger_run(canbus_logger *logger);
 unsigned int canbus_awsiotlogger_stop(canbus_logger *logger);
@@ -0,0 +1,286 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "canbus_bcm.h"
+#include "canbus_filter.h"
+
+static void canbus_bcm_head(canbus_bcm_msg *msg, uint32_t opcode, uint32_t flags, canbus_frame *frame) {
+  memset(msg, 0, sizeof(canbus_bcm_msg));
+  msg->head.opcode = opcode;
+  msg->head.flags = flags;
+  msg->head.can_id = frame->frame.can_id;
+  if(frame->flags & CANBUS_FRAME_FD) {
+    msg->head.flags |= CAN_FD_FRAME;
+  }
+}
+
+static unsigned int canbus_bcm_send(canbus_client *canbus, canbus_bcm_msg *msg, const char *op) {
+  size_t len = sizeof(struct bcm_msg_head);
+  if(msg->head.nframes) {
+    len += (msg->head.flags & CAN_FD_FRAME) ? CANFD_MTU : CAN_MTU;
+  }
+  pthread_mutex_lock(&canbus->wlock);
+  ssize_t nbytes = write(canbus->socket, msg, len);
+  pthread_mutex_unlock(&canbus->wlock);
+  if(nbytes != len) {
+    syslog(LOG_ERR, "canbus_bcm_send: %s failed. can_id=%x, error=%s", op, msg->head.can_id, strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Opens a CAN_BCM socket on canbus->iface. Called by canbus_connect when
+ * canbus->capture is CANBUS_CAPTURE_BCM.
+ */
+unsigned int canbus_bcm_connect(canbus_client *canbus) {
+
+  struct sockaddr_can addr;
+  struct ifreq ifr;
+  int tstampns = 1;
+
+  if((canbus->socket = socket(PF_CAN, SOCK_DGRAM, CAN_BCM)) == -1) {
+    syslog(LOG_ERR, "canbus_bcm_connect: error opening socket: %s", strerror(errno));
+    canbus->socket = 0;
+    return 1;
+  }
+
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, canbus->iface, IFNAMSIZ - 1);
+  if(ioctl(canbus->socket, SIOCGIFINDEX, &ifr) < 0) {
+    syslog(LOG_ERR, "canbus_bcm_connect: unable to find CAN interface %s", canbus->iface);
+    close(canbus->socket);
+    canbus->socket = 0;
+    return 2;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = ifr.ifr_ifindex;
+  if(connect(canbus->socket, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    syslog(LOG_ERR, "canbus_bcm_connect: error in socket connect: %s", strerror(errno));
+    close(canbus->socket);
+    canbus->socket = 0;
+    return 3;
+  }
+
+  canbus->mtu = CAN_MTU;
+  if(ioctl(canbus->socket, SIOCGIFMTU, &ifr) == 0 && ifr.ifr_mtu == CANFD_MTU) {
+    canbus->mtu = CANFD_MTU;
+  }
+
+  if(setsockopt(canbus->socket, SOL_SOCKET, SO_TIMESTAMPNS, &tstampns, sizeof(tstampns)) == 0) {
+    canbus->tstamp = CANBUS_TSTAMP_TIMESTAMPNS;
+  }
+
+  int rxq_ovfl = 1;
+  setsockopt(canbus->socket, SOL_SOCKET, SO_RXQ_OVFL, &rxq_ovfl, sizeof(rxq_ovfl));
+
+  if(canbus->rcvbuf > 0) {
+    canbus_set_rcvbuf(canbus, canbus->rcvbuf);
+  }
+
+  syslog(LOG_DEBUG, "canbus_bcm_connect: %s socket=%i, mtu=%d", canbus->iface, canbus->socket, canbus->mtu);
+  return 0;
+}
+
+/**
+ * Starts (or replaces) cyclic transmission of frame every interval_ms. The
+ * first copy goes out immediately; the kernel owns the timer after that.
+ */
+unsigned int canbus_bcm_tx_setup(canbus_client *canbus, canbus_frame *frame, unsigned int interval_ms) {
+
+  if(interval_ms < CANBUS_BCM_MIN_INTERVAL_MS || interval_ms > CANBUS_BCM_MAX_INTERVAL_MS) {
+    syslog(LOG_ERR, "canbus_bcm_tx_setup: interval out of range. interval_ms=%u", interval_ms);
+    return 1;
+  }
+
+  if((frame->flags & CANBUS_FRAME_FD) && !canbus_isfd(canbus)) {
+    syslog(LOG_ERR, "canbus_bcm_tx_setup: CAN FD frame on a classic CAN interface");
+    return 2;
+  }
+
+  canbus_bcm_msg msg;
+  canbus_bcm_head(&msg, TX_SETUP, SETTIMER | STARTTIMER | TX_ANNOUNCE, frame);
+  msg.head.count = 0;
+  msg.head.ival2.tv_sec = interval_ms / 1000;
+  msg.head.ival2.tv_usec = (interval_ms % 1000) * 1000;
+  msg.head.nframes = 1;
+  memcpy(&msg.frame, &frame->frame, (frame->flags & CANBUS_FRAME_FD) ? CANFD_MTU : CAN_MTU);
+
+  return canbus_bcm_send(canbus, &msg, "TX_SETUP") ? 3 : 0;
+}
+
+unsigned int canbus_bcm_tx_delete(canbus_client *canbus, canbus_frame *frame) {
+  canbus_bcm_msg msg;
+  canbus_bcm_head(&msg, TX_DELETE, 0, frame);
+  return canbus_bcm_send(canbus, &msg, "TX_DELETE");
+}
+
+/**
+ * Subscribes to can_id with a full payload mask so the kernel only passes the
+ * frame up (as RX_CHANGED) when its data or length differs from the last one.
+ */
+unsigned int canbus_bcm_rx_changed(canbus_client *canbus, canid_t can_id, bool fd) {
+  canbus_bcm_msg msg;
+  memset(&msg, 0, sizeof(canbus_bcm_msg));
+  msg.head.opcode = RX_SETUP;
+  msg.head.flags = RX_CHECK_DLC | (fd ? CAN_FD_FRAME : 0);
+  msg.head.can_id = can_id;
+  msg.head.nframes = 1;
+  msg.frame.len = fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN;
+  memset(msg.frame.data, 0xff, msg.frame.len);
+  return canbus_bcm_send(canbus, &msg, "RX_SETUP");
+}
+
+static bool canbus_bcm_rule_match(struct canbus_filter *rule, canid_t can_id) {
+  return (can_id & rule->can_mask) == (rule->can_id & rule->can_mask);
+}
+
+static bool canbus_bcm_rule_eff(struct canbus_filter *rule) {
+  return rule->type == CANBUS_FILTER_PASS && canbus_bcm_rule_match(rule, rule->can_id | CAN_EFF_FLAG);
+}
+
+static bool canbus_bcm_blocked(struct canbus_filter *rules, unsigned int count, canid_t can_id) {
+  unsigned int i;
+  for(i=0; i<count; i++) {
+    if(rules[i].type == CANBUS_FILTER_BLOCK && rules[i].data_len == 0 && canbus_bcm_rule_match(&rules[i], can_id)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static unsigned int canbus_bcm_rx_changed_id(canbus_client *canbus, struct canbus_filter *rules, unsigned int count, canid_t can_id) {
+  if(canbus_bcm_blocked(rules, count, can_id)) return 0;
+  if(canbus_bcm_rx_changed(canbus, can_id, false) != 0) return 1;
+  if(canbus_isfd(canbus) && canbus_bcm_rx_changed(canbus, can_id, true) != 0) return 1;
+  return 0;
+}
+
+/**
+ * Registers change detection for every identifier a pass rule matches, 11 and
+ * 29 bit alike. Without pass rules only the 11 bit space is registered (29 bit
+ * frames are then not captured). A 29 bit rule must leave at most
+ * CANBUS_BCM_RX_MAX_FREE_BITS identifier bits unmasked, since each matching ID
+ * costs a kernel RX_SETUP; wider rules are rejected. Payload matches
+ * (data_len) don't apply here, BCM compares the whole payload.
+ */
+unsigned int canbus_bcm_rx_changed_filters(canbus_client *canbus, struct canbus_filter *rules, unsigned int count) {
+
+  unsigned int i, npass = 0;
+  canid_t can_id;
+
+  for(i=0; i<count; i++) {
+    if(rules[i].type != CANBUS_FILTER_PASS) continue;
+    if(canbus_bcm_rule_eff(&rules[i]) && __builtin_popcount(~rules[i].can_mask & CAN_EFF_MASK) > CANBUS_BCM_RX_MAX_FREE_BITS) {
+      syslog(LOG_ERR, "canbus_bcm_rx_changed_filters: rule matches too many 29 bit identifiers (add CAN_EFF_FLAG to can_mask for 11 bit only). can_id=%x, can_mask=%x",
+        rules[i].can_id, rules[i].can_mask);
+      return 1;
+    }
+    npass++;
+  }
+
+  if(npass == 0) {
+    syslog(LOG_WARNING, "canbus_bcm_rx_changed_filters: no pass filters; 29 bit identifiers on %s are not captured", canbus->iface);
+  }
+
+  for(can_id = 0; can_id <= CAN_SFF_MASK; can_id++) {
+    bool pass = npass == 0;
+    for(i=0; i<count && !pass; i++) {
+      pass = rules[i].type == CANBUS_FILTER_PASS && canbus_bcm_rule_match(&rules[i], can_id);
+    }
+    if(pass && canbus_bcm_rx_changed_id(canbus, rules, count, can_id) != 0) return 2;
+  }
+
+  for(i=0; i<count; i++) {
+    if(!canbus_bcm_rule_eff(&rules[i])) continue;
+    // walk every combination of the unmasked bits on top of the fixed ones
+    canid_t free_bits = ~rules[i].can_mask & CAN_EFF_MASK;
+    canid_t base = rules[i].can_id & rules[i].can_mask & CAN_EFF_MASK;
+    canid_t sub = 0;
+    do {
+      can_id = base | sub | CAN_EFF_FLAG;
+      if(canbus_bcm_rule_match(&rules[i], can_id) && canbus_bcm_rx_changed_id(canbus, rules, count, can_id) != 0) return 3;
+      sub = (sub - free_bits) & free_bits;
+    } while(sub != 0);
+  }
+
+  return 0;
+}
+
+/**
+ * Same contract as canbus_read_batch for a CANBUS_CAPTURE_BCM client. Only
+ * RX_CHANGED notifications are returned; other BCM replies are dropped. Every
+ * wait goes through canbus_poll, so canbus_cancel stops a blocked reader.
+ */
+ssize_t canbus_bcm_read_batch(canbus_client *canbus, canbus_frame *frames, unsigned int vlen) {
+
+  if(vlen > CANBUS_BATCH_SIZE) {
+    vlen = CANBUS_BATCH_SIZE;
+  }
+
+  struct mmsghdr msgs[CANBUS_BATCH_SIZE];
+  struct iovec iovs[CANBUS_BATCH_SIZE];
+  canbus_bcm_msg bcm[CANBUS_BATCH_SIZE];
+  char ctrl[CANBUS_BATCH_SIZE][CMSG_SPACE(3 * sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t))];
+
+  unsigned int i;
+  for(i=0; i<vlen; i++) {
+    iovs[i].iov_base = &bcm[i];
+    iovs[i].iov_len = sizeof(canbus_bcm_msg);
+    memset(&msgs[i], 0, sizeof(struct mmsghdr));
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = ctrl[i];
+    msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+  }
+
+  unsigned int nframes = 0;
+  while(nframes == 0) {
+
+    // wait where canbus_cancel can reach us, also while only other replies arrive
+    if(canbus_poll(canbus, -1) == -1) {
+      return -1;
+    }
+
+    int n = recvmmsg(canbus->socket, msgs, vlen, MSG_WAITFORONE, NULL);
+    if(n == -1) {
+      if(errno != EINTR && errno != EAGAIN) {
+        syslog(LOG_ERR, "canbus_bcm_read_batch: recvmmsg: %s", strerror(errno));
+      }
+      return -1;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    for(i=0; i<n; i++) {
+      if(bcm[i].head.opcode != RX_CHANGED || bcm[i].head.nframes != 1) continue;
+      bool fd = bcm[i].head.flags & CAN_FD_FRAME;
+      frames[nframes].flags = fd ? CANBUS_FRAME_FD : 0;
+      memcpy(&frames[nframes].frame, &bcm[i].frame, fd ? CANFD_MTU : CAN_MTU);
+      frames[nframes].ts = now;
+      canbus_cmsg_parse(canbus, &msgs[i].msg_hdr, &frames[nframes].ts);
+      nframes++;
+    }
+  }
+
+  return nframes;
+}
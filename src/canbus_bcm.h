@@ -0,0 +1,47 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANBUSBCM_H
+#define CANBUSBCM_H
+
+#include <linux/can/bcm.h>
+#include "canbus.h"
+
+#define CANBUS_BCM_MIN_INTERVAL_MS 1
+#define CANBUS_BCM_MAX_INTERVAL_MS 65535
+#define CANBUS_BCM_RX_MAX_FREE_BITS 11  // a 29 bit rule may match at most 2048 identifiers
+
+struct canbus_filter;
+
+/**
+ * One CAN_BCM message: the broadcast manager header followed by a single
+ * classic or FD frame.
+ */
+typedef struct {
+  struct bcm_msg_head head;
+  struct canfd_frame frame;
+} canbus_bcm_msg;
+
+unsigned int canbus_bcm_connect(canbus_client *canbus);
+unsigned int canbus_bcm_tx_setup(canbus_client *canbus, canbus_frame *frame, unsigned int interval_ms);
+unsigned int canbus_bcm_tx_delete(canbus_client *canbus, canbus_frame *frame);
+unsigned int canbus_bcm_rx_changed(canbus_client *canbus, canid_t can_id, bool fd);
+unsigned int canbus_bcm_rx_changed_filters(canbus_client *canbus, struct canbus_filter *rules, unsigned int count);
+ssize_t canbus_bcm_read_batch(canbus_client *canbus, canbus_frame *frames, unsigned int vlen);
+
+#endif
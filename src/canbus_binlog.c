@@ -0,0 +1,190 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "canbus_binlog.h"
+
+uint16_t canbus_binlog_record_len(bool fd) {
+  return sizeof(canbus_binlog_record) + (fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN);
+}
+
+/**
+ * Starts a binary log on a freshly opened file. Interfaces that negotiated
+ * CAN FD get 64 byte records, others 8.
+ */
+unsigned int canbus_binlog_write_header(FILE *file, const char *iface, bool fd) {
+  canbus_binlog_header header;
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CANBUS_BINLOG_MAGIC, CANBUS_BINLOG_MAGIC_LEN);
+  header.version = htole16(CANBUS_BINLOG_VERSION);
+  header.header_len = htole16(sizeof(canbus_binlog_header));
+  header.record_len = htole16(canbus_binlog_record_len(fd));
+  header.flags = htole16(fd ? CANBUS_BINLOG_FD : 0);
+  header.start_sec = htole64(now.tv_sec);
+  header.start_nsec = htole32(now.tv_nsec);
+  if(iface != NULL) {
+    strncpy(header.iface, iface, IFNAMSIZ - 1);
+  }
+
+  if(fwrite(&header, sizeof(header), 1, file) != 1) {
+    syslog(LOG_ERR, "canbus_binlog_write_header: unable to write header. error=%s", strerror(errno));
+    return errno;
+  }
+  return 0;
+}
+
+/**
+ * Validates a header read from the start of a file and converts it to host
+ * byte order.
+ */
+unsigned int canbus_binlog_parse_header(const void *buf, size_t len, canbus_binlog_header *header) {
+  if(len < sizeof(canbus_binlog_header)) {
+    return EINVAL;
+  }
+  memcpy(header, buf, sizeof(canbus_binlog_header));
+  header->version = le16toh(header->version);
+  header->header_len = le16toh(header->header_len);
+  header->record_len = le16toh(header->record_len);
+  header->flags = le16toh(header->flags);
+  header->start_sec = le64toh(header->start_sec);
+  header->start_nsec = le32toh(header->start_nsec);
+  header->iface[IFNAMSIZ - 1] = '\0';
+
+  if(memcmp(header->magic, CANBUS_BINLOG_MAGIC, CANBUS_BINLOG_MAGIC_LEN) != 0 ||
+     header->header_len < sizeof(canbus_binlog_header) ||
+     header->record_len < canbus_binlog_record_len(false)) {
+    return EINVAL;
+  }
+  if(header->version > CANBUS_BINLOG_VERSION) {
+    return ENOTSUP;
+  }
+  return 0;
+}
+
+/**
+ * Encodes one frame into a record_len byte record.
+ */
+void canbus_binlog_encode(canbus_frame *frame, uint8_t *buf, uint16_t record_len) {
+  canbus_binlog_record *rec = (canbus_binlog_record *)buf;
+  unsigned int data_len = record_len - sizeof(canbus_binlog_record);
+  memset(buf, 0, record_len);
+  rec->ts = htole64((uint64_t)frame->ts.tv_sec * 1000000000ULL + frame->ts.tv_nsec);
+  rec->can_id = htole32(frame->frame.can_id);
+  rec->flags = frame->flags;
+  rec->fd_flags = frame->frame.flags;
+  rec->len = frame->frame.len <= data_len ? frame->frame.len : data_len;
+  memcpy(rec->data, frame->frame.data, rec->len);
+}
+
+void canbus_binlog_decode(const uint8_t *buf, uint16_t record_len, canbus_frame *frame) {
+  const canbus_binlog_record *rec = (const canbus_binlog_record *)buf;
+  unsigned int data_len = record_len - sizeof(canbus_binlog_record);
+  uint64_t ts = le64toh(rec->ts);
+  if(data_len > CANFD_MAX_DLEN) data_len = CANFD_MAX_DLEN;
+  frame->ts.tv_sec = ts / 1000000000ULL;
+  frame->ts.tv_nsec = ts % 1000000000ULL;
+  frame->flags = rec->flags;
+  frame->frame.can_id = le32toh(rec->can_id);
+  frame->frame.flags = rec->fd_flags;
+  frame->frame.len = rec->len <= data_len ? rec->len : data_len;
+  frame->frame.__res0 = 0;
+  frame->frame.__res1 = 0;
+  memcpy(frame->frame.data, rec->data, frame->frame.len);
+}
+
+unsigned int canbus_binlog_open(canbus_binlog_reader *reader, const char *filename) {
+  struct stat st;
+  canbus_binlog_header *header = &reader->header;
+  unsigned int rc;
+
+  reader->map = NULL;
+  reader->count = 0;
+
+  reader->fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if(reader->fd == -1) {
+    syslog(LOG_ERR, "canbus_binlog_open: unable to open %s. error=%s", filename, strerror(errno));
+    return errno;
+  }
+
+  if(fstat(reader->fd, &st) == -1 || st.st_size < sizeof(canbus_binlog_header)) {
+    syslog(LOG_ERR, "canbus_binlog_open: %s is too short to be a binary log", filename);
+    canbus_binlog_close(reader);
+    return EINVAL;
+  }
+  reader->size = st.st_size;
+
+  reader->map = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+  if(reader->map == MAP_FAILED) {
+    rc = errno;
+    syslog(LOG_ERR, "canbus_binlog_open: mmap failed. error=%s", strerror(rc));
+    reader->map = NULL;
+    canbus_binlog_close(reader);
+    return rc;
+  }
+  madvise(reader->map, reader->size, MADV_SEQUENTIAL);
+
+  rc = canbus_binlog_parse_header(reader->map, reader->size, header);
+  if(rc == 0 && header->header_len > reader->size) {
+    rc = EINVAL;
+  }
+  if(rc != 0) {
+    syslog(LOG_ERR, "canbus_binlog_open: %s is not a supported binary log (version %d)", filename, header->version);
+    canbus_binlog_close(reader);
+    return rc;
+  }
+
+  reader->count = (reader->size - header->header_len) / header->record_len;
+  return 0;
+}
+
+/**
+ * Decodes up to max records starting at index. Returns the number decoded,
+ * 0 past the end.
+ */
+unsigned int canbus_binlog_read(canbus_binlog_reader *reader, uint64_t index, canbus_frame *frames, unsigned int max) {
+  unsigned int i;
+  const uint8_t *p;
+
+  if(index >= reader->count) return 0;
+  if(max > reader->count - index) max = reader->count - index;
+
+  p = reader->map + reader->header.header_len + index * reader->header.record_len;
+  for(i=0; i<max; i++, p+=reader->header.record_len) {
+    canbus_binlog_decode(p, reader->header.record_len, &frames[i]);
+  }
+  return max;
+}
+
+void canbus_binlog_close(canbus_binlog_reader *reader) {
+  if(reader->map != NULL) {
+    munmap(reader->map, reader->size);
+    reader->map = NULL;
+  }
+  if(reader->fd != -1) {
+    close(reader->fd);
+    reader->fd = -1;
+  }
+}
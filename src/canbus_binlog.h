@@ -0,0 +1,88 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANBUSBINLOG_H
+#define CANBUSBINLOG_H
+
+#include <stdio.h>
+#include "canbus.h"
+
+#define CANBUS_BINLOG_MAGIC       "ECUCANLG"
+#define CANBUS_BINLOG_MAGIC_LEN   8
+#define CANBUS_BINLOG_VERSION     1
+#define CANBUS_BINLOG_FD          (1 << 0)  // header flag: records carry CANFD_MAX_DLEN data bytes
+#define CANBUS_BINLOG_EXT         ".bin"
+
+/**
+ * File layout, all fields little endian:
+ *
+ *   canbus_binlog_header                       header_len bytes
+ *   canbus_binlog_record + data[8 or 64]       record_len bytes, repeated
+ *
+ * Readers honour header_len and record_len rather than sizeof, so later
+ * versions can grow either one. A torn record at the end of the file (power
+ * loss) is ignored. Records carry no checksum: recovery can only cut off a
+ * short tail, not detect a damaged record. Logs that need that are written
+ * in the compressed format (canbus_blocklog), whose blocks are CRC32C
+ * committed.
+ */
+typedef struct __attribute__((packed)) {
+  char magic[CANBUS_BINLOG_MAGIC_LEN];
+  uint16_t version;
+  uint16_t header_len;
+  uint16_t record_len;
+  uint16_t flags;           // CANBUS_BINLOG_*
+  int64_t start_sec;        // CLOCK_REALTIME when the file was opened
+  uint32_t start_nsec;
+  uint32_t reserved;
+  char iface[IFNAMSIZ];
+  uint8_t pad[16];
+} canbus_binlog_header;
+
+typedef struct __attribute__((packed)) {
+  uint64_t ts;              // ns since the epoch (canbus_frame.ts)
+  uint32_t can_id;          // including CAN_EFF_FLAG / CAN_RTR_FLAG / CAN_ERR_FLAG
+  uint8_t flags;            // canbus_frame.flags
+  uint8_t fd_flags;         // canfd_frame.flags
+  uint8_t len;
+  uint8_t reserved;
+  uint8_t data[];
+} canbus_binlog_record;
+
+/**
+ * Read only mapping of a binary log. Records are decoded on demand, so opening
+ * a large file costs one mmap regardless of its size.
+ */
+typedef struct {
+  int fd;
+  uint8_t *map;
+  size_t size;
+  canbus_binlog_header header;  // host byte order
+  uint64_t count;               // complete records
+} canbus_binlog_reader;
+
+uint16_t canbus_binlog_record_len(bool fd);
+unsigned int canbus_binlog_write_header(FILE *file, const char *iface, bool fd);
+unsigned int canbus_binlog_parse_header(const void *buf, size_t len, canbus_binlog_header *header);
+void canbus_binlog_encode(canbus_frame *frame, uint8_t *buf, uint16_t record_len);
+void canbus_binlog_decode(const uint8_t *buf, uint16_t record_len, canbus_frame *frame);
+unsigned int canbus_binlog_open(canbus_binlog_reader *reader, const char *filename);
+unsigned int canbus_binlog_read(canbus_binlog_reader *reader, uint64_t index, canbus_frame *frames, unsigned int max);
+void canbus_binlog_close(canbus_binlog_reader *reader);
+
+#endif
@@ -0,0 +1,388 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include "canbus_blocklog.h"
+#include "canbus_crc32c.h"
+
+static inline uint64_t canbus_blocklog_ts(canbus_frame *frame) {
+  return (uint64_t)frame->ts.tv_sec * 1000000000ULL + frame->ts.tv_nsec;
+}
+
+static inline uint64_t canbus_blocklog_zigzag(int64_t v) {
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t canbus_blocklog_unzigzag(uint64_t v) {
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline size_t canbus_blocklog_varint_len(uint64_t v) {
+  size_t n = 1;
+  while(v >= 0x80) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+static inline uint8_t *canbus_blocklog_put_varint(uint8_t *p, uint64_t v) {
+  while(v >= 0x80) {
+    *p++ = v | 0x80;
+    v >>= 7;
+  }
+  *p++ = v;
+  return p;
+}
+
+static inline const uint8_t *canbus_blocklog_get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v) {
+  unsigned int shift = 0;
+  *v = 0;
+  while(p < end && shift < 64) {
+    *v |= (uint64_t)(*p & 0x7f) << shift;
+    if(!(*p++ & 0x80)) return p;
+    shift += 7;
+  }
+  return NULL;
+}
+
+// deltas of can_id wrap at 32 bits, so the flag bits cost nothing while they stay the same
+static inline uint64_t canbus_blocklog_id_delta(canbus_frame *frame, canbus_frame *prev) {
+  return canbus_blocklog_zigzag((int32_t)(frame->frame.can_id - (prev != NULL ? prev->frame.can_id : 0)));
+}
+
+/**
+ * The last frame before frames[i] with the same can_id, NULL for the first.
+ * slots maps can_id to the index of its latest frame plus one and is updated
+ * to frames[i].
+ */
+static canbus_frame *canbus_blocklog_prev_same_id(uint16_t *slots, canbus_frame *frames, unsigned int i) {
+  uint32_t id = frames[i].frame.can_id;
+  unsigned int h = (id * 2654435761U) >> (32 - 11);
+  canbus_frame *prev;
+
+  for(;; h = (h + 1) & (CANBUS_BLOCKLOG_ID_SLOTS - 1)) {
+    if(slots[h] == 0) {
+      slots[h] = i + 1;
+      return NULL;
+    }
+    prev = &frames[slots[h] - 1];
+    if(prev->frame.can_id == id) {
+      slots[h] = i + 1;
+      return prev;
+    }
+  }
+}
+
+/**
+ * Fills buf with the header of a log started now. Returns its length,
+ * sizeof(canbus_binlog_header).
+ */
+size_t canbus_blocklog_header(uint8_t *buf, const char *iface, bool fd) {
+  canbus_binlog_header header;
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CANBUS_BLOCKLOG_MAGIC, CANBUS_BINLOG_MAGIC_LEN);
+  header.version = htole16(CANBUS_BLOCKLOG_VERSION);
+  header.header_len = htole16(sizeof(canbus_binlog_header));
+  header.flags = htole16(fd ? CANBUS_BINLOG_FD : 0);
+  header.start_sec = htole64(now.tv_sec);
+  header.start_nsec = htole32(now.tv_nsec);
+  if(iface != NULL) {
+    strncpy(header.iface, iface, IFNAMSIZ - 1);
+  }
+  memcpy(buf, &header, sizeof(header));
+  return sizeof(header);
+}
+
+unsigned int canbus_blocklog_write_header(FILE *file, const char *iface, bool fd) {
+  uint8_t header[sizeof(canbus_binlog_header)];
+
+  canbus_blocklog_header(header, iface, fd);
+  if(fwrite(header, sizeof(header), 1, file) != 1) {
+    syslog(LOG_ERR, "canbus_blocklog_write_header: unable to write header. error=%s", strerror(errno));
+    return errno;
+  }
+  return 0;
+}
+
+unsigned int canbus_blocklog_parse_header(const void *buf, size_t len, canbus_binlog_header *header) {
+  if(len < sizeof(canbus_binlog_header)) {
+    return EINVAL;
+  }
+  memcpy(header, buf, sizeof(canbus_binlog_header));
+  header->version = le16toh(header->version);
+  header->header_len = le16toh(header->header_len);
+  header->record_len = le16toh(header->record_len);
+  header->flags = le16toh(header->flags);
+  header->start_sec = le64toh(header->start_sec);
+  header->start_nsec = le32toh(header->start_nsec);
+  header->iface[IFNAMSIZ - 1] = '\0';
+
+  if(memcmp(header->magic, CANBUS_BLOCKLOG_MAGIC, CANBUS_BINLOG_MAGIC_LEN) != 0 ||
+     header->header_len < sizeof(canbus_binlog_header)) {
+    return EINVAL;
+  }
+  if(header->version > CANBUS_BLOCKLOG_VERSION) {
+    return ENOTSUP;
+  }
+  return 0;
+}
+
+/**
+ * Bytes frame adds to the raw encoding of a block when it follows prev, or
+ * starts the block when prev is NULL.
+ */
+size_t canbus_blocklog_raw_len(canbus_frame *frame, canbus_frame *prev) {
+  size_t len = 3 + frame->frame.len + canbus_blocklog_varint_len(canbus_blocklog_id_delta(frame, prev));
+  if(prev != NULL) {
+    len += canbus_blocklog_varint_len(canbus_blocklog_zigzag(canbus_blocklog_ts(frame) - canbus_blocklog_ts(prev)));
+  }
+  else {
+    len += 1;
+  }
+  return len;
+}
+
+/**
+ * Encodes and compresses frames into one block at buf, which must hold
+ * CANBUS_BLOCKLOG_BLOCK_MAX bytes. The frames' raw_len sum must not exceed
+ * CANBUS_BLOCKLOG_RAW_LEN, nor nframes CANBUS_BLOCKLOG_FRAMES. Returns the
+ * size of the block, commit trailer included.
+ */
+size_t canbus_blocklog_encode(canbus_frame *frames, unsigned int nframes, uint8_t *buf) {
+  uint8_t raw[CANBUS_BLOCKLOG_RAW_LEN + CANBUS_BLOCKLOG_FRAME_MAX];
+  uint16_t slots[CANBUS_BLOCKLOG_ID_SLOTS];
+  canbus_blocklog_block *block = (canbus_blocklog_block *)buf;
+  canbus_blocklog_commit commit;
+  canbus_frame *prev;
+  uint8_t *p = raw, *payload = buf + sizeof(canbus_blocklog_block);
+  uint64_t prev_ts = canbus_blocklog_ts(&frames[0]);
+  unsigned int i, j;
+  size_t raw_len, comp_len;
+
+  for(i=0; i<nframes; i++) {
+    uint64_t ts = canbus_blocklog_ts(&frames[i]);
+    p = canbus_blocklog_put_varint(p, canbus_blocklog_zigzag(ts - prev_ts));
+    prev_ts = ts;
+  }
+  for(i=0; i<nframes; i++) {
+    p = canbus_blocklog_put_varint(p, canbus_blocklog_id_delta(&frames[i], i > 0 ? &frames[i - 1] : NULL));
+  }
+  for(i=0; i<nframes; i++) *p++ = frames[i].flags;
+  for(i=0; i<nframes; i++) *p++ = frames[i].frame.flags;
+  for(i=0; i<nframes; i++) *p++ = frames[i].frame.len;
+  // repeating payloads become runs of zeros, counters and checksums a byte or two
+  memset(slots, 0, sizeof(slots));
+  for(i=0; i<nframes; i++) {
+    prev = canbus_blocklog_prev_same_id(slots, frames, i);
+    for(j=0; j<frames[i].frame.len; j++) {
+      *p++ = frames[i].frame.data[j] ^ (prev != NULL && j < prev->frame.len ? prev->frame.data[j] : 0);
+    }
+  }
+  raw_len = p - raw;
+
+  comp_len = canbus_lz4_compress(raw, raw_len, payload, raw_len);
+  block->flags = htole16(CANBUS_BLOCKLOG_COMMITTED);
+  if(comp_len == 0) {
+    memcpy(payload, raw, raw_len);
+    comp_len = raw_len;
+    block->flags = htole16(CANBUS_BLOCKLOG_COMMITTED | CANBUS_BLOCKLOG_STORED);
+  }
+  block->sync = htole32(CANBUS_BLOCKLOG_SYNC);
+  block->comp_len = htole32(comp_len);
+  block->raw_len = htole32(raw_len);
+  block->frames = htole16(nframes);
+  block->first_ts = htole64(canbus_blocklog_ts(&frames[0]));
+  block->last_ts = htole64(canbus_blocklog_ts(&frames[nframes - 1]));
+
+  commit.len = htole32(sizeof(canbus_blocklog_block) + comp_len);
+  commit.crc = htole32(canbus_crc32c(0, buf, sizeof(canbus_blocklog_block) + comp_len));
+  commit.commit = htole32(CANBUS_BLOCKLOG_COMMIT);
+  memcpy(payload + comp_len, &commit, sizeof(commit));
+  return sizeof(canbus_blocklog_block) + comp_len + sizeof(commit);
+}
+
+/**
+ * Validates a block header and converts it to host byte order. The payload
+ * that follows is comp_len bytes.
+ */
+unsigned int canbus_blocklog_parse_block(const void *buf, size_t len, canbus_blocklog_block *block) {
+  if(len < sizeof(canbus_blocklog_block)) {
+    return EINVAL;
+  }
+  memcpy(block, buf, sizeof(canbus_blocklog_block));
+  block->sync = le32toh(block->sync);
+  block->comp_len = le32toh(block->comp_len);
+  block->raw_len = le32toh(block->raw_len);
+  block->frames = le16toh(block->frames);
+  block->flags = le16toh(block->flags);
+  block->first_ts = le64toh(block->first_ts);
+  block->last_ts = le64toh(block->last_ts);
+
+  if(block->sync != CANBUS_BLOCKLOG_SYNC || block->frames == 0 || block->frames > CANBUS_BLOCKLOG_FRAMES ||
+     block->raw_len > CANBUS_BLOCKLOG_RAW_LEN + CANBUS_BLOCKLOG_FRAME_MAX ||
+     block->comp_len > CANBUS_LZ4_BOUND(block->raw_len)) {
+    return EINVAL;
+  }
+  return 0;
+}
+
+/**
+ * Bytes the parsed block takes in the file: header, payload and the commit
+ * trailer if it has one.
+ */
+size_t canbus_blocklog_block_len(const canbus_blocklog_block *block) {
+  return sizeof(canbus_blocklog_block) + block->comp_len +
+         (block->flags & CANBUS_BLOCKLOG_COMMITTED ? sizeof(canbus_blocklog_commit) : 0);
+}
+
+static bool canbus_blocklog_committed(const uint8_t *buf, size_t len) {
+  canbus_blocklog_commit commit;
+  memcpy(&commit, buf + len, sizeof(commit));
+  return le32toh(commit.commit) == CANBUS_BLOCKLOG_COMMIT && le32toh(commit.len) == len &&
+         le32toh(commit.crc) == canbus_crc32c(0, buf, len);
+}
+
+/**
+ * True if a committed block ends at end: its trailer's marker, length and CRC
+ * check out. *start is set to the start of the block.
+ */
+static bool canbus_blocklog_committed_at(const uint8_t *buf, size_t end, size_t *start) {
+  canbus_blocklog_block block;
+  canbus_blocklog_commit commit;
+  size_t block_len, at;
+
+  if(end < sizeof(canbus_blocklog_block) + sizeof(commit)) return false;
+  memcpy(&commit, buf + end - sizeof(commit), sizeof(commit));
+  if(le32toh(commit.commit) != CANBUS_BLOCKLOG_COMMIT) return false;
+  block_len = le32toh(commit.len);
+  if(block_len > end - sizeof(commit) || block_len < sizeof(canbus_blocklog_block)) return false;
+  at = end - sizeof(commit) - block_len;
+  if(canbus_blocklog_parse_block(buf + at, block_len, &block) != 0 ||
+     sizeof(canbus_blocklog_block) + block.comp_len != block_len || !canbus_blocklog_committed(buf + at, block_len)) {
+    return false;
+  }
+  *start = at;
+  return true;
+}
+
+/**
+ * Length of the log data in buf (everything after the file header) up to the
+ * end of its last intact block, reading only the tail: the last committed
+ * block is found by scanning back from the end for a commit marker whose
+ * length and CRC check out, then the blocks before it are followed back
+ * through their trailers for CANBUS_BLOCKLOG_RECOVER_WINDOW bytes, since
+ * writes still in flight at a crash may have landed out of order and left a
+ * hole. Everything before the window is taken as written. Logs without commit
+ * trailers (version 1) are walked from the start instead.
+ */
+size_t canbus_blocklog_recover(const uint8_t *buf, size_t len) {
+  canbus_blocklog_block block;
+  size_t end, start, block_len;
+
+  for(end = len; end > 0; end--) {
+    if(!canbus_blocklog_committed_at(buf, end, &start)) continue;
+    while(start > 0 && end - start < CANBUS_BLOCKLOG_RECOVER_WINDOW && canbus_blocklog_committed_at(buf, start, &start));
+    if(start == 0 || end - start >= CANBUS_BLOCKLOG_RECOVER_WINDOW) {
+      return end;
+    }
+    // the block before start is damaged, so nothing from there on can be kept
+    end = start;
+  }
+
+  for(end = 0; canbus_blocklog_parse_block(buf + end, len - end, &block) == 0; end += block_len) {
+    block_len = canbus_blocklog_block_len(&block);
+    if(block_len > len - end || (block.flags & CANBUS_BLOCKLOG_COMMITTED)) break;
+  }
+  return end;
+}
+
+/**
+ * Decodes the block at buf (header, payload and commit trailer, len bytes)
+ * into frames. Returns the number of frames, or -1 if the block is corrupt,
+ * fails its CRC or holds more than max.
+ */
+int canbus_blocklog_decode(const uint8_t *buf, size_t len, canbus_frame *frames, unsigned int max) {
+  uint8_t raw[CANBUS_BLOCKLOG_RAW_LEN + CANBUS_BLOCKLOG_FRAME_MAX];
+  uint16_t slots[CANBUS_BLOCKLOG_ID_SLOTS];
+  canbus_blocklog_block block;
+  canbus_frame *prev;
+  const uint8_t *p, *end, *payload = buf + sizeof(canbus_blocklog_block);
+  uint64_t v, ts;
+  uint32_t id = 0;
+  unsigned int i, j;
+  int raw_len;
+
+  if(canbus_blocklog_parse_block(buf, len, &block) != 0 || block.frames > max ||
+     len < canbus_blocklog_block_len(&block)) {
+    return -1;
+  }
+  if((block.flags & CANBUS_BLOCKLOG_COMMITTED) && !canbus_blocklog_committed(buf, sizeof(canbus_blocklog_block) + block.comp_len)) {
+    return -1;
+  }
+  if(block.flags & CANBUS_BLOCKLOG_STORED) {
+    if(block.comp_len != block.raw_len) return -1;
+    memcpy(raw, payload, block.raw_len);
+    raw_len = block.raw_len;
+  }
+  else {
+    raw_len = canbus_lz4_decompress(payload, block.comp_len, raw, sizeof(raw));
+  }
+  if(raw_len != (int)block.raw_len) {
+    return -1;
+  }
+  p = raw;
+  end = raw + raw_len;
+
+  ts = block.first_ts;
+  for(i=0; i<block.frames; i++) {
+    if((p = canbus_blocklog_get_varint(p, end, &v)) == NULL) return -1;
+    ts += canbus_blocklog_unzigzag(v);
+    frames[i].ts.tv_sec = ts / 1000000000ULL;
+    frames[i].ts.tv_nsec = ts % 1000000000ULL;
+  }
+  for(i=0; i<block.frames; i++) {
+    if((p = canbus_blocklog_get_varint(p, end, &v)) == NULL) return -1;
+    id += (uint32_t)canbus_blocklog_unzigzag(v);
+    frames[i].frame.can_id = id;
+  }
+  if(end - p < 3 * block.frames) {
+    return -1;
+  }
+  for(i=0; i<block.frames; i++) frames[i].flags = *p++;
+  for(i=0; i<block.frames; i++) frames[i].frame.flags = *p++;
+  for(i=0; i<block.frames; i++) {
+    frames[i].frame.len = *p++;
+    frames[i].frame.__res0 = 0;
+    frames[i].frame.__res1 = 0;
+  }
+  memset(slots, 0, sizeof(slots));
+  for(i=0; i<block.frames; i++) {
+    if(frames[i].frame.len > CANFD_MAX_DLEN || end - p < frames[i].frame.len) return -1;
+    prev = canbus_blocklog_prev_same_id(slots, frames, i);
+    for(j=0; j<frames[i].frame.len; j++) {
+      frames[i].frame.data[j] = *p++ ^ (prev != NULL && j < prev->frame.len ? prev->frame.data[j] : 0);
+    }
+  }
+  return block.frames;
+}
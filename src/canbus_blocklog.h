@@ -0,0 +1,95 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANBUSBLOCKLOG_H
+#define CANBUSBLOCKLOG_H
+
+#include <stdio.h>
+#include "canbus.h"
+#include "canbus_binlog.h"
+#include "canbus_lz4.h"
+
+#define CANBUS_BLOCKLOG_MAGIC     "ECUCANBK"
+#define CANBUS_BLOCKLOG_VERSION   2
+#define CANBUS_BLOCKLOG_EXT       ".cbl"
+#define CANBUS_BLOCKLOG_SYNC      0x4b4c4243   // "CBLK" at the start of every block
+#define CANBUS_BLOCKLOG_COMMIT    0x544d4f43   // "COMT" at the end of every committed block
+#define CANBUS_BLOCKLOG_FRAMES    1024         // most frames in one block
+#define CANBUS_BLOCKLOG_RAW_LEN   16384        // most delta encoded bytes in one block
+#define CANBUS_BLOCKLOG_ID_SLOTS  2048         // can_id lookup while coding a block, a power of two above CANBUS_BLOCKLOG_FRAMES
+#define CANBUS_BLOCKLOG_FRAME_MAX (10 + 5 + 3 + CANFD_MAX_DLEN)  // delta encoding of one frame, worst case
+#define CANBUS_BLOCKLOG_RECOVER_WINDOW (1024 * 1024)  // tail canbus_blocklog_recover checks block by block, past any writes in flight at a crash
+#define CANBUS_BLOCKLOG_BLOCK_MAX (sizeof(canbus_blocklog_block) + CANBUS_LZ4_BOUND(CANBUS_BLOCKLOG_RAW_LEN) + sizeof(canbus_blocklog_commit))
+
+#define CANBUS_BLOCKLOG_STORED    (1 << 0)     // block flag: payload is the raw encoding, it did not compress
+#define CANBUS_BLOCKLOG_COMMITTED (1 << 1)     // block flag: a canbus_blocklog_commit follows the payload (version 2)
+
+/**
+ * File layout, all fields little endian:
+ *
+ *   canbus_binlog_header with CANBUS_BLOCKLOG_MAGIC, record_len 0
+ *   canbus_blocklog_block + payload[comp_len] + canbus_blocklog_commit   repeated
+ *
+ * A payload is an LZ4 block of raw_len bytes holding the block's frames as
+ * columns, so similar bytes sit together:
+ *
+ *   timestamps  zigzag varint ns delta from the previous frame (first_ts for the first)
+ *   ids         zigzag varint delta of can_id from the previous frame (0 for the first)
+ *   flags       canbus_frame.flags of every frame
+ *   fd_flags    canfd_frame.flags of every frame
+ *   lens        canfd_frame.len of every frame
+ *   data        the payloads back to back, each XORed with the previous
+ *               payload of the same can_id in the block
+ *
+ * Nothing carries over from one block to the next, so any block decodes on
+ * its own and first_ts/last_ts let a reader skip to a time without
+ * decompressing anything.
+ *
+ * The commit trailer carries a CRC32C of the block header and payload and
+ * ends with a marker, so a block torn or corrupted by a crash is detected
+ * before it is decoded, and canbus_blocklog_recover can find the last good
+ * block by scanning back from the end of the file. Version 1 files have no
+ * trailers and still read.
+ */
+typedef struct __attribute__((packed)) {
+  uint32_t sync;            // CANBUS_BLOCKLOG_SYNC
+  uint32_t comp_len;
+  uint32_t raw_len;
+  uint16_t frames;
+  uint16_t flags;           // CANBUS_BLOCKLOG_*
+  uint64_t first_ts;        // ns since the epoch
+  uint64_t last_ts;
+} canbus_blocklog_block;
+
+typedef struct __attribute__((packed)) {
+  uint32_t len;             // block header and payload, to find the block from its end
+  uint32_t crc;             // CRC32C of the block header and payload
+  uint32_t commit;          // CANBUS_BLOCKLOG_COMMIT
+} canbus_blocklog_commit;
+
+size_t canbus_blocklog_header(uint8_t *buf, const char *iface, bool fd);
+unsigned int canbus_blocklog_write_header(FILE *file, const char *iface, bool fd);
+unsigned int canbus_blocklog_parse_header(const void *buf, size_t len, canbus_binlog_header *header);
+size_t canbus_blocklog_raw_len(canbus_frame *frame, canbus_frame *prev);
+size_t canbus_blocklog_encode(canbus_frame *frames, unsigned int nframes, uint8_t *buf);
+unsigned int canbus_blocklog_parse_block(const void *buf, size_t len, canbus_blocklog_block *block);
+size_t canbus_blocklog_block_len(const canbus_blocklog_block *block);
+size_t canbus_blocklog_recover(const uint8_t *buf, size_t len);
+int canbus_blocklog_decode(const uint8_t *buf, size_t len, canbus_frame *frames, unsigned int max);
+
+#endif
@@ -0,0 +1,167 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include "canbus_crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CANBUS_CRC32C_X86
+#elif defined(__aarch64__) && defined(__linux__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CANBUS_CRC32C_ARM
+#endif
+
+#define CANBUS_CRC32C_POLY 0x82f63b78   // reflected 0x1edc6f41
+
+typedef uint32_t (*canbus_crc32c_fn)(uint32_t crc, const uint8_t *p, size_t len);
+
+static canbus_crc32c_fn canbus_crc32c_impl = NULL;
+static uint32_t canbus_crc32c_tables[8][256];
+static pthread_once_t canbus_crc32c_tables_once = PTHREAD_ONCE_INIT;
+
+static void canbus_crc32c_tables_init(void) {
+  uint32_t crc;
+  unsigned int i, j;
+  for(i=0; i<256; i++) {
+    crc = i;
+    for(j=0; j<8; j++) {
+      crc = (crc >> 1) ^ (CANBUS_CRC32C_POLY & -(crc & 1));
+    }
+    canbus_crc32c_tables[0][i] = crc;
+  }
+  for(i=0; i<256; i++) {
+    for(j=1; j<8; j++) {
+      crc = canbus_crc32c_tables[j - 1][i];
+      canbus_crc32c_tables[j][i] = (crc >> 8) ^ canbus_crc32c_tables[0][crc & 0xff];
+    }
+  }
+}
+
+/**
+ * Slicing by 8: one table lookup per byte, eight of them independent.
+ */
+static uint32_t canbus_crc32c_table(uint32_t crc, const uint8_t *p, size_t len) {
+  uint32_t (*t)[256] = canbus_crc32c_tables;
+  uint32_t lo, hi;
+
+  pthread_once(&canbus_crc32c_tables_once, canbus_crc32c_tables_init);
+  while(len >= 8) {
+    lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+    hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+    crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+          t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+    p += 8;
+    len -= 8;
+  }
+  while(len-- > 0) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+  }
+  return crc;
+}
+
+#ifdef CANBUS_CRC32C_X86
+
+__attribute__((target("sse4.2")))
+static uint32_t canbus_crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len) {
+  for(; len > 0 && ((uintptr_t)p & 7) != 0; len--) {
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+#ifdef __x86_64__
+  uint64_t crc64 = crc, v;
+  for(; len >= 8; len -= 8, p += 8) {
+    memcpy(&v, p, sizeof(v));
+    crc64 = _mm_crc32_u64(crc64, v);
+  }
+  crc = crc64;
+#endif
+  uint32_t v32;
+  for(; len >= 4; len -= 4, p += 4) {
+    memcpy(&v32, p, sizeof(v32));
+    crc = _mm_crc32_u32(crc, v32);
+  }
+  for(; len > 0; len--) {
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+  return crc;
+}
+
+#endif
+
+#ifdef CANBUS_CRC32C_ARM
+
+__attribute__((target("+crc")))
+static uint32_t canbus_crc32c_armv8(uint32_t crc, const uint8_t *p, size_t len) {
+  uint64_t v;
+  for(; len > 0 && ((uintptr_t)p & 7) != 0; len--) {
+    crc = __crc32cb(crc, *p++);
+  }
+  for(; len >= 8; len -= 8, p += 8) {
+    memcpy(&v, p, sizeof(v));
+    crc = __crc32cd(crc, v);
+  }
+  for(; len > 0; len--) {
+    crc = __crc32cb(crc, *p++);
+  }
+  return crc;
+}
+
+#endif
+
+/**
+ * Selects the kernel used by canbus_crc32c. Kernels the CPU (or the
+ * architecture) does not support fall back to the tables. Returns the kernel
+ * actually selected.
+ */
+int canbus_crc32c_kernel(int kernel) {
+#ifdef CANBUS_CRC32C_X86
+  __builtin_cpu_init();
+  if((kernel == CANBUS_CRC32C_AUTO || kernel == CANBUS_CRC32C_SSE42) && __builtin_cpu_supports("sse4.2")) {
+    __atomic_store_n(&canbus_crc32c_impl, canbus_crc32c_sse42, __ATOMIC_RELAXED);
+    return CANBUS_CRC32C_SSE42;
+  }
+#endif
+#ifdef CANBUS_CRC32C_ARM
+  if((kernel == CANBUS_CRC32C_AUTO || kernel == CANBUS_CRC32C_ARMV8) && (getauxval(AT_HWCAP) & HWCAP_CRC32)) {
+    __atomic_store_n(&canbus_crc32c_impl, canbus_crc32c_armv8, __ATOMIC_RELAXED);
+    return CANBUS_CRC32C_ARMV8;
+  }
+#endif
+  __atomic_store_n(&canbus_crc32c_impl, canbus_crc32c_table, __ATOMIC_RELAXED);
+  return CANBUS_CRC32C_TABLE;
+}
+
+const char *canbus_crc32c_kernel_name(int kernel) {
+  switch(kernel) {
+    case CANBUS_CRC32C_SSE42: return "sse4.2";
+    case CANBUS_CRC32C_ARMV8: return "armv8";
+    default: return "table";
+  }
+}
+
+uint32_t canbus_crc32c(uint32_t crc, const void *buf, size_t len) {
+  canbus_crc32c_fn fn = __atomic_load_n(&canbus_crc32c_impl, __ATOMIC_RELAXED);
+  if(fn == NULL) {
+    canbus_crc32c_kernel(CANBUS_CRC32C_AUTO);
+    fn = __atomic_load_n(&canbus_crc32c_impl, __ATOMIC_RELAXED);
+  }
+  return ~fn(~crc, (const uint8_t *)buf, len);
+}
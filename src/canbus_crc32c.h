@@ -0,0 +1,40 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANBUSCRC32C_H
+#define CANBUSCRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CANBUS_CRC32C_AUTO   -1  // best kernel the CPU supports
+#define CANBUS_CRC32C_TABLE  0
+#define CANBUS_CRC32C_SSE42  1
+#define CANBUS_CRC32C_ARMV8  2
+
+/**
+ * CRC-32C (Castagnoli), the checksum of iSCSI, ext4 and btrfs, with the CRC
+ * instructions of SSE4.2 or ARMv8 where the CPU has them and slicing by 8
+ * tables everywhere else. canbus_crc32c continues crc over buf, starting from
+ * 0, so crc32c("123456789") is canbus_crc32c(0, "123456789", 9) = 0xe3069283.
+ */
+int canbus_crc32c_kernel(int kernel);
+const char *canbus_crc32c_kernel_name(int kernel);
+uint32_t canbus_crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif
@@ -17,36 +17,79 @@
  */
 
 #include "canbus_filelogger.h"
+#include "canbus_log.h"
+#include "canbus_logwriter.h"
 
-void *canbus_filelogger_thread(void *ptr) {
+void canbus_filelogger_onread(canbus_client *canbus, canbus_frame *frames, unsigned int nframes, void *arg) {
 
-  canbus_logger *pLogger = (canbus_logger *)ptr;
-  if(canbus_log_open(pLogger, "w") != 0) return NULL;
+  canbus_log *log = (canbus_log *)arg;
+  canbus_drop(canbus, CANBUS_DROP_FILE, canbus_log_write_frames(log, frames, nframes));
+}
+
+void canbus_filelogger_onread_async(canbus_client *canbus, canbus_frame *frames, unsigned int nframes, void *arg) {
 
-  syslog(LOG_DEBUG, "canbus_filelogger_thread: running");
+  canbus_logwriter *writer = (canbus_logwriter *)arg;
+  canbus_drop(canbus, CANBUS_DROP_FILE, canbus_logwriter_push(writer, frames, nframes));
+}
 
-  int can_frame_len = sizeof(struct can_frame);
-  struct can_frame frame;
-  memset(&frame, 0, can_frame_len);
+void *canbus_filelogger_thread(void *ptr) {
 
-  int data_len = can_frame_len + 25;
-  char data[data_len];
-  memset(data, 0, data_len);
+  canbus_logger *pLogger = (canbus_logger *)ptr;
 
-  while(canbus_isconnected(pLogger->canbus) && canbus_read(pLogger->canbus, &frame) > 0 && pLogger->isrunning) {
+  int i;
+  canbus_log logs[CANBUS_LOGGER_MAX_IFACES];
+  canbus_logwriter *writers[CANBUS_LOGGER_MAX_IFACES];
+  void *args[CANBUS_LOGGER_MAX_IFACES];
+  bool async = true;
+  const char *logdir = pLogger->logdir != NULL ? pLogger->logdir : ".";
 
-    memset(data, 0, data_len);
-    canbus_framecpy(&frame, data);
+  // logs a crash left open end in a torn record; cut it off before anything reads them
+  canbus_log_recover_dir(logdir);
 
-    if(frame.can_id & CAN_ERR_FLAG) {
-      syslog(LOG_ERR, "canbus_filelogger_thread: CAN ERROR: %s", data);
+  for(i=0; i<pLogger->canbus_count; i++) {
+    logs[i].file = NULL;
+    logs[i].segments = NULL;
+    writers[i] = NULL;
+    args[i] = NULL;
+    if(!canbus_isconnected(pLogger->canbus[i])) continue;
+    if(canbus_log_open(&logs[i], pLogger, pLogger->canbus[i]->iface, "w") != 0) continue;
+    canbus_log_journal_add(logdir, &logs[i]);
+    args[i] = &logs[i];
+    writers[i] = malloc(sizeof(canbus_logwriter));
+    if(writers[i] == NULL ||
+       canbus_logwriter_init(writers[i], &logs[i], CANBUS_LOGWRITER_SLOTS, pLogger->fsync_ms) != 0 ||
+       canbus_logwriter_start(writers[i]) != 0) {
+      async = false;
+    }
+  }
+
+  // handlers are per logger, so one log that can not be written at an offset keeps them all on stdio
+  for(i=0; i<pLogger->canbus_count; i++) {
+    if(writers[i] == NULL) continue;
+    if(async) {
+      args[i] = writers[i];
       continue;
     }
+    canbus_logwriter_free(writers[i]);
+    free(writers[i]);
+    writers[i] = NULL;
+  }
+
+  syslog(LOG_DEBUG, "canbus_filelogger_thread: running, %s writes", async ? "asynchronous" : "synchronous");
 
-    canbus_log_write(data);
+  if(canbus_logger_add_handlers(pLogger, async ? canbus_filelogger_onread_async : canbus_filelogger_onread, args) > 0) {
+    canbus_reactor_run(&pLogger->reactor);
+  }
+
+  for(i=0; i<pLogger->canbus_count; i++) {
+    if(writers[i] != NULL) {
+      canbus_logwriter_free(writers[i]);
+      free(writers[i]);
+    }
+    canbus_log_close(&logs[i]);
   }
+  canbus_log_journal_clear(logdir);
 
-  canbus_log_close();
   syslog(LOG_DEBUG, "canbus_filelogger_thread: stopping");
   pLogger->canbus_thread_state = CANBUS_LOGTHREAD_STOPPED;
   return NULL;
@@ -61,10 +104,12 @@ unsigned int canbus_filelogger_run(canbus_logger *logger) {
 unsigned int canbus_filelogger_stop(canbus_logger *logger) {
   if(logger->canbus_thread != NULL) {
     logger->isrunning = false;
-    while(canbus_isconnected(logger->canbus)) {
-      syslog(LOG_DEBUG, "canbus_filelogger_stop: waiting for canbus connection to close");
-      sleep(1);
+    int i;
+    for(i=0; i<logger->canbus_count; i++) {
+      canbus_cancel(logger->canbus[i]);
     }
+    canbus_reactor_stop(&logger->reactor);
+    pthread_join(logger->canbus_thread, NULL);
     logger->canbus_thread = NULL;
   }
   return 0;
@@ -0,0 +1,355 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <arpa/inet.h>
+#include "canbus_filter.h"
+
+#define CANBUS_FILTER_ID_BITS (CAN_EFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG)  // bits the kernel compares
+
+static bool canbus_filter_covers(struct can_filter *a, struct can_filter *b) {
+  return (a->can_mask & ~b->can_mask) == 0 && ((a->can_id ^ b->can_id) & a->can_mask) == 0;
+}
+
+static bool canbus_filter_overlaps(struct can_filter *a, struct can_filter *b) {
+  return ((a->can_id ^ b->can_id) & a->can_mask & b->can_mask) == 0;
+}
+
+/**
+ * Reduces an OR'd set of id/mask filters in place: drops filters covered by
+ * another and merges pairs that differ in a single compared bit, until
+ * neither applies. Returns the new count.
+ */
+static unsigned int canbus_filter_minimize(struct can_filter *set, unsigned int count) {
+  unsigned int i, j;
+  bool changed = true;
+
+  while(changed) {
+    changed = false;
+    for(i=0; i<count && !changed; i++) {
+      for(j=0; j<count && !changed; j++) {
+        if(i == j) continue;
+        canid_t diff = set[i].can_id ^ set[j].can_id;
+        if(canbus_filter_covers(&set[i], &set[j])) {
+          set[j] = set[--count];
+          changed = true;
+        }
+        else if(set[i].can_mask == set[j].can_mask && __builtin_popcount(diff) == 1) {
+          set[i].can_mask &= ~diff;
+          set[i].can_id &= ~diff;
+          set[j] = set[--count];
+          changed = true;
+        }
+      }
+    }
+  }
+  return count;
+}
+
+static void canbus_filter_stmt(canbus_filter_program *prog, uint16_t code, uint32_t k) {
+  struct sock_filter insn = BPF_STMT(code, k);
+  prog->bpf[prog->bpf_len++] = insn;
+}
+
+static unsigned int canbus_filter_jump(canbus_filter_program *prog, uint16_t code, uint32_t k) {
+  struct sock_filter insn = BPF_JUMP(code, k, 0, 0);
+  prog->bpf[prog->bpf_len] = insn;
+  return prog->bpf_len++;
+}
+
+/**
+ * Emits one rule. Every failed test jumps past the rule; a full match ends in
+ * a "ja" (pass rules, patched by the caller) or "ret #0" (block rules).
+ * Returns the index of the final instruction.
+ */
+static unsigned int canbus_filter_bpf_rule(canbus_filter_program *prog, struct canbus_filter *rule) {
+
+  unsigned int fail[2 + CAN_MAX_DLEN];
+  unsigned int nfail = 0, i;
+  int last = -1;
+
+  // BPF_W loads are big endian; can_id is stored in host order
+  if(rule->can_mask & CANBUS_FILTER_ID_BITS) {
+    canid_t mask = rule->can_mask & CANBUS_FILTER_ID_BITS;
+    canbus_filter_stmt(prog, BPF_LD | BPF_W | BPF_ABS, offsetof(struct canfd_frame, can_id));
+    canbus_filter_stmt(prog, BPF_ALU | BPF_AND | BPF_K, ntohl(mask));
+    fail[nfail++] = canbus_filter_jump(prog, BPF_JMP | BPF_JEQ | BPF_K, ntohl(rule->can_id & mask));
+  }
+
+  for(i=0; i<rule->data_len; i++) {
+    if(rule->data_mask[i]) last = i;
+  }
+
+  if(last >= 0) {
+    canbus_filter_stmt(prog, BPF_LD | BPF_B | BPF_ABS, offsetof(struct canfd_frame, len));
+    fail[nfail++] = canbus_filter_jump(prog, BPF_JMP | BPF_JGT | BPF_K, last);
+    for(i=0; i<=last; i++) {
+      if(rule->data_mask[i] == 0) continue;
+      canbus_filter_stmt(prog, BPF_LD | BPF_B | BPF_ABS, offsetof(struct canfd_frame, data) + i);
+      if(rule->data_mask[i] != 0xff) {
+        canbus_filter_stmt(prog, BPF_ALU | BPF_AND | BPF_K, rule->data_mask[i]);
+      }
+      fail[nfail++] = canbus_filter_jump(prog, BPF_JMP | BPF_JEQ | BPF_K, rule->data[i] & rule->data_mask[i]);
+    }
+  }
+
+  unsigned int end = prog->bpf_len;
+  if(rule->type == CANBUS_FILTER_PASS) {
+    canbus_filter_stmt(prog, BPF_JMP | BPF_JA, 0);
+  }
+  else {
+    canbus_filter_stmt(prog, BPF_RET | BPF_K, 0);
+  }
+
+  for(i=0; i<nfail; i++) {
+    prog->bpf[fail[i]].jf = end - fail[i];
+  }
+  return end;
+}
+
+/**
+ * Compiles every rule into a classic BPF socket filter. Error frames are
+ * always accepted, as they are with CAN_RAW filters.
+ */
+static void canbus_filter_bpf(struct canbus_filter *rules, unsigned int count, canbus_filter_program *prog) {
+
+  unsigned int ja[CANBUS_FILTER_MAX];
+  unsigned int npass = 0, i;
+
+  prog->bpf_len = 0;
+  canbus_filter_stmt(prog, BPF_LD | BPF_W | BPF_ABS, offsetof(struct canfd_frame, can_id));
+  struct sock_filter errframe = BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, ntohl(CAN_ERR_FLAG), 0, 1);
+  prog->bpf[prog->bpf_len++] = errframe;
+  canbus_filter_stmt(prog, BPF_RET | BPF_K, CANBUS_FILTER_BPF_ACCEPT);
+
+  for(i=0; i<count; i++) {
+    if(rules[i].type == CANBUS_FILTER_PASS) {
+      ja[npass++] = canbus_filter_bpf_rule(prog, &rules[i]);
+    }
+  }
+  if(npass) {
+    canbus_filter_stmt(prog, BPF_RET | BPF_K, 0);
+  }
+
+  unsigned int blocks = prog->bpf_len;
+  for(i=0; i<npass; i++) {
+    prog->bpf[ja[i]].k = blocks - ja[i] - 1;
+  }
+
+  for(i=0; i<count; i++) {
+    if(rules[i].type == CANBUS_FILTER_BLOCK) {
+      canbus_filter_bpf_rule(prog, &rules[i]);
+    }
+  }
+  canbus_filter_stmt(prog, BPF_RET | BPF_K, CANBUS_FILTER_BPF_ACCEPT);
+}
+
+/**
+ * Compiles pass/block rules into the smallest CAN_RAW filter set that expresses
+ * them:
+ *
+ *   - pass rules only: the minimized pass set (any may match)
+ *   - block rules only: the minimized block set inverted with CAN_INV_FILTER
+ *     and joined with CAN_RAW_JOIN_FILTERS
+ *   - one pass rule plus blocks: the pass rule joined with the inverted blocks
+ *
+ * Blocks that can't intersect a pass rule are dropped, as are pass rules a
+ * block covers. Anything else (several pass rules with overlapping blocks,
+ * data byte rules, or CANBUS_FILTER_COMPILE_BPF) is compiled to a socket
+ * filter; can[] then holds the pass ID set as a cheap kernel prefilter.
+ */
+unsigned int canbus_filter_compile(struct canbus_filter *rules, unsigned int count, unsigned int flags, canbus_filter_program *prog) {
+
+  struct can_filter pass[CANBUS_FILTER_MAX], block[CANBUS_FILTER_MAX];
+  unsigned int npass = 0, nblock = 0, i, j;
+  bool data = false;
+
+  if(count > CANBUS_FILTER_MAX) {
+    syslog(LOG_ERR, "canbus_filter_compile: too many rules. count=%u, CANBUS_FILTER_MAX=%d", count, CANBUS_FILTER_MAX);
+    return 1;
+  }
+
+  for(i=0; i<count; i++) {
+    if(rules[i].type != CANBUS_FILTER_PASS && rules[i].type != CANBUS_FILTER_BLOCK) {
+      syslog(LOG_ERR, "canbus_filter_compile: invalid rule type %u", rules[i].type);
+      return 2;
+    }
+    if(rules[i].data_len > CAN_MAX_DLEN) {
+      syslog(LOG_ERR, "canbus_filter_compile: invalid data_len %u", rules[i].data_len);
+      return 3;
+    }
+    for(j=0; j<rules[i].data_len; j++) {
+      if(rules[i].data_mask[j]) data = true;
+    }
+    struct can_filter f;
+    f.can_mask = rules[i].can_mask & CANBUS_FILTER_ID_BITS;
+    f.can_id = rules[i].can_id & f.can_mask;
+    if(rules[i].type == CANBUS_FILTER_PASS) {
+      pass[npass++] = f;
+    }
+    else {
+      block[nblock++] = f;
+    }
+  }
+
+  bool passes = npass > 0;
+  npass = canbus_filter_minimize(pass, npass);
+  nblock = canbus_filter_minimize(block, nblock);
+
+  prog->can_count = 0;
+  prog->join = false;
+  prog->bpf_len = 0;
+
+  if(data || (flags & CANBUS_FILTER_COMPILE_BPF)) {
+    canbus_filter_bpf(rules, count, prog);
+    if(!passes) {
+      prog->can[prog->can_count].can_id = 0;
+      prog->can[prog->can_count++].can_mask = 0;
+    }
+    for(i=0; i<npass; i++) {
+      prog->can[prog->can_count++] = pass[i];
+    }
+    return 0;
+  }
+
+  if(passes) {
+    for(j=0; j<nblock; ) {
+      bool overlaps = false;
+      for(i=0; i<npass; i++) {
+        if(canbus_filter_overlaps(&pass[i], &block[j])) overlaps = true;
+      }
+      if(overlaps) j++;
+      else block[j] = block[--nblock];
+    }
+    for(i=0; i<npass; ) {
+      bool covered = false;
+      for(j=0; j<nblock; j++) {
+        if(canbus_filter_covers(&block[j], &pass[i])) covered = true;
+      }
+      if(covered) pass[i] = pass[--npass];
+      else i++;
+    }
+    if(npass == 0) {
+      return 0;  // every pass rule is blocked
+    }
+  }
+
+  if(nblock == 0) {
+    if(!passes) {
+      prog->can[0].can_id = 0;
+      prog->can[0].can_mask = 0;
+      prog->can_count = 1;
+      return 0;
+    }
+    memcpy(prog->can, pass, sizeof(struct can_filter) * npass);
+    prog->can_count = npass;
+    return 0;
+  }
+
+  if(npass > 1) {
+    canbus_filter_bpf(rules, count, prog);
+    memcpy(prog->can, pass, sizeof(struct can_filter) * npass);
+    prog->can_count = npass;
+    return 0;
+  }
+
+  if(npass == 1) {
+    prog->can[prog->can_count++] = pass[0];
+  }
+  for(i=0; i<nblock; i++) {
+    prog->can[prog->can_count].can_id = block[i].can_id | CAN_INV_FILTER;
+    prog->can[prog->can_count++].can_mask = block[i].can_mask;
+  }
+  prog->join = prog->can_count > 1;
+  return 0;
+}
+
+/**
+ * Installs a compiled program. CAN_RAW sockets get the filter set and, when
+ * needed, the socket filter; AF_PACKET capture only takes the socket filter.
+ */
+unsigned int canbus_filter_apply(canbus_client *canbus, canbus_filter_program *prog) {
+
+  int join = prog->join;
+  unsigned int i;
+
+  if(!canbus_isconnected(canbus)) {
+    syslog(LOG_ERR, "canbus_filter_apply: CAN socket not connected");
+    return 1;
+  }
+
+  if(canbus->capture == CANBUS_CAPTURE_BCM) {
+    syslog(LOG_ERR, "canbus_filter_apply: CAN_BCM sockets only receive registered IDs");
+    return 2;
+  }
+
+  if(canbus->capture == CANBUS_CAPTURE_SOCKET) {
+    for(i=0; i<prog->can_count; i++) {
+      syslog(LOG_DEBUG, "canbus_filter_apply: can_id=%x, can_mask=%x", prog->can[i].can_id, prog->can[i].can_mask);
+    }
+    if(setsockopt(canbus->socket, SOL_CAN_RAW, CAN_RAW_FILTER, prog->can, sizeof(struct can_filter) * prog->can_count) == -1) {
+      syslog(LOG_ERR, "canbus_filter_apply: unable to set CAN_RAW_FILTER: %s", strerror(errno));
+      return 3;
+    }
+    if(setsockopt(canbus->socket, SOL_CAN_RAW, CAN_RAW_JOIN_FILTERS, &join, sizeof(join)) == -1 && join) {
+      syslog(LOG_ERR, "canbus_filter_apply: unable to set CAN_RAW_JOIN_FILTERS: %s", strerror(errno));
+      return 4;
+    }
+  }
+  else if(prog->bpf_len == 0) {
+    syslog(LOG_ERR, "canbus_filter_apply: AF_PACKET capture requires CANBUS_FILTER_COMPILE_BPF");
+    return 5;
+  }
+
+  if(prog->bpf_len) {
+    struct sock_fprog fprog = { .len = prog->bpf_len, .filter = prog->bpf };
+    syslog(LOG_DEBUG, "canbus_filter_apply: attaching socket filter. len=%u", prog->bpf_len);
+    if(setsockopt(canbus->socket, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) == -1) {
+      syslog(LOG_ERR, "canbus_filter_apply: unable to attach socket filter: %s", strerror(errno));
+      return 6;
+    }
+  }
+  else {
+    setsockopt(canbus->socket, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0);
+  }
+
+  return 0;
+}
+
+/**
+ * Compiles and installs rules for canbus->capture. Kernels without
+ * CAN_RAW_JOIN_FILTERS get the socket filter instead. Returns the
+ * canbus_filter_compile error, or 10 + the canbus_filter_apply error.
+ */
+unsigned int canbus_filter_set(canbus_client *canbus, struct canbus_filter *rules, unsigned int count) {
+
+  canbus_filter_program *prog = malloc(sizeof(canbus_filter_program));
+  unsigned int flags = canbus->capture == CANBUS_CAPTURE_MMAP ? CANBUS_FILTER_COMPILE_BPF : 0;
+
+  unsigned int rc = canbus_filter_compile(rules, count, flags, prog);
+  if(rc == 0) {
+    rc = canbus_filter_apply(canbus, prog);
+    if(rc == 4 && canbus_filter_compile(rules, count, CANBUS_FILTER_COMPILE_BPF, prog) == 0) {
+      rc = canbus_filter_apply(canbus, prog);
+    }
+    if(rc != 0) rc += 10;
+  }
+
+  free(prog);
+  return rc;
+}
@@ -0,0 +1,69 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANBUSFILTER_H
+#define CANBUSFILTER_H
+
+#include <linux/filter.h>
+#include "canbus.h"
+
+#ifndef CAN_RAW_JOIN_FILTERS
+#define CAN_RAW_JOIN_FILTERS 6          // linux >= 4.1
+#endif
+
+#define CANBUS_FILTER_PASS        1     // same values as J2534 PASS_FILTER / BLOCK_FILTER
+#define CANBUS_FILTER_BLOCK       2
+
+#define CANBUS_FILTER_MAX         32    // rules per compile
+#define CANBUS_FILTER_BPF_MAX     1024  // socket filter instructions; a rule compiles to at most 30
+#define CANBUS_FILTER_BPF_ACCEPT  0xffff
+
+#define CANBUS_FILTER_COMPILE_BPF (1 << 0)  // express every rule in the socket filter (AF_PACKET capture)
+
+/**
+ * A pass or block rule. can_id / can_mask follow struct can_filter (include
+ * CAN_EFF_FLAG in the mask to match only 11 or only 29 bit IDs). data_len > 0
+ * additionally matches the first data_len payload bytes under data_mask; the
+ * kernel can't express that, so such rules are compiled to a socket filter.
+ */
+struct canbus_filter {
+  canid_t can_id;
+  canid_t can_mask;
+  uint8_t type;
+  uint8_t data_len;
+  uint8_t data[CAN_MAX_DLEN];
+  uint8_t data_mask[CAN_MAX_DLEN];
+};
+
+/**
+ * Output of canbus_filter_compile. A frame is received when it matches any
+ * pass rule (or there are none) and no block rule.
+ */
+typedef struct {
+  struct can_filter can[CANBUS_FILTER_MAX];
+  unsigned int can_count;             // 0 receives nothing
+  bool join;                          // CAN_RAW_JOIN_FILTERS: all of can[] must match
+  struct sock_filter bpf[CANBUS_FILTER_BPF_MAX];
+  unsigned int bpf_len;               // 0 when can[] alone expresses the rules
+} canbus_filter_program;
+
+unsigned int canbus_filter_compile(struct canbus_filter *rules, unsigned int count, unsigned int flags, canbus_filter_program *prog);
+unsigned int canbus_filter_apply(canbus_client *canbus, canbus_filter_program *prog);
+unsigned int canbus_filter_set(canbus_client *canbus, struct canbus_filter *rules, unsigned int count);
+
+#endif
@@ -0,0 +1,309 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "canbus_format.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CANBUS_FORMAT_X86
+#endif
+
+typedef char *(*canbus_hex_fn)(const uint8_t *data, size_t len, char *out);
+
+static const char canbus_hex_digits[16] = "0123456789abcdef";
+
+static const char canbus_hex_pairs[513] =
+  "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+  "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+  "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+  "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+  "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+  "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+  "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+  "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+static const char canbus_dec_pairs[201] =
+  "00010203040506070809101112131415161718192021222324"
+  "25262728293031323334353637383940414243444546474849"
+  "50515253545556575859606162636465666768697071727374"
+  "75767778798081828384858687888990919293949596979899";
+
+static canbus_hex_fn canbus_hex_impl = NULL;
+
+static char *canbus_hex_scalar(const uint8_t *data, size_t len, char *out) {
+  size_t i;
+  for(i=0; i<len; i++) {
+    out[0] = ' ';
+    memcpy(out + 1, &canbus_hex_pairs[data[i] * 2], 2);
+    out += 3;
+  }
+  return out;
+}
+
+#ifdef CANBUS_FORMAT_X86
+
+/**
+ * SSE2 has no byte shuffle, so nibbles are turned into digits arithmetically
+ * and interleaved into pairs; the spaces are put in while copying the pairs out.
+ */
+__attribute__((target("sse2")))
+static char *canbus_hex_sse2(const uint8_t *data, size_t len, char *out) {
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  const __m128i nine = _mm_set1_epi8(9);
+  const __m128i zero = _mm_set1_epi8('0');
+  const __m128i alpha = _mm_set1_epi8('a' - '0' - 10);
+  char pairs[32];
+  int i;
+  while(len >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)data);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+    __m128i lo = _mm_and_si128(v, nibble);
+    hi = _mm_add_epi8(_mm_add_epi8(hi, zero), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), alpha));
+    lo = _mm_add_epi8(_mm_add_epi8(lo, zero), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), alpha));
+    _mm_storeu_si128((__m128i *)pairs, _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)(pairs + 16), _mm_unpackhi_epi8(hi, lo));
+    for(i=0; i<16; i++) {
+      out[0] = ' ';
+      memcpy(out + 1, &pairs[i * 2], 2);
+      out += 3;
+    }
+    data += 16;
+    len -= 16;
+  }
+  return canbus_hex_scalar(data, len, out);
+}
+
+/**
+ * Shuffle masks spreading 16 high / low digits over 48 output bytes, one
+ * 16 byte chunk at a time; 0x80 leaves a zero for the space mask to fill.
+ */
+static const uint8_t canbus_hex_mask_hi[3][16] __attribute__((aligned(16))) = {
+  { 0x80, 0x00, 0x80, 0x80, 0x01, 0x80, 0x80, 0x02, 0x80, 0x80, 0x03, 0x80, 0x80, 0x04, 0x80, 0x80 },
+  { 0x05, 0x80, 0x80, 0x06, 0x80, 0x80, 0x07, 0x80, 0x80, 0x08, 0x80, 0x80, 0x09, 0x80, 0x80, 0x0a },
+  { 0x80, 0x80, 0x0b, 0x80, 0x80, 0x0c, 0x80, 0x80, 0x0d, 0x80, 0x80, 0x0e, 0x80, 0x80, 0x0f, 0x80 }
+};
+static const uint8_t canbus_hex_mask_lo[3][16] __attribute__((aligned(16))) = {
+  { 0x80, 0x80, 0x00, 0x80, 0x80, 0x01, 0x80, 0x80, 0x02, 0x80, 0x80, 0x03, 0x80, 0x80, 0x04, 0x80 },
+  { 0x80, 0x05, 0x80, 0x80, 0x06, 0x80, 0x80, 0x07, 0x80, 0x80, 0x08, 0x80, 0x80, 0x09, 0x80, 0x80 },
+  { 0x0a, 0x80, 0x80, 0x0b, 0x80, 0x80, 0x0c, 0x80, 0x80, 0x0d, 0x80, 0x80, 0x0e, 0x80, 0x80, 0x0f }
+};
+static const uint8_t canbus_hex_mask_sp[3][16] __attribute__((aligned(16))) = {
+  { 0x20, 0x00, 0x00, 0x20, 0x00, 0x00, 0x20, 0x00, 0x00, 0x20, 0x00, 0x00, 0x20, 0x00, 0x00, 0x20 },
+  { 0x00, 0x00, 0x20, 0x00, 0x00, 0x20, 0x00, 0x00, 0x20, 0x00, 0x00, 0x20, 0x00, 0x00, 0x20, 0x00 },
+  { 0x00, 0x20, 0x00, 0x00, 0x20, 0x00, 0x00, 0x20, 0x00, 0x00, 0x20, 0x00, 0x00, 0x20, 0x00, 0x00 }
+};
+
+/**
+ * 32 bytes per iteration: digits come from a 16 entry table lookup (vpshufb),
+ * then each 128 bit lane is spread into three 16 byte chunks of " xx" groups.
+ * Lane 0 yields output bytes 0..47 and lane 1 bytes 48..95, so the chunks are
+ * recombined across lanes before the stores.
+ */
+__attribute__((target("avx2")))
+static char *canbus_hex_avx2(const uint8_t *data, size_t len, char *out) {
+  const __m128i digits128 = _mm_loadu_si128((const __m128i *)canbus_hex_digits);
+  const __m256i digits = _mm256_broadcastsi128_si256(digits128);
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  __m256i hi_mask[3], lo_mask[3], sp_mask[3], o[3];
+  __m128i hi128, lo128, v128;
+  int c;
+
+  for(c=0; c<3; c++) {
+    hi_mask[c] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)canbus_hex_mask_hi[c]));
+    lo_mask[c] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)canbus_hex_mask_lo[c]));
+    sp_mask[c] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)canbus_hex_mask_sp[c]));
+  }
+
+  while(len >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)data);
+    __m256i hi = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+    __m256i lo = _mm256_shuffle_epi8(digits, _mm256_and_si256(v, nibble));
+    for(c=0; c<3; c++) {
+      o[c] = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(hi, hi_mask[c]),
+        _mm256_shuffle_epi8(lo, lo_mask[c])), sp_mask[c]);
+    }
+    _mm256_storeu_si256((__m256i *)out, _mm256_permute2x128_si256(o[0], o[1], 0x20));
+    _mm256_storeu_si256((__m256i *)(out + 32), _mm256_permute2x128_si256(o[2], o[0], 0x30));
+    _mm256_storeu_si256((__m256i *)(out + 64), _mm256_permute2x128_si256(o[1], o[2], 0x31));
+    data += 32;
+    out += 96;
+    len -= 32;
+  }
+
+  if(len >= 16) {
+    v128 = _mm_loadu_si128((const __m128i *)data);
+    hi128 = _mm_shuffle_epi8(digits128, _mm_and_si128(_mm_srli_epi16(v128, 4), _mm_set1_epi8(0x0f)));
+    lo128 = _mm_shuffle_epi8(digits128, _mm_and_si128(v128, _mm_set1_epi8(0x0f)));
+    for(c=0; c<3; c++) {
+      _mm_storeu_si128((__m128i *)(out + c * 16), _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(hi128, _mm256_castsi256_si128(hi_mask[c])),
+        _mm_shuffle_epi8(lo128, _mm256_castsi256_si128(lo_mask[c]))), _mm256_castsi256_si128(sp_mask[c])));
+    }
+    data += 16;
+    out += 48;
+    len -= 16;
+  }
+
+  return canbus_hex_scalar(data, len, out);
+}
+
+#endif
+
+/**
+ * Selects the kernel used by canbus_hex_encode. Kernels the CPU (or the
+ * architecture) does not support fall back to the next best one. Returns the
+ * kernel actually selected.
+ */
+int canbus_hex_kernel(int kernel) {
+#ifdef CANBUS_FORMAT_X86
+  __builtin_cpu_init();
+  if(kernel == CANBUS_HEX_AUTO || kernel == CANBUS_HEX_AVX2) {
+    if(__builtin_cpu_supports("avx2")) {
+      __atomic_store_n(&canbus_hex_impl, canbus_hex_avx2, __ATOMIC_RELAXED);
+      return CANBUS_HEX_AVX2;
+    }
+    kernel = CANBUS_HEX_SSE2;
+  }
+  if(kernel == CANBUS_HEX_SSE2 && __builtin_cpu_supports("sse2")) {
+    __atomic_store_n(&canbus_hex_impl, canbus_hex_sse2, __ATOMIC_RELAXED);
+    return CANBUS_HEX_SSE2;
+  }
+#endif
+  __atomic_store_n(&canbus_hex_impl, canbus_hex_scalar, __ATOMIC_RELAXED);
+  return CANBUS_HEX_SCALAR;
+}
+
+const char *canbus_hex_kernel_name(int kernel) {
+  switch(kernel) {
+    case CANBUS_HEX_SSE2: return "sse2";
+    case CANBUS_HEX_AVX2: return "avx2";
+    default: return "scalar";
+  }
+}
+
+/**
+ * Writes " xx" for each byte of data (3 * len bytes, no NUL) and returns the
+ * end of the output.
+ */
+char *canbus_hex_encode(const uint8_t *data, size_t len, char *out) {
+  canbus_hex_fn fn = __atomic_load_n(&canbus_hex_impl, __ATOMIC_RELAXED);
+  if(fn == NULL) {
+    canbus_hex_kernel(CANBUS_HEX_AUTO);
+    fn = __atomic_load_n(&canbus_hex_impl, __ATOMIC_RELAXED);
+  }
+  return fn(data, len, out);
+}
+
+static char *canbus_format_dec(char *p, uint64_t v) {
+  char tmp[20];
+  char *t = tmp + sizeof(tmp);
+  while(v >= 100) {
+    t -= 2;
+    memcpy(t, &canbus_dec_pairs[(v % 100) * 2], 2);
+    v /= 100;
+  }
+  if(v >= 10) {
+    t -= 2;
+    memcpy(t, &canbus_dec_pairs[v * 2], 2);
+  }
+  else {
+    *--t = '0' + v;
+  }
+  memcpy(p, t, tmp + sizeof(tmp) - t);
+  return p + (tmp + sizeof(tmp) - t);
+}
+
+// %0<min>x
+static char *canbus_format_hex(char *p, uint32_t v, int min) {
+  int n = min;
+  while(n < 8 && (v >> (n * 4)) != 0) n++;
+  while(n-- > 0) {
+    *p++ = canbus_hex_digits[(v >> (n * 4)) & 0x0f];
+  }
+  return p;
+}
+
+/**
+ * Formats one frame into buf (at least CANBUS_FRAME_TEXT_LEN bytes), NUL
+ * terminated. Returns the length of the line.
+ */
+size_t canbus_format_frame(canbus_frame *frame, char *buf) {
+  char *p = buf;
+  long sec = (long)frame->ts.tv_sec;
+  unsigned long usec = (unsigned long)frame->ts.tv_nsec / 1000;
+  uint8_t len = frame->frame.len;
+
+  *p++ = '(';
+  if(sec < 0) {
+    *p++ = '-';
+    p = canbus_format_dec(p, -(uint64_t)sec);
+  }
+  else {
+    p = canbus_format_dec(p, sec);
+  }
+  *p++ = '.';
+  if(usec > 999999) {
+    p = canbus_format_dec(p, usec);
+  }
+  else {
+    memcpy(p, &canbus_dec_pairs[(usec / 10000) * 2], 2);
+    memcpy(p + 2, &canbus_dec_pairs[(usec / 100 % 100) * 2], 2);
+    memcpy(p + 4, &canbus_dec_pairs[(usec % 100) * 2], 2);
+    p += 6;
+  }
+  memcpy(p, ") ", 2);
+  p = canbus_format_hex(p + 2, frame->frame.can_id, 4);
+  memcpy(p, ": ", 2);
+  p += 2;
+
+  if(frame->flags & CANBUS_FRAME_FD) {
+    memcpy(p, "FD:", 3);
+    p = canbus_format_hex(p + 3, frame->frame.flags, 1);
+    *p++ = ' ';
+  }
+  else if(frame->frame.can_id & CAN_RTR_FLAG) {
+    memcpy(p, "remote request", 15);
+    return p + 14 - buf;
+  }
+
+  *p++ = '[';
+  p = canbus_format_dec(p, len);
+  *p++ = ']';
+  if(len > CANFD_MAX_DLEN) len = CANFD_MAX_DLEN;
+  p = canbus_hex_encode(frame->frame.data, len, p);
+  *p = '\0';
+  return p - buf;
+}
+
+/**
+ * Formats frames as newline terminated lines into buf and NUL terminates it.
+ * Stops early when buf has no room for another CANBUS_FRAME_TEXT_LEN line;
+ * *nlines is set to the number of frames formatted, which is where the caller
+ * resumes. Returns the number of bytes written, excluding the NUL.
+ */
+size_t canbus_format_frames(canbus_frame *frames, unsigned int nframes, char *buf, size_t buf_len, unsigned int *nlines) {
+  size_t off = 0;
+  unsigned int i;
+  for(i=0; i<nframes && buf_len - off > CANBUS_FRAME_TEXT_LEN; i++) {
+    off += canbus_format_frame(&frames[i], buf + off);
+    buf[off++] = '\n';
+  }
+  if(off < buf_len) buf[off] = '\0';
+  *nlines = i;
+  return off;
+}
@@ -0,0 +1,46 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANBUSFORMAT_H
+#define CANBUSFORMAT_H
+
+#include "canbus.h"
+
+#define CANBUS_HEX_AUTO    -1  // best kernel the CPU supports
+#define CANBUS_HEX_SCALAR  0
+#define CANBUS_HEX_SSE2    1
+#define CANBUS_HEX_AVX2    2
+
+/**
+ * Text layout of canbus_framecpy, built with lookup tables instead of sprintf:
+ *
+ *   (ssssssssss.uuuuuu) iiii: [l] dd dd ..
+ *   (ssssssssss.uuuuuu) iiii: FD:f [l] dd dd ..
+ *   (ssssssssss.uuuuuu) iiii: remote request
+ *
+ * The payload goes through canbus_hex_encode, which picks a SIMD kernel at
+ * first use. The scalar kernel is used for payloads under 16 bytes and on
+ * anything that is not x86.
+ */
+int canbus_hex_kernel(int kernel);
+const char *canbus_hex_kernel_name(int kernel);
+char *canbus_hex_encode(const uint8_t *data, size_t len, char *out);
+size_t canbus_format_frame(canbus_frame *frame, char *buf);
+size_t canbus_format_frames(canbus_frame *frames, unsigned int nframes, char *buf, size_t buf_len, unsigned int *nlines);
+
+#endif
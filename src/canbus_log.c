@@ -16,65 +16,560 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include "canbus_log.h"
+#include "canbus_logreader.h"
+#include "canbus_format.h"
 
-static FILE *canbus_log;
+static const canbus_log_backend *canbus_log_backends[CANBUS_LOG_FORMATS] = {
+  &canbus_log_text_backend,
+  &canbus_log_binary_backend,
+  &canbus_log_candump_backend,
+  &canbus_log_asc_backend,
+  &canbus_log_pcapng_backend,
+  &canbus_log_compressed_backend
+};
 
-unsigned int canbus_log_open(canbus_logger *logger, const char *mode) {
+// most specific signature first; text is the fallback
+static const uint8_t canbus_log_detect_order[CANBUS_LOG_FORMATS] = {
+  CANBUS_LOG_FORMAT_BINARY,
+  CANBUS_LOG_FORMAT_COMPRESSED,
+  CANBUS_LOG_FORMAT_PCAPNG,
+  CANBUS_LOG_FORMAT_ASC,
+  CANBUS_LOG_FORMAT_CANDUMP,
+  CANBUS_LOG_FORMAT_TEXT
+};
+
+static const int8_t canbus_log_hexval[256] = {
+  ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+  ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+  ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16
+};  // digit value + 1, 0 = not a hex digit
+
+const canbus_log_backend *canbus_log_backend_get(uint8_t format) {
+  return format < CANBUS_LOG_FORMATS ? canbus_log_backends[format] : NULL;
+}
+
+const canbus_log_backend *canbus_log_backend_find(const char *name) {
+  int i;
+  for(i=0; i<CANBUS_LOG_FORMATS; i++) {
+    if(strcmp(canbus_log_backends[i]->name, name) == 0) {
+      return canbus_log_backends[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Parses up to max_digits hex digits. Returns the end of the number, or NULL
+ * when p does not start with one.
+ */
+const char *canbus_log_parse_hex(const char *p, unsigned int max_digits, uint32_t *value) {
+  uint32_t v = 0;
+  unsigned int n = 0;
+  int d;
+  while(n < max_digits && (d = canbus_log_hexval[(uint8_t)*p]) != 0) {
+    v = (v << 4) | (d - 1);
+    p++;
+    n++;
+  }
+  *value = v;
+  return n > 0 ? p : NULL;
+}
+
+/**
+ * Parses "seconds.fraction" (any number of fraction digits, nanoseconds kept).
+ */
+const char *canbus_log_parse_time(const char *p, struct timespec *ts) {
+  const char *start = p;
+  long sec = 0, nsec = 0, scale = 100000000;
+  while(*p >= '0' && *p <= '9') {
+    sec = sec * 10 + (*p++ - '0');
+  }
+  if(p == start) return NULL;
+  if(*p == '.') {
+    p++;
+    while(*p >= '0' && *p <= '9') {
+      nsec += (*p++ - '0') * scale;
+      scale /= 10;
+    }
+  }
+  ts->tv_sec = sec;
+  ts->tv_nsec = nsec;
+  return p;
+}
+
+/**
+ * Shared reader of the line based formats: parse returns 1 for a frame, 0 for
+ * a line that does not hold one (headers, comments, events).
+ */
+int canbus_log_read_lines(canbus_log *log, canbus_frame *frames, unsigned int max,
+    int (*parse)(canbus_log *log, char *line, canbus_frame *frame)) {
+  unsigned int n = 0;
+  while(n < max && getline(&log->line, &log->line_len, log->file) != -1) {
+    memset(&frames[n], 0, sizeof(canbus_frame));
+    if(parse(log, log->line, &frames[n]) == 1) {
+      n++;
+    }
+  }
+  return n;
+}
+
+/**
+ * Recovery of the line based formats: a line is whole once its newline is
+ * written, so only the last one needs looking at.
+ */
+size_t canbus_log_recover_lines(canbus_log *log, const uint8_t *buf, size_t len) {
+  const uint8_t *nl = memrchr(buf, '\n', len);
+  return nl != NULL ? nl - buf + 1 : 0;
+}
+
+/**
+ * Text: the canbus_framecpy layout.
+ */
+static bool canbus_log_text_detect(const char *head, size_t len) {
+  return true;
+}
+
+static size_t canbus_log_text_encode(canbus_log *log, canbus_frame *frame, char *buf) {
+  size_t len = canbus_format_frame(frame, buf);
+  buf[len++] = '\n';
+  return len;
+}
+
+static int canbus_log_text_parse(canbus_log *log, char *line, canbus_frame *frame) {
+  uint32_t v;
+  const char *p;
+  int i;
+
+  if(line[0] != '(' || (p = canbus_log_parse_time(line + 1, &frame->ts)) == NULL || p[0] != ')' || p[1] != ' ') return 0;
+  if((p = canbus_log_parse_hex(p + 2, 8, &frame->frame.can_id)) == NULL || p[0] != ':' || p[1] != ' ') return 0;
+  p += 2;
+
+  if(strncmp(p, "FD:", 3) == 0) {
+    if((p = canbus_log_parse_hex(p + 3, 2, &v)) == NULL || *p++ != ' ') return 0;
+    frame->flags = CANBUS_FRAME_FD;
+    frame->frame.flags = v;
+  }
+  else if(strncmp(p, "remote request", 14) == 0) {
+    return 1;
+  }
+
+  if(*p != '[') return 0;
+  for(v=0, p++; *p >= '0' && *p <= '9'; p++) {
+    v = v * 10 + (*p - '0');
+  }
+  if(*p++ != ']' || v > CANFD_MAX_DLEN) return 0;
+  frame->frame.len = v;
+  for(i=0; i<frame->frame.len; i++) {
+    if(*p++ != ' ' || (p = canbus_log_parse_hex(p, 2, &v)) == NULL) return 0;
+    frame->frame.data[i] = v;
+  }
+  return 1;
+}
+
+static int canbus_log_text_read(canbus_log *log, canbus_frame *frames, unsigned int max) {
+  return canbus_log_read_lines(log, frames, max, canbus_log_text_parse);
+}
+
+const canbus_log_backend canbus_log_text_backend = {
+  .format = CANBUS_LOG_FORMAT_TEXT,
+  .name = "text",
+  .ext = ".log",
+  .errors = false,
+  .record_max = CANBUS_LOG_RECORD_MAX,
+  .detect = canbus_log_text_detect,
+  .encode = canbus_log_text_encode,
+  .read = canbus_log_text_read,
+  .parse = canbus_log_text_parse,
+  .recover = canbus_log_recover_lines
+};
+
+/**
+ * Binary: canbus_binlog records, read here through stdio so replay streams
+ * like the other formats. canbus_binlog_open maps a whole file instead.
+ */
+static bool canbus_log_binary_detect(const char *head, size_t len) {
+  return len >= CANBUS_BINLOG_MAGIC_LEN && memcmp(head, CANBUS_BINLOG_MAGIC, CANBUS_BINLOG_MAGIC_LEN) == 0;
+}
+
+static unsigned int canbus_log_binary_begin(canbus_log *log) {
+  log->record_len = canbus_binlog_record_len(log->fd);
+  return canbus_binlog_write_header(log->file, log->iface, log->fd);
+}
+
+static size_t canbus_log_binary_encode(canbus_log *log, canbus_frame *frame, char *buf) {
+  canbus_binlog_encode(frame, (uint8_t *)buf, log->record_len);
+  return log->record_len;
+}
+
+static unsigned int canbus_log_binary_load(canbus_log *log) {
+  canbus_binlog_header header;
+  char buf[sizeof(canbus_binlog_header)];
+  unsigned int rc;
+
+  if(fread(buf, sizeof(buf), 1, log->file) != 1) {
+    return EINVAL;
+  }
+  if((rc = canbus_binlog_parse_header(buf, sizeof(buf), &header)) != 0) {
+    return rc;
+  }
+  if(header.record_len > CANBUS_LOG_RECORD_MAX || fseek(log->file, header.header_len, SEEK_SET) != 0) {
+    return EINVAL;
+  }
+  log->record_len = header.record_len;
+  log->fd = (header.flags & CANBUS_BINLOG_FD) != 0;
+  log->start.tv_sec = header.start_sec;
+  log->start.tv_nsec = header.start_nsec;
+  memcpy(log->iface, header.iface, IFNAMSIZ);
+  return 0;
+}
+
+static int canbus_log_binary_read(canbus_log *log, canbus_frame *frames, unsigned int max) {
+  char buf[CANBUS_BATCH_SIZE * CANBUS_LOG_RECORD_MAX];
+  unsigned int i, n;
+  if(max > CANBUS_BATCH_SIZE) max = CANBUS_BATCH_SIZE;
+  n = fread(buf, log->record_len, max, log->file);
+  for(i=0; i<n; i++) {
+    canbus_binlog_decode((uint8_t *)buf + i * log->record_len, log->record_len, &frames[i]);
+  }
+  return n;
+}
+
+static size_t canbus_log_binary_record(canbus_log *log, const uint8_t *buf, size_t len) {
+  return len >= log->record_len ? log->record_len : 0;
+}
+
+static int canbus_log_binary_decode(canbus_log *log, const uint8_t *buf, size_t len, canbus_frame *frames) {
+  canbus_binlog_decode(buf, log->record_len, frames);
+  return 1;
+}
+
+/**
+ * Records have no checksum; whole ones are kept, except for zeros a crash can
+ * leave where the file grew before its data reached the disk. No frame
+ * encodes to all zeros, the timestamp alone rules it out.
+ */
+static size_t canbus_log_binary_recover(canbus_log *log, const uint8_t *buf, size_t len) {
+  size_t i;
+  len -= len % log->record_len;
+  while(len > 0) {
+    for(i=len - log->record_len; i<len && buf[i] == 0; i++);
+    if(i < len) break;
+    len -= log->record_len;
+  }
+  return len;
+}
+
+const canbus_log_backend canbus_log_binary_backend = {
+  .format = CANBUS_LOG_FORMAT_BINARY,
+  .name = "binary",
+  .ext = CANBUS_BINLOG_EXT,
+  .errors = true,
+  .record_max = CANBUS_LOG_RECORD_MAX,
+  .detect = canbus_log_binary_detect,
+  .begin = canbus_log_binary_begin,
+  .encode = canbus_log_binary_encode,
+  .load = canbus_log_binary_load,
+  .read = canbus_log_binary_read,
+  .record = canbus_log_binary_record,
+  .decode = canbus_log_binary_decode,
+  .recover = canbus_log_binary_recover
+};
+
+static void canbus_log_reset(canbus_log *log, const char *filename) {
+  log->file = NULL;
+  log->backend = NULL;
+  log->writing = false;
+  log->iface[0] = '\0';
+  log->fd = false;
+  log->record_len = 0;
+  log->line = NULL;
+  log->line_len = 0;
+  log->frames = 0;
+  log->segments = NULL;
+  log->index = NULL;
+  memset(&log->asc, 0, sizeof(log->asc));
+  memset(&log->pcapng, 0, sizeof(log->pcapng));
+  memset(&log->block, 0, sizeof(log->block));
+  clock_gettime(CLOCK_REALTIME, &log->start);
+  if(filename != log->filename) {
+    strncpy(log->filename, filename, CANBUS_LOG_FILENAME_LEN - 1);
+    log->filename[CANBUS_LOG_FILENAME_LEN - 1] = '\0';
+  }
+}
+
+/**
+ * Opens filename ("-" for stdout) for writing in the given format and writes
+ * its header.
+ */
+unsigned int canbus_log_create(canbus_log *log, const char *filename, uint8_t format, const char *iface, bool fd) {
+  unsigned int rc;
+
+  canbus_log_reset(log, filename);
+  log->backend = canbus_log_backend_get(format);
+  if(log->backend == NULL) {
+    syslog(LOG_ERR, "canbus_log_create: unknown format %d", format);
+    return EINVAL;
+  }
+
+  log->file = strcmp(filename, "-") == 0 ? stdout : fopen(filename, "w");
+  if(log->file == NULL) {
+    syslog(LOG_ERR, "canbus_log_create: Unable to open %s. error=%s", filename, strerror(errno));
+    return errno;
+  }
+  setvbuf(log->file, NULL, _IOFBF, CANBUS_LOG_BUFFER_LEN);
+
+  log->writing = true;
+  log->fd = fd;
+  if(iface != NULL) {
+    strncpy(log->iface, iface, IFNAMSIZ - 1);
+    log->iface[IFNAMSIZ - 1] = '\0';
+  }
+
+  if(log->backend->begin != NULL && (rc = log->backend->begin(log)) != 0) {
+    canbus_log_close(log);
+    return rc;
+  }
+  return 0;
+}
+
+/**
+ * Opens an existing log for reading; the format is detected from its first
+ * bytes.
+ */
+unsigned int canbus_log_load(canbus_log *log, const char *filename) {
+  char head[CANBUS_LOG_HEAD_LEN];
+  size_t len;
+  unsigned int rc;
+  int i;
+
+  canbus_log_reset(log, filename);
+  log->file = fopen(filename, "r");
+  if(log->file == NULL) {
+    syslog(LOG_ERR, "canbus_log_load: Unable to open %s. error=%s", filename, strerror(errno));
+    return errno;
+  }
+
+  len = fread(head, 1, sizeof(head), log->file);
+  rewind(log->file);
+  for(i=0; i<CANBUS_LOG_FORMATS; i++) {
+    const canbus_log_backend *backend = canbus_log_backends[canbus_log_detect_order[i]];
+    if(backend->detect(head, len)) {
+      log->backend = backend;
+      break;
+    }
+  }
+
+  if(log->backend->load != NULL && (rc = log->backend->load(log)) != 0) {
+    syslog(LOG_ERR, "canbus_log_load: %s is not a valid %s log", filename, log->backend->name);
+    canbus_log_close(log);
+    return rc;
+  }
+  // a log without an index reads the same, only slower to filter
+  canbus_log_index_load(log);
+  syslog(LOG_DEBUG, "canbus_log_load: filename=%s, format=%s, indexed=%d", filename, log->backend->name, log->index != NULL);
+  return 0;
+}
+
+/**
+ * Returns the number of frames parsed into frames, 0 at the end of the log.
+ */
+int canbus_log_read_frames(canbus_log *log, canbus_frame *frames, unsigned int max) {
+  return log->backend->read(log, frames, max);
+}
+
+/**
+ * The interface name is only added to the filename when the logger records more
+ * than one interface, so single interface logs keep their historical names.
+ * With a segment limit set, that name becomes the session the numbered
+ * segments and their manifest are named after. Every file gets an index.
+ */
+unsigned int canbus_log_open(canbus_log *log, canbus_logger *logger, const char *iface, const char *mode) {
+
+  const canbus_log_backend *backend = canbus_log_backend_get(logger->log_format);
+  if(backend == NULL) {
+    backend = &canbus_log_text_backend;
+  }
 
   char datestamp[100];
   time_t now = time(0);
   struct tm tm = *gmtime(&now);
   strftime(datestamp, sizeof datestamp, "ecutuned_%m%d%Y_%H%M%S_%Z", &tm);
 
-  char filename[360];
+  char *filename = log->filename;
+  size_t len = sizeof(log->filename);
+  filename[0] = '\0';
+
   if(logger->logdir != NULL) {
-    strcpy(filename, logger->logdir);
-    if(filename[strlen(filename)] != '/') {
-      strcat(filename, "/");
+    strncat(filename, logger->logdir, len - 1);
+    if(filename[0] != '\0' && filename[strlen(filename) - 1] != '/') {
+      strncat(filename, "/", len - strlen(filename) - 1);
     }
   }
 
+  bool multi = iface != NULL && logger->canbus_count > 1;
+
   if(logger->logfile == NULL) {
-    strcat(filename, datestamp);
-    strcat(filename, ".log");
+    strncat(filename, datestamp, len - strlen(filename) - 1);
+    if(multi) {
+      strncat(filename, "_", len - strlen(filename) - 1);
+      strncat(filename, iface, len - strlen(filename) - 1);
+    }
+    strncat(filename, backend->ext, len - strlen(filename) - 1);
   }
   else {
-    strcat(filename, logger->logfile);
+    strncat(filename, logger->logfile, len - strlen(filename) - 1);
+    if(multi) {
+      strncat(filename, ".", len - strlen(filename) - 1);
+      strncat(filename, iface, len - strlen(filename) - 1);
+    }
   }
 
   syslog(LOG_DEBUG, "canbus_log_open: filename=%s", filename);
-  canbus_log = fopen(filename, mode);
-  if(canbus_log == NULL) {
-    syslog(LOG_ERR, "canbus_log_open: Unable to open %s. error=%s", filename, strerror(errno));
-    return errno;
+
+  if(mode[0] != 'w') {
+    return canbus_log_load(log, filename);
   }
-  return 0;
+
+  bool fd = false;
+  int i;
+  for(i=0; i<logger->canbus_count; i++) {
+    if(iface != NULL && strcmp(logger->canbus[i]->iface, iface) == 0) {
+      fd = canbus_isfd(logger->canbus[i]);
+    }
+  }
+  unsigned int rc;
+  if(logger->segment_bytes > 0 || logger->segment_ms > 0) {
+    rc = canbus_log_create_segmented(log, filename, backend->format, iface, fd, logger->segment_bytes, logger->segment_ms);
+  }
+  else {
+    rc = canbus_log_create(log, filename, backend->format, iface, fd);
+  }
+  if(rc == 0) {
+    canbus_log_index_create(log);
+  }
+  return rc;
+}
+
+typedef struct {
+  canbus_logger *logger;
+  canbus_logreader *reader;
+} canbus_log_replay;
+
+static void canbus_log_replay_onframes(canbus_frame *frames, unsigned int nframes, unsigned int worker, void *arg) {
+  canbus_log_replay *replay = (canbus_log_replay *)arg;
+  if(!replay->logger->isrunning) {
+    canbus_logreader_stop(replay->reader);
+    return;
+  }
+  replay->logger->onreplay(frames, nframes);
 }
 
-unsigned int canbus_log_read(canbus_logger *logger) {
-  char * line = NULL;
-  size_t len = 0;
-  ssize_t read;
-  while ((read = getline(&line, &len, canbus_log)) != -1) {
-    syslog(LOG_DEBUG, "canbus_log_read: len=%zu, line=%s", read, line);
-    logger->onread(line);
+/**
+ * Replays any format to logger->onreplay in file order, parsed across all
+ * cores by canbus_logreader. Logs that can not be mapped are read a batch at
+ * a time instead.
+ */
+unsigned int canbus_log_read(canbus_log *log, canbus_logger *logger) {
+  canbus_frame frames[CANBUS_BATCH_SIZE];
+  canbus_logreader reader;
+  canbus_log_replay replay = { logger, &reader };
+  int n;
+
+  if(canbus_logreader_open(&reader, log, 0, 0) == 0) {
+    canbus_logreader_run(&reader, canbus_log_replay_onframes, &replay);
+    canbus_logreader_close(&reader);
+    return 0;
+  }
+  while(logger->isrunning && (n = canbus_log_read_frames(log, frames, CANBUS_BATCH_SIZE)) > 0) {
+    logger->onreplay(frames, n);
   }
   return 0;
 }
 
-unsigned canbus_log_write(char *data) {
-  if(strlen(data) > 255) {
-    syslog(LOG_ERR, "canbus_log_write: data must not be larger than 255 chars");
-    return 1;
+unsigned canbus_log_write(canbus_log *log, canbus_frame *frame) {
+  return canbus_log_write_frames(log, frame, 1) == 0 ? 0 : EOF;
+}
+
+/**
+ * Encodes a batch into one buffer and hands it to stdio with a single fwrite.
+ * Formats without an error frame encoding leave them out; they are decoded
+ * into canbus->stats by the reactor. Returns the number of frames that could
+ * not be written.
+ */
+unsigned int canbus_log_write_frames(canbus_log *log, canbus_frame *frames, unsigned int nframes) {
+  char buf[CANBUS_BATCH_SIZE * CANBUS_LOG_RECORD_MAX];
+  unsigned int i, n = 0, dropped = 0;
+  size_t len = 0, rec;
+  off_t offset = 0;
+
+  // a segment that failed to open drops everything until the log is closed
+  if(log->file == NULL) {
+    return nframes;
+  }
+  // segments roll over between batches
+  if(log->segments != NULL && canbus_log_segment_due(log, ftello(log->file)) && canbus_log_rotate(log) != 0) {
+    return nframes;
+  }
+  if(log->index != NULL) {
+    offset = ftello(log->file);
+  }
+
+  for(i=0; i<nframes; i++) {
+    if((frames[i].frame.can_id & CAN_ERR_FLAG) && !log->backend->errors) {
+      continue;
+    }
+    rec = log->backend->encode(log, &frames[i], buf + len);
+    if(log->index != NULL) {
+      canbus_log_index_frame(log, &frames[i], offset + len, rec);
+    }
+    len += rec;
+    if(log->frames++ == 0) {
+      log->first = frames[i].ts;
+    }
+    log->last = frames[i].ts;
+    n++;
+    if(sizeof(buf) - len < log->backend->record_max) {
+      if(fwrite(buf, 1, len, log->file) != len) {
+        dropped += n;
+      }
+      offset += len;
+      len = 0;
+      n = 0;
+    }
+  }
+  if(len > 0 && fwrite(buf, 1, len, log->file) != len) {
+    dropped += n;
+  }
+  DLOG_DEBUG("canbus_log_write_frames: frames=%u, dropped=%u", nframes, dropped);
+  return dropped;
+}
+
+/**
+ * Closes the file but keeps the segment state, so canbus_log_rotate can open
+ * the next one.
+ */
+void canbus_log_close_file(canbus_log *log) {
+  if(log->file != NULL) {
+    if(log->writing && log->backend->end != NULL) {
+      log->backend->end(log);
+    }
+    if(log->segments != NULL) {
+      canbus_log_segment_closed(log);
+    }
+    canbus_log_index_close(log);
+    if(log->backend->close != NULL) {
+      log->backend->close(log);
+    }
+    fclose(log->file);
+    log->file = NULL;
+    free(log->line);
+    log->line = NULL;
   }
-  char d[257];
-  strncpy(d, data, strlen(data)+1);
-  syslog(LOG_DEBUG, "canbus_log_write: %s", d);
-  strcat(d, "\n");
-  return fprintf(canbus_log, d);
 }
 
-void canbus_log_close() {
-  fclose(canbus_log);
+void canbus_log_close(canbus_log *log) {
+  canbus_log_close_file(log);
+  canbus_log_segments_free(log);
 }
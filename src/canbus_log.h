@@ -23,10 +23,221 @@
 #include <syslog.h>
 #include <time.h>
 #include "canbus_logger.h"
+#include "canbus_binlog.h"
+#include "canbus_blocklog.h"
 
-unsigned int canbus_log_open(canbus_logger *logger, const char *mode);
-unsigned int canbus_log_write(char *data);
-unsigned int canbus_log_read(canbus_logger *logger);
-void canbus_log_close();
+#define CANBUS_LOG_FILENAME_LEN  360
+#define CANBUS_LOG_BUFFER_LEN    65536   // stdio buffer of every writer; flash likes large writes
+#define CANBUS_LOG_RECORD_MAX    640     // largest encoding of one frame in any format (ASC FD line + header)
+#define CANBUS_LOG_RECORD_FRAMES CANBUS_BLOCKLOG_FRAMES  // most frames a backend decodes from one record
+#define CANBUS_LOG_HEAD_LEN      64      // bytes read to detect the format of an existing log
+#define CANBUS_LOG_PCAPNG_IFACES 8       // interfaces a pcapng reader keeps timestamp resolutions for
+#define CANBUS_LOG_MANIFEST_EXT  ".manifest"
+#define CANBUS_LOG_JOURNAL       ".ecutuned_open"  // logs a file logger has open, kept in its logdir
+#define CANBUS_LOG_INDEX_EXT     ".idx"      // appended to the log filename
+#define CANBUS_LOG_INDEX_MAGIC   "ECUCANIX"
+#define CANBUS_LOG_INDEX_VERSION 1
+#define CANBUS_LOG_INDEX_FRAMES  4096      // frames an index entry covers, at least
+#define CANBUS_LOG_INDEX_ID_BITS 4096      // 11 bit ids map one to one into the low half, 29 bit ids hash into the high half
 
- #endif
+typedef struct canbus_log canbus_log;
+
+/**
+ * A log format. Writers encode one frame at a time into the shared batch
+ * buffer of canbus_log_write_frames; readers fill frames from log->file and
+ * return how many they parsed, 0 at the end of the file. Block formats may
+ * hold frames back and emit several at once, up to record_max bytes.
+ *
+ * canbus_logreader parses a mapped log instead: line formats through parse,
+ * the others by walking records with record and decoding each with decode.
+ * canbus_log_recover hands recover the mapped data of a log that was not
+ * closed, after its header, and cuts off whatever follows the last record.
+ * Only the compressed format checksums its records (CRC32C per block). Text,
+ * candump, ASC, pcapng and binary recovery goes by record boundaries alone,
+ * so a record damaged in place is not detected.
+ */
+typedef struct {
+  uint8_t format;           // CANBUS_LOG_FORMAT_*
+  const char *name;
+  const char *ext;          // default filename extension
+  bool errors;              // error frames are written rather than left to canbus->stats
+  size_t record_max;        // most bytes a single encode or flush returns
+  bool (*detect)(const char *head, size_t len);
+  unsigned int (*begin)(canbus_log *log);     // header, once the file is open for writing
+  unsigned int (*end)(canbus_log *log);       // trailer before the file is closed, may be NULL
+  size_t (*encode)(canbus_log *log, canbus_frame *frame, char *buf);
+  size_t (*flush)(canbus_log *log, char *buf);  // frames encode held back, may be NULL
+  unsigned int (*held)(canbus_log *log);      // number of frames encode holds back, NULL if it never does
+  unsigned int (*load)(canbus_log *log);      // header, once the file is open for reading
+  int (*read)(canbus_log *log, canbus_frame *frames, unsigned int max);
+  void (*seek)(canbus_log *log);              // drops read state after the file moved, may be NULL
+  int (*parse)(canbus_log *log, char *line, canbus_frame *frame);  // line formats: 1 for a frame, 0 for other lines
+  size_t (*record)(canbus_log *log, const uint8_t *buf, size_t len);  // length of the record at buf, 0 if torn
+  int (*decode)(canbus_log *log, const uint8_t *buf, size_t len, canbus_frame *frames);  // one record, -1 if corrupt
+  size_t (*recover)(canbus_log *log, const uint8_t *buf, size_t len);  // bytes of buf up to the end of its last whole record
+  void (*close)(canbus_log *log);             // frees per file state, may be NULL
+} canbus_log_backend;
+
+typedef struct {
+  bool relative;            // timestamps are deltas from the previous event
+  bool decimal;             // "base dec": ids and data in decimal
+  struct timespec last;
+} canbus_log_asc_state;
+
+typedef struct {
+  canbus_frame *frames;     // block being filled (writing) or decoded (reading)
+  unsigned int count;
+  unsigned int pos;         // next decoded frame to return
+  size_t raw_len;           // delta encoded size of the frames held back
+  uint8_t *buf;             // one compressed block, reading
+} canbus_log_block_state;
+
+typedef struct {
+  bool swap;                // section written with the other byte order
+  unsigned int ifaces;
+  uint64_t units[CANBUS_LOG_PCAPNG_IFACES];   // timestamp units per second, 0 = not a SocketCAN interface
+} canbus_log_pcapng_state;
+
+/**
+ * Rollover state of a segmented log. Segments are named after the session
+ * filename with a sequence number before its extension, and each one is
+ * appended to a manifest next to them once it is closed.
+ */
+typedef struct {
+  uint64_t max_bytes;       // 0 = no size limit
+  unsigned int max_ms;      // 0 = no time limit
+  unsigned int seq;         // of the open segment, from 1
+  char session[CANBUS_LOG_FILENAME_LEN];
+  FILE *manifest;
+  off_t prealloc;           // bytes reserved for the open segment
+  struct timespec opened;   // CLOCK_MONOTONIC_COARSE
+} canbus_log_segments;
+
+/**
+ * Sidecar index of a log, all fields little endian:
+ *
+ *   canbus_log_index_header
+ *   canbus_log_index_entry                     repeated
+ *
+ * Each entry covers a run of at least CANBUS_LOG_INDEX_FRAMES frames that a
+ * reader can start decoding at offset, with their time range and a bitmap of
+ * their can_ids. Entries are appended as the log is written, so the index of
+ * a log that was not closed stops short; readers scan what follows the last
+ * entry.
+ */
+typedef struct __attribute__((packed)) {
+  char magic[CANBUS_BINLOG_MAGIC_LEN];
+  uint16_t version;
+  uint16_t entry_len;
+  uint32_t reserved;
+} canbus_log_index_header;
+
+typedef struct __attribute__((packed)) {
+  uint64_t offset;          // of the first frame in the log
+  uint64_t len;             // bytes up to the next entry
+  uint64_t first_ts;        // ns since the epoch, earliest frame
+  uint64_t last_ts;         // latest frame
+  uint32_t frames;
+  uint32_t reserved;
+  uint8_t ids[CANBUS_LOG_INDEX_ID_BITS / 8];
+} canbus_log_index_entry;
+
+/**
+ * The index a log is writing, or the one loaded next to a log being read.
+ */
+typedef struct {
+  FILE *file;                     // writing
+  canbus_log_index_entry entry;   // being filled, host byte order
+  int fd;                         // reading
+  uint8_t *map;
+  size_t size;
+  const canbus_log_index_entry *entries;
+  unsigned int count;
+  unsigned int next;              // entry canbus_log_read_filtered looks at next
+  uint64_t left;                  // frames left in the entry being read
+  off_t tail;                     // start of the frames no entry covers
+  bool at_tail;
+} canbus_log_index;
+
+/**
+ * Frames canbus_log_read_filtered returns. Zero times leave that end of the
+ * window open; ids are can_id values with CAN_EFF_FLAG for 29 bit ids.
+ */
+typedef struct {
+  struct timespec from;
+  struct timespec to;
+  const uint32_t *ids;
+  unsigned int nids;        // 0 = every id
+} canbus_log_filter;
+
+/**
+ * One open log file. Loggers with several interfaces keep one per interface.
+ */
+typedef struct canbus_log {
+  FILE *file;
+  char filename[CANBUS_LOG_FILENAME_LEN];
+  const canbus_log_backend *backend;
+  bool writing;
+  char iface[IFNAMSIZ];
+  bool fd;                  // the interface negotiated CAN FD
+  struct timespec start;    // CLOCK_REALTIME when the log was started, or from its header
+  uint16_t record_len;      // CANBUS_LOG_FORMAT_BINARY record size
+  char *line;               // getline buffer of the line based readers
+  size_t line_len;
+  uint64_t frames;          // written to this file
+  struct timespec first;    // timestamps of the first and last frame written
+  struct timespec last;
+  canbus_log_segments *segments;  // NULL unless the log rolls over
+  canbus_log_index *index;        // NULL without a sidecar index
+  union {
+    canbus_log_asc_state asc;
+    canbus_log_pcapng_state pcapng;
+    canbus_log_block_state block;
+  };
+} canbus_log;
+
+extern const canbus_log_backend canbus_log_text_backend;
+extern const canbus_log_backend canbus_log_binary_backend;
+extern const canbus_log_backend canbus_log_candump_backend;
+extern const canbus_log_backend canbus_log_asc_backend;
+extern const canbus_log_backend canbus_log_pcapng_backend;
+extern const canbus_log_backend canbus_log_compressed_backend;
+
+const canbus_log_backend *canbus_log_backend_get(uint8_t format);
+const canbus_log_backend *canbus_log_backend_find(const char *name);
+unsigned int canbus_log_create(canbus_log *log, const char *filename, uint8_t format, const char *iface, bool fd);
+unsigned int canbus_log_load(canbus_log *log, const char *filename);
+int canbus_log_read_frames(canbus_log *log, canbus_frame *frames, unsigned int max);
+const char *canbus_log_parse_hex(const char *p, unsigned int max_digits, uint32_t *value);
+const char *canbus_log_parse_time(const char *p, struct timespec *ts);
+int canbus_log_read_lines(canbus_log *log, canbus_frame *frames, unsigned int max, int (*parse)(canbus_log *log, char *line, canbus_frame *frame));
+size_t canbus_log_recover_lines(canbus_log *log, const uint8_t *buf, size_t len);
+unsigned int canbus_log_open(canbus_log *log, canbus_logger *logger, const char *iface, const char *mode);
+unsigned int canbus_log_write(canbus_log *log, canbus_frame *frame);
+unsigned int canbus_log_write_frames(canbus_log *log, canbus_frame *frames, unsigned int nframes);
+unsigned int canbus_log_read(canbus_log *log, canbus_logger *logger);
+void canbus_log_close(canbus_log *log);
+void canbus_log_close_file(canbus_log *log);
+unsigned int canbus_log_recover(const char *filename, off_t *dropped);
+unsigned int canbus_log_recover_dir(const char *dir);
+unsigned int canbus_log_journal_add(const char *dir, canbus_log *log);
+void canbus_log_journal_clear(const char *dir);
+
+unsigned int canbus_log_create_segmented(canbus_log *log, const char *session, uint8_t format, const char *iface, bool fd, uint64_t max_bytes, unsigned int max_ms);
+bool canbus_log_segment_due(canbus_log *log, off_t size);
+unsigned int canbus_log_rotate(canbus_log *log);
+void canbus_log_segment_closed(canbus_log *log);
+void canbus_log_segments_free(canbus_log *log);
+void canbus_log_segment_name(const char *session, uint8_t format, unsigned int seq, char *filename, size_t len);
+void canbus_log_segment_manifest(const char *session, uint8_t format, char *filename, size_t len);
+
+unsigned int canbus_log_index_create(canbus_log *log);
+void canbus_log_index_frame(canbus_log *log, canbus_frame *frame, off_t offset, size_t len);
+unsigned int canbus_log_index_load(canbus_log *log);
+void canbus_log_index_close(canbus_log *log);
+bool canbus_log_index_end(canbus_log *log, struct timespec *ts);
+bool canbus_log_index_match(const canbus_log_index_entry *entry, canbus_log_filter *filter);
+bool canbus_log_filter_match(canbus_log_filter *filter, canbus_frame *frame);
+int canbus_log_read_filtered(canbus_log *log, canbus_log_filter *filter, canbus_frame *frames, unsigned int max);
+
+#endif
@@ -0,0 +1,306 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Vector ASCII log (CANalyzer / CANoe), as written with "base hex" and
+ * absolute timestamps relative to the date in the header:
+ *
+ *   date Thu Nov 24 01:00:00.000 pm 2016
+ *   base hex  timestamps absolute
+ *   internal events logged
+ *   Begin Triggerblock Thu Nov 24 01:00:00.000 pm 2016
+ *      0.000000 Start of measurement
+ *      0.001234 1  123             Rx   d 8 11 22 33 44 55 66 77 88
+ *      0.001300 1  18DAF110x       Rx   r 0
+ *      0.001400 CANFD   1 Rx        123                                   1 0 f 64 11 22 ..
+ *   End TriggerBlock
+ *
+ * The reader also accepts "base dec" and relative timestamps. Times are UTC,
+ * like the log filenames.
+ */
+
+#define _GNU_SOURCE
+#include "canbus_log.h"
+
+#define CANBUS_LOG_ASC_CHANNEL    1
+#define CANBUS_LOG_ASC_FLAG_EDL   0x1000
+#define CANBUS_LOG_ASC_FLAG_BRS   0x2000
+#define CANBUS_LOG_ASC_FLAG_ESI   0x4000
+#define CANBUS_LOG_ASC_DELIM      " \t\r\n"
+
+static const char canbus_log_asc_digits[16] = "0123456789ABCDEF";
+
+static uint8_t canbus_log_asc_len2dlc(uint8_t len) {
+  if(len <= 8) return len;
+  if(len <= 12) return 9;
+  if(len <= 16) return 10;
+  if(len <= 20) return 11;
+  if(len <= 24) return 12;
+  if(len <= 32) return 13;
+  if(len <= 48) return 14;
+  return 15;
+}
+
+static size_t canbus_log_asc_date(struct timespec *ts, char *buf, size_t len) {
+  struct tm tm;
+  char hms[32];
+  gmtime_r(&ts->tv_sec, &tm);
+  strftime(hms, sizeof(hms), "%a %b %d %I:%M:%S", &tm);
+  return snprintf(buf, len, "%s.%03ld %s %d", hms, ts->tv_nsec / 1000000, tm.tm_hour < 12 ? "am" : "pm", tm.tm_year + 1900);
+}
+
+static bool canbus_log_asc_detect(const char *head, size_t len) {
+  return (len >= 5 && strncmp(head, "date ", 5) == 0) || (len >= 5 && strncmp(head, "base ", 5) == 0);
+}
+
+/**
+ * The header is written with the first frame (or at close for an empty log),
+ * so the measurement start is never later than the first timestamp.
+ */
+static size_t canbus_log_asc_header(canbus_log *log, char *buf) {
+  char date[64];
+  log->start.tv_nsec -= log->start.tv_nsec % 1000000;   // the date line has ms resolution
+  canbus_log_asc_date(&log->start, date, sizeof(date));
+  log->asc.last = log->start;
+  return sprintf(buf,
+    "date %s\n"
+    "base hex  timestamps absolute\n"
+    "internal events logged\n"
+    "Begin Triggerblock %s\n"
+    "   0.000000 Start of measurement\n", date, date);
+}
+
+static size_t canbus_log_asc_encode(canbus_log *log, canbus_frame *frame, char *buf) {
+  canid_t id = frame->frame.can_id;
+  char *p = buf, ident[16];
+  long sec, usec;
+  int i;
+
+  if(log->asc.last.tv_sec == 0) {
+    if(frame->ts.tv_sec < log->start.tv_sec ||
+       (frame->ts.tv_sec == log->start.tv_sec && frame->ts.tv_nsec < log->start.tv_nsec)) {
+      log->start = frame->ts;
+    }
+    p += canbus_log_asc_header(log, p);
+  }
+
+  sec = frame->ts.tv_sec - log->start.tv_sec;
+  usec = (frame->ts.tv_nsec - log->start.tv_nsec) / 1000;
+  if(usec < 0) {
+    sec--;
+    usec += 1000000;
+  }
+  if(sec < 0) {
+    sec = usec = 0;
+  }
+
+  if(id & CAN_ERR_FLAG) {
+    p += sprintf(p, "%4ld.%06ld %d  ErrorFrame\n", sec, usec, CANBUS_LOG_ASC_CHANNEL);
+    return p - buf;
+  }
+
+  if(id & CAN_EFF_FLAG) {
+    snprintf(ident, sizeof(ident), "%Xx", id & CAN_EFF_MASK);
+  }
+  else {
+    snprintf(ident, sizeof(ident), "%X", id & CAN_SFF_MASK);
+  }
+
+  if(frame->flags & CANBUS_FRAME_FD) {
+    p += sprintf(p, "%4ld.%06ld CANFD %3d Rx   %8s  %32s %d %d %x %2d", sec, usec, CANBUS_LOG_ASC_CHANNEL, ident, "",
+      (frame->frame.flags & CANFD_BRS) != 0, (frame->frame.flags & CANFD_ESI) != 0,
+      canbus_log_asc_len2dlc(frame->frame.len), frame->frame.len);
+  }
+  else if(id & CAN_RTR_FLAG) {
+    p += sprintf(p, "%4ld.%06ld %d  %-15s Rx   r %x\n", sec, usec, CANBUS_LOG_ASC_CHANNEL, ident, frame->frame.len);
+    return p - buf;
+  }
+  else {
+    p += sprintf(p, "%4ld.%06ld %d  %-15s Rx   d %x", sec, usec, CANBUS_LOG_ASC_CHANNEL, ident, frame->frame.len);
+  }
+
+  for(i=0; i<frame->frame.len && i<CANFD_MAX_DLEN; i++) {
+    p[0] = ' ';
+    p[1] = canbus_log_asc_digits[frame->frame.data[i] >> 4];
+    p[2] = canbus_log_asc_digits[frame->frame.data[i] & 0x0f];
+    p += 3;
+  }
+
+  if(frame->flags & CANBUS_FRAME_FD) {
+    p += sprintf(p, " %8d %4d %8X %8d %8d %8d %8d %8d", 0, 0,
+      CANBUS_LOG_ASC_FLAG_EDL | ((frame->frame.flags & CANFD_BRS) ? CANBUS_LOG_ASC_FLAG_BRS : 0) |
+      ((frame->frame.flags & CANFD_ESI) ? CANBUS_LOG_ASC_FLAG_ESI : 0), 0, 0, 0, 0, 0);
+  }
+  *p++ = '\n';
+  return p - buf;
+}
+
+static unsigned int canbus_log_asc_end(canbus_log *log) {
+  char buf[CANBUS_LOG_RECORD_MAX];
+  size_t len = 0;
+  if(log->asc.last.tv_sec == 0) {
+    len = canbus_log_asc_header(log, buf);
+  }
+  len += sprintf(buf + len, "End TriggerBlock\n");
+  return fwrite(buf, 1, len, log->file) == len ? 0 : errno;
+}
+
+// "Thu Nov 24 01:00:00.000 pm 2016"
+static void canbus_log_asc_parse_date(canbus_log *log, const char *p) {
+  struct tm tm;
+  long msec = 0;
+  char *end;
+
+  memset(&tm, 0, sizeof(tm));
+  if((end = strptime(p, "%a %b %d %H:%M:%S", &tm)) == NULL) return;
+  if(*end == '.') {
+    msec = strtol(end + 1, &end, 10);
+  }
+  while(*end == ' ') end++;
+  if(strncasecmp(end, "pm", 2) == 0 && tm.tm_hour < 12) tm.tm_hour += 12;
+  if(strncasecmp(end, "am", 2) == 0 && tm.tm_hour == 12) tm.tm_hour = 0;
+  if(strncasecmp(end, "am", 2) == 0 || strncasecmp(end, "pm", 2) == 0) end += 2;
+  if(strptime(end, " %Y", &tm) == NULL) return;
+
+  log->start.tv_sec = timegm(&tm);
+  log->start.tv_nsec = msec * 1000000;
+  log->asc.last = log->start;
+}
+
+static void canbus_log_asc_stamp(canbus_log *log, struct timespec *t, canbus_frame *frame) {
+  struct timespec *base = log->asc.relative ? &log->asc.last : &log->start;
+  frame->ts.tv_sec = base->tv_sec + t->tv_sec;
+  frame->ts.tv_nsec = base->tv_nsec + t->tv_nsec;
+  if(frame->ts.tv_nsec >= 1000000000) {
+    frame->ts.tv_sec++;
+    frame->ts.tv_nsec -= 1000000000;
+  }
+  log->asc.last = frame->ts;
+}
+
+static bool canbus_log_asc_id(canbus_log *log, const char *tok, canbus_frame *frame) {
+  char *end;
+  unsigned long id = strtoul(tok, &end, log->asc.decimal ? 10 : 16);
+  if(end == tok) return false;
+  if(*end == 'x' || *end == 'X') {
+    frame->frame.can_id = (id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+  }
+  else {
+    frame->frame.can_id = id & CAN_SFF_MASK;
+  }
+  return true;
+}
+
+static void canbus_log_asc_data(canbus_log *log, char **save, canbus_frame *frame, unsigned int len) {
+  char *tok, *end;
+  unsigned int i;
+  for(i=0; i<len && (tok = strtok_r(NULL, CANBUS_LOG_ASC_DELIM, save)) != NULL; i++) {
+    frame->frame.data[i] = strtoul(tok, &end, log->asc.decimal ? 10 : 16);
+    if(end == tok) break;
+  }
+  frame->frame.len = i;
+}
+
+static int canbus_log_asc_parse(canbus_log *log, char *line, canbus_frame *frame) {
+  struct timespec t;
+  char *save, *tok, *end;
+  unsigned long len;
+
+  while(*line == ' ') line++;
+  if(strncmp(line, "date ", 5) == 0) {
+    canbus_log_asc_parse_date(log, line + 5);
+    return 0;
+  }
+  if(strncmp(line, "base ", 5) == 0) {
+    log->asc.decimal = strncmp(line + 5, "dec", 3) == 0;
+    log->asc.relative = strstr(line, "timestamps relative") != NULL;
+    return 0;
+  }
+  if(canbus_log_parse_time(line, &t) == NULL) {
+    return 0;
+  }
+
+  strtok_r(line, CANBUS_LOG_ASC_DELIM, &save);
+  if((tok = strtok_r(NULL, CANBUS_LOG_ASC_DELIM, &save)) == NULL) return 0;
+
+  if(strcmp(tok, "CANFD") == 0) {
+    // channel, direction, id, [symbolic name], brs, esi, dlc, data length, data
+    if(strtok_r(NULL, CANBUS_LOG_ASC_DELIM, &save) == NULL || strtok_r(NULL, CANBUS_LOG_ASC_DELIM, &save) == NULL) return 0;
+    if((tok = strtok_r(NULL, CANBUS_LOG_ASC_DELIM, &save)) == NULL || !canbus_log_asc_id(log, tok, frame)) return 0;
+    if((tok = strtok_r(NULL, CANBUS_LOG_ASC_DELIM, &save)) == NULL) return 0;
+    if(strcmp(tok, "0") != 0 && strcmp(tok, "1") != 0) {
+      if((tok = strtok_r(NULL, CANBUS_LOG_ASC_DELIM, &save)) == NULL) return 0;
+    }
+    frame->flags = CANBUS_FRAME_FD;
+    frame->frame.flags = tok[0] == '1' ? CANFD_BRS : 0;
+    if((tok = strtok_r(NULL, CANBUS_LOG_ASC_DELIM, &save)) == NULL) return 0;
+    frame->frame.flags |= tok[0] == '1' ? CANFD_ESI : 0;
+    if(strtok_r(NULL, CANBUS_LOG_ASC_DELIM, &save) == NULL) return 0;
+    if((tok = strtok_r(NULL, CANBUS_LOG_ASC_DELIM, &save)) == NULL) return 0;
+    len = strtoul(tok, &end, 10);
+    canbus_log_asc_data(log, &save, frame, len < CANFD_MAX_DLEN ? len : CANFD_MAX_DLEN);
+    canbus_log_asc_stamp(log, &t, frame);
+    return 1;
+  }
+
+  if(tok[0] < '0' || tok[0] > '9') return 0;   // "Start of measurement", status events
+  if((tok = strtok_r(NULL, CANBUS_LOG_ASC_DELIM, &save)) == NULL) return 0;
+
+  if(strcmp(tok, "ErrorFrame") == 0) {
+    frame->frame.can_id = CAN_ERR_FLAG;
+    frame->frame.len = CAN_ERR_DLC;
+    canbus_log_asc_stamp(log, &t, frame);
+    return 1;
+  }
+
+  if(!canbus_log_asc_id(log, tok, frame)) return 0;
+  if(strtok_r(NULL, CANBUS_LOG_ASC_DELIM, &save) == NULL) return 0;    // Rx / Tx
+  if((tok = strtok_r(NULL, CANBUS_LOG_ASC_DELIM, &save)) == NULL) return 0;
+  if(tok[0] == 'r') {
+    frame->frame.can_id |= CAN_RTR_FLAG;
+    if((tok = strtok_r(NULL, CANBUS_LOG_ASC_DELIM, &save)) != NULL) {
+      len = strtoul(tok, &end, 16);
+      frame->frame.len = end != tok && len <= CAN_MAX_DLEN ? len : 0;
+    }
+    canbus_log_asc_stamp(log, &t, frame);
+    return 1;
+  }
+  if(tok[0] != 'd' || (tok = strtok_r(NULL, CANBUS_LOG_ASC_DELIM, &save)) == NULL) return 0;
+  len = strtoul(tok, &end, 16);
+  canbus_log_asc_data(log, &save, frame, len < CAN_MAX_DLEN ? len : CAN_MAX_DLEN);
+  canbus_log_asc_stamp(log, &t, frame);
+  return 1;
+}
+
+static int canbus_log_asc_read(canbus_log *log, canbus_frame *frames, unsigned int max) {
+  return canbus_log_read_lines(log, frames, max, canbus_log_asc_parse);
+}
+
+const canbus_log_backend canbus_log_asc_backend = {
+  .format = CANBUS_LOG_FORMAT_ASC,
+  .name = "asc",
+  .ext = ".asc",
+  .errors = true,
+  .record_max = CANBUS_LOG_RECORD_MAX,
+  .detect = canbus_log_asc_detect,
+  .end = canbus_log_asc_end,
+  .encode = canbus_log_asc_encode,
+  .read = canbus_log_asc_read,
+  .parse = canbus_log_asc_parse,
+  .recover = canbus_log_recover_lines
+};
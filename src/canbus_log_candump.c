@@ -0,0 +1,177 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * can-utils candump -l / log2asc / canplayer format:
+ *
+ *   (1480000000.123456) can0 123#1122334455667788
+ *   (1480000000.123456) can0 12345678#R
+ *   (1480000000.123456) can0 123##1AABBCC...        (CAN FD, flags nibble first)
+ */
+
+#include "canbus_log.h"
+
+#define CANBUS_LOG_CANDUMP_IFACE "can0"   // interface column when the log has none
+
+static const char canbus_log_candump_digits[16] = "0123456789ABCDEF";
+
+static char *canbus_log_candump_dec(char *p, unsigned long v, int width) {
+  char tmp[20];
+  int n = 0;
+  do {
+    tmp[n++] = '0' + v % 10;
+    v /= 10;
+  } while(v > 0);
+  while(n < width) tmp[n++] = '0';
+  while(n > 0) *p++ = tmp[--n];
+  return p;
+}
+
+static char *canbus_log_candump_hex(char *p, uint32_t v, int digits) {
+  while(digits-- > 0) {
+    *p++ = canbus_log_candump_digits[(v >> (digits * 4)) & 0x0f];
+  }
+  return p;
+}
+
+static bool canbus_log_candump_detect(const char *head, size_t len) {
+  const char *end = head + len, *p = memchr(head, ')', len);
+  uint32_t id;
+  if(len == 0 || head[0] != '(' || p == NULL || p + 2 >= end || p[1] != ' ') return false;
+  p += 2;
+  while(p < end && *p != ' ' && *p != '\n') p++;   // interface
+  if(p + 1 >= end || *p != ' ') return false;
+  p = canbus_log_parse_hex(p + 1, 8, &id);
+  return p != NULL && p < end && *p == '#';
+}
+
+static size_t canbus_log_candump_encode(canbus_log *log, canbus_frame *frame, char *buf) {
+  canid_t id = frame->frame.can_id;
+  size_t iface_len = strlen(log->iface);
+  char *p = buf;
+  int i;
+
+  *p++ = '(';
+  p = canbus_log_candump_dec(p, frame->ts.tv_sec, 10);
+  *p++ = '.';
+  p = canbus_log_candump_dec(p, frame->ts.tv_nsec / 1000, 6);
+  *p++ = ')';
+  *p++ = ' ';
+  if(iface_len == 0) {
+    memcpy(p, CANBUS_LOG_CANDUMP_IFACE, sizeof(CANBUS_LOG_CANDUMP_IFACE) - 1);
+    p += sizeof(CANBUS_LOG_CANDUMP_IFACE) - 1;
+  }
+  else {
+    memcpy(p, log->iface, iface_len);
+    p += iface_len;
+  }
+  *p++ = ' ';
+
+  if(id & CAN_ERR_FLAG) {
+    p = canbus_log_candump_hex(p, id & (CAN_ERR_MASK | CAN_ERR_FLAG), 8);
+  }
+  else if(id & CAN_EFF_FLAG) {
+    p = canbus_log_candump_hex(p, id & CAN_EFF_MASK, 8);
+  }
+  else {
+    p = canbus_log_candump_hex(p, id & CAN_SFF_MASK, 3);
+  }
+  *p++ = '#';
+
+  if(frame->flags & CANBUS_FRAME_FD) {
+    *p++ = '#';
+    *p++ = canbus_log_candump_digits[frame->frame.flags & 0x0f];
+  }
+  else if(id & CAN_RTR_FLAG) {
+    *p++ = 'R';
+    if(frame->frame.len > 0 && frame->frame.len <= CAN_MAX_DLEN) {
+      *p++ = canbus_log_candump_digits[frame->frame.len];
+    }
+    *p++ = '\n';
+    return p - buf;
+  }
+
+  for(i=0; i<frame->frame.len && i<CANFD_MAX_DLEN; i++) {
+    *p++ = canbus_log_candump_digits[frame->frame.data[i] >> 4];
+    *p++ = canbus_log_candump_digits[frame->frame.data[i] & 0x0f];
+  }
+  *p++ = '\n';
+  return p - buf;
+}
+
+static int canbus_log_candump_parse(canbus_log *log, char *line, canbus_frame *frame) {
+  const char *p, *id_start;
+  uint32_t v;
+  unsigned int max = CAN_MAX_DLEN;
+
+  if(line[0] != '(' || (p = canbus_log_parse_time(line + 1, &frame->ts)) == NULL || p[0] != ')' || p[1] != ' ') return 0;
+  p += 2;
+  while(*p != ' ' && *p != '\0') p++;
+  if(*p++ != ' ') return 0;
+
+  id_start = p;
+  if((p = canbus_log_parse_hex(p, 8, &v)) == NULL || *p != '#') return 0;
+  if(p - id_start == 3) {
+    frame->frame.can_id = v;
+  }
+  else if(p - id_start == 8) {
+    frame->frame.can_id = (v & CAN_ERR_FLAG) ? v : (v & CAN_EFF_MASK) | CAN_EFF_FLAG;
+  }
+  else {
+    return 0;
+  }
+  p++;
+
+  if(*p == '#') {
+    if((p = canbus_log_parse_hex(p + 1, 1, &v)) == NULL) return 0;
+    frame->flags = CANBUS_FRAME_FD;
+    frame->frame.flags = v;
+    max = CANFD_MAX_DLEN;
+  }
+  else if(*p == 'R') {
+    frame->frame.can_id |= CAN_RTR_FLAG;
+    if(canbus_log_parse_hex(p + 1, 1, &v) != NULL && v <= CAN_MAX_DLEN) {
+      frame->frame.len = v;
+    }
+    return 1;
+  }
+
+  while(frame->frame.len < max) {
+    if(*p == '.') p++;
+    if((p = canbus_log_parse_hex(p, 2, &v)) == NULL) break;
+    frame->frame.data[frame->frame.len++] = v;
+  }
+  return 1;
+}
+
+static int canbus_log_candump_read(canbus_log *log, canbus_frame *frames, unsigned int max) {
+  return canbus_log_read_lines(log, frames, max, canbus_log_candump_parse);
+}
+
+const canbus_log_backend canbus_log_candump_backend = {
+  .format = CANBUS_LOG_FORMAT_CANDUMP,
+  .name = "candump",
+  .ext = ".log",
+  .errors = true,
+  .record_max = CANBUS_LOG_RECORD_MAX,
+  .detect = canbus_log_candump_detect,
+  .encode = canbus_log_candump_encode,
+  .read = canbus_log_candump_read,
+  .parse = canbus_log_candump_parse,
+  .recover = canbus_log_recover_lines
+};
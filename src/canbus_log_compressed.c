@@ -0,0 +1,186 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Compressed: canbus_blocklog blocks. Frames are held back until a block is
+ * full (CANBUS_BLOCKLOG_FRAMES frames or CANBUS_BLOCKLOG_RAW_LEN encoded
+ * bytes), then emitted compressed by the encode call that would overflow it.
+ * The rest goes out through flush, called by canbus_logwriter when capture
+ * goes quiet and by end when the file is closed. Every block is committed
+ * with a CRC32C trailer, so a crash loses at most the blocks not yet written.
+ */
+
+#include "canbus_log.h"
+
+static bool canbus_log_compressed_detect(const char *head, size_t len) {
+  return len >= CANBUS_BINLOG_MAGIC_LEN && memcmp(head, CANBUS_BLOCKLOG_MAGIC, CANBUS_BINLOG_MAGIC_LEN) == 0;
+}
+
+static unsigned int canbus_log_compressed_begin(canbus_log *log) {
+  log->block.frames = malloc(CANBUS_BLOCKLOG_FRAMES * sizeof(canbus_frame));
+  if(log->block.frames == NULL) {
+    syslog(LOG_ERR, "canbus_log_compressed_begin: unable to allocate block");
+    return ENOMEM;
+  }
+  return canbus_blocklog_write_header(log->file, log->iface, log->fd);
+}
+
+static size_t canbus_log_compressed_flush(canbus_log *log, char *buf) {
+  size_t len = 0;
+  if(log->block.count > 0) {
+    len = canbus_blocklog_encode(log->block.frames, log->block.count, (uint8_t *)buf);
+    log->block.count = 0;
+    log->block.raw_len = 0;
+  }
+  return len;
+}
+
+static size_t canbus_log_compressed_encode(canbus_log *log, canbus_frame *frame, char *buf) {
+  canbus_log_block_state *block = &log->block;
+  size_t len = 0, raw_len = canbus_blocklog_raw_len(frame, block->count > 0 ? &block->frames[block->count - 1] : NULL);
+
+  if(block->count == CANBUS_BLOCKLOG_FRAMES || block->raw_len + raw_len > CANBUS_BLOCKLOG_RAW_LEN) {
+    len = canbus_log_compressed_flush(log, buf);
+    raw_len = canbus_blocklog_raw_len(frame, NULL);
+  }
+  block->frames[block->count++] = *frame;
+  block->raw_len += raw_len;
+  return len;
+}
+
+static unsigned int canbus_log_compressed_held(canbus_log *log) {
+  return log->block.count;
+}
+
+static unsigned int canbus_log_compressed_end(canbus_log *log) {
+  char buf[CANBUS_BLOCKLOG_BLOCK_MAX];
+  size_t len = canbus_log_compressed_flush(log, buf);
+  return fwrite(buf, 1, len, log->file) == len ? 0 : errno;
+}
+
+static unsigned int canbus_log_compressed_load(canbus_log *log) {
+  canbus_binlog_header header;
+  char buf[sizeof(canbus_binlog_header)];
+  unsigned int rc;
+
+  if(fread(buf, sizeof(buf), 1, log->file) != 1) {
+    return EINVAL;
+  }
+  if((rc = canbus_blocklog_parse_header(buf, sizeof(buf), &header)) != 0) {
+    return rc;
+  }
+  if(fseek(log->file, header.header_len, SEEK_SET) != 0) {
+    return EINVAL;
+  }
+  log->fd = (header.flags & CANBUS_BINLOG_FD) != 0;
+  log->start.tv_sec = header.start_sec;
+  log->start.tv_nsec = header.start_nsec;
+  memcpy(log->iface, header.iface, IFNAMSIZ);
+
+  log->block.frames = malloc(CANBUS_BLOCKLOG_FRAMES * sizeof(canbus_frame));
+  log->block.buf = malloc(CANBUS_BLOCKLOG_BLOCK_MAX);
+  if(log->block.frames == NULL || log->block.buf == NULL) {
+    syslog(LOG_ERR, "canbus_log_compressed_load: unable to allocate block");
+    return ENOMEM;
+  }
+  return 0;
+}
+
+/**
+ * Decodes the next block once the previous one is used up. A torn or corrupt
+ * block ends the log.
+ */
+static int canbus_log_compressed_read(canbus_log *log, canbus_frame *frames, unsigned int max) {
+  canbus_log_block_state *block = &log->block;
+  canbus_blocklog_block header;
+  size_t len;
+  int n;
+
+  if(block->pos == block->count) {
+    block->pos = block->count = 0;
+    if(fread(block->buf, sizeof(canbus_blocklog_block), 1, log->file) != 1) {
+      return 0;
+    }
+    if(canbus_blocklog_parse_block(block->buf, sizeof(canbus_blocklog_block), &header) != 0 ||
+       (len = canbus_blocklog_block_len(&header)) > CANBUS_BLOCKLOG_BLOCK_MAX ||
+       fread(block->buf + sizeof(canbus_blocklog_block), 1, len - sizeof(canbus_blocklog_block), log->file) != len - sizeof(canbus_blocklog_block)) {
+      syslog(LOG_ERR, "canbus_log_compressed_read: %s: torn or corrupt block", log->filename);
+      return 0;
+    }
+    if((n = canbus_blocklog_decode(block->buf, len, block->frames, CANBUS_BLOCKLOG_FRAMES)) < 0) {
+      syslog(LOG_ERR, "canbus_log_compressed_read: %s: corrupt block", log->filename);
+      return 0;
+    }
+    block->count = n;
+  }
+
+  n = block->count - block->pos;
+  if(n > max) n = max;
+  memcpy(frames, &block->frames[block->pos], n * sizeof(canbus_frame));
+  block->pos += n;
+  return n;
+}
+
+static size_t canbus_log_compressed_record(canbus_log *log, const uint8_t *buf, size_t len) {
+  canbus_blocklog_block header;
+  size_t block_len;
+  if(canbus_blocklog_parse_block(buf, len, &header) != 0 || (block_len = canbus_blocklog_block_len(&header)) > CANBUS_BLOCKLOG_BLOCK_MAX ||
+     block_len > len) {
+    return 0;
+  }
+  return block_len;
+}
+
+static int canbus_log_compressed_decode(canbus_log *log, const uint8_t *buf, size_t len, canbus_frame *frames) {
+  return canbus_blocklog_decode(buf, len, frames, CANBUS_BLOCKLOG_FRAMES);
+}
+
+static size_t canbus_log_compressed_recover(canbus_log *log, const uint8_t *buf, size_t len) {
+  return canbus_blocklog_recover(buf, len);
+}
+
+static void canbus_log_compressed_seek(canbus_log *log) {
+  log->block.pos = log->block.count = 0;
+}
+
+static void canbus_log_compressed_close(canbus_log *log) {
+  free(log->block.frames);
+  free(log->block.buf);
+  memset(&log->block, 0, sizeof(log->block));
+}
+
+const canbus_log_backend canbus_log_compressed_backend = {
+  .format = CANBUS_LOG_FORMAT_COMPRESSED,
+  .name = "compressed",
+  .ext = CANBUS_BLOCKLOG_EXT,
+  .errors = true,
+  .record_max = CANBUS_BLOCKLOG_BLOCK_MAX,
+  .detect = canbus_log_compressed_detect,
+  .begin = canbus_log_compressed_begin,
+  .end = canbus_log_compressed_end,
+  .encode = canbus_log_compressed_encode,
+  .flush = canbus_log_compressed_flush,
+  .held = canbus_log_compressed_held,
+  .load = canbus_log_compressed_load,
+  .read = canbus_log_compressed_read,
+  .seek = canbus_log_compressed_seek,
+  .record = canbus_log_compressed_record,
+  .decode = canbus_log_compressed_decode,
+  .recover = canbus_log_compressed_recover,
+  .close = canbus_log_compressed_close
+};
@@ -0,0 +1,351 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "canbus_log.h"
+
+static inline uint64_t canbus_log_index_ns(struct timespec *ts) {
+  return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static inline unsigned int canbus_log_index_bit(uint32_t can_id) {
+  if(can_id & CAN_EFF_FLAG) {
+    return CANBUS_LOG_INDEX_ID_BITS / 2 + (((can_id & CAN_EFF_MASK) * 2654435761u) >> 21);
+  }
+  return can_id & CAN_SFF_MASK;
+}
+
+static void canbus_log_index_filename(canbus_log *log, char *filename, size_t len) {
+  snprintf(filename, len, "%s%s", log->filename, CANBUS_LOG_INDEX_EXT);
+}
+
+/**
+ * Starts the index of a log just created for writing. A log without one is
+ * still usable, so callers may carry on when this fails.
+ */
+unsigned int canbus_log_index_create(canbus_log *log) {
+  canbus_log_index_header header;
+  char filename[CANBUS_LOG_FILENAME_LEN + sizeof(CANBUS_LOG_INDEX_EXT)];
+  unsigned int rc;
+
+  canbus_log_index *index = calloc(1, sizeof(canbus_log_index));
+  if(index == NULL) {
+    syslog(LOG_ERR, "canbus_log_index_create: unable to allocate index");
+    return ENOMEM;
+  }
+  index->fd = -1;
+
+  canbus_log_index_filename(log, filename, sizeof(filename));
+  index->file = fopen(filename, "w");
+  if(index->file == NULL) {
+    rc = errno;
+    syslog(LOG_ERR, "canbus_log_index_create: Unable to open %s. error=%s", filename, strerror(rc));
+    free(index);
+    return rc;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CANBUS_LOG_INDEX_MAGIC, CANBUS_BINLOG_MAGIC_LEN);
+  header.version = htole16(CANBUS_LOG_INDEX_VERSION);
+  header.entry_len = htole16(sizeof(canbus_log_index_entry));
+  if(fwrite(&header, sizeof(header), 1, index->file) != 1) {
+    rc = errno;
+    syslog(LOG_ERR, "canbus_log_index_create: unable to write %s. error=%s", filename, strerror(rc));
+    fclose(index->file);
+    free(index);
+    return rc;
+  }
+  log->index = index;
+  return 0;
+}
+
+/**
+ * Appends the entry being filled, which ends where the next one starts.
+ */
+static void canbus_log_index_append(canbus_log_index *index, off_t end) {
+  canbus_log_index_entry *entry = &index->entry;
+  uint64_t offset = entry->offset;
+
+  entry->len = htole64(end - offset);
+  entry->offset = htole64(offset);
+  entry->first_ts = htole64(entry->first_ts);
+  entry->last_ts = htole64(entry->last_ts);
+  entry->frames = htole32(entry->frames);
+  if(fwrite(entry, sizeof(canbus_log_index_entry), 1, index->file) != 1) {
+    syslog(LOG_ERR, "canbus_log_index_append: %s", strerror(errno));
+  }
+  memset(entry, 0, sizeof(canbus_log_index_entry));
+}
+
+/**
+ * Adds a frame the backend just encoded into len bytes at offset. Entries
+ * only start where a reader can: at any record of the formats that write
+ * each frame as it comes, and after the output of an encode that left
+ * nothing but this frame held back for the others.
+ */
+void canbus_log_index_frame(canbus_log *log, canbus_frame *frame, off_t offset, size_t len) {
+  canbus_log_index_entry *entry = &log->index->entry;
+  uint64_t ts = canbus_log_index_ns(&frame->ts);
+  unsigned int bit = canbus_log_index_bit(frame->frame.can_id);
+  bool restart = true;
+
+  if(log->backend->held != NULL) {
+    restart = log->backend->held(log) == 1;
+    offset += len;
+  }
+  if(restart && entry->frames >= CANBUS_LOG_INDEX_FRAMES) {
+    canbus_log_index_append(log->index, offset);
+  }
+
+  if(entry->frames++ == 0) {
+    entry->offset = offset;
+    entry->first_ts = entry->last_ts = ts;
+  }
+  else if(ts < entry->first_ts) {
+    entry->first_ts = ts;
+  }
+  else if(ts > entry->last_ts) {
+    entry->last_ts = ts;
+  }
+  entry->ids[bit >> 3] |= 1 << (bit & 7);
+}
+
+static bool canbus_log_index_seek(canbus_log *log, off_t offset) {
+  if(fseeko(log->file, offset, SEEK_SET) != 0) {
+    syslog(LOG_ERR, "canbus_log_index_seek: %s: %s", log->filename, strerror(errno));
+    return false;
+  }
+  if(log->backend->seek != NULL) {
+    log->backend->seek(log);
+  }
+  return true;
+}
+
+/**
+ * Maps the index next to a log just loaded for reading. Entries pointing past
+ * the end of the log (it was cut short or rewritten) are ignored, and
+ * whatever follows the last one is left to a sequential scan.
+ */
+unsigned int canbus_log_index_load(canbus_log *log) {
+  char filename[CANBUS_LOG_FILENAME_LEN + sizeof(CANBUS_LOG_INDEX_EXT)];
+  const canbus_log_index_header *header;
+  struct stat st, logst;
+  canbus_frame frame;
+  off_t start;
+  unsigned int rc;
+
+  canbus_log_index *index = calloc(1, sizeof(canbus_log_index));
+  if(index == NULL) {
+    syslog(LOG_ERR, "canbus_log_index_load: unable to allocate index");
+    return ENOMEM;
+  }
+  log->index = index;
+
+  canbus_log_index_filename(log, filename, sizeof(filename));
+  index->fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if(index->fd == -1) {
+    rc = errno;
+    syslog(LOG_DEBUG, "canbus_log_index_load: no index %s: %s", filename, strerror(rc));
+    canbus_log_index_close(log);
+    return rc;
+  }
+  if(fstat(index->fd, &st) == -1 || st.st_size < sizeof(canbus_log_index_header) ||
+     fstat(fileno(log->file), &logst) == -1) {
+    syslog(LOG_ERR, "canbus_log_index_load: %s is too short to be an index", filename);
+    canbus_log_index_close(log);
+    return EINVAL;
+  }
+  index->size = st.st_size;
+
+  index->map = mmap(NULL, index->size, PROT_READ, MAP_PRIVATE, index->fd, 0);
+  if(index->map == MAP_FAILED) {
+    rc = errno;
+    syslog(LOG_ERR, "canbus_log_index_load: mmap failed. error=%s", strerror(rc));
+    index->map = NULL;
+    canbus_log_index_close(log);
+    return rc;
+  }
+
+  header = (const canbus_log_index_header *)index->map;
+  if(memcmp(header->magic, CANBUS_LOG_INDEX_MAGIC, CANBUS_BINLOG_MAGIC_LEN) != 0 ||
+     le16toh(header->version) != CANBUS_LOG_INDEX_VERSION || le16toh(header->entry_len) != sizeof(canbus_log_index_entry)) {
+    syslog(LOG_ERR, "canbus_log_index_load: %s is not a supported index", filename);
+    canbus_log_index_close(log);
+    return EINVAL;
+  }
+
+  index->entries = (const canbus_log_index_entry *)(index->map + sizeof(canbus_log_index_header));
+  index->count = (index->size - sizeof(canbus_log_index_header)) / sizeof(canbus_log_index_entry);
+  while(index->count > 0 && le64toh(index->entries[index->count - 1].offset) + le64toh(index->entries[index->count - 1].len) > (uint64_t)logst.st_size) {
+    index->count--;
+  }
+
+  // ASC takes its time base and pcapng its interfaces from what comes before
+  // the first frame, so that has to be read before seeking past it
+  start = ftello(log->file);
+  canbus_log_read_frames(log, &frame, 1);
+  if(!canbus_log_index_seek(log, start)) {
+    canbus_log_index_close(log);
+    return EIO;
+  }
+  index->tail = index->count > 0 ? le64toh(index->entries[index->count - 1].offset) + le64toh(index->entries[index->count - 1].len) : start;
+  syslog(LOG_DEBUG, "canbus_log_index_load: %s: %u entries", filename, index->count);
+  return 0;
+}
+
+/**
+ * Writes the last entry of a log being written, or unmaps a loaded index.
+ */
+void canbus_log_index_close(canbus_log *log) {
+  canbus_log_index *index = log->index;
+  if(index == NULL) {
+    return;
+  }
+  if(index->file != NULL) {
+    if(index->entry.frames > 0 && log->file != NULL && fflush(log->file) == 0) {
+      canbus_log_index_append(index, ftello(log->file));
+    }
+    fclose(index->file);
+  }
+  if(index->map != NULL) {
+    munmap(index->map, index->size);
+  }
+  if(index->fd != -1) {
+    close(index->fd);
+  }
+  free(index);
+  log->index = NULL;
+}
+
+/**
+ * Latest frame time in a loaded index. False without one, or when it is empty.
+ */
+bool canbus_log_index_end(canbus_log *log, struct timespec *ts) {
+  uint64_t last = 0;
+  unsigned int i;
+  if(log->index == NULL || log->index->count == 0) {
+    return false;
+  }
+  for(i=0; i<log->index->count; i++) {
+    if(le64toh(log->index->entries[i].last_ts) > last) {
+      last = le64toh(log->index->entries[i].last_ts);
+    }
+  }
+  ts->tv_sec = last / 1000000000ULL;
+  ts->tv_nsec = last % 1000000000ULL;
+  return true;
+}
+
+bool canbus_log_filter_match(canbus_log_filter *filter, canbus_frame *frame) {
+  unsigned int i;
+  if(filter->from.tv_sec != 0 && canbus_log_index_ns(&frame->ts) < canbus_log_index_ns(&filter->from)) return false;
+  if(filter->to.tv_sec != 0 && canbus_log_index_ns(&frame->ts) > canbus_log_index_ns(&filter->to)) return false;
+  if(filter->nids == 0) return true;
+  for(i=0; i<filter->nids; i++) {
+    if((frame->frame.can_id & (CAN_EFF_FLAG | CAN_EFF_MASK)) == filter->ids[i]) return true;
+  }
+  return false;
+}
+
+/**
+ * False if no frame in entry can pass the filter.
+ */
+bool canbus_log_index_match(const canbus_log_index_entry *entry, canbus_log_filter *filter) {
+  unsigned int i, bit;
+  if(filter->from.tv_sec != 0 && le64toh(entry->last_ts) < canbus_log_index_ns(&filter->from)) return false;
+  if(filter->to.tv_sec != 0 && le64toh(entry->first_ts) > canbus_log_index_ns(&filter->to)) return false;
+  if(filter->nids == 0) return true;
+  for(i=0; i<filter->nids; i++) {
+    bit = canbus_log_index_bit(filter->ids[i]);
+    if(entry->ids[bit >> 3] & (1 << (bit & 7))) return true;
+  }
+  return false;
+}
+
+/**
+ * Moves to the next entry that may hold frames the filter passes, or past the
+ * last one to the frames no entry covers. False once those are read too.
+ */
+static bool canbus_log_index_next(canbus_log *log, canbus_log_filter *filter) {
+  canbus_log_index *index = log->index;
+
+  while(index->next < index->count) {
+    const canbus_log_index_entry *entry = &index->entries[index->next++];
+    if(canbus_log_index_match(entry, filter)) {
+      index->left = le32toh(entry->frames);
+      return canbus_log_index_seek(log, le64toh(entry->offset));
+    }
+  }
+  if(index->at_tail) {
+    return false;
+  }
+  index->at_tail = true;
+  return canbus_log_index_seek(log, index->tail);
+}
+
+/**
+ * Like canbus_log_read_frames, but returns only the frames filter passes.
+ * With an index the entries that can not hold any are never read; without
+ * one the whole log is scanned. Returns 0 at the end of the log.
+ */
+int canbus_log_read_filtered(canbus_log *log, canbus_log_filter *filter, canbus_frame *frames, unsigned int max) {
+  canbus_log_index *index = log->index;
+  int i, n, kept;
+
+  for(;;) {
+    unsigned int want = max;
+    if(index != NULL && !index->at_tail) {
+      if(index->left == 0 && !canbus_log_index_next(log, filter)) {
+        return 0;
+      }
+      if(!index->at_tail && index->left < want) {
+        want = index->left;
+      }
+    }
+
+    n = canbus_log_read_frames(log, frames, want);
+    if(n <= 0) {
+      if(index == NULL || index->at_tail) {
+        return 0;
+      }
+      index->left = 0;
+      continue;
+    }
+    if(index != NULL && !index->at_tail) {
+      index->left -= n;
+    }
+
+    for(i=0, kept=0; i<n; i++) {
+      if(canbus_log_filter_match(filter, &frames[i])) {
+        if(kept != i) frames[kept] = frames[i];
+        kept++;
+      }
+    }
+    if(kept > 0) {
+      return kept;
+    }
+  }
+}
@@ -0,0 +1,360 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * pcapng with LINKTYPE_CAN_SOCKETCAN, readable by Wireshark and tcpdump:
+ * a section header, one interface description (nanosecond timestamps) and an
+ * enhanced packet block per frame. Packet data is the SocketCAN frame with
+ * the CAN ID in network byte order; FD frames carry CANFD_FDF in the flags
+ * byte and 72 bytes, classic frames 16.
+ *
+ * The reader follows the byte order of each section, honours if_tsresol and
+ * skips blocks and interfaces it does not understand.
+ */
+
+#include <endian.h>
+#include "canbus_log.h"
+
+#define CANBUS_LOG_PCAPNG_SHB           0x0A0D0D0A
+#define CANBUS_LOG_PCAPNG_IDB           0x00000001
+#define CANBUS_LOG_PCAPNG_SPB           0x00000003
+#define CANBUS_LOG_PCAPNG_EPB           0x00000006
+#define CANBUS_LOG_PCAPNG_BYTE_ORDER    0x1A2B3C4D
+#define CANBUS_LOG_PCAPNG_OPT_END       0
+#define CANBUS_LOG_PCAPNG_OPT_IF_NAME   2
+#define CANBUS_LOG_PCAPNG_OPT_TSRESOL   9
+#define CANBUS_LOG_PCAPNG_LINKTYPE      227     // LINKTYPE_CAN_SOCKETCAN
+#define CANBUS_LOG_PCAPNG_BLOCK_MAX     4096    // larger blocks are skipped unread
+
+#ifndef CANFD_FDF
+#define CANFD_FDF                       0x04
+#endif
+
+static uint32_t canbus_log_pcapng_u32(canbus_log *log, const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return log->pcapng.swap ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t canbus_log_pcapng_u16(canbus_log *log, const uint8_t *p) {
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return log->pcapng.swap ? __builtin_bswap16(v) : v;
+}
+
+static uint8_t *canbus_log_pcapng_put32(uint8_t *p, uint32_t v) {
+  memcpy(p, &v, sizeof(v));
+  return p + sizeof(v);
+}
+
+static uint8_t *canbus_log_pcapng_put16(uint8_t *p, uint16_t v) {
+  memcpy(p, &v, sizeof(v));
+  return p + sizeof(v);
+}
+
+static bool canbus_log_pcapng_detect(const char *head, size_t len) {
+  uint32_t type;
+  if(len < sizeof(type)) return false;
+  memcpy(&type, head, sizeof(type));
+  return type == CANBUS_LOG_PCAPNG_SHB;
+}
+
+/**
+ * Written in host byte order, as pcapng intends.
+ */
+static unsigned int canbus_log_pcapng_begin(canbus_log *log) {
+  uint8_t buf[128], *p = buf, *start;
+  size_t name_len = strlen(log->iface);
+
+  // section header block
+  p = canbus_log_pcapng_put32(p, CANBUS_LOG_PCAPNG_SHB);
+  p = canbus_log_pcapng_put32(p, 28);
+  p = canbus_log_pcapng_put32(p, CANBUS_LOG_PCAPNG_BYTE_ORDER);
+  p = canbus_log_pcapng_put16(p, 1);
+  p = canbus_log_pcapng_put16(p, 0);
+  p = canbus_log_pcapng_put32(p, 0xffffffff);   // section length unknown
+  p = canbus_log_pcapng_put32(p, 0xffffffff);
+  p = canbus_log_pcapng_put32(p, 28);
+
+  // interface description block: if_name, if_tsresol = 9 (ns)
+  start = p;
+  p = canbus_log_pcapng_put32(p, CANBUS_LOG_PCAPNG_IDB);
+  p = canbus_log_pcapng_put32(p, 0);            // length, patched below
+  p = canbus_log_pcapng_put16(p, CANBUS_LOG_PCAPNG_LINKTYPE);
+  p = canbus_log_pcapng_put16(p, 0);
+  p = canbus_log_pcapng_put32(p, CANFD_MTU);
+  if(name_len > 0) {
+    p = canbus_log_pcapng_put16(p, CANBUS_LOG_PCAPNG_OPT_IF_NAME);
+    p = canbus_log_pcapng_put16(p, name_len);
+    memset(p, 0, (name_len + 3) & ~3);
+    memcpy(p, log->iface, name_len);
+    p += (name_len + 3) & ~3;
+  }
+  p = canbus_log_pcapng_put16(p, CANBUS_LOG_PCAPNG_OPT_TSRESOL);
+  p = canbus_log_pcapng_put16(p, 1);
+  memset(p, 0, 4);
+  p[0] = 9;                                     // 10^-9 s
+  p += 4;
+  p = canbus_log_pcapng_put16(p, CANBUS_LOG_PCAPNG_OPT_END);
+  p = canbus_log_pcapng_put16(p, 0);
+  p = canbus_log_pcapng_put32(p, p - start + 4);
+  canbus_log_pcapng_put32(start + 4, p - start);
+
+  if(fwrite(buf, 1, p - buf, log->file) != p - buf) {
+    syslog(LOG_ERR, "canbus_log_pcapng_begin: unable to write header. error=%s", strerror(errno));
+    return errno;
+  }
+  return 0;
+}
+
+static size_t canbus_log_pcapng_encode(canbus_log *log, canbus_frame *frame, char *buf) {
+  uint8_t *p = (uint8_t *)buf;
+  bool fd = (frame->flags & CANBUS_FRAME_FD) != 0;
+  uint32_t caplen = fd ? CANFD_MTU : CAN_MTU;
+  uint32_t block_len = 32 + caplen;
+  uint64_t ts = (uint64_t)frame->ts.tv_sec * 1000000000ULL + frame->ts.tv_nsec;
+  uint8_t len = frame->frame.len <= (fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN) ? frame->frame.len : (fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN);
+
+  p = canbus_log_pcapng_put32(p, CANBUS_LOG_PCAPNG_EPB);
+  p = canbus_log_pcapng_put32(p, block_len);
+  p = canbus_log_pcapng_put32(p, 0);            // interface
+  p = canbus_log_pcapng_put32(p, ts >> 32);
+  p = canbus_log_pcapng_put32(p, ts & 0xffffffff);
+  p = canbus_log_pcapng_put32(p, caplen);
+  p = canbus_log_pcapng_put32(p, caplen);
+
+  memset(p, 0, caplen);
+  p = canbus_log_pcapng_put32(p, htobe32(frame->frame.can_id));
+  p[0] = len;
+  p[1] = fd ? (frame->frame.flags | CANFD_FDF) : 0;
+  memcpy(p + 4, frame->frame.data, len);
+  p += caplen - 4;
+
+  p = canbus_log_pcapng_put32(p, block_len);
+  return p - (uint8_t *)buf;
+}
+
+static uint64_t canbus_log_pcapng_units(uint8_t tsresol) {
+  uint64_t units = 1;
+  int i, exp = tsresol & 0x7f;
+  if(tsresol & 0x80) {
+    return exp < 64 ? 1ULL << exp : 0;
+  }
+  for(i=0; i<exp && i<19; i++) units *= 10;
+  return units;
+}
+
+static void canbus_log_pcapng_idb(canbus_log *log, const uint8_t *body, uint32_t len) {
+  unsigned int iface = log->pcapng.ifaces++;
+  const uint8_t *p = body + 8, *end = body + len;
+  uint16_t code, opt_len;
+  uint64_t units = 1000000;     // default if_tsresol: microseconds
+
+  if(iface >= CANBUS_LOG_PCAPNG_IFACES || len < 8) return;
+  if(canbus_log_pcapng_u16(log, body) != CANBUS_LOG_PCAPNG_LINKTYPE) {
+    log->pcapng.units[iface] = 0;
+    return;
+  }
+  while(p + 4 <= end) {
+    code = canbus_log_pcapng_u16(log, p);
+    opt_len = canbus_log_pcapng_u16(log, p + 2);
+    if(code == CANBUS_LOG_PCAPNG_OPT_END || p + 4 + opt_len > end) break;
+    if(code == CANBUS_LOG_PCAPNG_OPT_TSRESOL && opt_len >= 1) {
+      units = canbus_log_pcapng_units(p[4]);
+    }
+    if(code == CANBUS_LOG_PCAPNG_OPT_IF_NAME && iface == 0) {
+      memset(log->iface, 0, IFNAMSIZ);
+      memcpy(log->iface, p + 4, opt_len < IFNAMSIZ - 1 ? opt_len : IFNAMSIZ - 1);
+    }
+    p += 4 + ((opt_len + 3) & ~3);
+  }
+  log->pcapng.units[iface] = units;
+  if(canbus_log_pcapng_u32(log, body + 4) > CAN_MTU) {
+    log->fd = true;
+  }
+}
+
+static int canbus_log_pcapng_packet(canbus_log *log, const uint8_t *data, uint32_t caplen, uint64_t ts, uint64_t units, canbus_frame *frame) {
+  uint32_t id;
+  if(caplen < 8) return 0;
+  memcpy(&id, data, sizeof(id));
+  frame->frame.can_id = be32toh(id);
+  frame->frame.len = data[4];
+  if(caplen > CAN_MTU || (data[5] & CANFD_FDF)) {
+    frame->flags = CANBUS_FRAME_FD;
+    frame->frame.flags = data[5] & ~CANFD_FDF;
+  }
+  if(frame->frame.len > caplen - 8) frame->frame.len = caplen - 8;
+  if(frame->frame.len > CANFD_MAX_DLEN) frame->frame.len = CANFD_MAX_DLEN;
+  memcpy(frame->frame.data, data + 8, frame->frame.len);
+  if(units > 0) {
+    frame->ts.tv_sec = ts / units;
+    frame->ts.tv_nsec = (ts % units) * 1000000000ULL / units;
+  }
+  return 1;
+}
+
+/**
+ * Any block but the section header: body follows the 8 byte block header,
+ * len is the whole block. Returns 1 for a frame.
+ */
+static int canbus_log_pcapng_block(canbus_log *log, uint32_t type, const uint8_t *body, uint32_t len, canbus_frame *frame) {
+  uint32_t iface, caplen;
+  uint64_t ts;
+
+  if(type == CANBUS_LOG_PCAPNG_IDB) {
+    canbus_log_pcapng_idb(log, body, len - 12);
+  }
+  else if(type == CANBUS_LOG_PCAPNG_EPB && len >= 32) {
+    iface = canbus_log_pcapng_u32(log, body);
+    if(iface >= log->pcapng.ifaces || iface >= CANBUS_LOG_PCAPNG_IFACES || log->pcapng.units[iface] == 0) return 0;
+    ts = ((uint64_t)canbus_log_pcapng_u32(log, body + 4) << 32) | canbus_log_pcapng_u32(log, body + 8);
+    caplen = canbus_log_pcapng_u32(log, body + 12);
+    if(caplen > len - 32) return 0;
+    return canbus_log_pcapng_packet(log, body + 20, caplen, ts, log->pcapng.units[iface], frame);
+  }
+  else if(type == CANBUS_LOG_PCAPNG_SPB && len >= 16) {
+    if(log->pcapng.ifaces == 0 || log->pcapng.units[0] == 0) return 0;
+    caplen = canbus_log_pcapng_u32(log, body);
+    if(caplen > len - 16) caplen = len - 16;
+    return canbus_log_pcapng_packet(log, body + 4, caplen, 0, 0, frame);
+  }
+  return 0;
+}
+
+static int canbus_log_pcapng_read(canbus_log *log, canbus_frame *frames, unsigned int max) {
+  uint8_t hdr[8], body[CANBUS_LOG_PCAPNG_BLOCK_MAX];
+  uint32_t type, len;
+  unsigned int n = 0;
+
+  while(n < max && fread(hdr, sizeof(hdr), 1, log->file) == 1) {
+    memcpy(&type, hdr, sizeof(type));
+    if(type == CANBUS_LOG_PCAPNG_SHB) {
+      uint32_t magic;
+      if(fread(&magic, sizeof(magic), 1, log->file) != 1) break;
+      log->pcapng.swap = magic != CANBUS_LOG_PCAPNG_BYTE_ORDER;
+      log->pcapng.ifaces = 0;
+      len = canbus_log_pcapng_u32(log, hdr + 4);
+      if(len < 28 || len % 4 != 0 || fseek(log->file, len - 12, SEEK_CUR) != 0) break;
+      continue;
+    }
+
+    type = canbus_log_pcapng_u32(log, hdr);
+    len = canbus_log_pcapng_u32(log, hdr + 4);
+    if(len < 12 || len % 4 != 0) break;
+    if(len - 8 > sizeof(body)) {
+      if(fseek(log->file, len - 8, SEEK_CUR) != 0) break;
+      continue;
+    }
+    if(fread(body, len - 8, 1, log->file) != 1) break;   // torn block at the end of the file
+
+    memset(&frames[n], 0, sizeof(canbus_frame));
+    n += canbus_log_pcapng_block(log, type, body, len, &frames[n]);
+  }
+  return n;
+}
+
+/**
+ * Section headers and interface descriptions take effect here rather than in
+ * decode: canbus_logreader walks every block with this, once to split the
+ * file and again in the worker decoding each chunk.
+ */
+static size_t canbus_log_pcapng_record(canbus_log *log, const uint8_t *buf, size_t len) {
+  uint32_t type, magic, block_len;
+
+  if(len < 12) return 0;
+  memcpy(&type, buf, sizeof(type));
+  if(type == CANBUS_LOG_PCAPNG_SHB) {
+    memcpy(&magic, buf + 8, sizeof(magic));
+    log->pcapng.swap = magic != CANBUS_LOG_PCAPNG_BYTE_ORDER;
+    log->pcapng.ifaces = 0;
+  }
+  block_len = canbus_log_pcapng_u32(log, buf + 4);
+  if(block_len < (type == CANBUS_LOG_PCAPNG_SHB ? 28 : 12) || block_len % 4 != 0 || block_len > len) return 0;
+  if(type != CANBUS_LOG_PCAPNG_SHB && canbus_log_pcapng_u32(log, buf) == CANBUS_LOG_PCAPNG_IDB && block_len - 8 <= CANBUS_LOG_PCAPNG_BLOCK_MAX) {
+    canbus_log_pcapng_idb(log, buf + 8, block_len - 12);
+  }
+  return block_len;
+}
+
+static int canbus_log_pcapng_decode(canbus_log *log, const uint8_t *buf, size_t len, canbus_frame *frames) {
+  uint32_t type;
+
+  memcpy(&type, buf, sizeof(type));
+  if(type == CANBUS_LOG_PCAPNG_SHB || (type = canbus_log_pcapng_u32(log, buf)) == CANBUS_LOG_PCAPNG_IDB || len - 8 > CANBUS_LOG_PCAPNG_BLOCK_MAX) {
+    return 0;
+  }
+  memset(frames, 0, sizeof(canbus_frame));
+  return canbus_log_pcapng_block(log, type, buf + 8, len, frames);
+}
+
+/**
+ * Every block ends with its length again, so the last whole block is found
+ * from the end: a length at a 4 byte boundary that matches the one at the
+ * start of the block it spans. The mapped log starts with its section header,
+ * whose byte order the blocks are checked in.
+ */
+static size_t canbus_log_pcapng_recover(canbus_log *log, const uint8_t *buf, size_t len) {
+  uint32_t magic, block_len;
+  size_t end;
+
+  if(len < 28) return 0;
+  memcpy(&magic, buf + 8, sizeof(magic));
+  log->pcapng.swap = magic != CANBUS_LOG_PCAPNG_BYTE_ORDER;
+  for(end = len & ~(size_t)3; end >= 12; end -= 4) {
+    block_len = canbus_log_pcapng_u32(log, buf + end - 4);
+    if(block_len >= 12 && block_len % 4 == 0 && block_len <= end &&
+       canbus_log_pcapng_u32(log, buf + end - block_len + 4) == block_len) {
+      return end;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Reads ahead to the first packet for the interface name and whether the
+ * interface carries FD frames, then rewinds.
+ */
+static unsigned int canbus_log_pcapng_load(canbus_log *log) {
+  canbus_frame frame;
+  uint8_t hdr[12];
+  if(fread(hdr, sizeof(hdr), 1, log->file) != 1) {
+    return EINVAL;
+  }
+  rewind(log->file);
+  canbus_log_pcapng_read(log, &frame, 1);   // stops at the first packet, past its interface
+  rewind(log->file);
+  memset(&log->pcapng, 0, sizeof(log->pcapng));
+  return 0;
+}
+
+const canbus_log_backend canbus_log_pcapng_backend = {
+  .format = CANBUS_LOG_FORMAT_PCAPNG,
+  .name = "pcapng",
+  .ext = ".pcapng",
+  .errors = true,
+  .record_max = CANBUS_LOG_RECORD_MAX,
+  .detect = canbus_log_pcapng_detect,
+  .begin = canbus_log_pcapng_begin,
+  .encode = canbus_log_pcapng_encode,
+  .load = canbus_log_pcapng_load,
+  .read = canbus_log_pcapng_read,
+  .record = canbus_log_pcapng_record,
+  .decode = canbus_log_pcapng_decode,
+  .recover = canbus_log_pcapng_recover
+};
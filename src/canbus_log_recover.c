@@ -0,0 +1,209 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "canbus_log.h"
+
+/**
+ * Startup recovery of logs a crash or power loss left open. Appends only ever
+ * tear the end of a file, so each log is mapped and its backend looks back
+ * from the end for the last whole record; the file is truncated there. The
+ * cost is the tail, not the size of the log. An index next to the log needs
+ * no repair: entries past the new end are ignored when it is loaded.
+ *
+ * The file logger lists every log it opens in a journal in its logdir and
+ * removes the journal once they are all closed, so startup only looks at the
+ * logs of a session that did not stop cleanly and never at other files.
+ */
+
+/**
+ * Truncates filename after its last whole record. dropped, if not NULL, is
+ * set to the number of bytes cut off. Logs of formats without recovery are
+ * left alone.
+ */
+unsigned int canbus_log_recover(const char *filename, off_t *dropped) {
+  canbus_log log;
+  struct stat st;
+  uint8_t *map;
+  off_t start, valid;
+  unsigned int rc;
+
+  if(dropped != NULL) *dropped = 0;
+  if((rc = canbus_log_load(&log, filename)) != 0) {
+    return rc;
+  }
+  if(log.backend->recover == NULL || (start = ftello(log.file)) < 0 || fstat(fileno(log.file), &st) != 0 || st.st_size <= start) {
+    canbus_log_close(&log);
+    return 0;
+  }
+  // text is the fallback of format detection; only cut a file whose first line is one of ours
+  if(log.backend->format == CANBUS_LOG_FORMAT_TEXT) {
+    canbus_frame frame;
+    memset(&frame, 0, sizeof(canbus_frame));
+    if(getline(&log.line, &log.line_len, log.file) == -1 || log.backend->parse(&log, log.line, &frame) != 1) {
+      syslog(LOG_ERR, "canbus_log_recover: %s is not a recognised log; left alone", filename);
+      canbus_log_close(&log);
+      return EINVAL;
+    }
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(log.file), 0);
+  if(map == MAP_FAILED) {
+    syslog(LOG_ERR, "canbus_log_recover: unable to map %s. error=%s", filename, strerror(errno));
+    canbus_log_close(&log);
+    return errno;
+  }
+  valid = start + log.backend->recover(&log, map + start, st.st_size - start);
+  munmap(map, st.st_size);
+  canbus_log_close(&log);
+
+  // a segment that was never closed also still holds its preallocated blocks past the end
+  if(valid == st.st_size && (off_t)st.st_blocks * 512 <= ((st.st_size + st.st_blksize - 1) / st.st_blksize) * st.st_blksize) {
+    return 0;
+  }
+  if(truncate(filename, valid) != 0) {
+    syslog(LOG_ERR, "canbus_log_recover: unable to truncate %s. error=%s", filename, strerror(errno));
+    return errno;
+  }
+  if(valid < st.st_size) {
+    syslog(LOG_WARNING, "canbus_log_recover: %s: dropped %lld bytes after the last whole record",
+      filename, (long long)(st.st_size - valid));
+  }
+  if(dropped != NULL) *dropped = st.st_size - valid;
+  return 0;
+}
+
+/**
+ * Finds the segment of session that was open: the last one on disk, unless
+ * the manifest already lists it as closed.
+ */
+static bool canbus_log_recover_segment(const char *session, uint8_t format, char *filename, size_t len) {
+  char name[CANBUS_LOG_FILENAME_LEN], manifest[CANBUS_LOG_FILENAME_LEN];
+  char *line = NULL;
+  size_t line_len = 0;
+  struct stat st;
+  unsigned int seq;
+  bool found = false;
+  FILE *f;
+
+  for(seq = 1; ; seq++) {
+    canbus_log_segment_name(session, format, seq, name, sizeof(name));
+    if(stat(name, &st) != 0) break;
+    snprintf(filename, len, "%s", name);
+    found = true;
+  }
+  if(!found) return false;
+
+  canbus_log_segment_manifest(session, format, manifest, sizeof(manifest));
+  if((f = fopen(manifest, "r")) != NULL) {
+    const char *base = strrchr(filename, '/');
+    size_t base_len;
+    base = base != NULL ? base + 1 : filename;
+    base_len = strlen(base);
+    while(found && getline(&line, &line_len, f) != -1) {
+      if(strncmp(line, base, base_len) == 0 && line[base_len] == '\t') {
+        found = false;
+      }
+    }
+    free(line);
+    fclose(f);
+  }
+  return found;
+}
+
+/**
+ * Recovers the logs listed in dir's journal, i.e. those the last file logger
+ * session had open when it stopped without closing them, and removes the
+ * journal. Nothing is done after a clean stop.
+ */
+unsigned int canbus_log_recover_dir(const char *dir) {
+  char journal[CANBUS_LOG_FILENAME_LEN], filename[CANBUS_LOG_FILENAME_LEN];
+  char *line = NULL;
+  size_t line_len = 0;
+  unsigned int format, segmented, logs = 0, torn = 0;
+  off_t dropped;
+  int pos;
+  FILE *f;
+
+  snprintf(journal, sizeof(journal), "%s/%s", dir, CANBUS_LOG_JOURNAL);
+  if((f = fopen(journal, "r")) == NULL) {
+    if(errno == ENOENT) {
+      return 0;
+    }
+    syslog(LOG_ERR, "canbus_log_recover_dir: unable to open %s. error=%s", journal, strerror(errno));
+    return errno;
+  }
+  while(getline(&line, &line_len, f) != -1) {
+    line[strcspn(line, "\n")] = '\0';
+    pos = 0;
+    if(sscanf(line, "%u\t%u\t%n", &format, &segmented, &pos) != 2 || pos == 0 || canbus_log_backend_get(format) == NULL) {
+      syslog(LOG_ERR, "canbus_log_recover_dir: invalid journal entry: %s", line);
+      continue;
+    }
+    if(segmented) {
+      if(!canbus_log_recover_segment(line + pos, format, filename, sizeof(filename))) continue;
+    }
+    else {
+      snprintf(filename, sizeof(filename), "%s", line + pos);
+    }
+    logs++;
+    if(canbus_log_recover(filename, &dropped) == 0 && dropped > 0) {
+      torn++;
+    }
+  }
+  free(line);
+  fclose(f);
+  unlink(journal);
+  syslog(LOG_DEBUG, "canbus_log_recover_dir: dir=%s, logs=%u, torn=%u", dir, logs, torn);
+  return 0;
+}
+
+/**
+ * Lists log in dir's journal. A segmented log is listed by its session, as
+ * it moves on to new files by itself. The entry is on disk before the first
+ * frame is written.
+ */
+unsigned int canbus_log_journal_add(const char *dir, canbus_log *log) {
+  char journal[CANBUS_LOG_FILENAME_LEN];
+  FILE *f;
+
+  snprintf(journal, sizeof(journal), "%s/%s", dir, CANBUS_LOG_JOURNAL);
+  if((f = fopen(journal, "a")) == NULL) {
+    syslog(LOG_ERR, "canbus_log_journal_add: unable to open %s. error=%s", journal, strerror(errno));
+    return errno;
+  }
+  fprintf(f, "%u\t%u\t%s\n", log->backend->format, log->segments != NULL,
+    log->segments != NULL ? log->segments->session : log->filename);
+  fflush(f);
+  fsync(fileno(f));
+  fclose(f);
+  return 0;
+}
+
+/**
+ * Called once every log of the session is closed.
+ */
+void canbus_log_journal_clear(const char *dir) {
+  char journal[CANBUS_LOG_FILENAME_LEN];
+  snprintf(journal, sizeof(journal), "%s/%s", dir, CANBUS_LOG_JOURNAL);
+  if(unlink(journal) != 0 && errno != ENOENT) {
+    syslog(LOG_ERR, "canbus_log_journal_clear: unable to remove %s. error=%s", journal, strerror(errno));
+  }
+}
@@ -0,0 +1,200 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "canbus_log.h"
+
+/**
+ * The part of the session filename segments are numbered after: without the
+ * backend's extension when it has one.
+ */
+static size_t canbus_log_segment_stem(const char *session, const char *ext) {
+  size_t len = strlen(session), ext_len = strlen(ext);
+  if(ext_len > 0 && len > ext_len && strcmp(session + len - ext_len, ext) == 0) {
+    return len - ext_len;
+  }
+  return len;
+}
+
+/**
+ * Filename of segment seq of session.
+ */
+void canbus_log_segment_name(const char *session, uint8_t format, unsigned int seq, char *filename, size_t len) {
+  const char *ext = canbus_log_backend_get(format)->ext;
+  size_t stem = canbus_log_segment_stem(session, ext);
+  snprintf(filename, len, "%.*s_%04u%s", (int)stem, session, seq, stem < strlen(session) ? ext : "");
+}
+
+/**
+ * Filename of the manifest of session.
+ */
+void canbus_log_segment_manifest(const char *session, uint8_t format, char *filename, size_t len) {
+  snprintf(filename, len, "%.*s%s", (int)canbus_log_segment_stem(session, canbus_log_backend_get(format)->ext), session, CANBUS_LOG_MANIFEST_EXT);
+}
+
+static unsigned int canbus_log_segment_open(canbus_log *log, uint8_t format, const char *iface, bool fd) {
+  canbus_log_segments *segments = log->segments;
+  char filename[CANBUS_LOG_FILENAME_LEN];
+  unsigned int rc;
+
+  segments->seq++;
+  canbus_log_segment_name(segments->session, format, segments->seq, filename, sizeof(filename));
+
+  rc = canbus_log_create(log, filename, format, iface, fd);
+  log->segments = segments;
+  if(rc != 0) {
+    return rc;
+  }
+
+  // reserve the blocks up front; KEEP_SIZE leaves readers of a live segment the real length
+  if(segments->prealloc > 0 && fallocate(fileno(log->file), FALLOC_FL_KEEP_SIZE, 0, segments->prealloc) != 0) {
+    syslog(LOG_DEBUG, "canbus_log_segment_open: %s not preallocated: %s", filename, strerror(errno));
+    segments->prealloc = 0;
+  }
+  // the header goes out now, so a canbus_logwriter can take over at the file's offset
+  fflush(log->file);
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &segments->opened);
+  syslog(LOG_DEBUG, "canbus_log_segment_open: %s", filename);
+  return 0;
+}
+
+/**
+ * Starts a log that rolls over to a new segment once the open one holds
+ * max_bytes or has been open for max_ms, whichever comes first. session is
+ * the filename an unsegmented log would have had.
+ */
+unsigned int canbus_log_create_segmented(canbus_log *log, const char *session, uint8_t format, const char *iface, bool fd, uint64_t max_bytes, unsigned int max_ms) {
+
+  char manifest[CANBUS_LOG_FILENAME_LEN];
+  const canbus_log_backend *backend = canbus_log_backend_get(format);
+  if(backend == NULL) {
+    syslog(LOG_ERR, "canbus_log_create_segmented: unknown format %d", format);
+    return EINVAL;
+  }
+
+  canbus_log_segments *segments = calloc(1, sizeof(canbus_log_segments));
+  if(segments == NULL) {
+    syslog(LOG_ERR, "canbus_log_create_segmented: unable to allocate segment state");
+    return ENOMEM;
+  }
+  strncpy(segments->session, session, CANBUS_LOG_FILENAME_LEN - 1);
+  segments->max_bytes = max_bytes;
+  segments->max_ms = max_ms;
+  segments->prealloc = max_bytes;
+
+  canbus_log_segment_manifest(session, format, manifest, sizeof(manifest));
+  segments->manifest = fopen(manifest, "a");
+  if(segments->manifest == NULL) {
+    syslog(LOG_ERR, "canbus_log_create_segmented: Unable to open %s. error=%s", manifest, strerror(errno));
+    free(segments);
+    return errno;
+  }
+  if(ftello(segments->manifest) == 0) {
+    fprintf(segments->manifest, "# segment\tfirst\tlast\tframes\tbytes\n");
+  }
+
+  log->segments = segments;
+  unsigned int rc = canbus_log_segment_open(log, format, iface, fd);
+  if(rc != 0) {
+    canbus_log_segments_free(log);
+  }
+  return rc;
+}
+
+/**
+ * True once the open segment, size bytes long so far, should be closed before
+ * another frame is written.
+ */
+bool canbus_log_segment_due(canbus_log *log, off_t size) {
+  canbus_log_segments *segments = log->segments;
+  struct timespec now;
+
+  if(segments->max_bytes > 0 && (uint64_t)size >= segments->max_bytes) {
+    return true;
+  }
+  if(segments->max_ms > 0) {
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (now.tv_sec - segments->opened.tv_sec) * 1000 + (now.tv_nsec - segments->opened.tv_nsec) / 1000000 >= segments->max_ms;
+  }
+  return false;
+}
+
+/**
+ * Called by canbus_log_close_file once the trailer is written: gives back
+ * the preallocated blocks nothing was written to and lists the segment in
+ * the manifest.
+ */
+void canbus_log_segment_closed(canbus_log *log) {
+  canbus_log_segments *segments = log->segments;
+  const char *name = strrchr(log->filename, '/');
+  off_t size;
+
+  fflush(log->file);
+  size = ftello(log->file);
+  if(segments->prealloc > 0 && size >= 0 && ftruncate(fileno(log->file), size) != 0) {
+    syslog(LOG_ERR, "canbus_log_segment_closed: unable to trim %s: %s", log->filename, strerror(errno));
+  }
+  // time limited segments reserve what the last one needed
+  if(segments->max_bytes == 0 && size > 0) {
+    segments->prealloc = size;
+  }
+
+  fprintf(segments->manifest, "%s\t%ld.%06ld\t%ld.%06ld\t%llu\t%lld\n", name != NULL ? name + 1 : log->filename,
+    (long)log->first.tv_sec, log->first.tv_nsec / 1000, (long)log->last.tv_sec, log->last.tv_nsec / 1000,
+    (unsigned long long)log->frames, (long long)size);
+  fflush(segments->manifest);
+}
+
+/**
+ * Closes the open segment and starts the next one with the same format,
+ * interface and indexing. On failure the log is left without a file and drops what it is
+ * given.
+ */
+unsigned int canbus_log_rotate(canbus_log *log) {
+  uint8_t format = log->backend->format;
+  char iface[IFNAMSIZ];
+  bool fd = log->fd;
+  bool indexed = log->index != NULL;
+
+  memcpy(iface, log->iface, IFNAMSIZ);
+  canbus_log_close_file(log);
+  unsigned int rc = canbus_log_segment_open(log, format, iface, fd);
+  if(rc != 0) {
+    syslog(LOG_ERR, "canbus_log_rotate: unable to start segment %u of %s", log->segments->seq, log->segments->session);
+    return rc;
+  }
+  if(indexed) {
+    canbus_log_index_create(log);
+  }
+  return 0;
+}
+
+void canbus_log_segments_free(canbus_log *log) {
+  if(log->segments != NULL) {
+    if(log->segments->manifest != NULL) {
+      fclose(log->segments->manifest);
+    }
+    free(log->segments);
+    log->segments = NULL;
+  }
+}
@@ -22,14 +22,47 @@ void canbus_logger_run(canbus_logger *logger) {
 
   syslog(LOG_DEBUG, "canbus_logger_run: running");
 
-  canbus_connect(logger->canbus);
+  int i;
+  unsigned int connected = 0;
+  for(i=0; i<logger->canbus_count; i++) {
+    if(logger->type & CANBUS_LOGTYPE_FILE_MMAP) {
+      logger->canbus[i]->capture = CANBUS_CAPTURE_MMAP;
+    }
+    else if(logger->type & CANBUS_LOGTYPE_FILE_ONCHANGE) {
+      logger->canbus[i]->capture = CANBUS_CAPTURE_BCM;
+    }
+    canbus_connect(logger->canbus[i]);
+    if(canbus_isconnected(logger->canbus[i])) {
+      if(logger->canbus[i]->capture == CANBUS_CAPTURE_BCM &&
+         canbus_bcm_rx_changed_filters(logger->canbus[i], logger->filters, logger->filter_count) != 0) {
+        syslog(LOG_ERR, "canbus_logger_run: unable to register change filters on %s", logger->canbus[i]->iface);
+        canbus_close(logger->canbus[i]);
+        continue;
+      }
+      if(logger->canbus[i]->stats != NULL) {
+        canbus_stats_query_bitrate(logger->canbus[i]->stats, logger->canbus[i]->iface);
+      }
+      if(logger->filter_count && logger->canbus[i]->capture != CANBUS_CAPTURE_BCM &&
+         canbus_filter_set(logger->canbus[i], logger->filters, logger->filter_count) != 0) {
+        syslog(LOG_ERR, "canbus_logger_run: unable to set filters on %s", logger->canbus[i]->iface);
+      }
+      connected++;
+    }
+    else {
+      syslog(LOG_ERR, "canbus_logger_run: unable to connect to %s", logger->canbus[i]->iface);
+      canbus_close(logger->canbus[i]);
+    }
+  }
 
-  if(!canbus_isconnected(logger->canbus)) {
+  if(connected == 0) {
     syslog(LOG_CRIT, "canbus_logger_run: unable to connect to CAN");
     return 1;
   }
 
-  if(logger->type & CANBUS_LOGTYPE_FILE) {
+  // set before the thread exists; it may finish (and mark itself stopped) before we return
+  logger->canbus_thread_state = CANBUS_LOGTHREAD_RUNNING;
+
+  if(logger->type & (CANBUS_LOGTYPE_FILE | CANBUS_LOGTYPE_FILE_MMAP | CANBUS_LOGTYPE_FILE_ONCHANGE)) {
     canbus_filelogger_run(logger);
   }
   else if(logger->type & CANBUS_LOGTYPE_AWSIOT_REPLAY) {
@@ -40,20 +73,100 @@ void canbus_logger_run(canbus_logger *logger) {
   }
   else {
     syslog(LOG_ERR, "canbus_logger_run: invalid logger->type");
+    logger->canbus_thread_state = CANBUS_LOGTHREAD_STOPPED;
     return;
   }
+}
 
-  logger->canbus_thread_state = CANBUS_LOGTHREAD_RUNNING;
+/**
+ * Sends one stats report per connected interface through onstats.
+ */
+static void canbus_logger_report(canbus_logger *logger) {
+  char json[CANBUS_STATS_JSON_LEN];
+  int i;
+  if(logger->onstats == NULL) return;
+  for(i=0; i<logger->canbus_count; i++) {
+    if(logger->canbus[i]->stats == NULL || !canbus_isconnected(logger->canbus[i])) continue;
+    if(canbus_stats_json(logger->canbus[i], json, sizeof(json)) > 0) {
+      logger->onstats(json);
+    }
+  }
+}
+
+/**
+ * Reactor tick: closes the statistics windows and hands each interface's
+ * report to onstats at most every CANBUS_LOGGER_STATS_REPORT_MS.
+ */
+void canbus_logger_tick(void *arg) {
+
+  canbus_logger *logger = (canbus_logger *)arg;
+  struct timespec now;
+  int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for(i=0; i<logger->canbus_count; i++) {
+    if(logger->canbus[i]->stats != NULL) {
+      canbus_stats_roll(logger->canbus[i]->stats, &now);
+    }
+  }
+
+  if(logger->onstats == NULL ||
+     (now.tv_sec - logger->stats_reported.tv_sec) * 1000 + (now.tv_nsec - logger->stats_reported.tv_nsec) / 1000000 < CANBUS_LOGGER_STATS_REPORT_MS) {
+    return;
+  }
+  logger->stats_reported = now;
+  canbus_logger_report(logger);
+}
+
+/**
+ * Registers every connected interface with the logger's reactor. args holds one
+ * handler argument per interface (NULL entries are skipped), or NULL to pass the
+ * logger itself.
+ */
+unsigned int canbus_logger_add_handlers(canbus_logger *logger, canbus_reactor_onread onread, void **args) {
+  int i;
+  unsigned int added = 0;
+  clock_gettime(CLOCK_MONOTONIC, &logger->stats_reported);
+  logger->reactor.ontick = canbus_logger_tick;
+  logger->reactor.tick_arg = logger;
+  logger->reactor.timeout_ms = CANBUS_REACTOR_TIMEOUT_MS;
+  for(i=0; i<logger->canbus_count; i++) {
+    if(!canbus_isconnected(logger->canbus[i])) continue;
+    if(args != NULL && args[i] == NULL) continue;
+    if(canbus_reactor_add(&logger->reactor, logger->canbus[i], onread, args == NULL ? logger : args[i]) == 0) {
+      added++;
+    }
+  }
+  return added;
 }
 
 void canbus_logger_stop(canbus_logger *logger) {
   syslog(LOG_DEBUG, "canbus_logger_stop: stopping");
   logger->isrunning = false;
   logger->canbus_thread_state = CANBUS_LOGTHREAD_STOPPING;
-  while(!(logger->canbus_thread_state & CANBUS_LOGTHREAD_STOPPED)) {
-    syslog(LOG_DEBUG, "canbus_logger_stop: waiting for canbus connection to close");
-    sleep(1);
+
+  int i;
+  for(i=0; i<logger->canbus_count; i++) {
+    canbus_cancel(logger->canbus[i]);
+  }
+  canbus_reactor_stop(&logger->reactor);
+
+  if(logger->canbus_thread != NULL) {
+    pthread_join(logger->canbus_thread, NULL);
+    logger->canbus_thread = NULL;
+  }
+
+  // the session's final word on what was lost, sent before the sockets go away
+  canbus_logger_report(logger);
+
+  for(i=0; i<logger->canbus_count; i++) {
+    canbus_client *canbus = logger->canbus[i];
+    uint64_t drops = canbus_drops(canbus);
+    syslog(drops > 0 ? LOG_WARNING : LOG_INFO,
+      "canbus_logger_stop: %s dropped %llu frames. socket=%llu, incomplete=%llu, file=%llu, publish=%llu",
+      canbus->iface, (unsigned long long)drops,
+      (unsigned long long)canbus_dropped(canbus, CANBUS_DROP_SOCKET), (unsigned long long)canbus_dropped(canbus, CANBUS_DROP_INCOMPLETE),
+      (unsigned long long)canbus_dropped(canbus, CANBUS_DROP_FILE), (unsigned long long)canbus_dropped(canbus, CANBUS_DROP_PUBLISH));
+    canbus_close(canbus);
   }
-  canbus_close(logger->canbus);
-  logger->canbus_thread = NULL;
 }
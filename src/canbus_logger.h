@@ -24,32 +24,65 @@ typedef struct canbus_logger canbus_logger;
 #include "canbus_filelogger.h"
 #include "canbus_awsiotlogger.h"
 #include "canbus.h"
+#include "canbus_reactor.h"
+#include "canbus_bcm.h"
+#include "canbus_filter.h"
 
 #define CANBUS_LOGTYPE_FILE          (1 << 0)
 #define CANBUS_LOGTYPE_AWSIOT        (1 << 1)
 #define CANBUS_LOGTYPE_AWSIOT_REPLAY (1 << 2)
+#define CANBUS_LOGTYPE_FILE_MMAP     (1 << 3)  // CANBUS_LOGTYPE_FILE captured through a TPACKET_V3 ring
+#define CANBUS_LOGTYPE_FILE_ONCHANGE (1 << 4)  // CANBUS_LOGTYPE_FILE of payload changes only, filtered by CAN_BCM
+
+#define CANBUS_LOG_FORMAT_TEXT       0         // canbus_framecpy lines
+#define CANBUS_LOG_FORMAT_BINARY     1         // fixed size records, see canbus_binlog.h
+#define CANBUS_LOG_FORMAT_CANDUMP    2         // can-utils candump -l
+#define CANBUS_LOG_FORMAT_ASC        3         // Vector ASCII
+#define CANBUS_LOG_FORMAT_PCAPNG     4         // pcapng, LINKTYPE_CAN_SOCKETCAN
+#define CANBUS_LOG_FORMAT_COMPRESSED 5         // LZ4 blocks of delta encoded frames, see canbus_blocklog.h
+#define CANBUS_LOG_FORMATS           6
 
 #define CANBUS_LOGTHREAD_RUNNING     (1 << 0)
 #define CANBUS_LOGTHREAD_STOPPING    (1 << 1)
 #define CANBUS_LOGTHREAD_STOPPED     (1 << 2)
 
+#define CANBUS_LOGGER_STATS_REPORT_MS 10000  // minimum time between onstats reports
+
+#define CANBUS_LOGGER_MAX_IFACES     8
+
 typedef struct canbus_logger {
-  char *iface;
+  char *iface;              // CANBUS_IFACE_DELIM separated interface list
   char *logdir;
   char *logfile;
   char *certDir;
   char *cacheDir;
   bool isrunning;
   unsigned int type;
+  uint8_t log_format;       // CANBUS_LOG_FORMAT_* written by the file loggers
+  unsigned int fsync_ms;    // fdatasync interval of the file loggers, 0 syncs only when the log is closed
+  uint64_t segment_bytes;   // file logs roll over to a new segment at this size, 0 = no limit
+  unsigned int segment_ms;  // or after this long, 0 = no limit
+  unsigned int publish_frames;  // the AWS IoT logger publishes a batch at this many frames, 0 = CANBUS_AWSIOTLOGGER_BATCH_FRAMES
+  unsigned int publish_ms;      // or this long after its first frame, 0 = CANBUS_AWSIOTLOGGER_BATCH_MS
+  uint8_t spool_mode;           // CANBUS_AWSIOTLOGGER_SPOOL_*, batches are spooled under cacheDir
+  uint64_t spool_bytes;         // spool size, 0 = CANBUS_AWSIOTLOGGER_SPOOL_MB
+  unsigned int spool_rate;      // bytes per second the spool drains at, 0 = CANBUS_AWSIOTLOGGER_DRAIN_RATE
   uint8_t canbus_flags;
   uint8_t canbus_thread_state;
-  canbus_client *canbus;
+  canbus_client *canbus[CANBUS_LOGGER_MAX_IFACES];
+  unsigned int canbus_count;
+  canbus_reactor reactor;
   pthread_t canbus_thread;
-  struct canbus_filter *filters[10];
-  void (*onread)(const char *line);
+  struct canbus_filter filters[CANBUS_FILTER_MAX];
+  unsigned int filter_count;  // applied to every interface after connect
+  void (*onreplay)(canbus_frame *frames, unsigned int nframes);  // batches of a replayed log, error frames included
+  void (*onstats)(const char *json);  // one canbus_stats_json report per interface
+  struct timespec stats_reported;     // CLOCK_MONOTONIC
 } canbus_logger;
 
 void canbus_logger_run(canbus_logger *logger);
 void canbus_logger_stop(canbus_logger *logger);
+unsigned int canbus_logger_add_handlers(canbus_logger *logger, canbus_reactor_onread onread, void **args);
+void canbus_logger_tick(void *arg);
 
 #endif
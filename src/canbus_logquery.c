@@ -0,0 +1,493 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "canbus_logquery.h"
+#include "canbus_format.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CANBUS_LOGQUERY_X86
+#endif
+
+#define CANBUS_LOGQUERY_SLOTS 1024    // initial per worker count table, a power of two
+
+typedef unsigned int (*canbus_logquery_ids_fn)(canbus_logquery *query, canbus_frame *frames, unsigned int nframes, uint16_t *sel);
+
+static canbus_logquery_ids_fn canbus_logquery_ids_impl = NULL;
+
+static const char canbus_logquery_hex[16] = "0123456789abcdef";
+
+static inline uint64_t canbus_logquery_ns(const struct timespec *ts) {
+  return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static inline bool canbus_logquery_id(canbus_logquery *query, uint32_t can_id) {
+  unsigned int r;
+  for(r=0; r<query->nrules; r++) {
+    if((can_id & query->masks[r]) == query->ids[r]) return true;
+  }
+  return false;
+}
+
+static unsigned int canbus_logquery_ids_scalar(canbus_logquery *query, canbus_frame *frames, unsigned int nframes, uint16_t *sel) {
+  unsigned int i, n = 0;
+  for(i=0; i<nframes; i++) {
+    sel[n] = i;
+    n += canbus_logquery_id(query, frames[i].frame.can_id);
+  }
+  return n;
+}
+
+#ifdef CANBUS_LOGQUERY_X86
+
+/**
+ * Four frames against every rule at once; the ids are loaded one by one, SSE2
+ * has no gather.
+ */
+__attribute__((target("sse2")))
+static unsigned int canbus_logquery_ids_sse2(canbus_logquery *query, canbus_frame *frames, unsigned int nframes, uint16_t *sel) {
+  unsigned int i, r, n = 0;
+  int bits;
+
+  for(i=0; i + 4 <= nframes; i+=4) {
+    __m128i id = _mm_setr_epi32(frames[i].frame.can_id, frames[i + 1].frame.can_id, frames[i + 2].frame.can_id, frames[i + 3].frame.can_id);
+    __m128i hit = _mm_setzero_si128();
+    for(r=0; r<query->nrules; r++) {
+      hit = _mm_or_si128(hit, _mm_cmpeq_epi32(_mm_and_si128(id, _mm_set1_epi32(query->masks[r])), _mm_set1_epi32(query->ids[r])));
+    }
+    for(bits = _mm_movemask_ps(_mm_castsi128_ps(hit)); bits != 0; bits &= bits - 1) {
+      sel[n++] = i + __builtin_ctz(bits);
+    }
+  }
+  for(; i<nframes; i++) {
+    sel[n] = i;
+    n += canbus_logquery_id(query, frames[i].frame.can_id);
+  }
+  return n;
+}
+
+/**
+ * Eight frames per gather, each rule one AND and compare over all of them.
+ */
+__attribute__((target("avx2")))
+static unsigned int canbus_logquery_ids_avx2(canbus_logquery *query, canbus_frame *frames, unsigned int nframes, uint16_t *sel) {
+  const __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(sizeof(canbus_frame)));
+  unsigned int i, r, n = 0;
+  int bits;
+
+  for(i=0; i + 8 <= nframes; i+=8) {
+    __m256i id = _mm256_i32gather_epi32((const int *)&frames[i].frame.can_id, offsets, 1);
+    __m256i hit = _mm256_setzero_si256();
+    for(r=0; r<query->nrules; r++) {
+      hit = _mm256_or_si256(hit, _mm256_cmpeq_epi32(_mm256_and_si256(id, _mm256_set1_epi32(query->masks[r])), _mm256_set1_epi32(query->ids[r])));
+    }
+    for(bits = _mm256_movemask_ps(_mm256_castsi256_ps(hit)); bits != 0; bits &= bits - 1) {
+      sel[n++] = i + __builtin_ctz(bits);
+    }
+  }
+  for(; i<nframes; i++) {
+    sel[n] = i;
+    n += canbus_logquery_id(query, frames[i].frame.can_id);
+  }
+  return n;
+}
+
+#endif
+
+/**
+ * Selects the kernel used to match ID rules. Kernels the CPU (or the
+ * architecture) does not support fall back to the next best one. Returns the
+ * kernel actually selected.
+ */
+int canbus_logquery_kernel(int kernel) {
+#ifdef CANBUS_LOGQUERY_X86
+  __builtin_cpu_init();
+  if(kernel == CANBUS_LOGQUERY_AUTO || kernel == CANBUS_LOGQUERY_AVX2) {
+    if(__builtin_cpu_supports("avx2")) {
+      __atomic_store_n(&canbus_logquery_ids_impl, canbus_logquery_ids_avx2, __ATOMIC_RELAXED);
+      return CANBUS_LOGQUERY_AVX2;
+    }
+    kernel = CANBUS_LOGQUERY_SSE2;
+  }
+  if(kernel == CANBUS_LOGQUERY_SSE2 && __builtin_cpu_supports("sse2")) {
+    __atomic_store_n(&canbus_logquery_ids_impl, canbus_logquery_ids_sse2, __ATOMIC_RELAXED);
+    return CANBUS_LOGQUERY_SSE2;
+  }
+#endif
+  __atomic_store_n(&canbus_logquery_ids_impl, canbus_logquery_ids_scalar, __ATOMIC_RELAXED);
+  return CANBUS_LOGQUERY_SCALAR;
+}
+
+const char *canbus_logquery_kernel_name(int kernel) {
+  switch(kernel) {
+    case CANBUS_LOGQUERY_SSE2: return "sse2";
+    case CANBUS_LOGQUERY_AVX2: return "avx2";
+    default: return "scalar";
+  }
+}
+
+void canbus_logquery_init(canbus_logquery *query, uint8_t action) {
+  memset(query, 0, sizeof(canbus_logquery));
+  query->action = action;
+  query->out = stdout;
+}
+
+/**
+ * Adds an ID rule. Error frames never match one, and a mask without
+ * CAN_EFF_FLAG still tells 11 from 29 bit ids apart.
+ */
+unsigned int canbus_logquery_add_id(canbus_logquery *query, uint32_t can_id, uint32_t can_mask) {
+  if(query->nrules == CANBUS_LOGQUERY_RULES_MAX) {
+    return ENOSPC;
+  }
+  can_mask |= CAN_EFF_FLAG | CAN_ERR_FLAG;
+  query->masks[query->nrules] = can_mask;
+  query->ids[query->nrules] = can_id & can_mask & ~CAN_ERR_FLAG;
+  query->nrules++;
+  return 0;
+}
+
+unsigned int canbus_logquery_add_pattern(canbus_logquery *query, uint8_t offset, const uint8_t *data, const uint8_t *mask, uint8_t len) {
+  canbus_logquery_pattern *pattern = &query->patterns[query->npatterns];
+  unsigned int i;
+  if(query->npatterns == CANBUS_LOGQUERY_PATTERNS_MAX || len == 0 || offset + len > CANFD_MAX_DLEN) {
+    return EINVAL;
+  }
+  pattern->offset = offset;
+  pattern->len = len;
+  for(i=0; i<len; i++) {
+    pattern->mask[i] = mask != NULL ? mask[i] : 0xff;
+    pattern->data[i] = data[i] & pattern->mask[i];
+  }
+  query->npatterns++;
+  return 0;
+}
+
+static bool canbus_logquery_payload(canbus_logquery *query, canbus_frame *frame) {
+  canbus_logquery_pattern *pattern;
+  unsigned int i, j;
+  for(i=0; i<query->npatterns; i++) {
+    pattern = &query->patterns[i];
+    if(pattern->offset + pattern->len > frame->frame.len) return false;
+    for(j=0; j<pattern->len; j++) {
+      if((frame->frame.data[pattern->offset + j] & pattern->mask[j]) != pattern->data[j]) return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Fills sel with the indexes of the frames that pass the query, in order, and
+ * returns how many. nframes is at most CANBUS_LOGQUERY_BATCH.
+ */
+unsigned int canbus_logquery_match(canbus_logquery *query, canbus_frame *frames, unsigned int nframes, uint16_t *sel) {
+  uint64_t from = canbus_logquery_ns(&query->from), to = canbus_logquery_ns(&query->to), ts;
+  unsigned int i, n, kept;
+
+  if(query->nrules > 0) {
+    canbus_logquery_ids_fn fn = __atomic_load_n(&canbus_logquery_ids_impl, __ATOMIC_RELAXED);
+    if(fn == NULL) {
+      canbus_logquery_kernel(CANBUS_LOGQUERY_AUTO);
+      fn = __atomic_load_n(&canbus_logquery_ids_impl, __ATOMIC_RELAXED);
+    }
+    n = fn(query, frames, nframes, sel);
+  }
+  else {
+    for(n=0; n<nframes; n++) sel[n] = n;
+  }
+  if(from == 0 && to == 0 && query->npatterns == 0) {
+    return n;
+  }
+
+  for(i=0, kept=0; i<n; i++) {
+    canbus_frame *frame = &frames[sel[i]];
+    ts = canbus_logquery_ns(&frame->ts);
+    if((from != 0 && ts < from) || (to != 0 && ts > to) || !canbus_logquery_payload(query, frame)) continue;
+    sel[kept++] = sel[i];
+  }
+  return kept;
+}
+
+static bool canbus_logquery_grow(canbus_logquery_worker *worker) {
+  unsigned int i, h, size = worker->slots != NULL ? 2 * (worker->mask + 1) : CANBUS_LOGQUERY_SLOTS;
+  canbus_logquery_count *slots = calloc(size, sizeof(canbus_logquery_count));
+  if(slots == NULL) {
+    syslog(LOG_ERR, "canbus_logquery_grow: unable to allocate %u counts", size);
+    return false;
+  }
+  for(i=0; worker->slots != NULL && i<=worker->mask; i++) {
+    if(worker->slots[i].frames == 0) continue;
+    for(h = (worker->slots[i].can_id * 2654435761U) & (size - 1); slots[h].frames != 0; h = (h + 1) & (size - 1));
+    slots[h] = worker->slots[i];
+  }
+  free(worker->slots);
+  worker->slots = slots;
+  worker->mask = size - 1;
+  return true;
+}
+
+static void canbus_logquery_count_frame(canbus_logquery_worker *worker, canbus_frame *frame) {
+  uint32_t id = frame->frame.can_id;
+  uint64_t ts = canbus_logquery_ns(&frame->ts);
+  canbus_logquery_count *count;
+  unsigned int h;
+
+  id &= (id & CAN_ERR_FLAG) ? CAN_ERR_FLAG | CAN_ERR_MASK : (id & CAN_EFF_FLAG) ? CAN_EFF_FLAG | CAN_EFF_MASK : CAN_SFF_MASK;
+  for(h = (id * 2654435761U) & worker->mask; ; h = (h + 1) & worker->mask) {
+    count = &worker->slots[h];
+    if(count->frames == 0) {
+      if(2 * (worker->used + 1) > worker->mask + 1) {
+        if(!canbus_logquery_grow(worker)) return;
+        canbus_logquery_count_frame(worker, frame);
+        return;
+      }
+      worker->used++;
+      count->can_id = id;
+      count->first_ns = count->last_ns = ts;
+      break;
+    }
+    if(count->can_id == id) break;
+  }
+  count->frames++;
+  count->bytes += frame->frame.len;
+  if(ts < count->first_ns) count->first_ns = ts;
+  if(ts > count->last_ns) count->last_ns = ts;
+}
+
+static char *canbus_logquery_dec(char *p, uint64_t v, int digits) {
+  char tmp[20];
+  int n = 0;
+  do {
+    tmp[n++] = '0' + v % 10;
+    v /= 10;
+  } while(v > 0 || n < digits);
+  while(n > 0) *p++ = tmp[--n];
+  return p;
+}
+
+/**
+ * One CSV row: time,id,type,fd,len,data. The id is hex, eight digits for 29
+ * bit ids as candump writes them; data is hex bytes separated by spaces.
+ */
+static char *canbus_logquery_csv_frame(char *p, canbus_frame *frame) {
+  uint32_t id = frame->frame.can_id;
+  const char *type = (id & CAN_ERR_FLAG) ? ",error," : (id & CAN_RTR_FLAG) ? ",remote," : ",data,";
+  int i, digits = (id & (CAN_EFF_FLAG | CAN_ERR_FLAG)) ? 8 : 3;
+  size_t type_len = strlen(type);
+
+  p = canbus_logquery_dec(p, frame->ts.tv_sec, 1);
+  *p++ = '.';
+  p = canbus_logquery_dec(p, frame->ts.tv_nsec, 9);
+  *p++ = ',';
+  id &= (id & CAN_ERR_FLAG) ? CAN_ERR_MASK : (id & CAN_EFF_FLAG) ? CAN_EFF_MASK : CAN_SFF_MASK;
+  for(i=digits - 1; i>=0; i--) *p++ = canbus_logquery_hex[(id >> (4 * i)) & 0xf];
+  memcpy(p, type, type_len);
+  p += type_len;
+  *p++ = (frame->flags & CANBUS_FRAME_FD) ? '1' : '0';
+  *p++ = ',';
+  p = canbus_logquery_dec(p, frame->frame.len, 1);
+  if(frame->frame.len > 0 && !(frame->frame.can_id & CAN_RTR_FLAG)) {
+    // " xx xx ..": the leading space becomes the separator
+    char *end = canbus_hex_encode(frame->frame.data, frame->frame.len <= CANFD_MAX_DLEN ? frame->frame.len : CANFD_MAX_DLEN, p);
+    *p = ',';
+    p = end;
+  }
+  else {
+    *p++ = ',';
+  }
+  *p++ = '\n';
+  return p;
+}
+
+static void canbus_logquery_flush(canbus_logquery *query) {
+  if(query->csv_len > 0) {
+    fwrite(query->csv, 1, query->csv_len, query->out);
+    query->csv_len = 0;
+  }
+}
+
+static void canbus_logquery_onframes(canbus_frame *frames, unsigned int nframes, unsigned int worker, void *arg) {
+  canbus_logquery *query = (canbus_logquery *)arg;
+  canbus_logquery_worker *w = &query->workers[worker];
+  uint16_t sel[CANBUS_LOGQUERY_BATCH];
+  unsigned int i, j, n, batch;
+
+  for(i=0; i<nframes; i+=batch) {
+    batch = nframes - i < CANBUS_LOGQUERY_BATCH ? nframes - i : CANBUS_LOGQUERY_BATCH;
+    n = canbus_logquery_match(query, &frames[i], batch, sel);
+    w->matched += n;
+    if(query->action == CANBUS_LOGQUERY_COUNT) {
+      if(w->slots == NULL && n > 0 && !canbus_logquery_grow(w)) return;
+      for(j=0; j<n; j++) {
+        canbus_logquery_count_frame(w, &frames[i + sel[j]]);
+      }
+    }
+    else if(query->action == CANBUS_LOGQUERY_FRAMES) {
+      for(j=0; j<n; j++) {
+        query->csv_len = canbus_logquery_csv_frame(query->csv + query->csv_len, &frames[i + sel[j]]) - query->csv;
+        if(query->csv_len > CANBUS_LOGQUERY_CSV_LEN) {
+          canbus_logquery_flush(query);
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Runs the query over one log; results add up over several calls.
+ */
+unsigned int canbus_logquery_run(canbus_logquery *query, const char *filename) {
+  canbus_log log;
+  canbus_logreader reader;
+  canbus_log_filter filter;
+  uint32_t ids[CANBUS_LOGQUERY_RULES_MAX];
+  struct timespec from = query->from, to = query->to;
+  unsigned int i, rc;
+
+  if(query->action == CANBUS_LOGQUERY_FRAMES && query->csv == NULL &&
+     (query->csv = malloc(CANBUS_LOGQUERY_CSV_LEN + CANBUS_LOG_RECORD_MAX)) == NULL) {
+    syslog(LOG_ERR, "canbus_logquery_run: unable to allocate CSV buffer");
+    return ENOMEM;
+  }
+  if((rc = canbus_log_load(&log, filename)) != 0) {
+    return rc;
+  }
+  if(query->last.tv_sec != 0 || query->last.tv_nsec != 0) {
+    if(!canbus_log_index_end(&log, &query->to)) {
+      syslog(LOG_ERR, "canbus_logquery_run: the last seconds of %s need an index next to it", filename);
+      canbus_log_close(&log);
+      query->to = to;
+      return ENOENT;
+    }
+    query->from.tv_sec = query->to.tv_sec - query->last.tv_sec;
+    query->from.tv_nsec = query->to.tv_nsec - query->last.tv_nsec;
+    if(query->from.tv_nsec < 0) {
+      query->from.tv_sec--;
+      query->from.tv_nsec += 1000000000L;
+    }
+    query->to.tv_sec = query->to.tv_nsec = 0;   // the unindexed tail may run past the end the index knows
+  }
+  if((rc = canbus_logreader_open(&reader, &log, query->threads,
+                                 query->action == CANBUS_LOGQUERY_FRAMES ? 0 : CANBUS_LOGREADER_UNORDERED)) != 0) {
+    canbus_log_close(&log);
+    query->from = from;
+    query->to = to;
+    return rc;
+  }
+
+  // the index knows time ranges and exact ids; masked rules leave the ids open
+  memset(&filter, 0, sizeof(filter));
+  filter.from = query->from;
+  filter.to = query->to;
+  filter.ids = ids;
+  for(i=0; i<query->nrules; i++) {
+    uint32_t exact = (query->ids[i] & CAN_EFF_FLAG) ? CAN_EFF_MASK : CAN_SFF_MASK;
+    if((query->masks[i] & exact) != exact) break;
+    ids[i] = query->ids[i];
+  }
+  filter.nids = i == query->nrules ? query->nrules : 0;
+  canbus_logreader_filter(&reader, &filter);
+
+  rc = canbus_logreader_run(&reader, canbus_logquery_onframes, query);
+  if(query->action == CANBUS_LOGQUERY_FRAMES) {
+    canbus_logquery_flush(query);
+  }
+  query->scanned += reader.stats.frames;
+  query->bytes += reader.stats.bytes;
+  canbus_logreader_close(&reader);
+  canbus_log_close(&log);
+  query->from = from;
+  query->to = to;
+  return rc;
+}
+
+uint64_t canbus_logquery_matched(canbus_logquery *query) {
+  uint64_t matched = 0;
+  unsigned int i;
+  for(i=0; i<CANBUS_LOGREADER_THREADS_MAX; i++) {
+    matched += query->workers[i].matched;
+  }
+  return matched;
+}
+
+static int canbus_logquery_count_cmp(const void *a, const void *b) {
+  uint32_t x = ((const canbus_logquery_count *)a)->can_id, y = ((const canbus_logquery_count *)b)->can_id;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * The counts of a CANBUS_LOGQUERY_COUNT query, merged over the workers and
+ * sorted by can_id (11 bit ids first). Free with free().
+ */
+canbus_logquery_count *canbus_logquery_counts(canbus_logquery *query, unsigned int *count) {
+  canbus_logquery_worker merged;
+  canbus_logquery_count *counts, *c, *m;
+  unsigned int i, j, h, n = 0;
+
+  memset(&merged, 0, sizeof(merged));
+  *count = 0;
+  if(!canbus_logquery_grow(&merged)) {
+    return NULL;
+  }
+  for(i=0; i<CANBUS_LOGREADER_THREADS_MAX; i++) {
+    for(j=0; query->workers[i].slots != NULL && j<=query->workers[i].mask; j++) {
+      c = &query->workers[i].slots[j];
+      if(c->frames == 0) continue;
+      if(2 * (merged.used + 1) > merged.mask + 1 && !canbus_logquery_grow(&merged)) {
+        free(merged.slots);
+        return NULL;
+      }
+      for(h = (c->can_id * 2654435761U) & merged.mask; merged.slots[h].frames != 0 && merged.slots[h].can_id != c->can_id; h = (h + 1) & merged.mask);
+      m = &merged.slots[h];
+      if(m->frames == 0) {
+        *m = *c;
+        merged.used++;
+        continue;
+      }
+      m->frames += c->frames;
+      m->bytes += c->bytes;
+      if(c->first_ns < m->first_ns) m->first_ns = c->first_ns;
+      if(c->last_ns > m->last_ns) m->last_ns = c->last_ns;
+    }
+  }
+
+  counts = malloc((merged.used > 0 ? merged.used : 1) * sizeof(canbus_logquery_count));
+  if(counts != NULL) {
+    for(j=0; j<=merged.mask; j++) {
+      if(merged.slots[j].frames > 0) counts[n++] = merged.slots[j];
+    }
+    qsort(counts, n, sizeof(canbus_logquery_count), canbus_logquery_count_cmp);
+    *count = n;
+  }
+  free(merged.slots);
+  return counts;
+}
+
+void canbus_logquery_free(canbus_logquery *query) {
+  unsigned int i;
+  for(i=0; i<CANBUS_LOGREADER_THREADS_MAX; i++) {
+    free(query->workers[i].slots);
+    query->workers[i].slots = NULL;
+  }
+  free(query->csv);
+  query->csv = NULL;
+}
@@ -0,0 +1,105 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANBUSLOGQUERY_H
+#define CANBUSLOGQUERY_H
+
+#include "canbus_log.h"
+#include "canbus_logreader.h"
+
+#define CANBUS_LOGQUERY_RULES_MAX    64    // ID rules; a frame passes if any matches
+#define CANBUS_LOGQUERY_PATTERNS_MAX 8     // payload patterns; a frame passes if all match
+#define CANBUS_LOGQUERY_BATCH        256   // frames matched at a time
+#define CANBUS_LOGQUERY_CSV_LEN      65536 // CSV buffered before each fwrite
+
+#define CANBUS_LOGQUERY_COUNT        0     // frames, payload bytes and time range per can_id
+#define CANBUS_LOGQUERY_FRAMES       1     // matching frames as CSV, in file order
+#define CANBUS_LOGQUERY_TOTAL        2     // number of matching frames
+
+#define CANBUS_LOGQUERY_AUTO         -1    // best ID matching kernel the CPU supports
+#define CANBUS_LOGQUERY_SCALAR       0
+#define CANBUS_LOGQUERY_SSE2         1
+#define CANBUS_LOGQUERY_AVX2         2
+
+/**
+ * Payload bytes from offset on, compared under mask.
+ */
+typedef struct {
+  uint8_t offset;
+  uint8_t len;
+  uint8_t data[CANFD_MAX_DLEN];   // already masked
+  uint8_t mask[CANFD_MAX_DLEN];
+} canbus_logquery_pattern;
+
+typedef struct {
+  uint32_t can_id;          // with CAN_EFF_FLAG for 29 bit ids
+  uint64_t frames;
+  uint64_t bytes;           // of payload
+  uint64_t first_ns;        // since the epoch
+  uint64_t last_ns;
+} canbus_logquery_count;
+
+/**
+ * Counts of one canbus_logreader worker, merged when the query is done.
+ */
+typedef struct {
+  canbus_logquery_count *slots;   // open addressing on can_id, frames == 0 is empty
+  unsigned int mask;
+  unsigned int used;
+  uint64_t matched;
+} __attribute__((aligned(64))) canbus_logquery_worker;
+
+/**
+ * A filter, aggregate or extract query over one or more logs. ID rules follow
+ * struct can_filter: a frame matches when can_id & mask equals id & mask.
+ * Logs are scanned from a read only mapping by canbus_logreader on every
+ * core; ID rules are matched eight frames at a time with AVX2 (four with
+ * SSE2), and an index next to a log lets the scan skip entries the time
+ * window or exact IDs rule out.
+ */
+typedef struct canbus_logquery {
+  uint32_t ids[CANBUS_LOGQUERY_RULES_MAX];    // can_id & mask
+  uint32_t masks[CANBUS_LOGQUERY_RULES_MAX];
+  unsigned int nrules;                        // 0 passes every frame
+  canbus_logquery_pattern patterns[CANBUS_LOGQUERY_PATTERNS_MAX];
+  unsigned int npatterns;
+  struct timespec from;                       // zero leaves that end open
+  struct timespec to;
+  struct timespec last;                       // non zero: the last seconds of each log, from its index
+  uint8_t action;                             // CANBUS_LOGQUERY_*
+  unsigned int threads;                       // 0 = one per online CPU
+  FILE *out;                                  // CANBUS_LOGQUERY_FRAMES
+  char *csv;
+  size_t csv_len;
+  canbus_logquery_worker workers[CANBUS_LOGREADER_THREADS_MAX];
+  uint64_t scanned;                           // frames parsed
+  uint64_t bytes;                             // of log parsed
+} canbus_logquery;
+
+int canbus_logquery_kernel(int kernel);
+const char *canbus_logquery_kernel_name(int kernel);
+void canbus_logquery_init(canbus_logquery *query, uint8_t action);
+unsigned int canbus_logquery_add_id(canbus_logquery *query, uint32_t can_id, uint32_t can_mask);
+unsigned int canbus_logquery_add_pattern(canbus_logquery *query, uint8_t offset, const uint8_t *data, const uint8_t *mask, uint8_t len);
+unsigned int canbus_logquery_match(canbus_logquery *query, canbus_frame *frames, unsigned int nframes, uint16_t *sel);
+unsigned int canbus_logquery_run(canbus_logquery *query, const char *filename);
+uint64_t canbus_logquery_matched(canbus_logquery *query);
+canbus_logquery_count *canbus_logquery_counts(canbus_logquery *query, unsigned int *count);
+void canbus_logquery_free(canbus_logquery *query);
+
+#endif
@@ -0,0 +1,384 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "canbus_logreader.h"
+
+/**
+ * Maps log, which has just been loaded with canbus_log_load, for threads
+ * workers (0 = one per online CPU). Fails on files that can not be mapped,
+ * like a pipe; those are still readable with canbus_log_read_frames.
+ */
+unsigned int canbus_logreader_open(canbus_logreader *reader, canbus_log *log, unsigned int threads, unsigned int flags) {
+  canbus_frame frame;
+  struct stat st;
+  off_t start;
+  unsigned int rc;
+
+  memset(reader, 0, sizeof(canbus_logreader));
+  reader->log = log;
+  reader->flags = flags;
+
+  if(fstat(fileno(log->file), &st) != 0 || !S_ISREG(st.st_mode) || (start = ftello(log->file)) < 0) {
+    syslog(LOG_DEBUG, "canbus_logreader_open: %s is not a regular file", log->filename);
+    return ESPIPE;
+  }
+  reader->size = st.st_size;
+  if(reader->size > 0) {
+    reader->map = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, fileno(log->file), 0);
+    if(reader->map == MAP_FAILED) {
+      rc = errno;
+      syslog(LOG_ERR, "canbus_logreader_open: mmap failed. error=%s", strerror(rc));
+      reader->map = NULL;
+      return rc;
+    }
+    madvise(reader->map, reader->size, MADV_SEQUENTIAL);
+  }
+
+  if(threads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? cpus : 1;
+  }
+  reader->threads = threads < CANBUS_LOGREADER_THREADS_MAX ? threads : CANBUS_LOGREADER_THREADS_MAX;
+  reader->slots = 2 * reader->threads;
+  reader->chunks = calloc(reader->slots, sizeof(canbus_logreader_chunk));
+  if(reader->chunks == NULL) {
+    syslog(LOG_ERR, "canbus_logreader_open: unable to allocate chunks");
+    canbus_logreader_close(reader);
+    return ENOMEM;
+  }
+
+  // the ASC time base comes from the lines before the first frame
+  canbus_log_read_frames(log, &frame, 1);
+  reader->pos = start;
+  reader->end = reader->size;
+  reader->split = reader->pos >= reader->end;
+
+  // relative ASC timestamps chain from line to line, so they are parsed in one piece
+  reader->chunk_len = log->backend->format == CANBUS_LOG_FORMAT_ASC && log->asc.relative ? reader->size : CANBUS_LOGREADER_CHUNK_LEN;
+
+  pthread_mutex_init(&reader->lock, NULL);
+  pthread_cond_init(&reader->work, NULL);
+  pthread_cond_init(&reader->done, NULL);
+  return 0;
+}
+
+/**
+ * Only reads the parts of an indexed log that may hold frames filter passes;
+ * the frames handed to onframes still have to be matched against it. Call
+ * before canbus_logreader_run. Logs without an index, and ASC logs with
+ * relative timestamps, are read whole.
+ */
+void canbus_logreader_filter(canbus_logreader *reader, canbus_log_filter *filter) {
+  if(reader->log->index != NULL && reader->chunk_len != reader->size) {
+    reader->filter = filter;
+  }
+}
+
+/**
+ * Moves pos past the index entries the filter rules out and sets run_end to
+ * the end of the entries that follow and may match. Whatever no entry covers,
+ * like a pcapng header or the tail of a log that was not closed, is read.
+ */
+static void canbus_logreader_skip(canbus_logreader *reader) {
+  canbus_log_index *index = reader->log->index;
+  const canbus_log_index_entry *entry;
+  size_t from, to;
+
+  while(reader->pos >= reader->run_end) {
+    if(reader->entry >= index->count) {
+      reader->run_end = reader->end;
+      return;
+    }
+    entry = &index->entries[reader->entry];
+    from = le64toh(entry->offset);
+    to = from + le64toh(entry->len);
+    if(from > reader->pos) {
+      reader->run_end = from;
+      return;
+    }
+    reader->entry++;
+    if(to <= reader->pos) {
+      continue;
+    }
+    if(!canbus_log_index_match(entry, reader->filter)) {
+      reader->pos = to;
+      continue;
+    }
+    reader->run_end = to;
+    while(reader->entry < index->count && le64toh(index->entries[reader->entry].offset) == reader->run_end &&
+          canbus_log_index_match(&index->entries[reader->entry], reader->filter)) {
+      reader->run_end += le64toh(index->entries[reader->entry++].len);
+    }
+  }
+}
+
+/**
+ * Cuts the next chunk off the unsplit part of the file. Record formats are
+ * walked record by record, which also brings the log's state up to the start
+ * of the following chunk; a torn or corrupt record ends the log.
+ */
+static void canbus_logreader_split(canbus_logreader *reader, canbus_logreader_chunk *chunk) {
+  const canbus_log_backend *backend = reader->log->backend;
+  size_t from, to, len, end = reader->end;
+  const uint8_t *nl;
+
+  if(reader->filter != NULL) {
+    canbus_logreader_skip(reader);
+    if(reader->pos > end) reader->pos = end;
+    if(reader->run_end < end) end = reader->run_end;
+  }
+  from = reader->pos;
+
+  chunk->state = *reader->log;
+  if(backend->parse != NULL) {
+    to = end;
+    if(end - from > reader->chunk_len) {
+      nl = memchr(reader->map + from + reader->chunk_len, '\n', end - from - reader->chunk_len);
+      if(nl != NULL) {
+        to = nl - reader->map + 1;
+      }
+    }
+  }
+  else {
+    for(to = from; to < end && to - from < reader->chunk_len; to += len) {
+      if((len = backend->record(reader->log, reader->map + to, end - to)) == 0) {
+        syslog(LOG_DEBUG, "canbus_logreader_split: %s ends with %zu bytes of a torn record", reader->log->filename, reader->end - to);
+        reader->end = to;
+        break;
+      }
+    }
+  }
+  chunk->data = reader->map + from;
+  chunk->len = to - from;
+  reader->pos = to;
+}
+
+static bool canbus_logreader_grow(canbus_logreader_chunk *chunk) {
+  unsigned int cap = chunk->cap > 0 ? chunk->cap * 2 : 4 * CANBUS_LOG_RECORD_FRAMES;
+  canbus_frame *frames = realloc(chunk->frames, cap * sizeof(canbus_frame));
+  if(frames == NULL) {
+    syslog(LOG_ERR, "canbus_logreader_grow: unable to allocate %u frames", cap);
+    return false;
+  }
+  chunk->frames = frames;
+  chunk->cap = cap;
+  return true;
+}
+
+static void canbus_logreader_parse(canbus_logreader *reader, canbus_logreader_chunk *chunk) {
+  const canbus_log_backend *backend = reader->log->backend;
+  const uint8_t *p = chunk->data, *end = chunk->data + chunk->len, *nl;
+  char line[CANBUS_LOGREADER_LINE_LEN];
+  size_t len, copy;
+  int n;
+
+  chunk->count = 0;
+  chunk->corrupt = false;
+  while(p < end) {
+    if(chunk->cap - chunk->count < CANBUS_LOG_RECORD_FRAMES && !canbus_logreader_grow(chunk)) {
+      chunk->corrupt = true;
+      return;
+    }
+    if(backend->parse != NULL) {
+      nl = memchr(p, '\n', end - p);
+      len = (nl != NULL ? nl + 1 : end) - p;
+      copy = len < sizeof(line) ? len : sizeof(line) - 1;
+      memcpy(line, p, copy);
+      line[copy] = '\0';
+      memset(&chunk->frames[chunk->count], 0, sizeof(canbus_frame));
+      chunk->count += backend->parse(&chunk->state, line, &chunk->frames[chunk->count]) == 1;
+    }
+    else {
+      len = backend->record(&chunk->state, p, end - p);
+      if(len == 0 || (n = backend->decode(&chunk->state, p, len, &chunk->frames[chunk->count])) < 0) {
+        chunk->corrupt = true;
+        return;
+      }
+      chunk->count += n;
+    }
+    p += len;
+  }
+}
+
+static void *canbus_logreader_thread(void *ptr) {
+  canbus_logreader_worker *worker = (canbus_logreader_worker *)ptr;
+  canbus_logreader *reader = worker->reader;
+  canbus_logreader_chunk *chunk;
+  bool unordered = (reader->flags & CANBUS_LOGREADER_UNORDERED) != 0;
+
+  pthread_mutex_lock(&reader->lock);
+  for(;;) {
+    while(reader->claimed == reader->queued && !reader->split && !reader->stopping) {
+      pthread_cond_wait(&reader->work, &reader->lock);
+    }
+    if(reader->claimed == reader->queued || reader->stopping) {
+      break;
+    }
+    chunk = &reader->chunks[reader->claimed++ % reader->slots];
+    chunk->status = CANBUS_LOGREADER_CHUNK_PARSING;
+    pthread_mutex_unlock(&reader->lock);
+
+    canbus_logreader_parse(reader, chunk);
+    if(unordered && !__atomic_load_n(&reader->stopping, __ATOMIC_RELAXED)) {
+      reader->onframes(chunk->frames, chunk->count, worker->index, reader->arg);
+    }
+
+    pthread_mutex_lock(&reader->lock);
+    reader->stats.bytes += chunk->len;
+    reader->stats.chunks++;
+    if(unordered) {
+      reader->stats.frames += chunk->count;
+      if(chunk->corrupt) {
+        syslog(LOG_ERR, "canbus_logreader_thread: %s: corrupt record, the rest of the log is skipped", reader->log->filename);
+        reader->stopping = true;
+        pthread_cond_broadcast(&reader->work);
+      }
+    }
+    chunk->status = unordered ? CANBUS_LOGREADER_CHUNK_FREE : CANBUS_LOGREADER_CHUNK_DONE;
+    pthread_cond_broadcast(&reader->done);
+  }
+  pthread_mutex_unlock(&reader->lock);
+  return NULL;
+}
+
+/**
+ * True once no chunk is left to hand out or, when stopping, being parsed.
+ */
+static bool canbus_logreader_finished(canbus_logreader *reader) {
+  unsigned int i;
+  if(!reader->split && !reader->stopping) {
+    return false;
+  }
+  for(i=0; i<reader->slots; i++) {
+    uint8_t status = reader->chunks[i].status;
+    if(reader->stopping ? status == CANBUS_LOGREADER_CHUNK_PARSING : status != CANBUS_LOGREADER_CHUNK_FREE) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Reads the whole log into onframes and returns once every chunk has been
+ * handed to it, or canbus_logreader_stop was called.
+ */
+unsigned int canbus_logreader_run(canbus_logreader *reader, canbus_logreader_onframes onframes, void *arg) {
+  bool ordered = (reader->flags & CANBUS_LOGREADER_UNORDERED) == 0;
+  canbus_logreader_chunk *chunk;
+  unsigned int i, started = 0;
+  int rc = 0;
+
+  reader->onframes = onframes;
+  reader->arg = arg;
+  for(i=0; i<reader->threads; i++) {
+    reader->workers[i].reader = reader;
+    reader->workers[i].index = i;
+    if((rc = pthread_create(&reader->workers[i].thread, NULL, canbus_logreader_thread, &reader->workers[i])) != 0) {
+      syslog(LOG_ERR, "canbus_logreader_run: unable to start worker %u: %s", i, strerror(rc));
+      break;
+    }
+    started++;
+  }
+  if(started == 0) {
+    return rc;
+  }
+
+  pthread_mutex_lock(&reader->lock);
+  for(;;) {
+    chunk = &reader->chunks[reader->queued % reader->slots];
+    if(!reader->split && !reader->stopping && chunk->status == CANBUS_LOGREADER_CHUNK_FREE) {
+      pthread_mutex_unlock(&reader->lock);
+      canbus_logreader_split(reader, chunk);
+      pthread_mutex_lock(&reader->lock);
+      chunk->status = CANBUS_LOGREADER_CHUNK_QUEUED;
+      reader->queued++;
+      reader->split = reader->pos >= reader->end;
+      pthread_cond_broadcast(&reader->work);
+      continue;
+    }
+
+    chunk = &reader->chunks[reader->delivered % reader->slots];
+    if(ordered && reader->delivered < reader->queued && chunk->status == CANBUS_LOGREADER_CHUNK_DONE) {
+      pthread_mutex_unlock(&reader->lock);
+      if(!__atomic_load_n(&reader->stopping, __ATOMIC_RELAXED)) {
+        onframes(chunk->frames, chunk->count, 0, arg);
+      }
+      if(chunk->corrupt) {
+        syslog(LOG_ERR, "canbus_logreader_run: %s: corrupt record, the rest of the log is skipped", reader->log->filename);
+        canbus_logreader_stop(reader);
+      }
+      pthread_mutex_lock(&reader->lock);
+      reader->stats.frames += chunk->count;
+      chunk->status = CANBUS_LOGREADER_CHUNK_FREE;
+      reader->delivered++;
+      continue;
+    }
+
+    if(canbus_logreader_finished(reader)) {
+      break;
+    }
+    pthread_cond_wait(&reader->done, &reader->lock);
+  }
+  reader->stopping = true;
+  pthread_cond_broadcast(&reader->work);
+  pthread_mutex_unlock(&reader->lock);
+
+  for(i=0; i<started; i++) {
+    pthread_join(reader->workers[i].thread, NULL);
+  }
+  syslog(LOG_DEBUG, "canbus_logreader_run: %s: frames=%llu, bytes=%llu, chunks=%llu, threads=%u", reader->log->filename,
+    (unsigned long long)reader->stats.frames, (unsigned long long)reader->stats.bytes, (unsigned long long)reader->stats.chunks, started);
+  return 0;
+}
+
+/**
+ * Called from onframes: no more chunks are handed out after this one.
+ */
+void canbus_logreader_stop(canbus_logreader *reader) {
+  pthread_mutex_lock(&reader->lock);
+  reader->stopping = true;
+  pthread_cond_broadcast(&reader->work);
+  pthread_cond_broadcast(&reader->done);
+  pthread_mutex_unlock(&reader->lock);
+}
+
+void canbus_logreader_close(canbus_logreader *reader) {
+  unsigned int i;
+  if(reader->chunks != NULL) {
+    for(i=0; i<reader->slots; i++) {
+      free(reader->chunks[i].frames);
+    }
+    free(reader->chunks);
+    reader->chunks = NULL;
+    pthread_mutex_destroy(&reader->lock);
+    pthread_cond_destroy(&reader->work);
+    pthread_cond_destroy(&reader->done);
+  }
+  if(reader->map != NULL) {
+    munmap(reader->map, reader->size);
+    reader->map = NULL;
+  }
+}
@@ -0,0 +1,111 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANBUSLOGREADER_H
+#define CANBUSLOGREADER_H
+
+#include <pthread.h>
+#include "canbus_log.h"
+
+#define CANBUS_LOGREADER_CHUNK_LEN   (256 * 1024)  // bytes of the log one worker parses at a time; keeps its frames in cache
+#define CANBUS_LOGREADER_THREADS_MAX 16
+#define CANBUS_LOGREADER_SLOTS       (2 * CANBUS_LOGREADER_THREADS_MAX)  // chunks parsed ahead of the consumer, at most
+#define CANBUS_LOGREADER_LINE_LEN    1024          // longer lines are cut; none of the formats writes one
+
+#define CANBUS_LOGREADER_UNORDERED   (1 << 0)      // workers hand chunks to the consumer as they finish them
+
+#define CANBUS_LOGREADER_CHUNK_FREE    0
+#define CANBUS_LOGREADER_CHUNK_QUEUED  1
+#define CANBUS_LOGREADER_CHUNK_PARSING 2
+#define CANBUS_LOGREADER_CHUNK_DONE    3
+
+/**
+ * Called with the frames of one chunk. In order, from the thread running
+ * canbus_logreader_run, worker always 0; with CANBUS_LOGREADER_UNORDERED
+ * concurrently from the workers, worker being the index of the calling one.
+ */
+typedef void (*canbus_logreader_onframes)(canbus_frame *frames, unsigned int nframes, unsigned int worker, void *arg);
+
+typedef struct {
+  const uint8_t *data;
+  size_t len;
+  canbus_log state;         // backend state at the first record of the chunk
+  canbus_frame *frames;     // grows to the most frames any chunk in this slot held
+  unsigned int count;
+  unsigned int cap;
+  bool corrupt;             // a record failed to decode; the log ends there
+  uint8_t status;           // CANBUS_LOGREADER_CHUNK_*
+} canbus_logreader_chunk;
+
+struct canbus_logreader;
+
+typedef struct {
+  struct canbus_logreader *reader;
+  unsigned int index;
+  pthread_t thread;
+} canbus_logreader_worker;
+
+typedef struct {
+  uint64_t frames;          // handed to the consumer
+  uint64_t bytes;           // of the log parsed
+  uint64_t chunks;
+} canbus_logreader_stats;
+
+/**
+ * Replays or scans a whole log from a read only mapping. The calling thread
+ * splits the file on record boundaries into chunks of about
+ * CANBUS_LOGREADER_CHUNK_LEN: line formats at the first newline past the
+ * chunk length, the others by walking the record lengths. Workers parse the
+ * chunks with the log's backend into frame arrays, and the consumer gets one
+ * batch per chunk, in file order unless it asks for them unordered.
+ */
+typedef struct canbus_logreader {
+  canbus_log *log;
+  uint8_t *map;
+  size_t size;
+  size_t pos;               // where the next chunk starts
+  size_t end;               // of the last whole record
+  size_t chunk_len;
+  unsigned int flags;       // CANBUS_LOGREADER_*
+  unsigned int threads;
+  canbus_logreader_worker workers[CANBUS_LOGREADER_THREADS_MAX];
+  canbus_logreader_chunk *chunks;   // CANBUS_LOGREADER_SLOTS, used round robin
+  unsigned int slots;
+  uint64_t queued;          // chunks split so far
+  uint64_t claimed;         // by a worker
+  uint64_t delivered;       // in order, to the consumer
+  bool split;               // nothing left to split
+  bool stopping;
+  pthread_mutex_t lock;
+  pthread_cond_t work;      // a chunk was queued, or the reader is stopping
+  pthread_cond_t done;      // a chunk was parsed or handed back
+  canbus_logreader_onframes onframes;
+  void *arg;
+  canbus_log_filter *filter;        // index entries it can not pass are not read
+  unsigned int entry;               // next index entry the splitter looks at
+  size_t run_end;                   // end of the entries being split
+  canbus_logreader_stats stats;
+} canbus_logreader;
+
+unsigned int canbus_logreader_open(canbus_logreader *reader, canbus_log *log, unsigned int threads, unsigned int flags);
+void canbus_logreader_filter(canbus_logreader *reader, canbus_log_filter *filter);
+unsigned int canbus_logreader_run(canbus_logreader *reader, canbus_logreader_onframes onframes, void *arg);
+void canbus_logreader_stop(canbus_logreader *reader);
+void canbus_logreader_close(canbus_logreader *reader);
+
+#endif
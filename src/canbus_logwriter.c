@@ -0,0 +1,693 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "canbus_logwriter.h"
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+
+/**
+ * Just enough of io_uring to keep one WRITEV in flight per output buffer,
+ * without depending on liburing.
+ */
+struct canbus_logwriter_uring {
+  int fd;
+  void *sq_ring;
+  void *cq_ring;
+  size_t sq_ring_len;
+  size_t cq_ring_len;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_cqe *cqes;
+};
+
+static void canbus_logwriter_uring_free(struct canbus_logwriter_uring *ring) {
+  if(ring->sqes != NULL && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_len);
+  if(ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_len);
+  if(ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_len);
+  if(ring->fd >= 0) close(ring->fd);
+  free(ring);
+}
+
+static struct canbus_logwriter_uring *canbus_logwriter_uring_init() {
+  struct io_uring_params params;
+  struct canbus_logwriter_uring *ring = calloc(1, sizeof(struct canbus_logwriter_uring));
+  if(ring == NULL) {
+    return NULL;
+  }
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(__NR_io_uring_setup, 4, &params);
+  if(ring->fd < 0) {
+    // ENOSYS on old kernels, EPERM where io_uring is disabled by policy
+    syslog(LOG_DEBUG, "canbus_logwriter_uring_init: io_uring unavailable: %s", strerror(errno));
+    free(ring);
+    return NULL;
+  }
+
+  ring->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  ring->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if(params.features & IORING_FEAT_SINGLE_MMAP) {
+    if(ring->cq_ring_len > ring->sq_ring_len) ring->sq_ring_len = ring->cq_ring_len;
+    ring->cq_ring_len = ring->sq_ring_len;
+  }
+  ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if(ring->sq_ring == MAP_FAILED) {
+    syslog(LOG_ERR, "canbus_logwriter_uring_init: unable to map submission ring: %s", strerror(errno));
+    canbus_logwriter_uring_free(ring);
+    return NULL;
+  }
+  ring->cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq_ring :
+    mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if(ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    syslog(LOG_ERR, "canbus_logwriter_uring_init: unable to map completion ring: %s", strerror(errno));
+    canbus_logwriter_uring_free(ring);
+    return NULL;
+  }
+
+  ring->sq_tail = (unsigned int *)((char *)ring->sq_ring + params.sq_off.tail);
+  ring->sq_mask = (unsigned int *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *)((char *)ring->sq_ring + params.sq_off.array);
+  ring->cq_head = (unsigned int *)((char *)ring->cq_ring + params.cq_off.head);
+  ring->cq_tail = (unsigned int *)((char *)ring->cq_ring + params.cq_off.tail);
+  ring->cq_mask = (unsigned int *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+  return ring;
+}
+
+static int canbus_logwriter_uring_submit(struct canbus_logwriter_uring *ring, int fd, struct iovec *iov, off_t offset, uint64_t user_data) {
+  unsigned int tail = *ring->sq_tail;
+  unsigned int index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)iov;
+  sqe->len = 1;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  while(syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) < 0) {
+    if(errno != EINTR) return -errno;
+  }
+  return 0;
+}
+
+/**
+ * Waits for one completion. Returns its result, a byte count or -errno, and
+ * the buffer it belongs to in user_data.
+ */
+static int canbus_logwriter_uring_wait(struct canbus_logwriter_uring *ring, uint64_t *user_data) {
+  unsigned int head = *ring->cq_head;
+  while(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    if(syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+      return -errno;
+    }
+  }
+  struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+  int res = cqe->res;
+  *user_data = cqe->user_data;
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  return res;
+}
+#endif
+
+static inline int64_t canbus_logwriter_elapsed_us(struct timespec *since, struct timespec *now) {
+  return (now->tv_sec - since->tv_sec) * 1000000LL + (now->tv_nsec - since->tv_nsec) / 1000;
+}
+
+// bytes or held back frames the file has not seen yet
+static inline bool canbus_logwriter_unflushed(canbus_logwriter *writer) {
+  return writer->used > writer->written || writer->held;
+}
+
+static void canbus_logwriter_note_write(canbus_logwriter *writer, struct timespec *started) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t us = canbus_logwriter_elapsed_us(started, &now);
+  if(us > writer->stats.max_write_us) {
+    writer->stats.max_write_us = us;
+  }
+}
+
+/**
+ * Writes whatever of buf a short or failed asynchronous write left behind.
+ */
+static bool canbus_logwriter_pwrite(canbus_logwriter *writer, const char *buf, size_t len, off_t offset) {
+  while(len > 0) {
+    ssize_t n = pwrite(writer->fd, buf, len, offset);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) {
+      syslog(LOG_ERR, "canbus_logwriter_pwrite: %s: %s", writer->log->filename, n < 0 ? strerror(errno) : "short write");
+      return false;
+    }
+    buf += n;
+    len -= n;
+    offset += n;
+  }
+  return true;
+}
+
+static void canbus_logwriter_failed(canbus_logwriter *writer, unsigned int i) {
+  writer->stats.lost += writer->frames[i];
+  __atomic_add_fetch(&writer->failed, writer->frames[i], __ATOMIC_RELAXED);
+}
+
+/**
+ * Waits until buffer i may be filled again.
+ */
+static void canbus_logwriter_complete(canbus_logwriter *writer, unsigned int i) {
+#ifdef __NR_io_uring_setup
+  struct timespec started;
+  uint64_t user_data;
+  int res;
+
+  if(!writer->inflight[i]) {
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  while(writer->inflight[i]) {
+    user_data = UINT64_MAX;
+    res = canbus_logwriter_uring_wait(writer->uring, &user_data);
+    if(user_data > 1) {
+      // the ring itself failed; nothing is in flight that we can learn about
+      syslog(LOG_ERR, "canbus_logwriter_complete: %s: %s", writer->log->filename, strerror(-res));
+      writer->inflight[0] = writer->inflight[1] = false;
+      canbus_logwriter_failed(writer, i);
+      break;
+    }
+    struct iovec *iov = &writer->iov[user_data];
+    if(res < 0) {
+      syslog(LOG_ERR, "canbus_logwriter_complete: %s: %s", writer->log->filename, strerror(-res));
+      canbus_logwriter_failed(writer, user_data);
+    }
+    else if((size_t)res < iov->iov_len &&
+            !canbus_logwriter_pwrite(writer, (char *)iov->iov_base + res, iov->iov_len - res, writer->offset[user_data] + res)) {
+      canbus_logwriter_failed(writer, user_data);
+    }
+    writer->inflight[user_data] = false;
+    writer->frames[user_data] = 0;
+  }
+  canbus_logwriter_note_write(writer, &started);
+#endif
+}
+
+/**
+ * Writes bytes [from, to) of buffer i. io_uring writes complete in the
+ * background and are reaped by canbus_logwriter_complete.
+ */
+static void canbus_logwriter_submit(canbus_logwriter *writer, unsigned int i, size_t from, size_t to) {
+  struct timespec started;
+
+  clock_gettime(CLOCK_MONOTONIC, &started);
+#ifdef CANBUS_LOGWRITER_BENCH
+  if(writer->delay_us > 0) {
+    usleep(writer->delay_us);
+  }
+#endif
+  writer->iov[i].iov_base = writer->buf[i] + from;
+  writer->iov[i].iov_len = to - from;
+  writer->offset[i] = writer->base + from;
+  writer->stats.bytes += to - from;
+  writer->stats.writes++;
+  writer->dirty = true;
+
+#ifdef __NR_io_uring_setup
+  if(writer->io == CANBUS_LOGWRITER_IO_URING) {
+    int rc = canbus_logwriter_uring_submit(writer->uring, writer->fd, &writer->iov[i], writer->offset[i], i);
+    if(rc == 0) {
+      writer->inflight[i] = true;
+      canbus_logwriter_note_write(writer, &started);
+      return;
+    }
+    syslog(LOG_ERR, "canbus_logwriter_submit: io_uring submit failed, using pwritev: %s", strerror(-rc));
+    writer->io = CANBUS_LOGWRITER_IO_PWRITEV;
+  }
+#endif
+
+  ssize_t n;
+  do {
+    n = pwritev(writer->fd, &writer->iov[i], 1, writer->offset[i]);
+  } while(n < 0 && errno == EINTR);
+  if(n < 0) {
+    syslog(LOG_ERR, "canbus_logwriter_submit: %s: %s", writer->log->filename, strerror(errno));
+    canbus_logwriter_failed(writer, i);
+  }
+  else if((size_t)n < to - from &&
+          !canbus_logwriter_pwrite(writer, writer->buf[i] + from + n, to - from - n, writer->offset[i] + n)) {
+    canbus_logwriter_failed(writer, i);
+  }
+  writer->frames[i] = 0;
+  canbus_logwriter_note_write(writer, &started);
+}
+
+/**
+ * Hands the full active buffer to the kernel and switches to the other one,
+ * once its previous write has completed.
+ */
+static void canbus_logwriter_swap(canbus_logwriter *writer) {
+  unsigned int i = writer->active;
+  canbus_logwriter_submit(writer, i, writer->written, writer->used);
+  writer->base += writer->used;
+  writer->active = i ^ 1;
+  canbus_logwriter_complete(writer, writer->active);
+  writer->cap = CANBUS_LOGWRITER_BUFFER_LEN - (writer->base % CANBUS_LOGWRITER_ALIGN);
+  writer->used = 0;
+  writer->written = 0;
+  clock_gettime(CLOCK_MONOTONIC, &writer->flushed);
+}
+
+static void canbus_logwriter_encode(canbus_logwriter *writer, canbus_frame *frame);
+
+/**
+ * Writes the part of the active buffer not yet on its way to the file. The
+ * buffer keeps filling afterwards, so the next write starts where this one
+ * ended rather than on an aligned offset.
+ */
+static void canbus_logwriter_flush(canbus_logwriter *writer) {
+  if(writer->held) {
+    canbus_logwriter_encode(writer, NULL);
+  }
+  unsigned int i = writer->active;
+  if(writer->used > writer->written) {
+    canbus_logwriter_complete(writer, i);
+    canbus_logwriter_submit(writer, i, writer->written, writer->used);
+    canbus_logwriter_complete(writer, i);
+    writer->written = writer->used;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &writer->flushed);
+}
+
+static void canbus_logwriter_sync(canbus_logwriter *writer) {
+  canbus_logwriter_complete(writer, 0);
+  canbus_logwriter_complete(writer, 1);
+  if(writer->dirty) {
+    if(fdatasync(writer->fd) != 0) {
+      syslog(LOG_ERR, "canbus_logwriter_sync: %s: %s", writer->log->filename, strerror(errno));
+    }
+    writer->stats.syncs++;
+    writer->dirty = false;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &writer->synced);
+}
+
+static inline size_t canbus_logwriter_encode_into(canbus_logwriter *writer, canbus_frame *frame, char *buf) {
+  const canbus_log_backend *backend = writer->log->backend;
+  if(frame == NULL) {
+    writer->held = false;
+    return backend->flush(writer->log, buf);
+  }
+  writer->held = backend->flush != NULL;
+  return backend->encode(writer->log, frame, buf);
+}
+
+/**
+ * Appends frame to the active buffer, or with frame NULL whatever the backend
+ * held back.
+ */
+static void canbus_logwriter_encode(canbus_logwriter *writer, canbus_frame *frame) {
+  size_t room = writer->cap - writer->used, len;
+  off_t offset = writer->base + writer->used;
+  char *buf = writer->buf[writer->active];
+
+  if(frame != NULL) {
+    writer->frames[writer->active]++;
+    writer->stats.frames++;
+    if(writer->log->frames++ == 0) {
+      writer->log->first = frame->ts;
+    }
+    writer->log->last = frame->ts;
+  }
+  if(room >= writer->log->backend->record_max) {
+    len = canbus_logwriter_encode_into(writer, frame, buf + writer->used);
+    if(frame != NULL && writer->log->index != NULL) {
+      canbus_log_index_frame(writer->log, frame, offset, len);
+    }
+    writer->used += len;
+    if(writer->used == writer->cap) {
+      canbus_logwriter_swap(writer);
+    }
+    return;
+  }
+
+  // the record straddles the aligned end of the buffer
+  len = canbus_logwriter_encode_into(writer, frame, writer->record);
+  if(frame != NULL && writer->log->index != NULL) {
+    canbus_log_index_frame(writer->log, frame, offset, len);
+  }
+  char *record = writer->record;
+  size_t head = len < room ? len : room;
+  memcpy(buf + writer->used, record, head);
+  writer->used += head;
+  if(writer->used < writer->cap) {
+    return;
+  }
+  canbus_logwriter_swap(writer);
+  memcpy(writer->buf[writer->active], record + head, len - head);
+  writer->used = len - head;
+}
+
+/**
+ * Finishes the open segment and moves on to the next one, which starts with
+ * an aligned buffer of its own.
+ */
+static void canbus_logwriter_rotate(canbus_logwriter *writer) {
+  canbus_log *log = writer->log;
+
+  canbus_logwriter_flush(writer);
+  canbus_logwriter_sync(writer);
+  if(fseeko(log->file, writer->base + writer->used, SEEK_SET) != 0) {
+    syslog(LOG_ERR, "canbus_logwriter_rotate: %s: %s", log->filename, strerror(errno));
+  }
+  writer->used = 0;
+  writer->written = 0;
+  writer->fd = -1;
+  if(canbus_log_rotate(log) != 0) {
+    return;
+  }
+  writer->fd = fileno(log->file);
+  writer->base = ftello(log->file);
+  writer->cap = CANBUS_LOGWRITER_BUFFER_LEN - (writer->base % CANBUS_LOGWRITER_ALIGN);
+}
+
+/**
+ * Milliseconds until a partly filled buffer is due to be written or the file
+ * due to be synced, -1 if neither is pending.
+ */
+static int canbus_logwriter_timeout(canbus_logwriter *writer, struct timespec *now) {
+  int64_t ms = INT64_MAX, due;
+  if(canbus_logwriter_unflushed(writer)) {
+    ms = CANBUS_LOGWRITER_FLUSH_MS - (int64_t)canbus_logwriter_elapsed_us(&writer->flushed, now) / 1000;
+  }
+  if(writer->fsync_ms > 0 && (writer->dirty || canbus_logwriter_unflushed(writer))) {
+    due = writer->fsync_ms - (int64_t)canbus_logwriter_elapsed_us(&writer->synced, now) / 1000;
+    if(due < ms) ms = due;
+  }
+  if(ms == INT64_MAX) {
+    return -1;
+  }
+  return ms < 0 ? 0 : (int)ms;
+}
+
+static void canbus_logwriter_tick(canbus_logwriter *writer) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if(canbus_logwriter_unflushed(writer) &&
+     canbus_logwriter_elapsed_us(&writer->flushed, &now) >= CANBUS_LOGWRITER_FLUSH_MS * 1000) {
+    canbus_logwriter_flush(writer);
+  }
+  if(writer->fsync_ms > 0 && canbus_logwriter_elapsed_us(&writer->synced, &now) >= (int64_t)writer->fsync_ms * 1000) {
+    if(canbus_logwriter_unflushed(writer)) {
+      canbus_logwriter_flush(writer);
+    }
+    canbus_logwriter_sync(writer);
+  }
+}
+
+/**
+ * Drains every frame published so far. Returns the number drained.
+ */
+static unsigned int canbus_logwriter_drain(canbus_logwriter *writer) {
+  uint64_t tail = writer->tail;
+  uint64_t head = __atomic_load_n(&writer->head, __ATOMIC_ACQUIRE);
+  unsigned int n = 0;
+
+  for(; tail != head; tail++, n++) {
+    canbus_frame *frame = &writer->ring[tail & writer->mask];
+    if(writer->log->segments != NULL) {
+      if(writer->log->file != NULL && canbus_log_segment_due(writer->log, writer->base + writer->used)) {
+        canbus_logwriter_rotate(writer);
+      }
+      // a segment that failed to open drops everything until the writer stops
+      if(writer->log->file == NULL) {
+        writer->stats.lost++;
+        __atomic_add_fetch(&writer->failed, 1, __ATOMIC_RELAXED);
+        continue;
+      }
+    }
+    if(!(frame->frame.can_id & CAN_ERR_FLAG) || writer->log->backend->errors) {
+      canbus_logwriter_encode(writer, frame);
+    }
+    // hand slots back a batch at a time rather than per frame
+    if((tail & (CANBUS_BATCH_SIZE - 1)) == CANBUS_BATCH_SIZE - 1) {
+      __atomic_store_n(&writer->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+  }
+  __atomic_store_n(&writer->tail, tail, __ATOMIC_RELEASE);
+  return n;
+}
+
+static void *canbus_logwriter_thread(void *ptr) {
+
+  canbus_logwriter *writer = (canbus_logwriter *)ptr;
+  struct pollfd pfd = { .fd = writer->wakefd, .events = POLLIN };
+  struct timespec now;
+  uint64_t value;
+
+  syslog(LOG_DEBUG, "canbus_logwriter_thread: %s running, io=%s", writer->log->filename,
+    writer->io == CANBUS_LOGWRITER_IO_URING ? "io_uring" : "pwritev");
+
+  while(__atomic_load_n(&writer->state, __ATOMIC_ACQUIRE) == CANBUS_LOGWRITER_RUNNING) {
+    if(canbus_logwriter_drain(writer) > 0) {
+      canbus_logwriter_tick(writer);
+      continue;
+    }
+    // push checks waiting after publishing head, so one of us sees the other
+    __atomic_store_n(&writer->waiting, true, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&writer->head, __ATOMIC_SEQ_CST) == writer->tail &&
+       __atomic_load_n(&writer->state, __ATOMIC_ACQUIRE) == CANBUS_LOGWRITER_RUNNING) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if(poll(&pfd, 1, canbus_logwriter_timeout(writer, &now)) > 0) {
+        if(read(writer->wakefd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+          syslog(LOG_ERR, "canbus_logwriter_thread: unable to read wake event: %s", strerror(errno));
+        }
+      }
+    }
+    __atomic_store_n(&writer->waiting, false, __ATOMIC_RELAXED);
+    canbus_logwriter_tick(writer);
+  }
+
+  canbus_logwriter_drain(writer);
+  canbus_logwriter_flush(writer);
+  canbus_logwriter_sync(writer);
+
+  syslog(LOG_DEBUG, "canbus_logwriter_thread: %s stopped", writer->log->filename);
+  return NULL;
+}
+
+/**
+ * Takes over writing log, which must already be open with its header written.
+ * Fails on files that can not be written at an offset, like stdout on a pipe;
+ * the caller keeps writing those through stdio.
+ */
+unsigned int canbus_logwriter_init(canbus_logwriter *writer, canbus_log *log, unsigned int slots, unsigned int fsync_ms) {
+
+  struct stat st;
+  unsigned int i;
+
+  memset(writer, 0, sizeof(canbus_logwriter));
+  writer->log = log;
+  writer->wakefd = -1;
+  writer->fsync_ms = fsync_ms;
+  writer->state = CANBUS_LOGWRITER_STOPPED;
+
+  if(log->file == NULL || !log->writing) {
+    syslog(LOG_ERR, "canbus_logwriter_init: log is not open for writing");
+    return EINVAL;
+  }
+  if(slots < CANBUS_BATCH_SIZE || (slots & (slots - 1)) != 0) {
+    syslog(LOG_ERR, "canbus_logwriter_init: slots must be a power of two of at least %d, got %u", CANBUS_BATCH_SIZE, slots);
+    return EINVAL;
+  }
+  if(fflush(log->file) != 0) {
+    syslog(LOG_ERR, "canbus_logwriter_init: %s: %s", log->filename, strerror(errno));
+    return errno;
+  }
+  writer->fd = fileno(log->file);
+  if(fstat(writer->fd, &st) != 0 || !S_ISREG(st.st_mode) || (writer->base = ftello(log->file)) < 0) {
+    syslog(LOG_DEBUG, "canbus_logwriter_init: %s is not a regular file, writing synchronously", log->filename);
+    return ESPIPE;
+  }
+
+  writer->ring = calloc(slots, sizeof(canbus_frame));
+  if(writer->ring == NULL) {
+    syslog(LOG_ERR, "canbus_logwriter_init: unable to allocate %u slots", slots);
+    return ENOMEM;
+  }
+  writer->mask = slots - 1;
+  writer->record = malloc(log->backend->record_max);
+  if(writer->record == NULL) {
+    syslog(LOG_ERR, "canbus_logwriter_init: unable to allocate record buffer");
+    canbus_logwriter_free(writer);
+    return ENOMEM;
+  }
+  for(i=0; i<2; i++) {
+    if(posix_memalign((void **)&writer->buf[i], CANBUS_LOGWRITER_ALIGN, CANBUS_LOGWRITER_BUFFER_LEN) != 0) {
+      syslog(LOG_ERR, "canbus_logwriter_init: unable to allocate output buffers");
+      canbus_logwriter_free(writer);
+      return ENOMEM;
+    }
+  }
+  writer->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(writer->wakefd == -1) {
+    int rc = errno;
+    syslog(LOG_ERR, "canbus_logwriter_init: unable to create wake event: %s", strerror(rc));
+    canbus_logwriter_free(writer);
+    return rc;
+  }
+
+  writer->io = CANBUS_LOGWRITER_IO_PWRITEV;
+#ifdef __NR_io_uring_setup
+  writer->uring = canbus_logwriter_uring_init();
+  if(writer->uring != NULL) {
+    writer->io = CANBUS_LOGWRITER_IO_URING;
+  }
+#endif
+
+  writer->cap = CANBUS_LOGWRITER_BUFFER_LEN - (writer->base % CANBUS_LOGWRITER_ALIGN);
+  return 0;
+}
+
+unsigned int canbus_logwriter_start(canbus_logwriter *writer) {
+  clock_gettime(CLOCK_MONOTONIC, &writer->flushed);
+  writer->synced = writer->flushed;
+  writer->state = CANBUS_LOGWRITER_RUNNING;
+  int rc = pthread_create(&writer->thread, NULL, canbus_logwriter_thread, writer);
+  if(rc != 0) {
+    syslog(LOG_ERR, "canbus_logwriter_start: unable to start writer thread: %s", strerror(rc));
+    writer->state = CANBUS_LOGWRITER_STOPPED;
+    return rc;
+  }
+  return 0;
+}
+
+/**
+ * Copies frames into the ring for the writer thread. Never blocks: frames
+ * that do not fit are refused. Returns the number of frames lost since the
+ * last call, refused here or failed to reach the file in the writer thread.
+ */
+unsigned int canbus_logwriter_push(canbus_logwriter *writer, canbus_frame *frames, unsigned int nframes) {
+
+  unsigned int n, lost = 0;
+  uint64_t head = writer->head;
+  uint64_t queued = head - __atomic_load_n(&writer->tail, __ATOMIC_ACQUIRE);
+  size_t index = head & writer->mask;
+
+  if(__atomic_load_n(&writer->failed, __ATOMIC_RELAXED) > 0) {
+    lost += __atomic_exchange_n(&writer->failed, 0, __ATOMIC_RELAXED);
+  }
+
+  n = nframes;
+  if(n > writer->mask + 1 - queued) {
+    n = writer->mask + 1 - queued;
+    writer->stats.dropped += nframes - n;
+    lost += nframes - n;
+  }
+  if(n == 0) {
+    return lost;
+  }
+  if(index + n > writer->mask + 1) {
+    size_t first = writer->mask + 1 - index;
+    memcpy(&writer->ring[index], frames, first * sizeof(canbus_frame));
+    memcpy(writer->ring, frames + first, (n - first) * sizeof(canbus_frame));
+  }
+  else {
+    memcpy(&writer->ring[index], frames, n * sizeof(canbus_frame));
+  }
+  if(queued + n > writer->stats.max_queued) {
+    writer->stats.max_queued = queued + n;
+  }
+  __atomic_store_n(&writer->head, head + n, __ATOMIC_SEQ_CST);
+
+  if(__atomic_load_n(&writer->waiting, __ATOMIC_SEQ_CST)) {
+    uint64_t one = 1;
+    if(write(writer->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+      syslog(LOG_ERR, "canbus_logwriter_push: unable to wake writer: %s", strerror(errno));
+    }
+  }
+  return lost;
+}
+
+/**
+ * Writes out everything pushed so far, syncs the file and joins the writer.
+ * The log's FILE is left positioned at the end of the data, so
+ * canbus_log_close can append the backend's trailer.
+ */
+void canbus_logwriter_stop(canbus_logwriter *writer) {
+  if(writer->state != CANBUS_LOGWRITER_RUNNING) {
+    return;
+  }
+  __atomic_store_n(&writer->state, CANBUS_LOGWRITER_STOPPING, __ATOMIC_RELEASE);
+  uint64_t one = 1;
+  if(write(writer->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    syslog(LOG_ERR, "canbus_logwriter_stop: unable to wake writer: %s", strerror(errno));
+  }
+  pthread_join(writer->thread, NULL);
+  writer->state = CANBUS_LOGWRITER_STOPPED;
+
+  if(writer->log->file != NULL && fseeko(writer->log->file, writer->base + writer->used, SEEK_SET) != 0) {
+    syslog(LOG_ERR, "canbus_logwriter_stop: %s: %s", writer->log->filename, strerror(errno));
+  }
+
+  canbus_logwriter_stats *s = &writer->stats;
+  syslog(LOG_INFO, "canbus_logwriter_stop: %s frames=%llu, bytes=%llu, writes=%llu, syncs=%llu, dropped=%llu, lost=%llu, max_write_us=%llu, max_queued=%u/%u",
+    writer->log->filename, (unsigned long long)s->frames, (unsigned long long)s->bytes, (unsigned long long)s->writes,
+    (unsigned long long)s->syncs, (unsigned long long)s->dropped, (unsigned long long)s->lost,
+    (unsigned long long)s->max_write_us, s->max_queued, writer->mask + 1);
+}
+
+void canbus_logwriter_free(canbus_logwriter *writer) {
+  canbus_logwriter_stop(writer);
+#ifdef __NR_io_uring_setup
+  if(writer->uring != NULL) {
+    canbus_logwriter_uring_free(writer->uring);
+    writer->uring = NULL;
+  }
+#endif
+  free(writer->buf[0]);
+  free(writer->buf[1]);
+  writer->buf[0] = writer->buf[1] = NULL;
+  free(writer->ring);
+  writer->ring = NULL;
+  free(writer->record);
+  writer->record = NULL;
+  if(writer->wakefd != -1) {
+    close(writer->wakefd);
+    writer->wakefd = -1;
+  }
+}
@@ -0,0 +1,103 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANBUSLOGWRITER_H
+#define CANBUSLOGWRITER_H
+
+#include <sys/uio.h>
+#include "canbus_log.h"
+
+#define CANBUS_LOGWRITER_SLOTS       32768         // frames buffered between capture and writer (power of two), ~4 s of a saturated bus
+#define CANBUS_LOGWRITER_BUFFER_LEN  (256 * 1024)  // each of the two output buffers, a multiple of CANBUS_LOGWRITER_ALIGN
+#define CANBUS_LOGWRITER_ALIGN       4096          // full buffers end on this file offset boundary
+#define CANBUS_LOGWRITER_FLUSH_MS    1000          // a partly filled buffer reaches the file after this long
+#define CANBUS_LOGWRITER_FSYNC_MS    0             // default fdatasync interval; 0 syncs only on stop
+
+#define CANBUS_LOGWRITER_IO_PWRITEV  0
+#define CANBUS_LOGWRITER_IO_URING    1
+
+#define CANBUS_LOGWRITER_RUNNING     (1 << 0)
+#define CANBUS_LOGWRITER_STOPPING    (1 << 1)
+#define CANBUS_LOGWRITER_STOPPED     (1 << 2)
+
+typedef struct {
+  uint64_t frames;          // frames encoded into the log
+  uint64_t bytes;
+  uint64_t writes;
+  uint64_t syncs;
+  uint64_t dropped;         // frames refused by a full ring
+  uint64_t lost;            // frames in failed writes
+  uint64_t max_write_us;    // longest single write (or wait for one) seen by the writer
+  unsigned int max_queued;  // ring high watermark, in frames
+} canbus_logwriter_stats;
+
+struct canbus_logwriter_uring;
+
+/**
+ * Moves file I/O off the capture thread. The reactor thread copies each batch
+ * into a single producer / single consumer ring of frames with
+ * canbus_logwriter_push, which never blocks; frames that do not fit in a full
+ * ring are counted as lost instead. The
+ * writer thread encodes batches with the log's backend into one of two large
+ * buffers and writes a full buffer while it fills the other, through io_uring
+ * when the kernel allows it and pwritev otherwise. Full buffers end on
+ * CANBUS_LOGWRITER_ALIGN boundaries of the file.
+ */
+typedef struct canbus_logwriter {
+  canbus_log *log;
+  canbus_frame *ring;
+  unsigned int mask;
+  uint64_t head __attribute__((aligned(64)));  // next slot the capture thread fills
+  uint64_t tail __attribute__((aligned(64)));  // next slot the writer drains
+  bool waiting __attribute__((aligned(64)));   // writer is asleep on wakefd
+  int wakefd;
+  pthread_t thread;
+  uint8_t state;
+  uint8_t io;               // CANBUS_LOGWRITER_IO_*
+  int fd;
+  char *buf[2];
+  struct iovec iov[2];
+  off_t offset[2];          // file offset of iov[i]
+  bool inflight[2];
+  unsigned int frames[2];   // frames encoded into each buffer since its last write
+  unsigned int active;
+  off_t base;               // file offset of buf[active][0]
+  size_t cap;               // bytes buf[active] holds before base + cap is aligned
+  size_t used;
+  size_t written;           // bytes of buf[active] already written by an idle flush
+  bool held;                // the backend holds frames back for its next block
+  char *record;             // one record_max encoding that straddles the end of a buffer
+  unsigned int fsync_ms;
+#ifdef CANBUS_LOGWRITER_BENCH
+  unsigned int delay_us;    // added to every write; emulates slow storage in bench_canbus_logwriter
+#endif
+  uint64_t failed;          // frames in failed writes not yet returned by canbus_logwriter_push
+  bool dirty;               // written since the last fdatasync
+  struct timespec flushed;  // CLOCK_MONOTONIC
+  struct timespec synced;
+  struct canbus_logwriter_uring *uring;
+  canbus_logwriter_stats stats;
+} canbus_logwriter;
+
+unsigned int canbus_logwriter_init(canbus_logwriter *writer, canbus_log *log, unsigned int slots, unsigned int fsync_ms);
+unsigned int canbus_logwriter_start(canbus_logwriter *writer);
+unsigned int canbus_logwriter_push(canbus_logwriter *writer, canbus_frame *frames, unsigned int nframes);
+void canbus_logwriter_stop(canbus_logwriter *writer);
+void canbus_logwriter_free(canbus_logwriter *writer);
+
+#endif
@@ -0,0 +1,181 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "canbus_lz4.h"
+
+#define CANBUS_LZ4_MINMATCH     4
+#define CANBUS_LZ4_LASTLITERALS 5      // the block always ends with this many literals
+#define CANBUS_LZ4_MFLIMIT      12     // no match may start closer than this to the end
+#define CANBUS_LZ4_MAX_OFFSET   65535
+#define CANBUS_LZ4_HASH_LOG     12
+
+static inline uint32_t canbus_lz4_read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t canbus_lz4_hash(uint32_t v) {
+  return (v * 2654435761U) >> (32 - CANBUS_LZ4_HASH_LOG);
+}
+
+static uint8_t *canbus_lz4_put_length(uint8_t *op, size_t len) {
+  for(; len >= 255; len -= 255) {
+    *op++ = 255;
+  }
+  *op++ = len;
+  return op;
+}
+
+/**
+ * Greedy single pass compressor with a 4096 entry hash table, LZ4's "fast"
+ * level. Returns the compressed size, 0 when it would not fit in cap.
+ */
+size_t canbus_lz4_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+  uint32_t table[1 << CANBUS_LZ4_HASH_LOG];
+  const uint8_t *ip = src, *anchor = src, *ref;
+  const uint8_t *end = src + len;
+  const uint8_t *mflimit = end - CANBUS_LZ4_MFLIMIT;
+  const uint8_t *matchlimit = end - CANBUS_LZ4_LASTLITERALS;
+  uint8_t *op = dst, *op_end = dst + cap, *token;
+  size_t literals, match;
+  uint32_t h;
+
+  if(len > CANBUS_LZ4_MFLIMIT) {
+    memset(table, 0, sizeof(table));
+    ip++;
+    while(ip < mflimit) {
+      h = canbus_lz4_hash(canbus_lz4_read32(ip));
+      ref = src + table[h];
+      table[h] = ip - src;
+      if(ip - ref > CANBUS_LZ4_MAX_OFFSET || canbus_lz4_read32(ref) != canbus_lz4_read32(ip)) {
+        // step faster through data that does not compress
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+      while(ip > anchor && ref > src && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+      match = CANBUS_LZ4_MINMATCH;
+      while(ip + match < matchlimit && ip[match] == ref[match]) {
+        match++;
+      }
+
+      literals = ip - anchor;
+      if(op + 5 + literals + literals / 255 + match / 255 > op_end) {
+        return 0;
+      }
+      token = op++;
+      *token = (literals >= 15 ? 15 : literals) << 4;
+      if(literals >= 15) {
+        op = canbus_lz4_put_length(op, literals - 15);
+      }
+      memcpy(op, anchor, literals);
+      op += literals;
+      *op++ = (ip - ref) & 0xff;
+      *op++ = (ip - ref) >> 8;
+      match -= CANBUS_LZ4_MINMATCH;
+      *token |= match >= 15 ? 15 : match;
+      if(match >= 15) {
+        op = canbus_lz4_put_length(op, match - 15);
+      }
+      ip += match + CANBUS_LZ4_MINMATCH;
+      anchor = ip;
+      if(ip < mflimit) {
+        table[canbus_lz4_hash(canbus_lz4_read32(ip - 2))] = ip - 2 - src;
+      }
+    }
+  }
+
+  literals = end - anchor;
+  if(op + 1 + literals + literals / 255 + 1 > op_end) {
+    return 0;
+  }
+  token = op++;
+  *token = (literals >= 15 ? 15 : literals) << 4;
+  if(literals >= 15) {
+    op = canbus_lz4_put_length(op, literals - 15);
+  }
+  memcpy(op, anchor, literals);
+  op += literals;
+  return op - dst;
+}
+
+/**
+ * Decodes one block into dst. Every length and offset is checked, so a
+ * corrupt block fails rather than writing outside dst. Returns the
+ * decompressed size or -1.
+ */
+int canbus_lz4_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+  const uint8_t *ip = src, *end = src + len;
+  uint8_t *op = dst, *op_end = dst + cap;
+  size_t literals, match, offset;
+  uint8_t token, b;
+
+  while(ip < end) {
+    token = *ip++;
+    literals = token >> 4;
+    if(literals == 15) {
+      do {
+        if(ip >= end) return -1;
+        b = *ip++;
+        literals += b;
+      } while(b == 255);
+    }
+    if(literals > (size_t)(end - ip) || literals > (size_t)(op_end - op)) {
+      return -1;
+    }
+    memcpy(op, ip, literals);
+    ip += literals;
+    op += literals;
+    if(ip == end) {
+      break;  // the last sequence has no match
+    }
+
+    if(end - ip < 2) return -1;
+    offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if(offset == 0 || offset > (size_t)(op - dst)) {
+      return -1;
+    }
+    match = token & 15;
+    if(match == 15) {
+      do {
+        if(ip >= end) return -1;
+        b = *ip++;
+        match += b;
+      } while(b == 255);
+    }
+    match += CANBUS_LZ4_MINMATCH;
+    if(match > (size_t)(op_end - op)) {
+      return -1;
+    }
+    const uint8_t *ref = op - offset;
+    if(offset >= match) {
+      memcpy(op, ref, match);
+      op += match;
+    }
+    else {
+      // overlapping: a run of the last offset bytes
+      while(match--) *op++ = *ref++;
+    }
+  }
+  return op - dst;
+}
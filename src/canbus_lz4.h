@@ -0,0 +1,35 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANBUSLZ4_H
+#define CANBUSLZ4_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CANBUS_LZ4_BOUND(n)   ((n) + (n) / 255 + 16)   // worst case compressed size of n bytes
+
+/**
+ * A small LZ4 block codec (the raw block format, no frame header), so
+ * compressed logs do not add a library dependency. Output can be read by
+ * LZ4_decompress_safe and LZ4_decompress_safe can be fed to this decoder.
+ */
+size_t canbus_lz4_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+int canbus_lz4_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+#endif
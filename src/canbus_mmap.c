@@ -0,0 +1,184 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "canbus_mmap.h"
+
+/**
+ * Undoes a partial canbus_mmap_connect: unmaps the ring, if any, and closes
+ * the packet socket. Returns rc.
+ */
+static unsigned int canbus_mmap_connect_failed(canbus_client *canbus, unsigned int rc) {
+  canbus_mmap_close(canbus);
+  close(canbus->socket);
+  canbus->socket = 0;
+  return rc;
+}
+
+unsigned int canbus_mmap_connect(canbus_client *canbus) {
+
+  struct ifreq ifr;
+  struct sockaddr_ll addr;
+  struct tpacket_req3 req;
+  int version = TPACKET_V3;
+  int tstamp_flags = SOF_TIMESTAMPING_RAW_HARDWARE;
+
+  if((canbus->socket = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) == -1) {
+    syslog(LOG_ERR, "canbus_mmap_connect: error opening packet socket: %s", strerror(errno));
+    canbus->socket = 0;
+    return 1;
+  }
+
+  if(setsockopt(canbus->socket, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1) {
+    syslog(LOG_ERR, "canbus_mmap_connect: unable to set TPACKET_V3: %s", strerror(errno));
+    return canbus_mmap_connect_failed(canbus, 2);
+  }
+
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = CANBUS_MMAP_BLOCK_SIZE;
+  req.tp_block_nr = CANBUS_MMAP_BLOCK_NR;
+  req.tp_frame_size = CANBUS_MMAP_FRAME_SIZE;
+  req.tp_frame_nr = (CANBUS_MMAP_BLOCK_SIZE / CANBUS_MMAP_FRAME_SIZE) * CANBUS_MMAP_BLOCK_NR;
+  req.tp_retire_blk_tov = CANBUS_MMAP_RETIRE_MS;
+  if(setsockopt(canbus->socket, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1) {
+    syslog(LOG_ERR, "canbus_mmap_connect: unable to create PACKET_RX_RING: %s", strerror(errno));
+    return canbus_mmap_connect_failed(canbus, 3);
+  }
+
+  struct canbus_mmap_ring *ring = malloc(sizeof(struct canbus_mmap_ring));
+  if(ring == NULL) {
+    syslog(LOG_ERR, "canbus_mmap_connect: unable to allocate receive ring");
+    return canbus_mmap_connect_failed(canbus, 7);
+  }
+  ring->block_size = req.tp_block_size;
+  ring->block_nr = req.tp_block_nr;
+  ring->map_len = (size_t)req.tp_block_size * req.tp_block_nr;
+  ring->block = 0;
+  ring->remaining = 0;
+  ring->next = NULL;
+  ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, canbus->socket, 0);
+  if(ring->map == MAP_FAILED) {
+    syslog(LOG_ERR, "canbus_mmap_connect: unable to map receive ring: %s", strerror(errno));
+    free(ring);
+    return canbus_mmap_connect_failed(canbus, 4);
+  }
+  canbus->ring = ring;
+
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, canbus->iface, IFNAMSIZ - 1);
+  if(ioctl(canbus->socket, SIOCGIFINDEX, &ifr) < 0) {
+    syslog(LOG_ERR, "canbus_mmap_connect: unable to find CAN interface %s", canbus->iface);
+    return canbus_mmap_connect_failed(canbus, 5);
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(ETH_P_ALL);
+  addr.sll_ifindex = ifr.ifr_ifindex;
+  if(bind(canbus->socket, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    syslog(LOG_ERR, "canbus_mmap_connect: error in socket bind: %s", strerror(errno));
+    return canbus_mmap_connect_failed(canbus, 6);
+  }
+
+  canbus->mtu = CAN_MTU;
+  if(ioctl(canbus->socket, SIOCGIFMTU, &ifr) == 0 && ifr.ifr_mtu == CANFD_MTU) {
+    canbus->mtu = CANFD_MTU;
+  }
+
+  // every block header carries a timestamp; ask for the controller's clock when it has one
+  if(setsockopt(canbus->socket, SOL_PACKET, PACKET_TIMESTAMP, &tstamp_flags, sizeof(tstamp_flags)) == 0) {
+    canbus->tstamp = CANBUS_TSTAMP_TIMESTAMPING;
+  }
+  else {
+    canbus->tstamp = CANBUS_TSTAMP_TIMESTAMPNS;
+  }
+
+  syslog(LOG_DEBUG, "canbus_mmap_connect: %s socket=%i, ring=%zu bytes, mtu=%d",
+    canbus->iface, canbus->socket, ring->map_len, canbus->mtu);
+
+  return 0;
+}
+
+/**
+ * Same contract as canbus_read_batch: blocks until at least one frame is
+ * available, then returns up to vlen frames. The only syscall is the poll
+ * made when the ring is empty.
+ */
+ssize_t canbus_mmap_read_batch(canbus_client *canbus, canbus_frame *frames, unsigned int vlen) {
+
+  struct canbus_mmap_ring *ring = canbus->ring;
+  struct tpacket_block_desc *desc;
+  struct tpacket3_hdr *hdr;
+  unsigned int n = 0;
+
+  while(n == 0) {
+
+    desc = (struct tpacket_block_desc *)(ring->map + (size_t)ring->block * ring->block_size);
+
+    if(ring->remaining == 0) {
+      if((__atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0) {
+        if(canbus_poll(canbus, -1) == -1) {
+          return -1;
+        }
+        if(!canbus_isconnected(canbus)) {
+          errno = ENOTCONN;
+          return -1;
+        }
+        continue;
+      }
+      ring->remaining = desc->hdr.bh1.num_pkts;
+      ring->next = (struct tpacket3_hdr *)((uint8_t *)desc + desc->hdr.bh1.offset_to_first_pkt);
+    }
+
+    while(n < vlen && ring->remaining > 0) {
+      hdr = ring->next;
+      if(hdr->tp_snaplen == CAN_MTU || hdr->tp_snaplen == CANFD_MTU) {
+        frames[n].ts.tv_sec = hdr->tp_sec;
+        frames[n].ts.tv_nsec = hdr->tp_nsec;
+        frames[n].flags = hdr->tp_snaplen == CANFD_MTU ? CANBUS_FRAME_FD : 0;
+        memcpy(&frames[n].frame, (uint8_t *)hdr + hdr->tp_mac, hdr->tp_snaplen);
+        n++;
+      }
+      else {
+        canbus_drop(canbus, CANBUS_DROP_INCOMPLETE, 1);
+      }
+      ring->remaining--;
+      ring->next = (struct tpacket3_hdr *)((uint8_t *)hdr + hdr->tp_next_offset);
+    }
+
+    if(ring->remaining == 0) {
+      __atomic_store_n(&desc->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+      ring->block = (ring->block + 1) % ring->block_nr;
+      // frames the kernel could not place in the ring; reading the counters resets them
+      struct tpacket_stats_v3 st;
+      socklen_t len = sizeof(st);
+      if(getsockopt(canbus->socket, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0) {
+        canbus_drop(canbus, CANBUS_DROP_SOCKET, st.tp_drops);
+      }
+    }
+  }
+
+  return n;
+}
+
+void canbus_mmap_close(canbus_client *canbus) {
+  if(canbus->ring != NULL) {
+    munmap(canbus->ring->map, canbus->ring->map_len);
+    free(canbus->ring);
+    canbus->ring = NULL;
+  }
+}
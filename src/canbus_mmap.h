@@ -0,0 +1,51 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANBUSMMAP_H
+#define CANBUSMMAP_H
+
+#include <sys/mman.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <arpa/inet.h>
+#include "canbus.h"
+
+#define CANBUS_MMAP_BLOCK_SIZE  (1 << 20)  // bytes per TPACKET_V3 block
+#define CANBUS_MMAP_BLOCK_NR    16         // blocks in the ring
+#define CANBUS_MMAP_FRAME_SIZE  128        // nominal slot size; V3 packs frames back to back
+#define CANBUS_MMAP_RETIRE_MS   50         // hand a partially filled block to userspace after this long
+
+/**
+ * TPACKET_V3 receive ring shared with the kernel. Frames are consumed in
+ * place and a block is handed back as soon as its last frame is taken.
+ */
+struct canbus_mmap_ring {
+  uint8_t *map;
+  size_t map_len;
+  unsigned int block_size;
+  unsigned int block_nr;
+  unsigned int block;             // block currently owned by userspace
+  unsigned int remaining;         // frames left in that block; 0 = not yet opened
+  struct tpacket3_hdr *next;      // next frame in that block
+};
+
+unsigned int canbus_mmap_connect(canbus_client *canbus);
+ssize_t canbus_mmap_read_batch(canbus_client *canbus, canbus_frame *frames, unsigned int vlen);
+void canbus_mmap_close(canbus_client *canbus);
+
+#endif
@@ -0,0 +1,210 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "canbus_reactor.h"
+
+unsigned int canbus_reactor_init(canbus_reactor *reactor) {
+  reactor->state = 0;
+  reactor->count = 0;
+  reactor->joinable = false;
+  reactor->ontick = NULL;
+  reactor->tick_arg = NULL;
+  reactor->timeout_ms = CANBUS_REACTOR_TIMEOUT_MS;
+  memset(reactor->handlers, 0, sizeof(reactor->handlers));
+  reactor->wakefd = -1;
+  reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if(reactor->epfd == -1) {
+    syslog(LOG_ERR, "canbus_reactor_init: epoll_create1: %s", strerror(errno));
+    return 1;
+  }
+
+  // a NULL data.ptr marks the wakeup event; handlers always carry their slot
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if((reactor->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+     epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->wakefd, &ev) == -1) {
+    syslog(LOG_ERR, "canbus_reactor_init: unable to register wakeup eventfd: %s", strerror(errno));
+    return 2;
+  }
+  return 0;
+}
+
+unsigned int canbus_reactor_add(canbus_reactor *reactor, canbus_client *canbus, canbus_reactor_onread onread, void *arg) {
+
+  int i;
+  canbus_reactor_handler *handler = NULL;
+  for(i=0; i<CANBUS_REACTOR_MAX_HANDLERS; i++) {
+    if(reactor->handlers[i].canbus == NULL) {
+      handler = &reactor->handlers[i];
+      break;
+    }
+  }
+
+  if(handler == NULL) {
+    syslog(LOG_ERR, "canbus_reactor_add: no free handler slots. max=%i", CANBUS_REACTOR_MAX_HANDLERS);
+    return 1;
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = handler;
+  if(epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, canbus->socket, &ev) == -1) {
+    syslog(LOG_ERR, "canbus_reactor_add: epoll_ctl: %s. iface=%s", strerror(errno), canbus->iface);
+    return 2;
+  }
+
+  handler->onread = onread;
+  handler->arg = arg;
+  handler->canbus = canbus;
+  reactor->count++;
+
+  syslog(LOG_DEBUG, "canbus_reactor_add: iface=%s, count=%i", canbus->iface, reactor->count);
+  return 0;
+}
+
+unsigned int canbus_reactor_remove(canbus_reactor *reactor, canbus_client *canbus) {
+  int i;
+  for(i=0; i<CANBUS_REACTOR_MAX_HANDLERS; i++) {
+    if(reactor->handlers[i].canbus == canbus) {
+      epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, canbus->socket, NULL);
+      reactor->handlers[i].canbus = NULL;
+      reactor->count--;
+      syslog(LOG_DEBUG, "canbus_reactor_remove: iface=%s, count=%i", canbus->iface, reactor->count);
+      return 0;
+    }
+  }
+  syslog(LOG_ERR, "canbus_reactor_remove: iface=%s not registered", canbus->iface);
+  return 1;
+}
+
+void canbus_reactor_run(canbus_reactor *reactor) {
+
+  int i, nevents;
+  ssize_t nframes;
+  canbus_reactor_handler *handler;
+  struct epoll_event events[CANBUS_REACTOR_MAX_HANDLERS];
+  canbus_frame frames[CANBUS_BATCH_SIZE];
+  memset(frames, 0, sizeof(frames));
+
+  // a concurrent canbus_reactor_stop must win; once running, clear any wakeup left by an earlier stop
+  uint8_t state = reactor->state;
+  if(!(state & CANBUS_REACTOR_STOPPING) &&
+     __atomic_compare_exchange_n(&reactor->state, &state, CANBUS_REACTOR_RUNNING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    uint64_t stale;
+    while(reactor->wakefd >= 0 && read(reactor->wakefd, &stale, sizeof(stale)) == sizeof(stale));
+  }
+
+  syslog(LOG_DEBUG, "canbus_reactor_run: running. handlers=%i", reactor->count);
+
+  while((__atomic_load_n(&reactor->state, __ATOMIC_ACQUIRE) & CANBUS_REACTOR_RUNNING) && reactor->count > 0) {
+
+    nevents = epoll_wait(reactor->epfd, events, CANBUS_REACTOR_MAX_HANDLERS, reactor->timeout_ms);
+    if(nevents == -1) {
+      if(errno == EINTR) continue;
+      syslog(LOG_ERR, "canbus_reactor_run: epoll_wait: %s", strerror(errno));
+      break;
+    }
+
+    for(i=0; i<nevents; i++) {
+
+      handler = (canbus_reactor_handler *)events[i].data.ptr;
+      if(handler == NULL) {
+        // canbus_reactor_stop; state already says STOPPING, so the loop ends below
+        continue;
+      }
+      if(handler->canbus == NULL) continue;
+
+      if(events[i].events & (EPOLLERR | EPOLLHUP)) {
+        syslog(LOG_ERR, "canbus_reactor_run: socket error. iface=%s", handler->canbus->iface);
+        canbus_reactor_remove(reactor, handler->canbus);
+        continue;
+      }
+
+      nframes = canbus_read_batch(handler->canbus, frames, CANBUS_BATCH_SIZE);
+      if(nframes < 0) {
+        if(errno == EAGAIN || errno == EINTR) continue;
+        canbus_reactor_remove(reactor, handler->canbus);
+        continue;
+      }
+
+      if(nframes > 0) {
+        if(handler->canbus->stats != NULL) {
+          canbus_stats_update(handler->canbus->stats, frames, nframes);
+        }
+        handler->onread(handler->canbus, frames, nframes, handler->arg);
+      }
+    }
+
+    if(reactor->ontick != NULL) {
+      reactor->ontick(reactor->tick_arg);
+    }
+  }
+
+  syslog(LOG_DEBUG, "canbus_reactor_run: stopped");
+  reactor->state = CANBUS_REACTOR_STOPPED;
+}
+
+void *canbus_reactor_thread(void *ptr) {
+  canbus_reactor_run((canbus_reactor *)ptr);
+  return NULL;
+}
+
+unsigned int canbus_reactor_start(canbus_reactor *reactor) {
+  reactor->state = CANBUS_REACTOR_RUNNING;
+  if(pthread_create(&reactor->thread, NULL, canbus_reactor_thread, (void *)reactor) != 0) {
+    syslog(LOG_ERR, "canbus_reactor_start: unable to create reactor thread");
+    reactor->state = CANBUS_REACTOR_STOPPED;
+    return 1;
+  }
+  reactor->joinable = true;
+  return 0;
+}
+
+/**
+ * Wakes the reactor out of epoll_wait and, when it was started with
+ * canbus_reactor_start, joins its thread. Returns as soon as the current
+ * onread callback finishes.
+ */
+void canbus_reactor_stop(canbus_reactor *reactor) {
+  uint64_t one = 1;
+  if(!(reactor->state & CANBUS_REACTOR_STOPPED)) {
+    __atomic_store_n(&reactor->state, CANBUS_REACTOR_STOPPING, __ATOMIC_RELEASE);
+  }
+  if(reactor->wakefd >= 0 && write(reactor->wakefd, &one, sizeof(one)) != sizeof(one)) {
+    syslog(LOG_ERR, "canbus_reactor_stop: unable to wake reactor: %s", strerror(errno));
+  }
+  if(reactor->joinable) {
+    pthread_join(reactor->thread, NULL);
+    reactor->joinable = false;
+  }
+}
+
+void canbus_reactor_free(canbus_reactor *reactor) {
+  if(reactor->epfd != -1) {
+    close(reactor->epfd);
+    reactor->epfd = -1;
+  }
+  if(reactor->wakefd != -1) {
+    close(reactor->wakefd);
+    reactor->wakefd = -1;
+  }
+  reactor->count = 0;
+}
@@ -0,0 +1,76 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANBUSREACTOR_H
+#define CANBUSREACTOR_H
+
+#include <sys/epoll.h>
+#include "canbus.h"
+#include "canbus_stats.h"
+
+#define CANBUS_REACTOR_MAX_HANDLERS 16
+#define CANBUS_REACTOR_TIMEOUT_MS   1000
+
+#define CANBUS_REACTOR_RUNNING      (1 << 0)
+#define CANBUS_REACTOR_STOPPING     (1 << 1)
+#define CANBUS_REACTOR_STOPPED      (1 << 2)
+
+/**
+ * Called from the reactor thread with each batch read from an interface.
+ */
+typedef void (*canbus_reactor_onread)(canbus_client *canbus, canbus_frame *frames, unsigned int nframes, void *arg);
+
+/**
+ * Called from the reactor thread after every wakeup, and at least every
+ * timeout_ms while the buses are idle.
+ */
+typedef void (*canbus_reactor_ontick)(void *arg);
+
+typedef struct {
+  canbus_client *canbus;
+  canbus_reactor_onread onread;
+  void *arg;
+} canbus_reactor_handler;
+
+/**
+ * Services many CAN sockets from a single thread. Each readable socket gets
+ * one canbus_read_batch per wakeup so a busy bus can not starve the others.
+ * canbus_reactor_stop wakes epoll_wait immediately through wakefd.
+ */
+typedef struct {
+  int epfd;
+  int wakefd;               // eventfd in the epoll set; canbus_reactor_stop signals it
+  uint8_t state;
+  unsigned int count;
+  canbus_reactor_handler handlers[CANBUS_REACTOR_MAX_HANDLERS];
+  pthread_t thread;
+  bool joinable;
+  canbus_reactor_ontick ontick;
+  void *tick_arg;
+  int timeout_ms;           // longest epoll_wait, CANBUS_REACTOR_TIMEOUT_MS unless a sink needs ticks sooner
+} canbus_reactor;
+
+unsigned int canbus_reactor_init(canbus_reactor *reactor);
+unsigned int canbus_reactor_add(canbus_reactor *reactor, canbus_client *canbus, canbus_reactor_onread onread, void *arg);
+unsigned int canbus_reactor_remove(canbus_reactor *reactor, canbus_client *canbus);
+void canbus_reactor_run(canbus_reactor *reactor);
+unsigned int canbus_reactor_start(canbus_reactor *reactor);
+void canbus_reactor_stop(canbus_reactor *reactor);
+void canbus_reactor_free(canbus_reactor *reactor);
+
+#endif
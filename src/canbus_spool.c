@@ -0,0 +1,574 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "canbus_crc32c.h"
+#include "canbus_spool.h"
+
+static void canbus_spool_path(canbus_spool *spool, uint32_t seq, char *path) {
+  snprintf(path, CANBUS_SPOOL_FILENAME_LEN, "%s/%08u%s", spool->dir, seq, CANBUS_SPOOL_EXT);
+}
+
+static bool canbus_spool_seq(const char *name, uint32_t *seq) {
+  char *end;
+  unsigned long v = strtoul(name, &end, 10);
+  if(end == name || strcmp(end, CANBUS_SPOOL_EXT) != 0 || v == 0 || v > UINT32_MAX) {
+    return false;
+  }
+  *seq = v;
+  return true;
+}
+
+static int canbus_spool_open_segment(canbus_spool *spool, uint32_t seq, int flags) {
+  char path[CANBUS_SPOOL_FILENAME_LEN];
+  int fd;
+
+  canbus_spool_path(spool, seq, path);
+  if((fd = open(path, flags | O_CLOEXEC, 0644)) < 0) {
+    syslog(LOG_ERR, "canbus_spool_open_segment: unable to open %s. error=%s", path, strerror(errno));
+  }
+  return fd;
+}
+
+static uint32_t canbus_spool_crc(const canbus_spool_record *record, const void *topic, const void *payload) {
+  uint32_t crc = canbus_crc32c(0, &record->len, sizeof(canbus_spool_record) - offsetof(canbus_spool_record, len));
+  crc = canbus_crc32c(crc, topic, record->topic_len);
+  return canbus_crc32c(crc, payload, record->len);
+}
+
+/**
+ * Reads the record at off, which has to end by end. Returns the offset of
+ * the next record, or -1 when it is torn, corrupt or longer than max. With
+ * payload NULL only the header is read and nothing is checked past it.
+ */
+static off_t canbus_spool_read(int fd, off_t off, off_t end, canbus_spool_record *record, char *topic, void *payload, size_t max) {
+  struct iovec iov[2];
+  off_t next;
+
+  if(end - off < (off_t)sizeof(canbus_spool_record) ||
+     pread(fd, record, sizeof(canbus_spool_record), off) != sizeof(canbus_spool_record) ||
+     record->sync != CANBUS_SPOOL_SYNC || record->topic_len >= CANBUS_SPOOL_TOPIC_LEN) {
+    return -1;
+  }
+  next = off + sizeof(canbus_spool_record) + record->topic_len + record->len;
+  if(next > end) {
+    return -1;
+  }
+  if(payload == NULL) {
+    return next;
+  }
+  if(record->len > max) {
+    return -1;
+  }
+  iov[0].iov_base = topic;
+  iov[0].iov_len = record->topic_len;
+  iov[1].iov_base = payload;
+  iov[1].iov_len = record->len;
+  if(preadv(fd, iov, 2, off + sizeof(canbus_spool_record)) != (ssize_t)(record->topic_len + record->len) ||
+     canbus_spool_crc(record, topic, payload) != record->crc) {
+    return -1;
+  }
+  topic[record->topic_len] = '\0';
+  return next;
+}
+
+/**
+ * Looks past the bad record at off for the next one that reads back whole,
+ * so corruption costs that record rather than the rest of the segment.
+ * Returns its offset with *next set, or end when there is none.
+ */
+static off_t canbus_spool_resync(int fd, off_t off, off_t end, canbus_spool_record *record, char *topic, void *payload, size_t max, off_t *next) {
+  const uint32_t sync = CANBUS_SPOOL_SYNC;
+  uint8_t chunk[4096];
+  off_t pos = off + 1;
+  ssize_t n, i;
+
+  while(end - pos >= (off_t)sizeof(canbus_spool_record)) {
+    if((n = pread(fd, chunk, end - pos < (off_t)sizeof(chunk) ? end - pos : (off_t)sizeof(chunk), pos)) < (ssize_t)sizeof(sync)) break;
+    for(i=0; i+(ssize_t)sizeof(sync)<=n; i++) {
+      if(memcmp(chunk + i, &sync, sizeof(sync)) == 0 &&
+         (*next = canbus_spool_read(fd, pos + i, end, record, topic, payload, max)) >= 0) {
+        return pos + i;
+      }
+    }
+    pos += n - (sizeof(sync) - 1);
+  }
+  return end;
+}
+
+static void canbus_spool_cursor_write(canbus_spool *spool) {
+  canbus_spool_cursor cursor;
+  cursor.seq = spool->head;
+  cursor.reserved = 0;
+  cursor.off = spool->head_off;
+  if(pwrite(spool->cursor_fd, &cursor, sizeof(cursor), 0) != sizeof(cursor)) {
+    syslog(LOG_DEBUG, "canbus_spool_cursor_write: unable to write cursor. error=%s", strerror(errno));
+  }
+}
+
+static bool canbus_spool_isempty(canbus_spool *spool) {
+  return spool->head == spool->tail && spool->head_off >= spool->tail_off;
+}
+
+/**
+ * Deletes the head segment and moves on to the next one.
+ */
+static void canbus_spool_advance(canbus_spool *spool) {
+  char path[CANBUS_SPOOL_FILENAME_LEN];
+  struct stat st;
+
+  if(spool->head_fd >= 0) {
+    close(spool->head_fd);
+  }
+  canbus_spool_path(spool, spool->head, path);
+  unlink(path);
+  spool->bytes -= spool->head_len < (off_t)spool->bytes ? spool->head_len : spool->bytes;
+  spool->head++;
+  spool->head_off = 0;
+  spool->head_len = 0;
+  spool->peeked = false;
+  if(spool->head == spool->tail) {
+    spool->head_fd = spool->tail_fd >= 0 ? dup(spool->tail_fd) : -1;
+  }
+  else {
+    spool->head_fd = canbus_spool_open_segment(spool, spool->head, O_RDONLY);
+    if(spool->head_fd >= 0 && fstat(spool->head_fd, &st) == 0) {
+      spool->head_len = st.st_size;
+    }
+  }
+  if(canbus_spool_isempty(spool)) {
+    spool->frames = 0;
+  }
+  canbus_spool_cursor_write(spool);
+}
+
+/**
+ * Starts a new tail segment. The finished one is handed to writeback now
+ * rather than when canbus_spool_sync comes around.
+ */
+static void canbus_spool_roll(canbus_spool *spool) {
+  int fd = canbus_spool_open_segment(spool, spool->tail + 1, O_RDWR | O_APPEND | O_CREAT | O_TRUNC);
+  if(fd < 0) {
+    return;   // keep appending to the old one
+  }
+  if(spool->tail_fd >= 0) {
+    sync_file_range(spool->tail_fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    close(spool->tail_fd);
+  }
+  if(spool->head == spool->tail) {
+    spool->head_len = spool->tail_off;
+  }
+  spool->tail++;
+  spool->tail_fd = fd;
+  spool->tail_off = 0;
+}
+
+/**
+ * Drops the head segment to make room, handing the records in it that were
+ * not consumed yet to ondrop.
+ */
+static void canbus_spool_drop(canbus_spool *spool) {
+  canbus_spool_record record;
+  off_t off = spool->head_off;
+  uint64_t frames = 0;
+
+  while(spool->head_fd >= 0 && off < spool->head_len &&
+        (off = canbus_spool_read(spool->head_fd, off, spool->head_len, &record, NULL, NULL, 0)) >= 0) {
+    frames += record.frames;
+    if(spool->ondrop != NULL) {
+      spool->ondrop(spool->ondrop_arg, record.tag, record.frames);
+    }
+  }
+  syslog(LOG_WARNING, "canbus_spool_drop: %s is full, dropped segment %u with %llu frames",
+    spool->dir, spool->head, (unsigned long long)frames);
+  spool->frames -= frames < spool->frames ? frames : spool->frames;
+  spool->dropped += frames;
+  canbus_spool_advance(spool);
+}
+
+/**
+ * Checks the tail segment from off on, counting the frames of every whole
+ * record. Returns where the last one ends.
+ */
+static off_t canbus_spool_recover(canbus_spool *spool, int fd, off_t off, off_t end) {
+  canbus_spool_record record;
+  char topic[CANBUS_SPOOL_TOPIC_LEN];
+  uint8_t *buf = NULL, *p;
+  size_t cap = 0;
+  off_t next;
+
+  while(off < end) {
+    if(canbus_spool_read(fd, off, end, &record, NULL, NULL, 0) < 0) break;
+    if(record.len > cap) {
+      if((p = realloc(buf, record.len)) == NULL) break;
+      buf = p;
+      cap = record.len;
+    }
+    if((next = canbus_spool_read(fd, off, end, &record, topic, buf, cap)) < 0) break;
+    spool->frames += record.frames;
+    off = next;
+  }
+  free(buf);
+  return off;
+}
+
+/**
+ * Opens the spool in dir, creating the directory if need be, and picks up
+ * whatever an earlier session left in it. max_bytes bounds the segment files
+ * on disk.
+ */
+unsigned int canbus_spool_open(canbus_spool *spool, const char *dir, uint64_t max_bytes) {
+
+  char path[CANBUS_SPOOL_FILENAME_LEN];
+  canbus_spool_cursor cursor;
+  canbus_spool_record record;
+  pthread_condattr_t condattr;
+  struct dirent *entry;
+  struct stat st;
+  uint32_t seq, first = 0, last = 0;
+  off_t off;
+  DIR *d;
+  int fd;
+
+  memset(spool, 0, sizeof(canbus_spool));
+  spool->head_fd = spool->tail_fd = spool->cursor_fd = -1;
+  spool->max_bytes = max_bytes;
+  spool->segment_bytes = max_bytes / 4 < CANBUS_SPOOL_SEGMENT_BYTES ? max_bytes / 4 : CANBUS_SPOOL_SEGMENT_BYTES;
+  pthread_mutex_init(&spool->lock, NULL);
+  pthread_condattr_init(&condattr);
+  pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+  pthread_cond_init(&spool->not_empty, &condattr);
+  pthread_condattr_destroy(&condattr);
+
+  if((spool->dir = strdup(dir)) == NULL) {
+    canbus_spool_close(spool);
+    return ENOMEM;
+  }
+  if(mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    syslog(LOG_ERR, "canbus_spool_open: unable to create %s. error=%s", dir, strerror(errno));
+    canbus_spool_close(spool);
+    return errno;
+  }
+  if((d = opendir(dir)) == NULL) {
+    syslog(LOG_ERR, "canbus_spool_open: unable to open %s. error=%s", dir, strerror(errno));
+    canbus_spool_close(spool);
+    return errno;
+  }
+  while((entry = readdir(d)) != NULL) {
+    if(!canbus_spool_seq(entry->d_name, &seq)) continue;
+    if(first == 0 || seq < first) first = seq;
+    if(seq > last) last = seq;
+  }
+  closedir(d);
+
+  snprintf(path, sizeof(path), "%s/%s", dir, CANBUS_SPOOL_CURSOR);
+  if((spool->cursor_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+    syslog(LOG_ERR, "canbus_spool_open: unable to open %s. error=%s", path, strerror(errno));
+    canbus_spool_close(spool);
+    return errno;
+  }
+  if(last == 0) {
+    first = last = 1;
+  }
+  if(pread(spool->cursor_fd, &cursor, sizeof(cursor), 0) != sizeof(cursor) || cursor.seq < first || cursor.seq > last) {
+    cursor.seq = first;
+    cursor.off = 0;
+  }
+  // segments before the cursor's were consumed to the end
+  for(seq=first; seq<cursor.seq; seq++) {
+    canbus_spool_path(spool, seq, path);
+    unlink(path);
+  }
+  spool->head = cursor.seq;
+  spool->tail = last;
+
+  // the tail may have been torn by a crash: appends continue after its last whole record
+  if((spool->tail_fd = canbus_spool_open_segment(spool, spool->tail, O_RDWR | O_APPEND | O_CREAT)) < 0 ||
+     fstat(spool->tail_fd, &st) != 0) {
+    canbus_spool_close(spool);
+    return errno;
+  }
+  off = spool->head == spool->tail && (off_t)cursor.off < st.st_size ? (off_t)cursor.off : 0;
+  spool->tail_off = canbus_spool_recover(spool, spool->tail_fd, off, st.st_size);
+  if(spool->tail_off < st.st_size) {
+    syslog(LOG_WARNING, "canbus_spool_open: %s: dropped %lld bytes after the last whole record in segment %u",
+      dir, (long long)(st.st_size - spool->tail_off), spool->tail);
+    if(ftruncate(spool->tail_fd, spool->tail_off) != 0) {
+      syslog(LOG_ERR, "canbus_spool_open: unable to truncate segment %u. error=%s", spool->tail, strerror(errno));
+    }
+  }
+  spool->bytes = spool->tail_off;
+
+  // older segments were complete when the tail moved on; their records are checked as they are read
+  for(seq=spool->head; seq<spool->tail; seq++) {
+    if((fd = canbus_spool_open_segment(spool, seq, O_RDONLY)) < 0) continue;
+    if(fstat(fd, &st) != 0) {
+      close(fd);
+      continue;
+    }
+    spool->bytes += st.st_size;
+    off = seq == spool->head && (off_t)cursor.off < st.st_size ? (off_t)cursor.off : 0;
+    if(seq == spool->head) {
+      spool->head_off = off;
+      spool->head_len = st.st_size;
+    }
+    while(off < st.st_size && (off = canbus_spool_read(fd, off, st.st_size, &record, NULL, NULL, 0)) >= 0) {
+      spool->frames += record.frames;
+    }
+    if(seq == spool->head) {
+      spool->head_fd = fd;
+    }
+    else {
+      close(fd);
+    }
+  }
+  if(spool->head == spool->tail) {
+    spool->head_off = (off_t)cursor.off < spool->tail_off ? (off_t)cursor.off : spool->tail_off;
+    spool->head_fd = dup(spool->tail_fd);
+  }
+
+  syslog(LOG_INFO, "canbus_spool_open: %s: segments %u-%u, %llu bytes, %llu frames waiting",
+    dir, spool->head, spool->tail, (unsigned long long)spool->bytes, (unsigned long long)spool->frames);
+  return 0;
+}
+
+/**
+ * Appends one message, dropping the oldest segments first when it would take
+ * the spool past max_bytes. frames is what the message carries and tag is
+ * handed back to ondrop should it be dropped.
+ */
+unsigned int canbus_spool_append(canbus_spool *spool, const char *topic, const void *payload, size_t len, unsigned int frames, uint8_t tag) {
+
+  canbus_spool_record record;
+  struct iovec iov[3];
+  size_t topic_len = strlen(topic);
+  off_t rec_len = sizeof(canbus_spool_record) + topic_len + len;
+  unsigned int rc;
+  ssize_t n;
+
+  if(len == 0) {
+    return 0;
+  }
+  if(topic_len >= CANBUS_SPOOL_TOPIC_LEN || len > UINT32_MAX || (uint64_t)rec_len > spool->max_bytes) {
+    syslog(LOG_ERR, "canbus_spool_append: %zu byte message for %s does not fit in the spool", len, topic);
+    return EMSGSIZE;
+  }
+  record.sync = CANBUS_SPOOL_SYNC;
+  record.len = len;
+  record.frames = frames;
+  record.topic_len = topic_len;
+  record.tag = tag;
+  record.reserved = 0;
+  record.crc = canbus_spool_crc(&record, topic, payload);
+  iov[0].iov_base = &record;
+  iov[0].iov_len = sizeof(record);
+  iov[1].iov_base = (void *)topic;
+  iov[1].iov_len = topic_len;
+  iov[2].iov_base = (void *)payload;
+  iov[2].iov_len = len;
+
+  pthread_mutex_lock(&spool->lock);
+  if(spool->tail_fd < 0 || (spool->tail_off > 0 && spool->tail_off + rec_len > spool->segment_bytes)) {
+    canbus_spool_roll(spool);
+  }
+  while(spool->bytes + rec_len > spool->max_bytes && spool->head != spool->tail) {
+    canbus_spool_drop(spool);
+  }
+  if(spool->tail_fd < 0) {
+    pthread_mutex_unlock(&spool->lock);
+    return EBADF;
+  }
+  if((n = writev(spool->tail_fd, iov, 3)) != rec_len) {
+    rc = n < 0 ? errno : ENOSPC;
+    syslog(LOG_ERR, "canbus_spool_append: unable to write segment %u. error=%s", spool->tail, strerror(rc));
+    if(n > 0 && ftruncate(spool->tail_fd, spool->tail_off) != 0) {
+      syslog(LOG_ERR, "canbus_spool_append: unable to truncate segment %u. error=%s", spool->tail, strerror(errno));
+    }
+    pthread_mutex_unlock(&spool->lock);
+    return rc;
+  }
+  spool->tail_off += rec_len;
+  spool->bytes += rec_len;
+  spool->frames += frames;
+  spool->dirty = true;
+  pthread_cond_signal(&spool->not_empty);
+  pthread_mutex_unlock(&spool->lock);
+  return 0;
+}
+
+/**
+ * Reads the oldest message into topic (CANBUS_SPOOL_TOPIC_LEN bytes) and
+ * payload without removing it; canbus_spool_consume does that once it has
+ * been delivered. Returns its length, 0 when the spool is empty, or -1 when
+ * nothing readable was left in the head segment and it has been skipped.
+ */
+ssize_t canbus_spool_peek(canbus_spool *spool, char *topic, void *payload, size_t max) {
+
+  canbus_spool_record record;
+  uint32_t seq;
+  off_t off, end, next, found;
+  int fd;
+
+  pthread_mutex_lock(&spool->lock);
+  for(;;) {
+    end = spool->head == spool->tail ? spool->tail_off : spool->head_len;
+    if(spool->head_off < end) break;
+    if(spool->head == spool->tail) {
+      pthread_mutex_unlock(&spool->lock);
+      return 0;
+    }
+    canbus_spool_advance(spool);
+  }
+  seq = spool->head;
+  off = spool->head_off;
+  fd = spool->head_fd >= 0 ? dup(spool->head_fd) : -1;
+  pthread_mutex_unlock(&spool->lock);
+
+  // outside the lock; the dup keeps a head dropped meanwhile readable
+  found = off;
+  next = -1;
+  if(fd >= 0) {
+    if((next = canbus_spool_read(fd, off, end, &record, topic, payload, max)) < 0) {
+      found = canbus_spool_resync(fd, off, end, &record, topic, payload, max, &next);
+    }
+    close(fd);
+  }
+
+  pthread_mutex_lock(&spool->lock);
+  if(seq == spool->head && off == spool->head_off) {
+    if(found > off) {
+      syslog(LOG_ERR, "canbus_spool_peek: %s: bad record at %lld in segment %u, skipped %lld bytes",
+        spool->dir, (long long)off, seq, (long long)(found - off));
+      spool->head_off = found;
+      canbus_spool_cursor_write(spool);
+    }
+    spool->peeked = found < end;
+    spool->peek_seq = seq;
+    spool->peek_off = found;
+    spool->peek_next = next;
+    spool->peek_frames = record.frames;
+  }
+  pthread_mutex_unlock(&spool->lock);
+  return found < end ? (ssize_t)record.len : -1;
+}
+
+/**
+ * Removes the message the last canbus_spool_peek returned, unless it was
+ * dropped in the meantime.
+ */
+void canbus_spool_consume(canbus_spool *spool) {
+  pthread_mutex_lock(&spool->lock);
+  if(spool->peeked && spool->peek_seq == spool->head && spool->peek_off == spool->head_off) {
+    spool->head_off = spool->peek_next;
+    spool->frames -= spool->peek_frames < spool->frames ? spool->peek_frames : spool->frames;
+    if(spool->head != spool->tail && spool->head_off >= spool->head_len) {
+      canbus_spool_advance(spool);
+    }
+    else {
+      canbus_spool_cursor_write(spool);
+    }
+    if(canbus_spool_isempty(spool)) {
+      spool->frames = 0;
+    }
+  }
+  spool->peeked = false;
+  pthread_mutex_unlock(&spool->lock);
+}
+
+/**
+ * Waits up to timeout_ms for a message. Returns whether there is one.
+ */
+bool canbus_spool_wait(canbus_spool *spool, int timeout_ms) {
+  struct timespec deadline;
+  bool ready;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+  if(deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&spool->lock);
+  while(canbus_spool_isempty(spool)) {
+    if(pthread_cond_timedwait(&spool->not_empty, &spool->lock, &deadline) == ETIMEDOUT) break;
+  }
+  ready = !canbus_spool_isempty(spool);
+  pthread_mutex_unlock(&spool->lock);
+  return ready;
+}
+
+/**
+ * Frames in the messages waiting to be consumed.
+ */
+uint64_t canbus_spool_frames(canbus_spool *spool) {
+  uint64_t frames;
+  pthread_mutex_lock(&spool->lock);
+  frames = spool->frames;
+  pthread_mutex_unlock(&spool->lock);
+  return frames;
+}
+
+/**
+ * Flushes appends to the tail segment to disk. The append side is not held
+ * up while the disk catches up.
+ */
+void canbus_spool_sync(canbus_spool *spool) {
+  int fd = -1;
+
+  pthread_mutex_lock(&spool->lock);
+  if(spool->dirty && spool->tail_fd >= 0) {
+    fd = dup(spool->tail_fd);
+    spool->dirty = false;
+  }
+  pthread_mutex_unlock(&spool->lock);
+
+  if(fd >= 0) {
+    if(fdatasync(fd) != 0) {
+      syslog(LOG_ERR, "canbus_spool_sync: fdatasync failed. error=%s", strerror(errno));
+    }
+    close(fd);
+  }
+}
+
+void canbus_spool_close(canbus_spool *spool) {
+  if(spool->tail_fd >= 0) {
+    if(spool->dirty) fdatasync(spool->tail_fd);
+    close(spool->tail_fd);
+  }
+  if(spool->head_fd >= 0) close(spool->head_fd);
+  if(spool->cursor_fd >= 0) close(spool->cursor_fd);
+  spool->head_fd = spool->tail_fd = spool->cursor_fd = -1;
+  pthread_cond_destroy(&spool->not_empty);
+  pthread_mutex_destroy(&spool->lock);
+  free(spool->dir);
+  spool->dir = NULL;
+}
@@ -0,0 +1,101 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANBUSSPOOL_H
+#define CANBUSSPOOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define CANBUS_SPOOL_SYNC          0x43525053   // "SPRC" at the start of every record
+#define CANBUS_SPOOL_EXT           ".spool"
+#define CANBUS_SPOOL_CURSOR        "cursor"
+#define CANBUS_SPOOL_SEGMENT_BYTES (4 * 1024 * 1024)  // largest segment file, smaller spools use a quarter of their size
+#define CANBUS_SPOOL_TOPIC_LEN     256          // longest topic, NUL included
+#define CANBUS_SPOOL_FILENAME_LEN  512
+
+/**
+ * A bounded, persistent FIFO of MQTT messages. Records are appended to
+ * numbered segment files in dir and read back oldest first; a segment is
+ * deleted once every record in it has been consumed. When max_bytes would be
+ * exceeded the oldest segment is dropped, so the spool is a ring on disk and
+ * frames are lost from the old end rather than the new one.
+ *
+ * Every record carries a CRC32C. Segments left by a crash are picked up by
+ * canbus_spool_open: the newest one is truncated after its last whole record,
+ * and a small cursor file remembers how far the oldest one was consumed, so
+ * a restart resends at most the record that was in flight.
+ *
+ * One thread appends and another peeks and consumes; the lock is only held
+ * around bookkeeping, never across a read of a payload.
+ */
+typedef struct __attribute__((packed)) {
+  uint32_t sync;            // CANBUS_SPOOL_SYNC
+  uint32_t crc;             // CRC32C of the rest of the record: header from len on, topic and payload
+  uint32_t len;             // payload bytes
+  uint32_t frames;          // CAN frames in the payload, counted as lost if the record is dropped
+  uint16_t topic_len;       // topic bytes, no NUL
+  uint8_t tag;              // the appender's, handed back to ondrop
+  uint8_t reserved;
+} canbus_spool_record;
+
+typedef struct __attribute__((packed)) {
+  uint32_t seq;             // head segment
+  uint32_t reserved;
+  uint64_t off;             // first record in it not yet consumed
+} canbus_spool_cursor;
+
+typedef struct {
+  char *dir;
+  uint64_t max_bytes;
+  uint32_t segment_bytes;
+  uint32_t head;            // oldest segment, read from
+  off_t head_off;
+  off_t head_len;           // size of the head segment once it is no longer the tail
+  int head_fd;
+  uint32_t tail;            // newest segment, appended to
+  off_t tail_off;
+  int tail_fd;
+  int cursor_fd;
+  uint64_t bytes;           // segment files on disk
+  uint64_t frames;          // in records not yet consumed
+  uint64_t dropped;         // frames lost to max_bytes
+  bool dirty;               // appended since canbus_spool_sync
+  bool peeked;              // peek_* describe the head record handed out by canbus_spool_peek
+  uint32_t peek_seq;
+  off_t peek_off;
+  off_t peek_next;
+  uint32_t peek_frames;
+  void (*ondrop)(void *arg, uint8_t tag, unsigned int frames);  // records dropped to make room, called from canbus_spool_append
+  void *ondrop_arg;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+} canbus_spool;
+
+unsigned int canbus_spool_open(canbus_spool *spool, const char *dir, uint64_t max_bytes);
+unsigned int canbus_spool_append(canbus_spool *spool, const char *topic, const void *payload, size_t len, unsigned int frames, uint8_t tag);
+ssize_t canbus_spool_peek(canbus_spool *spool, char *topic, void *payload, size_t max);
+void canbus_spool_consume(canbus_spool *spool);
+bool canbus_spool_wait(canbus_spool *spool, int timeout_ms);
+uint64_t canbus_spool_frames(canbus_spool *spool);
+void canbus_spool_sync(canbus_spool *spool);
+void canbus_spool_close(canbus_spool *spool);
+
+#endif
@@ -0,0 +1,331 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "canbus_stats.h"
+
+#define CANBUS_STATS_ID_KEY(id) ((id) & (CAN_EFF_FLAG | CAN_EFF_MASK))
+
+static const char *canbus_stats_states[] = { "active", "warning", "passive", "busoff" };
+
+void canbus_stats_init(canbus_stats *stats, uint32_t bitrate, uint32_t data_bitrate) {
+  memset(stats, 0, sizeof(canbus_stats));
+  stats->bitrate = bitrate ? bitrate : CANBUS_STATS_BITRATE;
+  stats->data_bitrate = data_bitrate ? data_bitrate : CANBUS_STATS_DATA_BITRATE;
+  clock_gettime(CLOCK_MONOTONIC, &stats->window_start);
+}
+
+/**
+ * Reads the nominal and data phase bitrates of iface from the kernel
+ * (IFLA_CAN_BITTIMING / IFLA_CAN_DATA_BITTIMING over rtnetlink). The current
+ * values are kept when iface has no bit timing, e.g. vcan. Returns 0 when
+ * the nominal bitrate was found.
+ */
+unsigned int canbus_stats_query_bitrate(canbus_stats *stats, const char *iface) {
+
+  struct {
+    struct nlmsghdr nh;
+    struct ifinfomsg ifi;
+  } req;
+  union {
+    struct nlmsghdr nh;
+    char buf[8192];
+  } resp;
+
+  unsigned int ifindex = if_nametoindex(iface);
+  if(ifindex == 0) {
+    syslog(LOG_ERR, "canbus_stats_query_bitrate: unable to find CAN interface %s", iface);
+    return 1;
+  }
+
+  int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if(fd == -1) {
+    syslog(LOG_ERR, "canbus_stats_query_bitrate: error opening netlink socket: %s", strerror(errno));
+    return 2;
+  }
+
+  memset(&req, 0, sizeof(req));
+  req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+  req.nh.nlmsg_type = RTM_GETLINK;
+  req.nh.nlmsg_flags = NLM_F_REQUEST;
+  req.ifi.ifi_family = AF_UNSPEC;
+  req.ifi.ifi_index = ifindex;
+
+  ssize_t len = -1;
+  if(send(fd, &req, req.nh.nlmsg_len, 0) == req.nh.nlmsg_len) {
+    len = recv(fd, &resp, sizeof(resp), 0);
+  }
+  close(fd);
+
+  if(len < 0 || !NLMSG_OK(&resp.nh, len) || resp.nh.nlmsg_type != RTM_NEWLINK) {
+    syslog(LOG_ERR, "canbus_stats_query_bitrate: RTM_GETLINK failed for %s", iface);
+    return 3;
+  }
+
+  uint32_t bitrate = 0, data_bitrate = 0;
+  struct rtattr *rta = (struct rtattr *)((char *)NLMSG_DATA(&resp.nh) + NLMSG_ALIGN(sizeof(struct ifinfomsg)));
+  int rta_len = resp.nh.nlmsg_len - NLMSG_LENGTH(sizeof(struct ifinfomsg));
+
+  // IFLA_LINKINFO -> IFLA_INFO_DATA -> IFLA_CAN_*
+  for(; RTA_OK(rta, rta_len); rta = RTA_NEXT(rta, rta_len)) {
+    if((rta->rta_type & NLA_TYPE_MASK) != IFLA_LINKINFO) continue;
+    struct rtattr *info = RTA_DATA(rta);
+    int info_len = RTA_PAYLOAD(rta);
+    for(; RTA_OK(info, info_len); info = RTA_NEXT(info, info_len)) {
+      if((info->rta_type & NLA_TYPE_MASK) != IFLA_INFO_DATA) continue;
+      struct rtattr *can = RTA_DATA(info);
+      int can_len = RTA_PAYLOAD(info);
+      for(; RTA_OK(can, can_len); can = RTA_NEXT(can, can_len)) {
+        if(RTA_PAYLOAD(can) < sizeof(struct can_bittiming)) continue;
+        if(can->rta_type == IFLA_CAN_BITTIMING) {
+          bitrate = ((struct can_bittiming *)RTA_DATA(can))->bitrate;
+        }
+        else if(can->rta_type == IFLA_CAN_DATA_BITTIMING) {
+          data_bitrate = ((struct can_bittiming *)RTA_DATA(can))->bitrate;
+        }
+      }
+    }
+  }
+
+  if(data_bitrate) {
+    stats->data_bitrate = data_bitrate;
+  }
+  if(bitrate == 0) {
+    syslog(LOG_INFO, "canbus_stats_query_bitrate: %s has no bit timing; bus load assumes %u bit/s", iface, stats->bitrate);
+    return 4;
+  }
+  stats->bitrate = bitrate;
+  syslog(LOG_DEBUG, "canbus_stats_query_bitrate: %s bitrate=%u, data_bitrate=%u", iface, stats->bitrate, stats->data_bitrate);
+  return 0;
+}
+
+static unsigned int canbus_stats_hash(canid_t key) {
+  return (key * 2654435761u) & (CANBUS_STATS_MAX_IDS - 1);
+}
+
+/**
+ * Returns the slot for can_id, or NULL when it isn't tracked.
+ */
+canbus_stats_id *canbus_stats_id_get(canbus_stats *stats, canid_t can_id) {
+  canid_t key = CANBUS_STATS_ID_KEY(can_id);
+  unsigned int i = canbus_stats_hash(key);
+  while(stats->ids[i].used) {
+    if(stats->ids[i].can_id == key) return &stats->ids[i];
+    i = (i + 1) & (CANBUS_STATS_MAX_IDS - 1);
+  }
+  return NULL;
+}
+
+// the table is kept at most 3/4 full so probes stay short
+static canbus_stats_id *canbus_stats_id_add(canbus_stats *stats, canid_t can_id) {
+  canid_t key = CANBUS_STATS_ID_KEY(can_id);
+  unsigned int i = canbus_stats_hash(key);
+  while(stats->ids[i].used) {
+    if(stats->ids[i].can_id == key) return &stats->ids[i];
+    i = (i + 1) & (CANBUS_STATS_MAX_IDS - 1);
+  }
+  if(stats->id_count >= CANBUS_STATS_MAX_IDS / 4 * 3) {
+    return NULL;
+  }
+  stats->ids[i].used = true;
+  stats->ids[i].can_id = key;
+  stats->id_count++;
+  return &stats->ids[i];
+}
+
+/**
+ * Time the frame occupies the bus, ignoring bit stuffing. FD frames with BRS
+ * send the data phase at data_bitrate.
+ */
+static double canbus_stats_frame_time(canbus_stats *stats, canbus_frame *frame) {
+  bool eff = frame->frame.can_id & CAN_EFF_FLAG;
+  unsigned int len = frame->frame.len;
+  if(!(frame->flags & CANBUS_FRAME_FD)) {
+    return (double)((eff ? 67 : 47) + 8 * len) / stats->bitrate;
+  }
+  unsigned int nominal = eff ? 49 : 30;
+  unsigned int data = (len > 16 ? 30 : 26) + 8 * len;
+  if(frame->frame.flags & CANFD_BRS) {
+    return (double)nominal / stats->bitrate + (double)data / stats->data_bitrate;
+  }
+  return (double)(nominal + data) / stats->bitrate;
+}
+
+static void canbus_stats_state(canbus_stats *stats, uint8_t state) {
+  if(stats->errors.state != state) {
+    syslog(LOG_WARNING, "canbus_stats_state: controller %s -> %s",
+      canbus_stats_states[stats->errors.state], canbus_stats_states[state]);
+    stats->errors.state = state;
+  }
+}
+
+static void canbus_stats_error(canbus_stats *stats, struct canfd_frame *frame) {
+
+  canbus_stats_errors *errors = &stats->errors;
+  canid_t class = frame->can_id & CAN_ERR_MASK;
+
+  errors->total++;
+
+  if(class & CAN_ERR_TX_TIMEOUT) errors->tx_timeout++;
+  if(class & CAN_ERR_LOSTARB) errors->lost_arbitration++;
+  if(class & CAN_ERR_PROT) errors->protocol++;
+  if(class & CAN_ERR_TRX) errors->transceiver++;
+  if(class & CAN_ERR_ACK) errors->no_ack++;
+  if(class & CAN_ERR_BUSERROR) errors->bus_error++;
+
+  if(class & CAN_ERR_CRTL) {
+    uint8_t ctrl = frame->data[1];
+    if(ctrl & CAN_ERR_CRTL_RX_OVERFLOW) errors->rx_overflow++;
+    if(ctrl & CAN_ERR_CRTL_TX_OVERFLOW) errors->tx_overflow++;
+    if(ctrl & (CAN_ERR_CRTL_RX_WARNING | CAN_ERR_CRTL_TX_WARNING)) {
+      errors->warning++;
+      canbus_stats_state(stats, CANBUS_STATS_STATE_WARNING);
+    }
+    if(ctrl & (CAN_ERR_CRTL_RX_PASSIVE | CAN_ERR_CRTL_TX_PASSIVE)) {
+      errors->passive++;
+      canbus_stats_state(stats, CANBUS_STATS_STATE_PASSIVE);
+    }
+#ifdef CAN_ERR_CRTL_ACTIVE
+    if(ctrl & CAN_ERR_CRTL_ACTIVE) {
+      canbus_stats_state(stats, CANBUS_STATS_STATE_ACTIVE);
+    }
+#endif
+  }
+
+  if(class & CAN_ERR_BUSOFF) {
+    errors->bus_off++;
+    canbus_stats_state(stats, CANBUS_STATS_STATE_BUSOFF);
+  }
+
+  if(class & CAN_ERR_RESTARTED) {
+    errors->restarted++;
+    canbus_stats_state(stats, CANBUS_STATS_STATE_ACTIVE);
+  }
+
+#ifdef CAN_ERR_CNT
+  if(class & CAN_ERR_CNT) {
+    errors->tx_errors = frame->data[6];
+    errors->rx_errors = frame->data[7];
+  }
+#endif
+}
+
+void canbus_stats_update(canbus_stats *stats, canbus_frame *frames, unsigned int nframes) {
+  unsigned int i;
+  for(i=0; i<nframes; i++) {
+
+    if(frames[i].frame.can_id & CAN_ERR_FLAG) {
+      canbus_stats_error(stats, &frames[i].frame);
+      continue;
+    }
+
+    stats->frames++;
+    stats->bytes += frames[i].frame.len;
+    stats->window_frames++;
+    stats->window_busy += canbus_stats_frame_time(stats, &frames[i]);
+
+    canbus_stats_id *id = canbus_stats_id_add(stats, frames[i].frame.can_id);
+    if(id == NULL) {
+      stats->untracked++;
+      continue;
+    }
+    id->window++;
+    id->count++;
+  }
+}
+
+/**
+ * Closes the current window once CANBUS_STATS_WINDOW_MS has passed, updating
+ * fps, load and the per-ID rates. Returns true when a window was closed.
+ */
+bool canbus_stats_roll(canbus_stats *stats, struct timespec *now) {
+
+  double elapsed = (now->tv_sec - stats->window_start.tv_sec) + (now->tv_nsec - stats->window_start.tv_nsec) / 1e9;
+  if(elapsed * 1000 < CANBUS_STATS_WINDOW_MS) {
+    return false;
+  }
+
+  stats->fps = stats->window_frames / elapsed;
+  stats->load = stats->window_busy / elapsed * 100;
+  stats->window_frames = 0;
+  stats->window_busy = 0;
+  stats->window_start = *now;
+
+  int i;
+  for(i=0; i<CANBUS_STATS_MAX_IDS; i++) {
+    if(!stats->ids[i].used) continue;
+    stats->ids[i].rate = stats->ids[i].window / elapsed;
+    stats->ids[i].window = 0;
+  }
+  return true;
+}
+
+/**
+ * Writes a compact report, sized for a shadow update:
+ * {"stats":{"iface":"can0","frames":N,"fps":N,"load":N,"state":"active","err":{...},"drops":{...},"top":[["7e8",N],...]}}
+ * drops comes from canbus->drops, so every stage that lost frames is reported.
+ * The busiest IDs are dropped first when json_len is too small. Returns the
+ * length written, or -1 if even the counters don't fit.
+ */
+int canbus_stats_json(canbus_client *canbus, char *json, size_t json_len) {
+
+  canbus_stats *stats = canbus->stats;
+  canbus_stats_errors *e = &stats->errors;
+  canbus_stats_id *top[CANBUS_STATS_REPORT_IDS];
+  int i, j, ntop = 0;
+
+  for(i=0; i<CANBUS_STATS_MAX_IDS; i++) {
+    canbus_stats_id *id = &stats->ids[i];
+    if(!id->used || id->rate <= 0) continue;
+    for(j=ntop; j>0 && top[j-1]->rate < id->rate; j--) {
+      if(j < CANBUS_STATS_REPORT_IDS) top[j] = top[j-1];
+    }
+    if(j < CANBUS_STATS_REPORT_IDS) {
+      top[j] = id;
+      if(ntop < CANBUS_STATS_REPORT_IDS) ntop++;
+    }
+  }
+
+  int len = snprintf(json, json_len,
+    "{\"stats\":{\"iface\":\"%s\",\"frames\":%llu,\"fps\":%.1f,\"load\":%.1f,\"state\":\"%s\","
+    "\"err\":{\"total\":%llu,\"busOff\":%llu,\"passive\":%llu,\"warning\":%llu,\"arbLost\":%llu,"
+    "\"rxOverflow\":%llu,\"protocol\":%llu,\"noAck\":%llu,\"tec\":%u,\"rec\":%u},"
+    "\"drops\":{\"socket\":%llu,\"short\":%llu,\"file\":%llu,\"mqtt\":%llu},\"top\":[",
+    canbus->iface, (unsigned long long)stats->frames, stats->fps, stats->load, canbus_stats_states[e->state],
+    (unsigned long long)e->total, (unsigned long long)e->bus_off, (unsigned long long)e->passive,
+    (unsigned long long)e->warning, (unsigned long long)e->lost_arbitration, (unsigned long long)e->rx_overflow,
+    (unsigned long long)e->protocol, (unsigned long long)e->no_ack, e->tx_errors, e->rx_errors,
+    (unsigned long long)canbus_dropped(canbus, CANBUS_DROP_SOCKET), (unsigned long long)canbus_dropped(canbus, CANBUS_DROP_INCOMPLETE),
+    (unsigned long long)canbus_dropped(canbus, CANBUS_DROP_FILE), (unsigned long long)canbus_dropped(canbus, CANBUS_DROP_PUBLISH));
+
+  if(len < 0 || len + 4 >= json_len) {
+    return -1;
+  }
+
+  for(i=0; i<ntop; i++) {
+    char entry[32];
+    int n = (top[i]->can_id & CAN_EFF_FLAG)
+      ? snprintf(entry, sizeof(entry), "%s[\"%08x\",%.1f]", i ? "," : "", top[i]->can_id & CAN_EFF_MASK, top[i]->rate)
+      : snprintf(entry, sizeof(entry), "%s[\"%03x\",%.1f]", i ? "," : "", top[i]->can_id, top[i]->rate);
+    if(len + n + 4 >= json_len) break;
+    strcpy(&json[len], entry);
+    len += n;
+  }
+
+  strcpy(&json[len], "]}}");
+  return len + 3;
+}
@@ -0,0 +1,96 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANBUSSTATS_H
+#define CANBUSSTATS_H
+
+#include <linux/can/error.h>
+#include <linux/can/netlink.h>
+#include <linux/rtnetlink.h>
+#include "canbus.h"
+
+#define CANBUS_STATS_WINDOW_MS        1000    // rates and bus load cover the last completed window
+#define CANBUS_STATS_MAX_IDS          512     // per-ID rate slots (power of two); further IDs count as untracked
+#define CANBUS_STATS_REPORT_IDS       4       // busiest IDs included in canbus_stats_json
+#define CANBUS_STATS_JSON_LEN         384     // fits a shadow report (AWS_IOT_MQTT_TX_BUF_LEN)
+#define CANBUS_STATS_BITRATE          500000  // used for bus load when the interface reports no bit timing (vcan)
+#define CANBUS_STATS_DATA_BITRATE     2000000 // CAN FD data phase bitrate (BRS frames)
+
+#define CANBUS_STATS_STATE_ACTIVE     0
+#define CANBUS_STATS_STATE_WARNING    1
+#define CANBUS_STATS_STATE_PASSIVE    2
+#define CANBUS_STATS_STATE_BUSOFF     3
+
+/**
+ * Error frame classes decoded from CAN_ERR_FLAG frames (linux/can/error.h).
+ */
+typedef struct {
+  uint64_t total;
+  uint64_t tx_timeout;
+  uint64_t lost_arbitration;
+  uint64_t rx_overflow;       // controller RX buffer overflow: frames lost before the kernel saw them
+  uint64_t tx_overflow;
+  uint64_t warning;
+  uint64_t passive;
+  uint64_t bus_off;
+  uint64_t bus_error;
+  uint64_t protocol;
+  uint64_t transceiver;
+  uint64_t no_ack;
+  uint64_t restarted;
+  uint8_t tx_errors;          // last TEC / REC reported by the controller
+  uint8_t rx_errors;
+  uint8_t state;              // CANBUS_STATS_STATE_*
+} canbus_stats_errors;
+
+typedef struct {
+  canid_t can_id;
+  bool used;
+  uint32_t window;            // frames in the current window
+  float rate;                 // frames/s over the last window
+  uint64_t count;
+} canbus_stats_id;
+
+/**
+ * Per interface counters. canbus_stats_update is called from the reading thread
+ * for every batch; canbus_stats_roll closes a window from the same thread.
+ */
+typedef struct canbus_stats {
+  uint64_t frames;
+  uint64_t bytes;
+  uint32_t bitrate;
+  uint32_t data_bitrate;
+  struct timespec window_start;  // CLOCK_MONOTONIC
+  uint64_t window_frames;
+  double window_busy;         // seconds the bus was occupied by this window's frames
+  float fps;
+  float load;                 // percent
+  canbus_stats_errors errors;
+  canbus_stats_id ids[CANBUS_STATS_MAX_IDS];
+  unsigned int id_count;
+  uint64_t untracked;
+} canbus_stats;
+
+void canbus_stats_init(canbus_stats *stats, uint32_t bitrate, uint32_t data_bitrate);
+unsigned int canbus_stats_query_bitrate(canbus_stats *stats, const char *iface);
+void canbus_stats_update(canbus_stats *stats, canbus_frame *frames, unsigned int nframes);
+bool canbus_stats_roll(canbus_stats *stats, struct timespec *now);
+canbus_stats_id *canbus_stats_id_get(canbus_stats *stats, canid_t can_id);
+int canbus_stats_json(canbus_client *canbus, char *json, size_t json_len);
+
+#endif
@@ -0,0 +1,219 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "canbus_txqueue.h"
+
+static void canbus_txqueue_deadline(struct timespec *deadline, int timeout_ms) {
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  deadline->tv_sec += timeout_ms / 1000;
+  deadline->tv_nsec += (timeout_ms % 1000) * 1000000;
+  if(deadline->tv_nsec >= 1000000000) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000;
+  }
+}
+
+void *canbus_txqueue_thread(void *ptr) {
+
+  canbus_txqueue *txqueue = (canbus_txqueue *)ptr;
+  canbus_frame frames[CANBUS_BATCH_SIZE];
+  unsigned int n, i;
+
+  syslog(LOG_DEBUG, "canbus_txqueue_thread: running");
+
+  while(1) {
+
+    pthread_mutex_lock(&txqueue->lock);
+    while(txqueue->count == 0 && (txqueue->state & CANBUS_TXQUEUE_RUNNING)) {
+      pthread_cond_wait(&txqueue->not_empty, &txqueue->lock);
+    }
+    if(txqueue->count == 0) {
+      pthread_mutex_unlock(&txqueue->lock);
+      break;
+    }
+
+    n = (txqueue->count > CANBUS_BATCH_SIZE) ? CANBUS_BATCH_SIZE : txqueue->count;
+    for(i=0; i<n; i++) {
+      memcpy(&frames[i], &txqueue->ring[(txqueue->head + i) % txqueue->size], sizeof(canbus_frame));
+    }
+    txqueue->head = (txqueue->head + n) % txqueue->size;
+    txqueue->count -= n;
+    pthread_cond_broadcast(&txqueue->not_full);
+    pthread_mutex_unlock(&txqueue->lock);
+
+    ssize_t sent = canbus_write_batch(txqueue->canbus, frames, n, CANBUS_TX_TIMEOUT_MS);
+    if(sent < 0) sent = 0;
+
+    __atomic_add_fetch(&txqueue->stats.sent, sent, __ATOMIC_RELAXED);
+    if(sent < n) {
+      __atomic_add_fetch(&txqueue->stats.dropped, n - sent, __ATOMIC_RELAXED);
+      syslog(LOG_ERR, "canbus_txqueue_thread: dropped %zd frames", n - sent);
+    }
+  }
+
+  syslog(LOG_DEBUG, "canbus_txqueue_thread: stopping");
+  return NULL;
+}
+
+unsigned int canbus_txqueue_init(canbus_txqueue *txqueue, canbus_client *canbus, unsigned int size) {
+
+  pthread_condattr_t condattr;
+
+  memset(txqueue, 0, sizeof(canbus_txqueue));
+  txqueue->canbus = canbus;
+  txqueue->size = size ? size : CANBUS_TXQUEUE_SIZE;
+  txqueue->state = CANBUS_TXQUEUE_STOPPED;
+
+  txqueue->ring = malloc(sizeof(canbus_frame) * txqueue->size);
+  if(txqueue->ring == NULL) {
+    syslog(LOG_ERR, "canbus_txqueue_init: unable to allocate %u frame ring", txqueue->size);
+    return 1;
+  }
+
+  if(pthread_mutex_init(&txqueue->lock, NULL) != 0) {
+    syslog(LOG_ERR, "canbus_txqueue_init: unable to initialize mutex: %s", strerror(errno));
+    return 2;
+  }
+
+  // deadlines in canbus_txqueue_push are measured on the monotonic clock
+  pthread_condattr_init(&condattr);
+  pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+  if(pthread_cond_init(&txqueue->not_empty, &condattr) != 0 || pthread_cond_init(&txqueue->not_full, &condattr) != 0) {
+    syslog(LOG_ERR, "canbus_txqueue_init: unable to initialize condition variables: %s", strerror(errno));
+    pthread_condattr_destroy(&condattr);
+    return 3;
+  }
+  pthread_condattr_destroy(&condattr);
+
+  return 0;
+}
+
+unsigned int canbus_txqueue_start(canbus_txqueue *txqueue) {
+  txqueue->state = CANBUS_TXQUEUE_RUNNING;
+  if(pthread_create(&txqueue->thread, NULL, canbus_txqueue_thread, (void *)txqueue) != 0) {
+    syslog(LOG_ERR, "canbus_txqueue_start: unable to create TX thread: %s", strerror(errno));
+    txqueue->state = CANBUS_TXQUEUE_STOPPED;
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Copies frames into the queue. While the queue is full the caller blocks for up
+ * to timeout_ms (0 = never block, -1 = wait forever). Returns the number of frames
+ * queued; anything short of count was refused and is counted as dropped, leaving
+ * the caller to retry or slow down.
+ */
+ssize_t canbus_txqueue_push(canbus_txqueue *txqueue, canbus_frame *frames, unsigned int count, int timeout_ms) {
+
+  struct timespec deadline;
+  unsigned int pushed = 0;
+
+  if(timeout_ms > 0) {
+    canbus_txqueue_deadline(&deadline, timeout_ms);
+  }
+
+  pthread_mutex_lock(&txqueue->lock);
+
+  if(!(txqueue->state & CANBUS_TXQUEUE_RUNNING)) {
+    pthread_mutex_unlock(&txqueue->lock);
+    syslog(LOG_ERR, "canbus_txqueue_push: TX queue not running");
+    return -1;
+  }
+
+  while(pushed < count) {
+
+    while(txqueue->count == txqueue->size && (txqueue->state & CANBUS_TXQUEUE_RUNNING)) {
+      if(timeout_ms == 0) break;
+      if(timeout_ms < 0) {
+        pthread_cond_wait(&txqueue->not_full, &txqueue->lock);
+      }
+      else if(pthread_cond_timedwait(&txqueue->not_full, &txqueue->lock, &deadline) == ETIMEDOUT) {
+        break;
+      }
+    }
+
+    if(txqueue->count == txqueue->size || !(txqueue->state & CANBUS_TXQUEUE_RUNNING)) {
+      break;
+    }
+
+    // copy as much as fits contiguously before waking the TX thread
+    while(pushed < count && txqueue->count < txqueue->size) {
+      unsigned int tail = (txqueue->head + txqueue->count) % txqueue->size;
+      memcpy(&txqueue->ring[tail], &frames[pushed], sizeof(canbus_frame));
+      txqueue->count++;
+      pushed++;
+    }
+    pthread_cond_signal(&txqueue->not_empty);
+  }
+
+  txqueue->stats.queued += pushed;
+  __atomic_add_fetch(&txqueue->stats.dropped, count - pushed, __ATOMIC_RELAXED);
+
+  pthread_mutex_unlock(&txqueue->lock);
+
+  if(pushed < count) {
+    syslog(LOG_WARNING, "canbus_txqueue_push: TX queue full. queued=%u, refused=%u", pushed, count - pushed);
+  }
+
+  return pushed;
+}
+
+unsigned int canbus_txqueue_pending(canbus_txqueue *txqueue) {
+  pthread_mutex_lock(&txqueue->lock);
+  unsigned int count = txqueue->count;
+  pthread_mutex_unlock(&txqueue->lock);
+  return count;
+}
+
+void canbus_txqueue_get_stats(canbus_txqueue *txqueue, canbus_txqueue_stats *stats) {
+  pthread_mutex_lock(&txqueue->lock);
+  stats->queued = txqueue->stats.queued;
+  stats->dropped = __atomic_load_n(&txqueue->stats.dropped, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&txqueue->lock);
+  stats->sent = __atomic_load_n(&txqueue->stats.sent, __ATOMIC_RELAXED);
+}
+
+/**
+ * Stops accepting frames, lets the TX thread drain what is already queued and
+ * joins it.
+ */
+void canbus_txqueue_stop(canbus_txqueue *txqueue) {
+  syslog(LOG_DEBUG, "canbus_txqueue_stop: stopping. pending=%u", canbus_txqueue_pending(txqueue));
+  pthread_mutex_lock(&txqueue->lock);
+  if(!(txqueue->state & CANBUS_TXQUEUE_RUNNING)) {
+    pthread_mutex_unlock(&txqueue->lock);
+    return;
+  }
+  txqueue->state = CANBUS_TXQUEUE_STOPPING;
+  pthread_cond_broadcast(&txqueue->not_empty);
+  pthread_cond_broadcast(&txqueue->not_full);
+  pthread_mutex_unlock(&txqueue->lock);
+
+  pthread_join(txqueue->thread, NULL);
+  txqueue->state = CANBUS_TXQUEUE_STOPPED;
+}
+
+void canbus_txqueue_free(canbus_txqueue *txqueue) {
+  canbus_txqueue_stop(txqueue);
+  pthread_cond_destroy(&txqueue->not_empty);
+  pthread_cond_destroy(&txqueue->not_full);
+  pthread_mutex_destroy(&txqueue->lock);
+  free(txqueue->ring);
+  txqueue->ring = NULL;
+}
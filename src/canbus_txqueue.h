@@ -0,0 +1,63 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANBUSTXQUEUE_H
+#define CANBUSTXQUEUE_H
+
+#include "canbus.h"
+
+#define CANBUS_TXQUEUE_SIZE      1024  // default number of frames buffered per socket
+
+#define CANBUS_TXQUEUE_RUNNING   (1 << 0)
+#define CANBUS_TXQUEUE_STOPPING  (1 << 1)
+#define CANBUS_TXQUEUE_STOPPED   (1 << 2)
+
+typedef struct {
+  uint64_t queued;    // frames accepted by canbus_txqueue_push
+  uint64_t sent;      // frames handed to the kernel
+  uint64_t dropped;   // frames refused because the queue stayed full, or that failed to send
+} canbus_txqueue_stats;
+
+/**
+ * Per-socket transmit queue. Producers copy frames into a ring under a short lock;
+ * a dedicated TX thread drains it in batches with canbus_write_batch outside the
+ * lock. A full ring pushes back on producers instead of growing or spinning.
+ */
+typedef struct {
+  canbus_client *canbus;
+  canbus_frame *ring;
+  unsigned int size;
+  unsigned int head;
+  unsigned int count;
+  uint8_t state;
+  canbus_txqueue_stats stats;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+} canbus_txqueue;
+
+unsigned int canbus_txqueue_init(canbus_txqueue *txqueue, canbus_client *canbus, unsigned int size);
+unsigned int canbus_txqueue_start(canbus_txqueue *txqueue);
+ssize_t canbus_txqueue_push(canbus_txqueue *txqueue, canbus_frame *frames, unsigned int count, int timeout_ms);
+unsigned int canbus_txqueue_pending(canbus_txqueue *txqueue);
+void canbus_txqueue_get_stats(canbus_txqueue *txqueue, canbus_txqueue_stats *stats);
+void canbus_txqueue_stop(canbus_txqueue *txqueue);
+void canbus_txqueue_free(canbus_txqueue *txqueue);
+
+#endif
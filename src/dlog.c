@@ -0,0 +1,535 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <sys/eventfd.h>
+#include "dlog.h"
+
+#define DLOG_LEN_NONE 0
+#define DLOG_LEN_HH   1
+#define DLOG_LEN_H    2
+#define DLOG_LEN_L    3
+#define DLOG_LEN_LL   4
+#define DLOG_LEN_J    5
+#define DLOG_LEN_Z    6
+#define DLOG_LEN_T    7
+#define DLOG_LEN_LD   8
+
+/**
+ * One printf conversion: spec runs from start ('%') to end, the length
+ * modifier (if any) starts at mod.
+ */
+typedef struct {
+  const char *start;
+  const char *mod;
+  const char *end;
+  char conv;
+  uint8_t length;
+  bool width_star;
+  bool prec_star;
+} dlog_spec;
+
+int dlog_level = LOG_DEBUG;
+
+static bool dlog_running = false;
+static FILE *dlog_file = NULL;
+static dlog_ring *dlog_rings = NULL;
+static uint64_t dlog_dropped_closed = 0;
+static pthread_mutex_t dlog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t dlog_thread;
+static int dlog_wakefd = -1;   // written when a ring stops being empty, read by the idle drainer
+static pthread_key_t dlog_key;
+static pthread_once_t dlog_key_once = PTHREAD_ONCE_INIT;
+static __thread dlog_ring *dlog_thread_ring = NULL;
+
+static const char dlog_null[] = "(null)";
+static const char *dlog_priorities[] = { "EMERG", "ALERT", "CRIT", "ERR", "WARNING", "NOTICE", "INFO", "DEBUG" };
+
+static const char *dlog_spec_parse(const char *p, dlog_spec *spec) {
+  spec->start = p++;
+  while(*p && strchr("-+ #0'", *p)) p++;
+  spec->width_star = (*p == '*');
+  if(spec->width_star) p++;
+  else while(isdigit((unsigned char)*p)) p++;
+  spec->prec_star = false;
+  if(*p == '.') {
+    p++;
+    spec->prec_star = (*p == '*');
+    if(spec->prec_star) p++;
+    else while(isdigit((unsigned char)*p)) p++;
+  }
+  spec->mod = p;
+  spec->length = DLOG_LEN_NONE;
+  switch(*p) {
+    case 'h': spec->length = (p[1] == 'h') ? DLOG_LEN_HH : DLOG_LEN_H; p += (p[1] == 'h') ? 2 : 1; break;
+    case 'l': spec->length = (p[1] == 'l') ? DLOG_LEN_LL : DLOG_LEN_L; p += (p[1] == 'l') ? 2 : 1; break;
+    case 'q': spec->length = DLOG_LEN_LL; p++; break;
+    case 'j': spec->length = DLOG_LEN_J; p++; break;
+    case 'z': spec->length = DLOG_LEN_Z; p++; break;
+    case 't': spec->length = DLOG_LEN_T; p++; break;
+    case 'L': spec->length = DLOG_LEN_LD; p++; break;
+  }
+  spec->conv = *p;
+  if(*p) p++;
+  spec->end = p;
+  return p;
+}
+
+static bool dlog_put(dlog_record *rec, const void *value, size_t len) {
+  if(rec->len + len > sizeof(rec->args)) {
+    rec->truncated = 1;
+    return false;
+  }
+  memcpy(rec->args + rec->len, value, len);
+  rec->len += len;
+  return true;
+}
+
+static bool dlog_put_string(dlog_record *rec, const char *s) {
+  size_t room = sizeof(rec->args) - rec->len;
+  if(room == 0) {
+    rec->truncated = 1;
+    return false;
+  }
+  if(s == NULL) s = dlog_null;
+  size_t len = (s == dlog_null) ? sizeof(dlog_null) - 1 : strnlen(s, DLOG_STRING_MAX);
+  if(len > room - 1) len = room - 1;
+  memcpy(rec->args + rec->len, s, len);
+  rec->args[rec->len + len] = '\0';
+  rec->len += len + 1;
+  return true;
+}
+
+/**
+ * Copies the arguments of fmt into rec in the order the conversions appear.
+ * Integers are widened to 64 bits, floating point to double and strings are
+ * copied inline. Stops at the first argument that does not fit.
+ */
+static void dlog_pack(dlog_record *rec, const char *fmt, int err, va_list ap) {
+  const char *p = fmt;
+  dlog_spec spec;
+  int64_t i;
+  uint64_t u;
+  double d;
+
+  rec->len = 0;
+  rec->truncated = 0;
+
+  while((p = strchr(p, '%')) != NULL) {
+    p = dlog_spec_parse(p, &spec);
+    if(spec.conv == '%') continue;
+    if(spec.width_star && !dlog_put(rec, &(int64_t){ va_arg(ap, int) }, sizeof(int64_t))) return;
+    if(spec.prec_star && !dlog_put(rec, &(int64_t){ va_arg(ap, int) }, sizeof(int64_t))) return;
+    switch(spec.conv) {
+      case 'd': case 'i':
+        switch(spec.length) {
+          case DLOG_LEN_L:  i = va_arg(ap, long); break;
+          case DLOG_LEN_LL: i = va_arg(ap, long long); break;
+          case DLOG_LEN_J:  i = va_arg(ap, intmax_t); break;
+          case DLOG_LEN_Z:  i = va_arg(ap, ssize_t); break;
+          case DLOG_LEN_T:  i = va_arg(ap, ptrdiff_t); break;
+          default:          i = va_arg(ap, int); break;
+        }
+        if(!dlog_put(rec, &i, sizeof(i))) return;
+        break;
+      case 'o': case 'u': case 'x': case 'X':
+        switch(spec.length) {
+          case DLOG_LEN_L:  u = va_arg(ap, unsigned long); break;
+          case DLOG_LEN_LL: u = va_arg(ap, unsigned long long); break;
+          case DLOG_LEN_J:  u = va_arg(ap, uintmax_t); break;
+          case DLOG_LEN_Z:  u = va_arg(ap, size_t); break;
+          case DLOG_LEN_T:  u = va_arg(ap, ptrdiff_t); break;
+          default:          u = va_arg(ap, unsigned int); break;
+        }
+        // %hx and friends print the value as the narrower type would
+        if(spec.length == DLOG_LEN_HH) u = (unsigned char)u;
+        if(spec.length == DLOG_LEN_H) u = (unsigned short)u;
+        if(!dlog_put(rec, &u, sizeof(u))) return;
+        break;
+      case 'c':
+        i = va_arg(ap, int);
+        if(!dlog_put(rec, &i, sizeof(i))) return;
+        break;
+      case 'p':
+        u = (uintptr_t)va_arg(ap, void *);
+        if(!dlog_put(rec, &u, sizeof(u))) return;
+        break;
+      case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        d = (spec.length == DLOG_LEN_LD) ? (double)va_arg(ap, long double) : va_arg(ap, double);
+        if(!dlog_put(rec, &d, sizeof(d))) return;
+        break;
+      case 's':
+        if(!dlog_put_string(rec, va_arg(ap, const char *))) return;
+        break;
+      case 'm':
+        // syslog's %m; errno belongs to the caller, so resolve it now
+        if(!dlog_put_string(rec, strerror(err))) return;
+        break;
+      case 'n':
+        (void)va_arg(ap, void *);
+        break;
+      default:
+        rec->truncated = 1;
+        return;
+    }
+  }
+}
+
+static bool dlog_get(dlog_record *rec, size_t *off, void *value, size_t len) {
+  if(*off + len > rec->len) return false;
+  memcpy(value, rec->args + *off, len);
+  *off += len;
+  return true;
+}
+
+/**
+ * Formats a record the way printf would have at the call site. Returns the
+ * length of line.
+ */
+size_t dlog_format(dlog_record *rec, char *line, size_t line_len) {
+  const char *p = rec->fmt, *pct, *c;
+  size_t out = 0, off = 0, n;
+  char spec_buf[64];
+  dlog_spec spec;
+  int64_t i, width = 0, prec = 0;
+  uint64_t u;
+  double d;
+  int len;
+
+  line[0] = '\0';
+  while(*p && out < line_len - 1) {
+
+    pct = strchr(p, '%');
+    n = (pct != NULL) ? (size_t)(pct - p) : strlen(p);
+    if(n > line_len - 1 - out) n = line_len - 1 - out;
+    memcpy(line + out, p, n);
+    out += n;
+    line[out] = '\0';
+    if(pct == NULL) break;
+
+    p = dlog_spec_parse(pct, &spec);
+    if(spec.conv == '%') {
+      if(out < line_len - 1) line[out++] = '%';
+      line[out] = '\0';
+      continue;
+    }
+    if(spec.conv == 'n') continue;
+
+    if((spec.width_star && !dlog_get(rec, &off, &width, sizeof(width))) ||
+       (spec.prec_star && !dlog_get(rec, &off, &prec, sizeof(prec)))) {
+      break;
+    }
+
+    // flags, width and precision as written, stars resolved, then a normalised length
+    size_t sl = 0;
+    for(c = spec.start; c < spec.mod && sl < sizeof(spec_buf) - 24; c++) {
+      if(*c == '*') sl += sprintf(spec_buf + sl, "%lld", (long long)((c > spec.start && c[-1] == '.') ? prec : width));
+      else spec_buf[sl++] = *c;
+    }
+
+    len = 0;
+    switch(spec.conv) {
+      case 'd': case 'i':
+        if(!dlog_get(rec, &off, &i, sizeof(i))) goto truncated;
+        sprintf(spec_buf + sl, "ll%c", spec.conv);
+        len = snprintf(line + out, line_len - out, spec_buf, (long long)i);
+        break;
+      case 'o': case 'u': case 'x': case 'X':
+        if(!dlog_get(rec, &off, &u, sizeof(u))) goto truncated;
+        sprintf(spec_buf + sl, "ll%c", spec.conv);
+        len = snprintf(line + out, line_len - out, spec_buf, (unsigned long long)u);
+        break;
+      case 'c':
+        if(!dlog_get(rec, &off, &i, sizeof(i))) goto truncated;
+        sprintf(spec_buf + sl, "c");
+        len = snprintf(line + out, line_len - out, spec_buf, (int)i);
+        break;
+      case 'p':
+        if(!dlog_get(rec, &off, &u, sizeof(u))) goto truncated;
+        sprintf(spec_buf + sl, "p");
+        len = snprintf(line + out, line_len - out, spec_buf, (void *)(uintptr_t)u);
+        break;
+      case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        if(!dlog_get(rec, &off, &d, sizeof(d))) goto truncated;
+        sprintf(spec_buf + sl, "%c", spec.conv);
+        len = snprintf(line + out, line_len - out, spec_buf, d);
+        break;
+      case 's': case 'm':
+        if(off >= rec->len) goto truncated;
+        sprintf(spec_buf + sl, "s");
+        len = snprintf(line + out, line_len - out, spec_buf, (char *)rec->args + off);
+        off += strlen((char *)rec->args + off) + 1;
+        break;
+      default:
+        goto truncated;
+    }
+    if(len > 0) {
+      out += ((size_t)len < line_len - out) ? (size_t)len : line_len - 1 - out;
+    }
+  }
+  return out;
+
+truncated:
+  n = strlen(line);
+  snprintf(line + n, line_len - n, "...");
+  return strlen(line);
+}
+
+static void dlog_emit(int prio, struct timespec *ts, const char *line) {
+  if(dlog_file != NULL) {
+    struct tm tm;
+    char stamp[32];
+    localtime_r(&ts->tv_sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    fprintf(dlog_file, "%s.%03ld %s %s\n", stamp, ts->tv_nsec / 1000000, dlog_priorities[prio & 7], line);
+    return;
+  }
+  syslog(prio, "%s", line);
+}
+
+/**
+ * Empties every ring once. Serialised by dlog_lock, so dlog_flush and the
+ * drainer thread can not both consume the same ring. Returns the number of
+ * records written.
+ */
+static unsigned int dlog_drain() {
+  char line[DLOG_LINE_LEN];
+  unsigned int n = 0;
+  dlog_ring **link, *ring;
+
+  pthread_mutex_lock(&dlog_lock);
+  for(link = &dlog_rings; (ring = *link) != NULL; ) {
+
+    uint64_t tail = ring->tail;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+    for(; tail != head; tail++, n++) {
+      dlog_record *rec = &ring->slots[tail & (DLOG_RING_SLOTS - 1)];
+      dlog_format(rec, line, sizeof(line));
+      dlog_emit(rec->prio, &rec->ts, line);
+      __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if(dropped != ring->reported) {
+      struct timespec now;
+      clock_gettime(CLOCK_REALTIME_COARSE, &now);
+      snprintf(line, sizeof(line), "dlog: %llu messages dropped on a full ring", (unsigned long long)(dropped - ring->reported));
+      dlog_emit(LOG_WARNING, &now, line);
+      ring->reported = dropped;
+    }
+
+    // the owner is gone, so head can not move again
+    if(__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE) && __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+      *link = ring->next;
+      dlog_dropped_closed += ring->dropped;
+      free(ring);
+      continue;
+    }
+    link = &ring->next;
+  }
+  if(n > 0 && dlog_file != NULL) {
+    fflush(dlog_file);
+  }
+  pthread_mutex_unlock(&dlog_lock);
+
+  return n;
+}
+
+static void dlog_wake() {
+  uint64_t one = 1;
+  if(write(dlog_wakefd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN) {
+    syslog(LOG_ERR, "dlog_wake: %s", strerror(errno));
+  }
+}
+
+/**
+ * Sleeps on dlog_wakefd whenever a pass finds every ring empty, so an idle
+ * process sees no wakeups. A producer signals after publishing into an empty
+ * ring, which is after the drainer's last look at it or in time for the pass
+ * it is making.
+ */
+static void *dlog_drain_thread(void *ptr) {
+  uint64_t count;
+  while(__atomic_load_n(&dlog_running, __ATOMIC_ACQUIRE)) {
+    if(dlog_drain() == 0 && read(dlog_wakefd, &count, sizeof(count)) == -1 && errno != EINTR) {
+      syslog(LOG_ERR, "dlog_drain_thread: %s", strerror(errno));
+      break;
+    }
+  }
+  dlog_drain();
+  return NULL;
+}
+
+static void dlog_thread_exit(void *ptr) {
+  __atomic_store_n(&((dlog_ring *)ptr)->closed, true, __ATOMIC_RELEASE);
+}
+
+static void dlog_key_create() {
+  pthread_key_create(&dlog_key, dlog_thread_exit);
+}
+
+static dlog_ring *dlog_ring_get() {
+  if(dlog_thread_ring != NULL) {
+    return dlog_thread_ring;
+  }
+  dlog_ring *ring = calloc(1, sizeof(dlog_ring));
+  if(ring == NULL) {
+    return NULL;
+  }
+  pthread_setspecific(dlog_key, ring);
+  pthread_mutex_lock(&dlog_lock);
+  ring->next = dlog_rings;
+  dlog_rings = ring;
+  pthread_mutex_unlock(&dlog_lock);
+  dlog_thread_ring = ring;
+  return ring;
+}
+
+/**
+ * Starts the drainer thread. Until this is called, and after dlog_close,
+ * dlog_write falls through to syslog synchronously.
+ */
+unsigned int dlog_init(int sink, const char *path) {
+
+  if(__atomic_load_n(&dlog_running, __ATOMIC_ACQUIRE)) {
+    syslog(LOG_ERR, "dlog_init: already running");
+    return 1;
+  }
+
+  pthread_once(&dlog_key_once, dlog_key_create);
+
+  if(sink == DLOG_SINK_FILE) {
+    if(path == NULL || (dlog_file = fopen(path, "a")) == NULL) {
+      syslog(LOG_ERR, "dlog_init: unable to open %s: %s", path ? path : "(null)", strerror(errno));
+      return 2;
+    }
+  }
+
+  if((dlog_wakefd = eventfd(0, EFD_CLOEXEC)) == -1) {
+    syslog(LOG_ERR, "dlog_init: unable to create eventfd: %s", strerror(errno));
+    if(dlog_file != NULL) {
+      fclose(dlog_file);
+      dlog_file = NULL;
+    }
+    return 3;
+  }
+
+  __atomic_store_n(&dlog_running, true, __ATOMIC_RELEASE);
+  if(pthread_create(&dlog_thread, NULL, dlog_drain_thread, NULL) != 0) {
+    syslog(LOG_ERR, "dlog_init: unable to create drainer thread");
+    __atomic_store_n(&dlog_running, false, __ATOMIC_RELEASE);
+    close(dlog_wakefd);
+    dlog_wakefd = -1;
+    if(dlog_file != NULL) {
+      fclose(dlog_file);
+      dlog_file = NULL;
+    }
+    return 4;
+  }
+
+  return 0;
+}
+
+void dlog_setlevel(int level) {
+  dlog_level = level;
+}
+
+/**
+ * Queues a message on the calling thread's ring. Never blocks: when the ring is
+ * full the message is counted as dropped and the drainer reports the loss.
+ */
+void dlog_write(int prio, const char *fmt, ...) {
+  int err = errno;
+  dlog_ring *ring;
+  va_list ap;
+
+  if(!__atomic_load_n(&dlog_running, __ATOMIC_RELAXED) || (ring = dlog_ring_get()) == NULL) {
+    va_start(ap, fmt);
+    vsyslog(prio, fmt, ap);
+    va_end(ap);
+    errno = err;
+    return;
+  }
+
+  uint64_t head = ring->head;
+  if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= DLOG_RING_SLOTS) {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  dlog_record *rec = &ring->slots[head & (DLOG_RING_SLOTS - 1)];
+  clock_gettime(CLOCK_REALTIME_COARSE, &rec->ts);
+  rec->fmt = fmt;
+  rec->prio = prio;
+  va_start(ap, fmt);
+  dlog_pack(rec, fmt, err, ap);
+  va_end(ap);
+
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == head) {
+    dlog_wake();
+  }
+  errno = err;
+}
+
+/**
+ * Writes out everything queued so far on every thread's ring, on the calling
+ * thread rather than the drainer. Returns the number of records written.
+ */
+unsigned int dlog_flush() {
+  return dlog_drain();
+}
+
+uint64_t dlog_dropped() {
+  uint64_t dropped;
+  dlog_ring *ring;
+  pthread_mutex_lock(&dlog_lock);
+  dropped = dlog_dropped_closed;
+  for(ring = dlog_rings; ring != NULL; ring = ring->next) {
+    dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&dlog_lock);
+  return dropped;
+}
+
+/**
+ * Stops the drainer after it has written everything already queued. Rings
+ * of live threads are kept so a later dlog_init picks them up again.
+ */
+void dlog_close() {
+  if(!__atomic_load_n(&dlog_running, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  __atomic_store_n(&dlog_running, false, __ATOMIC_RELEASE);
+  dlog_wake();
+  pthread_join(dlog_thread, NULL);
+  close(dlog_wakefd);
+  dlog_wakefd = -1;
+  pthread_mutex_lock(&dlog_lock);
+  if(dlog_file != NULL) {
+    fclose(dlog_file);
+    dlog_file = NULL;
+  }
+  pthread_mutex_unlock(&dlog_lock);
+}
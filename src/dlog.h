@@ -0,0 +1,92 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DLOG_H
+#define DLOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+
+/**
+ * Highest syslog priority compiled in. Calls above it are removed by the
+ * compiler, arguments and all; build with -DDLOG_LEVEL=LOG_DEBUG to keep them.
+ */
+#ifndef DLOG_LEVEL
+#define DLOG_LEVEL          LOG_INFO
+#endif
+
+#define DLOG_SINK_SYSLOG    0
+#define DLOG_SINK_FILE      1
+
+#define DLOG_RING_SLOTS     512     // records buffered per thread (power of two)
+#define DLOG_RECORD_LEN     256     // bytes per record, header included
+#define DLOG_STRING_MAX     160     // %s arguments are cut to this many bytes
+#define DLOG_LINE_LEN       1024    // longest formatted message
+
+#define DLOG(prio, ...) do { \
+    if((prio) <= DLOG_LEVEL && (prio) <= dlog_level) dlog_write((prio), __VA_ARGS__); \
+  } while(0)
+
+#define DLOG_ERR(...)       DLOG(LOG_ERR, __VA_ARGS__)
+#define DLOG_WARNING(...)   DLOG(LOG_WARNING, __VA_ARGS__)
+#define DLOG_INFO(...)      DLOG(LOG_INFO, __VA_ARGS__)
+#define DLOG_DEBUG(...)     DLOG(LOG_DEBUG, __VA_ARGS__)
+
+/**
+ * One deferred message. The caller only copies the format pointer and its
+ * arguments (strings by value); the drainer does the printf work.
+ */
+typedef struct {
+  struct timespec ts;       // CLOCK_REALTIME_COARSE at the call
+  const char *fmt;          // must be a string literal, it is read after the call returns
+  uint8_t prio;
+  uint8_t truncated;        // arguments did not fit; the message is cut at the first missing one
+  uint16_t len;
+  uint8_t args[DLOG_RECORD_LEN - sizeof(struct timespec) - sizeof(char *) - 4];
+} dlog_record;
+
+/**
+ * Per-thread single producer, single consumer ring. The owning thread only
+ * advances head and the drainer only advances tail, so neither takes a lock.
+ */
+typedef struct dlog_ring {
+  dlog_record slots[DLOG_RING_SLOTS];
+  uint64_t head __attribute__((aligned(64)));
+  uint64_t tail __attribute__((aligned(64)));
+  uint64_t dropped;         // records refused while the ring was full
+  uint64_t reported;        // dropped count last reported by the drainer
+  bool closed;              // owner thread has exited; freed once drained
+  struct dlog_ring *next;
+} dlog_ring;
+
+extern int dlog_level;
+
+unsigned int dlog_init(int sink, const char *path);
+void dlog_setlevel(int level);
+void dlog_write(int prio, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+size_t dlog_format(dlog_record *rec, char *line, size_t line_len);
+unsigned int dlog_flush();
+uint64_t dlog_dropped();
+void dlog_close();
+
+#endif
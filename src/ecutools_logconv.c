@@ -0,0 +1,158 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Converts between the CAN log formats canbus_log can read and write. The
+ * input format is detected; the output format defaults to the text layout
+ * written by the text file logger.
+ *
+ *   ecutools-logconv [-f text|binary|candump|asc|pcapng|compressed] [-x] [-r]
+ *                    [-s from] [-e to] [-l seconds] [-i id]... <input> [output]
+ *
+ * Without an output file the log goes to stdout. -s and -e keep the frames
+ * between two times (seconds since the epoch), -l those of the last seconds
+ * of the log, and every -i adds an ID to keep; an index next to the input
+ * lets these skip what can not match. -x writes an index for the output,
+ * which also indexes an existing log when converted to its own format. -r
+ * first repairs the input in place, cutting off a record torn by a crash.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <syslog.h>
+#include "canbus_log.h"
+
+#define LOGCONV_IDS_MAX 64
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-f text|binary|candump|asc|pcapng|compressed] [-x] [-r] [-s from] [-e to] [-l seconds] [-i id]... <input> [output]\n", name);
+}
+
+int main(int argc, char **argv) {
+  const canbus_log_backend *backend = &canbus_log_text_backend;
+  canbus_log in, out;
+  canbus_frame frames[CANBUS_BATCH_SIZE];
+  canbus_log_filter filter;
+  uint32_t ids[LOGCONV_IDS_MAX];
+  struct timespec last = {0, 0};
+  bool filtered = false, index = false, recover = false;
+  unsigned long frames_out = 0, dropped = 0;
+  char *end;
+  int c, n;
+
+  memset(&filter, 0, sizeof(filter));
+  filter.ids = ids;
+  while((c = getopt(argc, argv, "f:xrs:e:l:i:")) != -1) {
+    switch(c) {
+      case 'f':
+        if((backend = canbus_log_backend_find(optarg)) == NULL) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'x':
+        index = true;
+        break;
+      case 'r':
+        recover = true;
+        break;
+      case 's':
+      case 'e':
+      case 'l':
+        if(canbus_log_parse_time(optarg, c == 's' ? &filter.from : c == 'e' ? &filter.to : &last) == NULL) {
+          usage(argv[0]);
+          return 1;
+        }
+        filtered = true;
+        break;
+      case 'i':
+        if(filter.nids == LOGCONV_IDS_MAX || (ids[filter.nids] = strtoul(optarg, &end, 16)) > CAN_EFF_MASK || *end != '\0') {
+          usage(argv[0]);
+          return 1;
+        }
+        // candump style: 29 bit IDs are written with all eight digits
+        if(ids[filter.nids] > CAN_SFF_MASK || strlen(optarg) == 8) {
+          ids[filter.nids] |= CAN_EFF_FLAG;
+        }
+        filter.nids++;
+        filtered = true;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if(argc - optind < 1 || argc - optind > 2) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  openlog("ecutools-logconv", LOG_PERROR, LOG_USER);
+  setlogmask(LOG_UPTO(LOG_WARNING));
+
+  // what was cut off is reported through syslog
+  if(recover && canbus_log_recover(argv[optind], NULL) != 0) {
+    return 1;
+  }
+  if(canbus_log_load(&in, argv[optind]) != 0) {
+    return 1;
+  }
+  if(last.tv_sec != 0 || last.tv_nsec != 0) {
+    if(!canbus_log_index_end(&in, &filter.to)) {
+      fprintf(stderr, "-l needs an index next to %s; write one with -x\n", argv[optind]);
+      canbus_log_close(&in);
+      return 1;
+    }
+    filter.from.tv_sec = filter.to.tv_sec - last.tv_sec;
+    filter.from.tv_nsec = filter.to.tv_nsec - last.tv_nsec;
+    if(filter.from.tv_nsec < 0) {
+      filter.from.tv_sec--;
+      filter.from.tv_nsec += 1000000000L;
+    }
+    filter.to.tv_sec = 0;   // the unindexed tail may run past the end the index knows
+  }
+
+  // a binary log without a known interface gets FD sized records so nothing is cut
+  bool fd = in.backend->format == CANBUS_LOG_FORMAT_BINARY || in.backend->format == CANBUS_LOG_FORMAT_COMPRESSED ||
+            in.backend->format == CANBUS_LOG_FORMAT_PCAPNG ? in.fd : true;
+  if(canbus_log_create(&out, argc - optind == 2 ? argv[optind + 1] : "-", backend->format, in.iface, fd) != 0) {
+    canbus_log_close(&in);
+    return 1;
+  }
+  out.start = in.start;
+  if(index && out.file != stdout) {
+    canbus_log_index_create(&out);
+  }
+
+  while((n = filtered ? canbus_log_read_filtered(&in, &filter, frames, CANBUS_BATCH_SIZE) :
+                        canbus_log_read_frames(&in, frames, CANBUS_BATCH_SIZE)) > 0) {
+    dropped += canbus_log_write_frames(&out, frames, n);
+    frames_out += n;
+  }
+
+  canbus_log_close(&in);
+  canbus_log_close(&out);
+  closelog();
+
+  if(dropped > 0) {
+    fprintf(stderr, "%lu of %lu frames could not be written\n", dropped, frames_out);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,205 @@
+/**
+ * ecutools: IoT Automotive Tuning, Diagnostics & Analytics
+ * Copyright (C) 2014 Jeremy Hahn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Filter, aggregate and extract queries over CAN logs of any format canbus_log
+ * reads, scanned on every core from a memory mapping.
+ *
+ *   ecutools-logq [-a count|frames|total] [-j threads] [-s from] [-e to]
+ *                 [-l seconds] [-i id[/mask]]... [-p offset:bytes]... [-v] <log>...
+ *
+ * count (the default) prints frames, payload bytes, time range and rate per
+ * ID; frames prints the matching frames in file order; total just their
+ * number. All of it is CSV. Every -i adds an ID (hex, eight digits or above
+ * 7ff for 29 bit) a frame may have, under an optional mask; every -p a run of
+ * payload bytes (hex, x for any nibble) it must have at the given offset.
+ * -s, -e and -l select a time window as in ecutools-logconv; an index next to
+ * a log lets the scan skip what the window and exact IDs rule out. -v reports
+ * the scan rate on stderr.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <syslog.h>
+#include "canbus_logquery.h"
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-a count|frames|total] [-j threads] [-s from] [-e to] [-l seconds] [-i id[/mask]]... [-p offset:bytes]... [-v] <log>...\n", name);
+}
+
+static double logq_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int logq_nibble(char c) {
+  if(c >= '0' && c <= '9') return c - '0';
+  if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+static bool logq_id(canbus_logquery *query, const char *arg) {
+  uint32_t id, mask;
+  char *end;
+
+  id = strtoul(arg, &end, 16);
+  if(end == arg || id > CAN_EFF_MASK) return false;
+  // candump style: 29 bit IDs are written with all eight digits
+  if(id > CAN_SFF_MASK || end - arg == 8) {
+    id |= CAN_EFF_FLAG;
+  }
+  mask = (id & CAN_EFF_FLAG) ? CAN_EFF_MASK : CAN_SFF_MASK;
+  if(*end == '/') {
+    arg = end + 1;
+    mask = strtoul(arg, &end, 16);
+    if(end == arg) return false;
+  }
+  return *end == '\0' && canbus_logquery_add_id(query, id, mask) == 0;
+}
+
+static bool logq_pattern(canbus_logquery *query, const char *arg) {
+  uint8_t data[CANFD_MAX_DLEN], mask[CANFD_MAX_DLEN];
+  unsigned long offset;
+  unsigned int len = 0;
+  int hi, lo;
+  char *p;
+
+  offset = strtoul(arg, &p, 10);
+  if(p == arg || *p++ != ':' || offset >= CANFD_MAX_DLEN) return false;
+  for(; p[0] != '\0' && p[1] != '\0' && len < CANFD_MAX_DLEN; p += 2, len++) {
+    hi = p[0] == 'x' || p[0] == 'X' ? 0 : logq_nibble(p[0]);
+    lo = p[1] == 'x' || p[1] == 'X' ? 0 : logq_nibble(p[1]);
+    if(hi < 0 || lo < 0) return false;
+    data[len] = hi << 4 | lo;
+    mask[len] = (p[0] == 'x' || p[0] == 'X' ? 0 : 0xf0) | (p[1] == 'x' || p[1] == 'X' ? 0 : 0x0f);
+  }
+  return *p == '\0' && canbus_logquery_add_pattern(query, offset, data, mask, len) == 0;
+}
+
+static void logq_counts(canbus_logquery *query) {
+  canbus_logquery_count *counts;
+  unsigned int i, n;
+  double span;
+
+  if((counts = canbus_logquery_counts(query, &n)) == NULL) {
+    return;
+  }
+  printf("id,frames,bytes,first,last,hz\n");
+  for(i=0; i<n; i++) {
+    canbus_logquery_count *c = &counts[i];
+    span = (c->last_ns - c->first_ns) / 1e9;
+    if(c->can_id & CAN_ERR_FLAG) {
+      printf("error %08x", c->can_id & CAN_ERR_MASK);
+    }
+    else {
+      printf((c->can_id & CAN_EFF_FLAG) ? "%08x" : "%03x", c->can_id & CAN_EFF_MASK);
+    }
+    printf(",%llu,%llu,%llu.%09llu,%llu.%09llu,%.3f\n", (unsigned long long)c->frames, (unsigned long long)c->bytes,
+      (unsigned long long)(c->first_ns / 1000000000ULL), (unsigned long long)(c->first_ns % 1000000000ULL),
+      (unsigned long long)(c->last_ns / 1000000000ULL), (unsigned long long)(c->last_ns % 1000000000ULL),
+      span > 0 ? (c->frames - 1) / span : 0.0);
+  }
+  free(counts);
+}
+
+int main(int argc, char **argv) {
+  canbus_logquery query;
+  bool verbose = false;
+  double start;
+  int c, i, rc = 0;
+
+  canbus_logquery_init(&query, CANBUS_LOGQUERY_COUNT);
+  while((c = getopt(argc, argv, "a:j:s:e:l:i:p:v")) != -1) {
+    switch(c) {
+      case 'a':
+        if(strcmp(optarg, "count") == 0) query.action = CANBUS_LOGQUERY_COUNT;
+        else if(strcmp(optarg, "frames") == 0) query.action = CANBUS_LOGQUERY_FRAMES;
+        else if(strcmp(optarg, "total") == 0) query.action = CANBUS_LOGQUERY_TOTAL;
+        else {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'j':
+        query.threads = atoi(optarg);
+        break;
+      case 's':
+      case 'e':
+      case 'l':
+        if(canbus_log_parse_time(optarg, c == 's' ? &query.from : c == 'e' ? &query.to : &query.last) == NULL) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'i':
+        if(!logq_id(&query, optarg)) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'p':
+        if(!logq_pattern(&query, optarg)) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if(argc - optind < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  openlog("ecutools-logq", LOG_PERROR, LOG_USER);
+  setlogmask(LOG_UPTO(LOG_WARNING));
+
+  if(query.action == CANBUS_LOGQUERY_FRAMES) {
+    printf("time,id,type,fd,len,data\n");
+  }
+  start = logq_now();
+  for(i=optind; i<argc && rc == 0; i++) {
+    rc = canbus_logquery_run(&query, argv[i]);
+  }
+  double elapsed = logq_now() - start;
+  fflush(stdout);
+
+  if(rc == 0 && query.action == CANBUS_LOGQUERY_COUNT) {
+    logq_counts(&query);
+  }
+  else if(rc == 0 && query.action == CANBUS_LOGQUERY_TOTAL) {
+    printf("%llu\n", (unsigned long long)canbus_logquery_matched(&query));
+  }
+  if(verbose) {
+    fprintf(stderr, "%llu of %llu frames matched, %.1f MB scanned in %.3f s: %.2f GB/s, %.1f M frames/s\n",
+      (unsigned long long)canbus_logquery_matched(&query), (unsigned long long)query.scanned, query.bytes / 1e6, elapsed,
+      query.bytes / elapsed / 1e9, query.scanned / elapsed / 1e6);
+  }
+
+  canbus_logquery_free(&query);
+  closelog();
+  return rc == 0 ? 0 : 1;
+}
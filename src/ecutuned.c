@@ -24,11 +24,14 @@
 #include "mystring.h"
 #include "passthru_thing.h"
 #include "j2534.h"
+#include "dlog.h"
 
 int daemonize = 0;
+char *dlogfile = NULL;
 
 int main_exit(int exit_status, passthru_thing_params *params) {
   syslog(LOG_DEBUG, "exiting %s", params->thingName);
+  dlog_close();
   closelog();
   if(params->iface != NULL) {
     free(params->iface);
@@ -98,7 +101,7 @@ void print_program_header() {
 
 void parse_args(int argc, char** argv, passthru_thing_params *params) {
   int opt;
-  while((opt = getopt(argc, argv, "n:i:l:s:c:d")) != -1) {
+  while((opt = getopt(argc, argv, "n:i:l:s:c:r:f:S:T:b:B:q:wR:o:d")) != -1) {
     switch(opt) {
       case 'n':
         if(strlen(optarg) > 80) {
@@ -108,8 +111,8 @@ void parse_args(int argc, char** argv, passthru_thing_params *params) {
         params->thingName = MYSTRING_COPY(optarg, strlen(optarg));
         break;
       case 'i':
-        if(strlen(optarg) > 10) {
-          printf("ERROR: interface value must not exceed 10 chars");
+        if(strlen(optarg) > 255) {
+          printf("ERROR: interface list must not exceed 255 chars");
           main_exit(1, params);
         }
         params->iface = MYSTRING_COPY(optarg, strlen(optarg));
@@ -135,6 +138,75 @@ void parse_args(int argc, char** argv, passthru_thing_params *params) {
         }
         params->certDir = MYSTRING_COPY(optarg, strlen(optarg));
         break;
+      case 'r':
+        params->rcvbuf = atoi(optarg);
+        if(params->rcvbuf <= 0) {
+          printf("ERROR: receive buffer size must be a positive number of bytes");
+          main_exit(1, params);
+        }
+        break;
+      case 'f':
+        params->fsync_ms = atoi(optarg);
+        if(params->fsync_ms < 0) {
+          printf("ERROR: fsync interval must be a number of milliseconds, 0 to sync on close only");
+          main_exit(1, params);
+        }
+        break;
+      case 'S':
+        params->segment_mb = atoi(optarg);
+        if(params->segment_mb <= 0) {
+          printf("ERROR: log segment size must be a positive number of megabytes");
+          main_exit(1, params);
+        }
+        break;
+      case 'T':
+        params->segment_sec = atoi(optarg);
+        if(params->segment_sec <= 0) {
+          printf("ERROR: log segment duration must be a positive number of seconds");
+          main_exit(1, params);
+        }
+        break;
+      case 'b':
+        params->publish_frames = atoi(optarg);
+        if(params->publish_frames <= 0) {
+          printf("ERROR: publish batch size must be a positive number of frames");
+          main_exit(1, params);
+        }
+        break;
+      case 'B':
+        params->publish_ms = atoi(optarg);
+        if(params->publish_ms <= 0) {
+          printf("ERROR: publish batch interval must be a positive number of milliseconds");
+          main_exit(1, params);
+        }
+        break;
+      case 'q':
+        params->spool_mb = atoi(optarg);
+        if(params->spool_mb <= 0) {
+          printf("ERROR: publish spool size must be a positive number of megabytes");
+          main_exit(1, params);
+        }
+        if(params->spool_mode == CANBUS_AWSIOTLOGGER_SPOOL_OFF) {
+          params->spool_mode = CANBUS_AWSIOTLOGGER_SPOOL_OUTAGE;
+        }
+        break;
+      case 'w':
+        params->spool_mode = CANBUS_AWSIOTLOGGER_SPOOL_ALWAYS;
+        break;
+      case 'R':
+        params->spool_kbps = atoi(optarg);
+        if(params->spool_kbps <= 0) {
+          printf("ERROR: publish spool drain rate must be a positive number of KB per second");
+          main_exit(1, params);
+        }
+        break;
+      case 'o':
+        if(strlen(optarg) > 255) {
+          printf("ERROR: diagnostic log file must not exceed 255 chars");
+          main_exit(1, params);
+        }
+        dlogfile = optarg;
+        break;
       case 'd':
         daemonize = 1;
         break;
@@ -178,6 +250,15 @@ int main(int argc, char **argv) {
   params->iface = NULL;
   params->certDir = NULL;
   params->cacheDir = NULL;
+  params->rcvbuf = 0;
+  params->fsync_ms = 0;
+  params->segment_mb = 0;
+  params->segment_sec = 0;
+  params->publish_frames = 0;
+  params->publish_ms = 0;
+  params->spool_mode = CANBUS_AWSIOTLOGGER_SPOOL_OFF;
+  params->spool_mb = 0;
+  params->spool_kbps = 0;
   parse_args(argc, argv, params);
 
   struct sigaction newSigAction;
@@ -204,6 +285,11 @@ int main(int argc, char **argv) {
 
   if(daemonize) daemon(1, 0);
 
+  // after daemon(), which would leave the drainer thread behind in the parent
+  if(dlog_init(dlogfile ? DLOG_SINK_FILE : DLOG_SINK_SYSLOG, dlogfile) != 0) {
+    syslog(LOG_WARNING, "unable to start diagnostic log drainer, logging synchronously");
+  }
+
   passthru_thing_init(params);
   passthru_thing_run();
   passthru_thing_close();
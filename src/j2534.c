@@ -39,13 +39,42 @@ unsigned long unless_concurrent_call(unsigned long status, unsigned long api_cal
   return status;
 }
 
+/**
+ * Queues the frames the daemon published on msg_rx_topic. Each message holds
+ * up to J2534_MSG_BATCH records of J2534_MSG_RECORD_LEN bytes, in the binary
+ * log's record layout, so every frame keeps its kernel receive timestamp.
+ */
 void j2534_rxqueue_handler(AWS_IoT_Client *pClient, char *topicName, uint16_t topicNameLen, IoT_Publish_Message_Params *params, void *pData) {
 
-  syslog(LOG_DEBUG, "j2534_rxqueue_handler: topicName=%s, topicNameLen=%u, payload=%s, payload_len=%i",
-    topicName, (unsigned int)topicNameLen, params->payload, params->payloadLen);
+  DLOG_DEBUG("j2534_rxqueue_handler: topicName=%.*s, payload_len=%zu", (int)topicNameLen, topicName, params->payloadLen);
 
   j2534_client *client = (j2534_client *)pData;
-  vector_add(client->rxQueue, pData);
+  const uint8_t *payload = (const uint8_t *)params->payload;
+  unsigned long dropped = client->rxDropped;
+  size_t i;
+
+  if(params->payloadLen % J2534_MSG_RECORD_LEN != 0) {
+    syslog(LOG_ERR, "j2534_rxqueue_handler: payload_len=%zu is not a whole number of records", params->payloadLen);
+    return;
+  }
+
+  for(i=0; i<params->payloadLen; i+=J2534_MSG_RECORD_LEN) {
+    if(vector_count(client->rxQueue) >= J2534_MSG_BUFFER_SIZE) {
+      client->rxDropped++;
+      continue;
+    }
+    canbus_frame *frame = malloc(sizeof(canbus_frame));
+    if(frame == NULL) {
+      client->rxDropped++;
+      continue;
+    }
+    canbus_binlog_decode(&payload[i], J2534_MSG_RECORD_LEN, frame);
+    vector_add(client->rxQueue, frame);
+  }
+
+  if(client->rxDropped != dropped) {
+    syslog(LOG_WARNING, "j2534_rxqueue_handler: rx queue full, messages dropped. dropped=%lu", client->rxDropped);
+  }
 }
 
 j2534_client* j2534_client_by_channel_id(unsigned long ChannelID) {
@@ -56,6 +85,7 @@ j2534_client* j2534_client_by_channel_id(unsigned long ChannelID) {
       return client;
     }
   }
+  return NULL;
 }
 
 j2534_client* j2534_client_by_device_id(unsigned long DeviceID) {
@@ -109,32 +139,35 @@ void j2534_onerror(awsiot_client *awsiot, const char *message) {
   syslog(LOG_ERR, "j2534_onerror: message=%s", message);
 }
 
+/**
+ * Writes one filter as {"id":"<hex>","mask":"<hex>","type":N,"data":"<hex>","dataMask":"<hex>"}.
+ * json_len should be at least J2534_FILTER_JSON_LEN.
+ */
+void j2534_canbus_filter_json(struct canbus_filter *filter, char *json, size_t json_len) {
+  char data[CAN_MAX_DLEN * 2 + 1], data_mask[CAN_MAX_DLEN * 2 + 1];
+  int i;
+  for(i=0; i<filter->data_len; i++) {
+    sprintf(&data[i*2], "%02x", filter->data[i]);
+    sprintf(&data_mask[i*2], "%02x", filter->data_mask[i]);
+  }
+  data[filter->data_len * 2] = '\0';
+  data_mask[filter->data_len * 2] = '\0';
+  snprintf(json, json_len, "{\"id\":\"%x\",\"mask\":\"%x\",\"type\":%u,\"data\":\"%s\",\"dataMask\":\"%s\"}",
+    filter->can_id, filter->can_mask, filter->type, data, data_mask);
+}
+
 char *filter_json(j2534_client *client) {
 
-  unsigned int json_len = client->filters->count * 27;
-  j2534_canfilter *canfilter = NULL;
+  unsigned int json_len = client->filters->count * (J2534_FILTER_JSON_LEN + 1) + 3;
   char *json = malloc(sizeof(char) * json_len);
-  memset(json, '\0', sizeof(char) * json_len);
+  char tmp[J2534_FILTER_JSON_LEN];
   strcpy(json, "[");
 
   int i;
   for(i=0; i<client->filters->count; i++) {
-
-    char tmp_format[json_len];
-    char tmp[json_len];
-
-    canfilter = (j2534_canfilter *)vector_get(client->filters, i);
-
-    strcpy(tmp_format, "{\"id\":\"");
-    strcat(tmp_format, "%x");
-    strcat(tmp_format, "\",");
-    strcat(tmp_format, "\"mask\":\"");
-    strcat(tmp_format, "%x");
-    strcat(tmp_format, "\"}");
-
-    snprintf(tmp, json_len, tmp_format, canfilter->can_id, canfilter->can_mask);
+    j2534_canfilter *canfilter = (j2534_canfilter *)vector_get(client->filters, i);
+    j2534_canbus_filter_json(&canfilter->filter, tmp, sizeof(tmp));
     strcat(json, tmp);
-
     if(i < client->filters->count-1) {
       strcat(json, ",");
     }
@@ -144,16 +177,143 @@ char *filter_json(j2534_client *client) {
   return json;
 }
 
-unsigned int j2534_publish_state(j2534_client *client, int desired_state) {
+/**
+ * Converts a captured CAN or CAN FD frame into a PASSTHRU_MSG. DataBuffer must hold
+ * at least 4 + the frame length (up to 4 + CANFD_MAX_DLEN): the 4 byte big endian
+ * CAN ID followed by the payload. Timestamp carries the kernel receive timestamp in
+ * microseconds.
+ */
+unsigned int j2534_canbus_frame_to_msg(canbus_frame *frame, unsigned long protocolId, PASSTHRU_MSG *msg) {
+
+  canid_t can_id = frame->frame.can_id & (frame->frame.can_id & CAN_EFF_FLAG ? CAN_EFF_MASK : CAN_SFF_MASK);
+  unsigned long data_len = 4 + frame->frame.len;
+
+  if(msg->DataBuffer == NULL || msg->DataBufferSize < data_len) {
+    return ERR_BUFFER_TOO_SMALL;
+  }
+
+  msg->ProtocolID = protocolId;
+  msg->RxStatus = (frame->frame.can_id & CAN_EFF_FLAG) ? CAN_29BIT_ID : 0;
+  if(frame->flags & CANBUS_FRAME_FD) {
+    msg->RxStatus |= J2534_CAN_FD_FORMAT;
+    if(frame->frame.flags & CANFD_BRS) msg->RxStatus |= J2534_CAN_FD_BRS;
+    if(frame->frame.flags & CANFD_ESI) msg->RxStatus |= J2534_CAN_FD_ESI;
+  }
+  msg->TxFlags = 0;
+  msg->Timestamp = (unsigned long)((uint64_t)frame->ts.tv_sec * 1000000 + frame->ts.tv_nsec / 1000);
+  msg->DataLength = data_len;
+  msg->ExtraDataIndex = data_len;
+
+  msg->DataBuffer[0] = (can_id >> 24) & 0xff;
+  msg->DataBuffer[1] = (can_id >> 16) & 0xff;
+  msg->DataBuffer[2] = (can_id >> 8) & 0xff;
+  msg->DataBuffer[3] = can_id & 0xff;
+  memcpy(&msg->DataBuffer[4], frame->frame.data, frame->frame.len);
+
+  return STATUS_NOERROR;
+}
+
+/**
+ * Inverse of j2534_canbus_frame_to_msg: builds a frame from a 4 byte big endian
+ * CAN ID and payload. <TxFlags> select 29 bit IDs and the CAN FD format.
+ * Returns ERR_INVALID_MSG when the payload does not fit the frame type.
+ */
+unsigned int j2534_msg_to_canbus_frame(PASSTHRU_MSG *msg, canbus_frame *frame) {
+
+  if(msg->DataBuffer == NULL || msg->DataLength < 4) {
+    return ERR_INVALID_MSG;
+  }
+
+  unsigned long len = msg->DataLength - 4;
+  bool fd = msg->TxFlags & J2534_CAN_FD_FORMAT;
+
+  if(!fd && len > CAN_MAX_DLEN) {
+    return ERR_INVALID_MSG;
+  }
+
+  // CAN FD payloads are limited to the lengths a DLC can express
+  if(fd && len > 8 && len != 12 && len != 16 && len != 20 && len != 24 && len != 32 && len != 48 && len != 64) {
+    return ERR_INVALID_MSG;
+  }
+
+  canid_t can_id = ((canid_t)msg->DataBuffer[0] << 24) | ((canid_t)msg->DataBuffer[1] << 16) |
+                   ((canid_t)msg->DataBuffer[2] << 8) | msg->DataBuffer[3];
+
+  memset(frame, 0, sizeof(canbus_frame));
+  if(msg->TxFlags & CAN_29BIT_ID) {
+    frame->frame.can_id = (can_id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+  }
+  else {
+    if(can_id > CAN_SFF_MASK) return ERR_INVALID_MSG;
+    frame->frame.can_id = can_id;
+  }
+
+  frame->frame.len = len;
+  memcpy(frame->frame.data, &msg->DataBuffer[4], len);
+
+  if(fd) {
+    frame->flags = CANBUS_FRAME_FD;
+    if(msg->TxFlags & J2534_CAN_FD_BRS) frame->frame.flags |= CANFD_BRS;
+  }
+
+  return STATUS_NOERROR;
+}
+
+/**
+ * Converts a J2534 mask/pattern pair into a canbus_filter. The first 4 bytes are
+ * the big endian CAN ID, the rest match payload bytes; CAN_29BIT_ID in the
+ * pattern's <TxFlags> selects 29 bit IDs, so a filter never matches both formats.
+ */
+unsigned int j2534_msg_to_canbus_filter(unsigned long type, PASSTHRU_MSG *mask, PASSTHRU_MSG *pattern, struct canbus_filter *filter) {
+
+  if(mask->DataBuffer == NULL || pattern->DataBuffer == NULL || mask->DataLength != pattern->DataLength ||
+     mask->DataLength < 1 || mask->DataLength > 4 + CAN_MAX_DLEN) {
+    return ERR_INVALID_MSG;
+  }
+
+  memset(filter, 0, sizeof(struct canbus_filter));
+  filter->type = type;
+
+  canid_t id = 0, id_mask = 0;
+  int i;
+  for(i=0; i<4; i++) {
+    id <<= 8;
+    id_mask <<= 8;
+    if(i < mask->DataLength) {
+      id |= pattern->DataBuffer[i];
+      id_mask |= mask->DataBuffer[i];
+    }
+  }
+
+  bool eff = pattern->TxFlags & CAN_29BIT_ID;
+  canid_t bits = eff ? CAN_EFF_MASK : CAN_SFF_MASK;
+  filter->can_id = (id & bits) | (eff ? CAN_EFF_FLAG : 0);
+  filter->can_mask = (id_mask & bits) | CAN_EFF_FLAG;
+
+  // trailing "don't care" bytes are dropped so ID only filters stay in the kernel
+  for(i=4; i<mask->DataLength; i++) {
+    filter->data[i-4] = pattern->DataBuffer[i];
+    filter->data_mask[i-4] = mask->DataBuffer[i];
+    if(mask->DataBuffer[i]) filter->data_len = i - 3;
+  }
+
+  return STATUS_NOERROR;
+}
+
+/**
+ * Publishes the desired state and waits for the daemon to report it back.
+ * fields holds extra members for the j2534 object (",\"key\":value..."), or "".
+ */
+unsigned int j2534_publish_state_fields(j2534_client *client, int desired_state, const char *fields) {
 
   char *msgfilters = filter_json(client);
 
-  char json_format[255] = "{\"state\":{\"desired\":{\"j2534\":{\"deviceId\":%i,\"state\":%i,\"filters\":%s}}}}";
-  unsigned int json_format_len = strlen(json_format) - 4;
-  unsigned int json_len = json_format_len + MYINT_LEN(desired_state) + MYINT_LEN(client->deviceId) + strlen(msgfilters);
+  char json_format[255] = "{\"state\":{\"desired\":{\"j2534\":{\"deviceId\":%i,\"protocolId\":%i,\"state\":%i,\"filters\":%s%s}}}}";
+  unsigned int json_format_len = strlen(json_format) - 10;
+  unsigned int json_len = json_format_len + MYINT_LEN(desired_state) + MYINT_LEN(client->deviceId) + MYINT_LEN(client->protocolId) + strlen(msgfilters) + strlen(fields);
 
   char json[json_len+1];
-  snprintf(json, json_len+1, json_format, client->deviceId, desired_state, msgfilters);
+  snprintf(json, json_len+1, json_format, client->deviceId, client->protocolId, desired_state, msgfilters, fields);
   json[json_len+1] = '\0';
   free(msgfilters);
 
@@ -162,6 +322,9 @@ unsigned int j2534_publish_state(j2534_client *client, int desired_state) {
     return ERR_DEVICE_NOT_CONNECTED;
   }
 
+  // repeated calls (e.g. a second periodic message) report the same state again
+  client->state = NULL;
+
   unsigned int i = 0;
   while(client->state != desired_state) {
 
@@ -186,6 +349,34 @@ unsigned int j2534_publish_state(j2534_client *client, int desired_state) {
   }
 
   return STATUS_NOERROR;
+}
+
+unsigned int j2534_publish_state(j2534_client *client, int desired_state) {
+  return j2534_publish_state_fields(client, desired_state, "");
+}
+
+void j2534_rxqueue_clear(j2534_client *client) {
+  int i;
+  for(i=0; i<client->rxQueue->count; i++) {
+    free(vector_get(client->rxQueue, i));
+  }
+  client->rxQueue->count = 0;
+}
+
+void j2534_periodic_msgs_clear(j2534_client *client) {
+  int i;
+  for(i=0; i<client->periodicMsgs->count; i++) {
+    free(vector_get(client->periodicMsgs, i));
+  }
+  client->periodicMsgs->count = 0;
+}
+
+void j2534_filters_clear(j2534_client *client) {
+  int i;
+  for(i=0; i<client->filters->count; i++) {
+    free(vector_get(client->filters, i));
+  }
+  client->filters->count = 0;
 } // end not J2534 spec
 
 /**
@@ -488,10 +679,15 @@ long PassThruOpen(const char *pName, unsigned long *pDeviceID) {
   client->txQueue = malloc(sizeof(vector));
   vector_init(client->rxQueue);
   vector_init(client->txQueue);
+  client->rxDropped = 0;
 
   client->filters = malloc(sizeof(vector));
   vector_init(client->filters);
 
+  client->periodicMsgs = malloc(sizeof(vector));
+  vector_init(client->periodicMsgs);
+  client->bcm = NULL;
+
   client->channelSet = malloc(sizeof(SCHANNELSET));
   client->channelSet->ChannelCount = 0;
   client->channelSet->ChannelThreshold = 0;
@@ -588,6 +784,16 @@ long PassThruClose(unsigned long DeviceID) {
     J2534_PassThruClose
   );
 
+  if(client->rxDropped > 0) {
+    syslog(LOG_WARNING, "PassThruClose: %lu received messages were dropped on a full rx queue", client->rxDropped);
+  }
+
+  int i;
+  for(i=0; i<vector_count(client->rxQueue); i++) {
+    free(vector_get(client->rxQueue, i));
+  }
+  vector_free(client->rxQueue);
+
   free(client->channelSet);
   free(client->txQueue);
   free(client->rxQueue);
@@ -711,7 +917,7 @@ long PassThruConnect(unsigned long DeviceID, unsigned long ProtocolID, unsigned
     return unless_concurrent_call(ERR_PROTOCOL_ID_NOT_SUPPORTED, J2534_PassThruConnect);
   }*/
 
-  if(ProtocolID != CAN) {
+  if(ProtocolID != CAN && ProtocolID != J2534_CAN_FD_PS) {
     return unless_concurrent_call(ERR_PROTOCOL_ID_NOT_SUPPORTED, J2534_PassThruConnect);
   }
 
@@ -721,10 +927,13 @@ long PassThruConnect(unsigned long DeviceID, unsigned long ProtocolID, unsigned
 
   client->channelId = *pChannelID;
 
-  return unless_concurrent_call(
-    j2534_publish_state(client, J2534_PassThruConnect),
-    J2534_PassThruConnect
-  );
+  unsigned int rc = j2534_publish_state(client, J2534_PassThruConnect);
+  if(rc == STATUS_NOERROR && awsiot_client_subscribe(client->awsiot, client->msg_rx_topic, j2534_rxqueue_handler, client) != 0) {
+    syslog(LOG_ERR, "PassThruConnect: failed to subscribe. topic=%s, rc=%d", client->msg_rx_topic, client->awsiot->rc);
+    rc = ERR_DEVICE_NOT_CONNECTED;
+  }
+
+  return unless_concurrent_call(rc, J2534_PassThruConnect);
 }
 
 /**
@@ -782,10 +991,18 @@ long PassThruDisconnect(unsigned long ChannelID) {
     return unless_concurrent_call(ERR_INVALID_CHANNEL_ID, J2534_PassThruDisconnect);
   }
 
-  return unless_concurrent_call( 
-    j2534_publish_state(client, J2534_PassThruDisconnect),
-    J2534_PassThruDisconnect
-  );
+  if(awsiot_client_unsubscribe(client->awsiot, client->msg_rx_topic) != 0) {
+    syslog(LOG_ERR, "PassThruDisconnect: failed to unsubscribe. topic=%s, rc=%d", client->msg_rx_topic, client->awsiot->rc);
+  }
+
+  unsigned int rc = j2534_publish_state(client, J2534_PassThruDisconnect);
+  if(rc == STATUS_NOERROR) {
+    j2534_periodic_msgs_clear(client);
+    j2534_filters_clear(client);
+    j2534_rxqueue_clear(client);
+  }
+
+  return unless_concurrent_call(rc, J2534_PassThruDisconnect);
 }
 
 /**
@@ -1138,7 +1355,58 @@ long PassThruSelect(SCHANNELSET *ChannelSetPtr, unsigned long SelectType, unsign
  *   STATUS_NOERROR                   Function call was successful
  */
 long PassThruReadMsgs(unsigned long ChannelID, PASSTHRU_MSG *pMsg, unsigned long *pNumMsgs, unsigned long Timeout) {
-	return ERR_NOT_SUPPORTED;
+
+  j2534_current_api_call = J2534_PassThruReadMsgs;
+
+  if(!j2534_opened) {
+    return unless_concurrent_call(ERR_DEVICE_NOT_OPEN, J2534_PassThruReadMsgs);
+  }
+
+  if(pMsg == NULL || pNumMsgs == NULL) {
+    return unless_concurrent_call(ERR_NULL_PARAMETER, J2534_PassThruReadMsgs);
+  }
+
+  j2534_client *client = j2534_client_by_channel_id(ChannelID);
+  if(client == NULL) {
+    return unless_concurrent_call(ERR_INVALID_CHANNEL_ID, J2534_PassThruReadMsgs);
+  }
+
+  unsigned long max = *pNumMsgs, n = 0;
+  unsigned int rc = STATUS_NOERROR;
+  struct timespec start, now;
+
+  if(Timeout > J2534_TIMEOUT_MILLIS) {
+    Timeout = J2534_TIMEOUT_MILLIS;
+  }
+
+  // frames only reach rxQueue while the MQTT client yields
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+    client->awsiot->rc = aws_iot_mqtt_yield(client->awsiot->client, Timeout > 0 ? J2534_CHANNEL_POLL_MS : 1);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while(vector_count(client->rxQueue) < max &&
+          (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 < (long)Timeout);
+
+  while(n < max && vector_count(client->rxQueue) > 0) {
+    canbus_frame *frame = vector_get(client->rxQueue, 0);
+    rc = j2534_canbus_frame_to_msg(frame, client->protocolId, &pMsg[n]);
+    vector_delete(client->rxQueue, 0);
+    free(frame);
+    if(rc != STATUS_NOERROR) break;
+    n++;
+  }
+
+  *pNumMsgs = n;
+  if(rc != STATUS_NOERROR) {
+    return unless_concurrent_call(rc, J2534_PassThruReadMsgs);
+  }
+  if(n == 0) {
+    return unless_concurrent_call(ERR_BUFFER_EMPTY, J2534_PassThruReadMsgs);
+  }
+  if(n < max && Timeout > 0) {
+    return unless_concurrent_call(ERR_TIMEOUT, J2534_PassThruReadMsgs);
+  }
+  return unless_concurrent_call(STATUS_NOERROR, J2534_PassThruReadMsgs);
 }
 
 /**
@@ -1217,7 +1485,61 @@ long PassThruReadMsgs(unsigned long ChannelID, PASSTHRU_MSG *pMsg, unsigned long
  *   STATUS_NOERROR                  Function call was successful
  */
 long PassThruQueueMsgs(unsigned long ChannelID, PASSTHRU_MSG *pMsg, unsigned long *pNumMsgs) {
-	return ERR_NOT_SUPPORTED;
+
+  j2534_current_api_call = J2534_PassThruQueueMsgs;
+
+  if(!j2534_opened) {
+    return unless_concurrent_call(ERR_DEVICE_NOT_OPEN, J2534_PassThruQueueMsgs);
+  }
+
+  if(pMsg == NULL || pNumMsgs == NULL) {
+    return unless_concurrent_call(ERR_NULL_PARAMETER, J2534_PassThruQueueMsgs);
+  }
+
+  j2534_client *client = j2534_client_by_channel_id(ChannelID);
+  if(client == NULL) {
+    return unless_concurrent_call(ERR_INVALID_CHANNEL_ID, J2534_PassThruQueueMsgs);
+  }
+
+  // J2534_MSG_BATCH frames per publish; the daemon queues them for one sendmmsg
+  uint8_t payload[J2534_MSG_BATCH * J2534_MSG_RECORD_LEN];
+  unsigned long count = *pNumMsgs, queued = 0, n = 0;
+  unsigned int rc = STATUS_NOERROR;
+  canbus_frame frame;
+
+  while(queued + n < count) {
+    PASSTHRU_MSG *msg = &pMsg[queued + n];
+    if(msg->ProtocolID != client->protocolId) {
+      rc = ERR_MSG_PROTOCOL_ID;
+      break;
+    }
+    if((rc = j2534_msg_to_canbus_frame(msg, &frame)) != STATUS_NOERROR) {
+      break;
+    }
+    canbus_binlog_encode(&frame, &payload[n * J2534_MSG_RECORD_LEN], J2534_MSG_RECORD_LEN);
+    if(++n == J2534_MSG_BATCH) {
+      if(awsiot_client_publish_data(client->awsiot, client->msg_tx_topic, payload, n * J2534_MSG_RECORD_LEN) != 0) {
+        rc = ERR_DEVICE_NOT_CONNECTED;
+        n = 0;
+        break;
+      }
+      queued += n;
+      n = 0;
+    }
+  }
+
+  // the valid messages ahead of a bad one are still sent, in order
+  if(n > 0) {
+    if(awsiot_client_publish_data(client->awsiot, client->msg_tx_topic, payload, n * J2534_MSG_RECORD_LEN) == 0) {
+      queued += n;
+    }
+    else if(rc == STATUS_NOERROR) {
+      rc = ERR_DEVICE_NOT_CONNECTED;
+    }
+  }
+
+  *pNumMsgs = queued;
+  return unless_concurrent_call(rc, J2534_PassThruQueueMsgs);
 }
 
 /**
@@ -1315,7 +1637,77 @@ long PassThruQueueMsgs(unsigned long ChannelID, PASSTHRU_MSG *pMsg, unsigned lon
  *   STATUS_NOERROR                     Function call was successful
  */
 long PassThruStartPeriodicMsg(unsigned long ChannelID, PASSTHRU_MSG *pMsg, unsigned long *pMsgID, unsigned long TimeInterval) {
-	return ERR_NOT_SUPPORTED;
+
+  j2534_current_api_call = J2534_PassThruStartPeriodicMsg;
+
+  if(pMsg == NULL || pMsgID == NULL) {
+    return unless_concurrent_call(ERR_NULL_PARAMETER, J2534_PassThruStartPeriodicMsg);
+  }
+
+  if(!j2534_opened) {
+    return unless_concurrent_call(ERR_DEVICE_NOT_OPEN, J2534_PassThruStartPeriodicMsg);
+  }
+
+  j2534_client *client = j2534_client_by_channel_id(ChannelID);
+  if(client == NULL) {
+    return unless_concurrent_call(ERR_INVALID_CHANNEL_ID, J2534_PassThruStartPeriodicMsg);
+  }
+
+  if(pMsg->ProtocolID != client->protocolId) {
+    return unless_concurrent_call(ERR_MSG_PROTOCOL_ID, J2534_PassThruStartPeriodicMsg);
+  }
+
+  if(TimeInterval < J2534_PERIODIC_MIN_INTERVAL || TimeInterval > J2534_PERIODIC_MAX_INTERVAL) {
+    return unless_concurrent_call(ERR_TIME_INTERVAL_NOT_SUPPORTED, J2534_PassThruStartPeriodicMsg);
+  }
+
+  if(client->periodicMsgs->count >= J2534_MAX_PERIODIC_MSGS) {
+    return unless_concurrent_call(ERR_EXCEEDED_LIMIT, J2534_PassThruStartPeriodicMsg);
+  }
+
+  canbus_frame frame;
+  if(j2534_msg_to_canbus_frame(pMsg, &frame) != STATUS_NOERROR) {
+    return unless_concurrent_call(ERR_INVALID_MSG, J2534_PassThruStartPeriodicMsg);
+  }
+
+  if((frame.flags & CANBUS_FRAME_FD) && client->protocolId != J2534_CAN_FD_PS) {
+    return unless_concurrent_call(ERR_INVALID_MSG, J2534_PassThruStartPeriodicMsg);
+  }
+
+  // lowest free id; ids are only unique per channel
+  unsigned long id = 0;
+  int i;
+  bool used = true;
+  while(used) {
+    id++;
+    used = false;
+    for(i=0; i<client->periodicMsgs->count; i++) {
+      j2534_periodic_msg *periodic = vector_get(client->periodicMsgs, i);
+      if(periodic->id == id) used = true;
+    }
+  }
+
+  char data[(4 + CANFD_MAX_DLEN) * 2 + 1];
+  for(i=0; i<pMsg->DataLength; i++) {
+    sprintf(&data[i*2], "%02x", pMsg->DataBuffer[i]);
+  }
+  data[pMsg->DataLength * 2] = '\0';
+
+  char fields[255];
+  snprintf(fields, sizeof(fields), ",\"periodicMsg\":{\"id\":%lu,\"interval\":%lu,\"txFlags\":%lu,\"data\":\"%s\"}",
+    id, TimeInterval, pMsg->TxFlags, data);
+
+  unsigned int rc = j2534_publish_state_fields(client, J2534_PassThruStartPeriodicMsg, fields);
+  if(rc == STATUS_NOERROR) {
+    j2534_periodic_msg *periodic = malloc(sizeof(j2534_periodic_msg));
+    periodic->id = id;
+    periodic->interval = TimeInterval;
+    periodic->frame = frame;
+    vector_add(client->periodicMsgs, periodic);
+    *pMsgID = id;
+  }
+
+  return unless_concurrent_call(rc, J2534_PassThruStartPeriodicMsg);
 }
 
 /**
@@ -1353,7 +1745,38 @@ long PassThruStartPeriodicMsg(unsigned long ChannelID, PASSTHRU_MSG *pMsg, unsig
  *   STATUS_NOERROR                    Function call was successful
  */
 long PassThruStopPeriodicMsg(unsigned long ChannelID, unsigned long MsgID) {
-	return ERR_NOT_SUPPORTED;
+
+  j2534_current_api_call = J2534_PassThruStopPeriodicMsg;
+
+  if(!j2534_opened) {
+    return unless_concurrent_call(ERR_DEVICE_NOT_OPEN, J2534_PassThruStopPeriodicMsg);
+  }
+
+  j2534_client *client = j2534_client_by_channel_id(ChannelID);
+  if(client == NULL) {
+    return unless_concurrent_call(ERR_INVALID_CHANNEL_ID, J2534_PassThruStopPeriodicMsg);
+  }
+
+  int i, index = -1;
+  for(i=0; i<client->periodicMsgs->count; i++) {
+    j2534_periodic_msg *periodic = vector_get(client->periodicMsgs, i);
+    if(periodic->id == MsgID) index = i;
+  }
+
+  if(index == -1) {
+    return unless_concurrent_call(ERR_INVALID_MSG_ID, J2534_PassThruStopPeriodicMsg);
+  }
+
+  char fields[64];
+  snprintf(fields, sizeof(fields), ",\"periodicMsg\":{\"id\":%lu}", MsgID);
+
+  unsigned int rc = j2534_publish_state_fields(client, J2534_PassThruStopPeriodicMsg, fields);
+  if(rc == STATUS_NOERROR) {
+    free(vector_get(client->periodicMsgs, index));
+    vector_delete(client->periodicMsgs, index);
+  }
+
+  return unless_concurrent_call(rc, J2534_PassThruStopPeriodicMsg);
 }
 
 /**
@@ -1509,20 +1932,44 @@ long PassThruStartMsgFilter(unsigned long ChannelID, unsigned long FilterType, P
     return unless_concurrent_call(ERR_INVALID_MSG, J2534_PassThruStartMsgFilter);
   }
 
-  if(client->filters->size >= 10) {
-    return unless_concurrent_call(ERR_EXCEEDED_LIMIT, J2534_PassThruStartMsgFilter); 
+  if(client->filters->count >= J2534_MAX_FILTERS) {
+    return unless_concurrent_call(ERR_EXCEEDED_LIMIT, J2534_PassThruStartMsgFilter);
+  }
+
+  struct canbus_filter rule;
+  if(j2534_msg_to_canbus_filter(FilterType, pMaskMsg, pPatternMsg, &rule) != STATUS_NOERROR) {
+    return unless_concurrent_call(ERR_INVALID_MSG, J2534_PassThruStartMsgFilter);
   }
 
+  // lowest free id; ids are only unique per channel
+  unsigned long id = 0;
+  int i;
+  bool used = true;
+  while(used) {
+    id++;
+    used = false;
+    for(i=0; i<client->filters->count; i++) {
+      j2534_canfilter *canfilter = vector_get(client->filters, i);
+      if(canfilter->id == id) used = true;
+    }
+  }
+
+  // the published state carries the complete filter list
   j2534_canfilter *filter = malloc(sizeof(j2534_canfilter));
-  filter->id = pFilterID;
-  filter->can_id = pPatternMsg->DataBuffer;
-  filter->can_mask = pMaskMsg->DataBuffer;
+  filter->id = id;
+  filter->filter = rule;
   vector_add(client->filters, filter);
 
-  return unless_concurrent_call(
-    j2534_publish_state(client, J2534_PassThruStartMsgFilter),
-    J2534_PassThruStartMsgFilter
-  );
+  unsigned int rc = j2534_publish_state(client, J2534_PassThruStartMsgFilter);
+  if(rc == STATUS_NOERROR) {
+    *pFilterID = id;
+  }
+  else {
+    vector_delete(client->filters, client->filters->count - 1);
+    free(filter);
+  }
+
+  return unless_concurrent_call(rc, J2534_PassThruStartMsgFilter);
 }
 
 /**
@@ -1559,8 +2006,41 @@ long PassThruStartMsgFilter(unsigned long ChannelID, unsigned long FilterType, P
  *                                     Interface shall never return ERR_FAILED.
  *   STATUS_NOERROR                    Function call was successful
  */
-long  PassThruStopMsgFilter(unsigned long ChannelID, unsigned long FilterID) {
-  return ERR_NOT_SUPPORTED;
+long PassThruStopMsgFilter(unsigned long ChannelID, unsigned long FilterID) {
+
+  j2534_current_api_call = J2534_PassThruStopMsgFilter;
+
+  if(!j2534_opened) {
+    return unless_concurrent_call(ERR_DEVICE_NOT_OPEN, J2534_PassThruStopMsgFilter);
+  }
+
+  j2534_client *client = j2534_client_by_channel_id(ChannelID);
+  if(client == NULL) {
+    return unless_concurrent_call(ERR_INVALID_CHANNEL_ID, J2534_PassThruStopMsgFilter);
+  }
+
+  int i, index = -1;
+  for(i=0; i<client->filters->count; i++) {
+    j2534_canfilter *canfilter = vector_get(client->filters, i);
+    if(canfilter->id == FilterID) index = i;
+  }
+
+  if(index == -1) {
+    return unless_concurrent_call(ERR_INVALID_FILTER_ID, J2534_PassThruStopMsgFilter);
+  }
+
+  j2534_canfilter *filter = vector_get(client->filters, index);
+  vector_delete(client->filters, index);
+
+  unsigned int rc = j2534_publish_state(client, J2534_PassThruStopMsgFilter);
+  if(rc == STATUS_NOERROR) {
+    free(filter);
+  }
+  else {
+    vector_add(client->filters, filter);
+  }
+
+  return unless_concurrent_call(rc, J2534_PassThruStopMsgFilter);
 }
 
 /**
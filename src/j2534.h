@@ -27,6 +27,8 @@
 #include "passthru_thing.h"
 #include "passthru_shadow_parser.h"
 #include "awsiot_client.h"
+#include "canbus_binlog.h"
+#include "canbus_txqueue.h"
 #include "j2534/apigateway.h"
 
 // Return Values
@@ -111,7 +113,7 @@
 #define CAN_ID_BOTH         (0 << 11)
 //Reserved for SAE          10
 #define CHECKSUM_DISABLED   (0 << 9)
-#define CAN_29BIT_ID        (0 << 8)
+#define CAN_29BIT_ID        (1 << 8)
 //Reserved for SAE J2534-1  2-7
 //Reserved for SAE          1
 #define FULL_DUPLEX         (0 << 0)
@@ -306,7 +308,19 @@ long PassThruIoctl(unsigned long ControlTarget, unsigned long IoctlID, void *Inp
 #define J2534_MSG_RX_TOPIC                  "ecutools/j2534/%s/rx"
 #define J2534_MSG_TX_TOPIC                  "ecutools/j2534/%s/tx"
 #define J2534_MSG_BUFFER_SIZE               1000
+#define J2534_MSG_RECORD_LEN                (sizeof(canbus_binlog_record) + CANFD_MAX_DLEN)  // one frame on the rx and tx topics
+#define J2534_MSG_BATCH                     32          // frames per rx/tx publish, sized to fit AWS_IOT_MQTT_RX_BUF_LEN
+#define J2534_CHANNEL_POLL_MS               10          // longest the daemon's channel thread waits on the bus before yielding
+#define J2534_CAN_FD_PS                     0x00008005  // CAN FD frames (no transport layer)
+#define J2534_CAN_FD_FORMAT                 (1 << 16)   // <RxStatus>/<TxFlags>: frame uses the CAN FD format
+#define J2534_CAN_FD_BRS                    (1 << 17)   // <RxStatus>/<TxFlags>: CAN FD bit rate switch
+#define J2534_CAN_FD_ESI                    (1 << 18)   // <RxStatus>: CAN FD error state indicator
 #define J2534_TIMEOUT_MILLIS                30000
+#define J2534_MAX_PERIODIC_MSGS             10          // per physical channel (7.3.12)
+#define J2534_PERIODIC_MIN_INTERVAL         5           // <TimeInterval> range in milliseconds
+#define J2534_PERIODIC_MAX_INTERVAL         65535
+#define J2534_MAX_FILTERS                   10          // per physical channel (7.3.14)
+#define J2534_FILTER_JSON_LEN               128         // one filter_json element
 #define J2534_PassThruScanForDevices        1
 #define J2534_PassThruGetNextDevice         2
 #define J2534_PassThruOpen                  3
@@ -328,11 +342,16 @@ long PassThruIoctl(unsigned long ControlTarget, unsigned long IoctlID, void *Inp
 #define J2534_PassThruIoctl                 19
 
 typedef struct {
-  unsigned long *id;
-  canid_t can_id;
-  canid_t can_mask;
+  unsigned long id;
+  struct canbus_filter filter;
 } j2534_canfilter;
 
+typedef struct {
+  unsigned long id;
+  unsigned long interval;
+  canbus_frame frame;
+} j2534_periodic_msg;
+
 typedef struct {
   char *name;
   int *state;
@@ -349,12 +368,22 @@ typedef struct {
   SCHANNELSET *channelSet;
   awsiot_client *awsiot;
   canbus_client *canbus;
-  vector *rxQueue;
+  canbus_client *bcm;         // CANBUS_CAPTURE_BCM connection owning the periodic messages
+  pthread_t channel_thread;   // daemon: publishes received frames on msg_rx_topic
+  bool channelRunning;
+  canbus_txqueue *txqueue;    // daemon: frames from msg_tx_topic, written in batches under canbus->wlock
+  vector *rxQueue;            // canbus_frame, oldest first
+  unsigned long rxDropped;    // messages refused because rxQueue already held J2534_MSG_BUFFER_SIZE
   vector *txQueue;
   vector *filters;
+  vector *periodicMsgs;
 } j2534_client;
 
 void j2534_send_error(awsiot_client *awsiot, unsigned int error);
+unsigned int j2534_canbus_frame_to_msg(canbus_frame *frame, unsigned long protocolId, PASSTHRU_MSG *msg);
+unsigned int j2534_msg_to_canbus_frame(PASSTHRU_MSG *msg, canbus_frame *frame);
+unsigned int j2534_msg_to_canbus_filter(unsigned long type, PASSTHRU_MSG *mask, PASSTHRU_MSG *pattern, struct canbus_filter *filter);
+void j2534_canbus_filter_json(struct canbus_filter *filter, char *json, size_t json_len);
 // end non-J2534 spec
 
 #endif
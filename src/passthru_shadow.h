@@ -27,6 +27,7 @@
 #include <linux/can.h>
 #include <linux/can/raw.h>
 #include "vector.h"
+#include "canbus_filter.h"
 #include "aws_iot_src/include/aws_iot_log.h"
 #include "aws_iot_src/include/aws_iot_version.h"
 #include "aws_iot_src/include/aws_iot_mqtt_client_interface.h"
@@ -40,22 +41,33 @@
 
 static char DELTA_REPORT[SHADOW_MAX_SIZE_OF_RX_BUFFER];
 
+typedef struct canbus_filter shadow_j2534_filter;
+
 typedef struct {
   int *type;
   char *file;
+  int format;   // CANBUS_LOG_FORMAT_* for file logs
+  vector *filters;              // shadow_j2534_filter rules the logger captures through, NULL for all frames
+  bool filtersInvalid;          // the delta carried a malformed filter list; filters is NULL
 } shadow_log;
 
 typedef struct {
-  canid_t can_id;
-  canid_t can_mask;
-} shadow_j2534_filter;
+  unsigned long id;
+  unsigned long interval;       // 0 when the message is being stopped
+  unsigned long txFlags;
+  unsigned long dataLength;
+  unsigned char data[4 + CANFD_MAX_DLEN];
+} shadow_j2534_periodic_msg;
 
 typedef struct {
   int *deviceId;
+  int *protocolId;
   int *state;
   int *error;
   char *data;
   vector *filters;
+  bool filtersInvalid;          // the delta carried a malformed filter list; filters is NULL
+  shadow_j2534_periodic_msg *periodicMsg;
 } shadow_j2534;
 
 typedef struct {
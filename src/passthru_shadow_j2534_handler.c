@@ -83,6 +83,148 @@ void passthru_shadow_j2534_handler_send_report(int state) {
   passthru_thing_send_report(json);
 }
 
+/**
+ * Echoes the filter list back in the report (an empty list when filters is
+ * NULL) so the shadow only produces a filters delta when the client changes it.
+ */
+void passthru_shadow_j2534_handler_send_filter_report(int state, vector *filters) {
+  unsigned int count = filters ? filters->count : 0;
+  unsigned int json_len = 64 + count * (J2534_FILTER_JSON_LEN + 1);
+  char json[json_len];
+  char filter_json[J2534_FILTER_JSON_LEN];
+  int i;
+  snprintf(json, json_len, "{\"j2534\":{\"state\":%i,\"error\":null,\"filters\":[", state);
+  for(i=0; i<count; i++) {
+    j2534_canbus_filter_json(vector_get(filters, i), filter_json, sizeof(filter_json));
+    if(i > 0) strcat(json, ",");
+    strcat(json, filter_json);
+  }
+  strcat(json, "]}}");
+  passthru_thing_send_report(json);
+}
+
+/**
+ * Publishes what the channel receives on msg_rx_topic, J2534_MSG_BATCH frames
+ * at most per message, each with its kernel receive timestamp. The thread is
+ * the only user of the channel's MQTT connection once it is running.
+ */
+void *passthru_shadow_j2534_handler_channel_thread(void *ptr) {
+
+  j2534_client *client = (j2534_client *)ptr;
+  canbus_frame frames[J2534_MSG_BATCH];
+  uint8_t payload[J2534_MSG_BATCH * J2534_MSG_RECORD_LEN];
+  ssize_t i, n;
+
+  syslog(LOG_DEBUG, "passthru_shadow_j2534_handler_channel_thread: running on %s", client->canbus->iface);
+
+  while(1) {
+
+    n = canbus_read_timeout(client->canbus, frames, J2534_MSG_BATCH, J2534_CHANNEL_POLL_MS);
+    if(n < 0) {
+      if(errno != ECANCELED) {
+        syslog(LOG_ERR, "passthru_shadow_j2534_handler_channel_thread: read failed: %s", strerror(errno));
+      }
+      break;
+    }
+
+    if(n > 0) {
+      for(i=0; i<n; i++) {
+        canbus_binlog_encode(&frames[i], &payload[i * J2534_MSG_RECORD_LEN], J2534_MSG_RECORD_LEN);
+      }
+      if(awsiot_client_publish_data(client->awsiot, client->msg_rx_topic, payload, n * J2534_MSG_RECORD_LEN) != 0) {
+        client->rxDropped += n;
+      }
+    }
+
+    // keepalive, and delivery of anything subscribed on this connection
+    aws_iot_mqtt_yield(client->awsiot->client, 1);
+  }
+
+  syslog(LOG_DEBUG, "passthru_shadow_j2534_handler_channel_thread: stopping. dropped=%lu", client->rxDropped);
+  return NULL;
+}
+
+/**
+ * Queues the frames libj2534 published on msg_tx_topic for the channel's TX
+ * thread, which writes them in batches. Runs on the channel thread inside
+ * aws_iot_mqtt_yield, so it never waits for room; the queue counts what it
+ * refuses.
+ */
+void passthru_shadow_j2534_handler_tx_handler(AWS_IoT_Client *pClient, char *topicName, uint16_t topicNameLen, IoT_Publish_Message_Params *params, void *pData) {
+
+  j2534_client *client = (j2534_client *)pData;
+  const uint8_t *payload = (const uint8_t *)params->payload;
+  canbus_frame frames[J2534_MSG_BATCH];
+  size_t i, n = params->payloadLen / J2534_MSG_RECORD_LEN;
+
+  if(params->payloadLen % J2534_MSG_RECORD_LEN != 0 || n > J2534_MSG_BATCH) {
+    syslog(LOG_ERR, "passthru_shadow_j2534_handler_tx_handler: payload_len=%zu is not a batch of records", params->payloadLen);
+    return;
+  }
+
+  for(i=0; i<n; i++) {
+    canbus_binlog_decode(&payload[i * J2534_MSG_RECORD_LEN], J2534_MSG_RECORD_LEN, &frames[i]);
+  }
+
+  ssize_t queued = canbus_txqueue_push(client->txqueue, frames, n, 0);
+  if(queued < (ssize_t)n) {
+    syslog(LOG_WARNING, "passthru_shadow_j2534_handler_tx_handler: TX queue full, %zd of %zu frames queued", queued < 0 ? 0 : queued, n);
+  }
+}
+
+/**
+ * Stops the channel thread before anything it uses, then lets the TX queue
+ * write out what it still holds.
+ */
+void passthru_shadow_j2534_handler_stop_channel(j2534_client *client) {
+  if(client->channelRunning) {
+    canbus_cancel(client->canbus);
+    pthread_join(client->channel_thread, NULL);
+    client->channelRunning = false;
+    awsiot_client_unsubscribe(client->awsiot, client->msg_tx_topic);
+  }
+  if(client->txqueue != NULL) {
+    canbus_txqueue_free(client->txqueue);
+    free(client->txqueue);
+    client->txqueue = NULL;
+  }
+}
+
+/**
+ * Starts the channel's TX queue, its msg_tx_topic subscription and the
+ * channel thread. Returns 0, or non-zero with nothing left running.
+ */
+unsigned int passthru_shadow_j2534_handler_start_channel(j2534_client *client) {
+
+  client->txqueue = malloc(sizeof(canbus_txqueue));
+  if(client->txqueue == NULL) {
+    syslog(LOG_ERR, "passthru_shadow_j2534_handler_start_channel: unable to allocate TX queue");
+    return 1;
+  }
+  if(canbus_txqueue_init(client->txqueue, client->canbus, 0) != 0 || canbus_txqueue_start(client->txqueue) != 0) {
+    canbus_txqueue_free(client->txqueue);
+    free(client->txqueue);
+    client->txqueue = NULL;
+    return 2;
+  }
+
+  if(awsiot_client_subscribe(client->awsiot, client->msg_tx_topic, passthru_shadow_j2534_handler_tx_handler, client) != 0) {
+    syslog(LOG_ERR, "passthru_shadow_j2534_handler_start_channel: failed to subscribe. topic=%s, rc=%d", client->msg_tx_topic, client->awsiot->rc);
+    passthru_shadow_j2534_handler_stop_channel(client);
+    return 3;
+  }
+
+  if(pthread_create(&client->channel_thread, NULL, passthru_shadow_j2534_handler_channel_thread, client) != 0) {
+    syslog(LOG_ERR, "passthru_shadow_j2534_handler_start_channel: unable to start channel thread: %s", strerror(errno));
+    awsiot_client_unsubscribe(client->awsiot, client->msg_tx_topic);
+    passthru_shadow_j2534_handler_stop_channel(client);
+    return 4;
+  }
+  client->channelRunning = true;
+
+  return 0;
+}
+
 void passthru_shadow_j2534_handler_desired_open(passthru_thing *thing, shadow_j2534 *j2534) {
 
 syslog(LOG_DEBUG, "passthru_shadow_j2534_handler_desired_open: j2534->deviceId=%d", j2534->deviceId);
@@ -97,6 +239,13 @@ syslog(LOG_DEBUG, "passthru_shadow_j2534_handler_desired_open: j2534->deviceId=%
   client->state = J2534_PassThruOpen;
   client->deviceId = MYINT_DUP(j2534->deviceId);
   client->opened = true;
+  client->canbus = NULL;
+  client->bcm = NULL;
+  client->channelRunning = false;
+  client->txqueue = NULL;
+  client->rxDropped = 0;
+  client->periodicMsgs = malloc(sizeof(vector));
+  vector_init(client->periodicMsgs);
 
   unsigned int shadow_update_topic_len = PASSTHRU_SHADOW_UPDATE_TOPIC + strlen(client->name) + 1;
   unsigned int shadow_update_accepted_topic_len = PASSTHRU_SHADOW_UPDATE_ACCEPTED_TOPIC + strlen(client->name) + 1;
@@ -140,6 +289,7 @@ void passthru_shadow_j2534_handler_desired_close(passthru_thing *thing, shadow_j
     return passthru_shadow_j2534_handler_send_error(thing, J2534_PassThruConnect, ERR_INVALID_DEVICE_ID);
   }
 
+  passthru_shadow_j2534_handler_stop_channel(client);
   awsiot_client_close(client->awsiot);
 
   passthru_shadow_j2534_handler_delete_client(thing, j2534->deviceId);
@@ -151,9 +301,21 @@ void passthru_shadow_j2534_handler_desired_close(passthru_thing *thing, shadow_j
   free(client->msg_tx_topic);
   free(client->msg_rx_topic);
   free(client->name);
+  vector_free(client->periodicMsgs);
+  free(client->periodicMsgs);
   free(client);
 }
 
+/**
+ * Closes and releases the channel's CAN socket.
+ */
+void passthru_shadow_j2534_handler_free_canbus(j2534_client *client) {
+  canbus_close(client->canbus);
+  canbus_free(client->canbus);
+  free(client->canbus);
+  client->canbus = NULL;
+}
+
 void passthru_shadow_j2534_handler_desired_connect(passthru_thing *thing, shadow_j2534 *j2534) {
 
   j2534_client *client = passthru_shadow_j2534_handler_get_client(thing, j2534->deviceId);
@@ -166,14 +328,44 @@ void passthru_shadow_j2534_handler_desired_connect(passthru_thing *thing, shadow
   }
 
   client->canbus = malloc(sizeof(canbus_client));
-  client->canbus->iface = thing->params->iface;
+  client->canbus->iface = NULL;
+  canbus_iface_split(thing->params->iface, &client->canbus->iface, 1);
 
   canbus_init(client->canbus);
   if(canbus_connect(client->canbus) == 0) {
-    return passthru_shadow_j2534_handler_send_report(J2534_PassThruConnect);
+    client->protocolId = j2534->protocolId;
+    if(client->protocolId == J2534_CAN_FD_PS && !canbus_isfd(client->canbus)) {
+      syslog(LOG_ERR, "passthru_shadow_j2534_handler_desired_connect: %s is not CAN FD capable", client->canbus->iface);
+      passthru_shadow_j2534_handler_free_canbus(client);
+      return passthru_shadow_j2534_handler_send_error(thing, J2534_PassThruConnect, ERR_PROTOCOL_ID_NOT_SUPPORTED);
+    }
+    if(passthru_shadow_j2534_handler_start_channel(client) != 0) {
+      passthru_shadow_j2534_handler_stop_channel(client);
+      passthru_shadow_j2534_handler_free_canbus(client);
+      return passthru_shadow_j2534_handler_send_error(thing, J2534_PassThruConnect, ERR_FAILED);
+    }
+    // a new channel starts unfiltered; reset the reported filter list to match
+    return passthru_shadow_j2534_handler_send_filter_report(J2534_PassThruConnect, NULL);
   }
 
   syslog(LOG_ERR, "passthru_shadow_j2534_handler_desired_connect: Failed to establish CAN connection");
+  canbus_free(client->canbus);
+  free(client->canbus);
+  client->canbus = NULL;
+}
+
+void passthru_shadow_j2534_handler_close_bcm(j2534_client *client) {
+  int i;
+  for(i=0; i<client->periodicMsgs->count; i++) {
+    free(vector_get(client->periodicMsgs, i));
+  }
+  client->periodicMsgs->count = 0;
+  if(client->bcm != NULL) {
+    canbus_close(client->bcm);
+    canbus_free(client->bcm);
+    free(client->bcm);
+    client->bcm = NULL;
+  }
 }
 
 void passthru_shadow_j2534_handler_desired_disconnect(passthru_thing *thing, shadow_j2534 *j2534) {
@@ -191,9 +383,11 @@ void passthru_shadow_j2534_handler_desired_disconnect(passthru_thing *thing, sha
     return passthru_shadow_j2534_handler_send_error(thing, J2534_PassThruDisconnect, ERR_DEVICE_NOT_CONNECTED);
   }
 
-  canbus_close(client->canbus);
-  canbus_free(client->canbus);
-  client->canbus = NULL;
+  passthru_shadow_j2534_handler_stop_channel(client);
+  passthru_shadow_j2534_handler_free_canbus(client);
+
+  // closing the BCM socket also deletes every periodic transmission it owns
+  passthru_shadow_j2534_handler_close_bcm(client);
 
   passthru_shadow_j2534_handler_send_report(J2534_PassThruDisconnect);
 }
@@ -210,43 +404,204 @@ void passthru_shadow_j2534_handler_desired_select(passthru_thing *thing, shadow_
   passthru_shadow_j2534_handler_send_report(client->state);
 }
 
-void passthru_shadow_j2534_handler_desired_startMsgFilter(passthru_thing *thing, shadow_j2534 *j2534) {
+/**
+ * Compiles the complete filter list published by the client and installs it
+ * on the channel; an empty list receives everything again.
+ */
+void passthru_shadow_j2534_handler_apply_filters(passthru_thing *thing, shadow_j2534 *j2534, int state) {
 
+  struct canbus_filter rules[J2534_MAX_FILTERS];
   int i;
 
   j2534_client *client = passthru_shadow_j2534_handler_get_client(thing, j2534->deviceId);
 
   if(client == NULL) {
-    return passthru_shadow_j2534_handler_send_error(thing, J2534_PassThruSelect, ERR_DEVICE_NOT_CONNECTED);
+    return passthru_shadow_j2534_handler_send_error(thing, state, ERR_DEVICE_NOT_CONNECTED);
   }
 
   if(!client->opened) {
-    return passthru_shadow_j2534_handler_send_error(thing, J2534_PassThruStartMsgFilter, ERR_DEVICE_NOT_OPEN);
+    return passthru_shadow_j2534_handler_send_error(thing, state, ERR_DEVICE_NOT_OPEN);
+  }
+
+  if(client->canbus == NULL) {
+    return passthru_shadow_j2534_handler_send_error(thing, state, ERR_INVALID_CHANNEL_ID);
+  }
+
+  if(j2534->filters->count > J2534_MAX_FILTERS) {
+    return passthru_shadow_j2534_handler_send_error(thing, state, ERR_EXCEEDED_LIMIT);
   }
 
-  client->state = J2534_PassThruStartMsgFilter;
+  client->state = state;
 
-  syslog(LOG_DEBUG, "passthru_shadow_j2534_handler_desired_startMsgFilter: j2534->filters->count=%i", j2534->filters->count);
+  syslog(LOG_DEBUG, "passthru_shadow_j2534_handler_apply_filters: j2534->filters->count=%i", j2534->filters->count);
 
-  struct can_filter *filters = malloc(sizeof(struct can_filter) * j2534->filters->count);
   for(i=0; i<j2534->filters->count; i++) {
+    rules[i] = *(shadow_j2534_filter *)vector_get(j2534->filters, i);
+  }
+
+  if(canbus_filter_set(client->canbus, rules, j2534->filters->count) != 0) {
+    return passthru_shadow_j2534_handler_send_error(thing, state, ERR_FAILED);
+  }
+
+  passthru_shadow_j2534_handler_send_filter_report(state, j2534->filters);
+}
+
+void passthru_shadow_j2534_handler_desired_startMsgFilter(passthru_thing *thing, shadow_j2534 *j2534) {
+  passthru_shadow_j2534_handler_apply_filters(thing, j2534, J2534_PassThruStartMsgFilter);
+}
+
+void passthru_shadow_j2534_handler_desired_stopMsgFilter(passthru_thing *thing, shadow_j2534 *j2534) {
+  passthru_shadow_j2534_handler_apply_filters(thing, j2534, J2534_PassThruStopMsgFilter);
+}
+
+/**
+ * Echoes periodicMsg back in the report so the shadow only produces a new
+ * delta when the client publishes a different one.
+ */
+void passthru_shadow_j2534_handler_send_periodic_report(int state, shadow_j2534_periodic_msg *msg) {
+  char json[320];
+  char data[(4 + CANFD_MAX_DLEN) * 2 + 1];
+  int i;
+  if(msg->interval == 0) {
+    snprintf(json, sizeof(json), "{\"j2534\":{\"state\":%i,\"error\":null,\"periodicMsg\":{\"id\":%lu}}}", state, msg->id);
+  }
+  else {
+    for(i=0; i<msg->dataLength; i++) {
+      sprintf(&data[i*2], "%02x", msg->data[i]);
+    }
+    data[msg->dataLength * 2] = '\0';
+    snprintf(json, sizeof(json), "{\"j2534\":{\"state\":%i,\"error\":null,\"periodicMsg\":{\"id\":%lu,\"interval\":%lu,\"txFlags\":%lu,\"data\":\"%s\"}}}",
+      state, msg->id, msg->interval, msg->txFlags, data);
+  }
+  passthru_thing_send_report(json);
+}
+
+void passthru_shadow_j2534_handler_desired_startPeriodicMsg(passthru_thing *thing, shadow_j2534 *j2534) {
+
+  j2534_client *client = passthru_shadow_j2534_handler_get_client(thing, j2534->deviceId);
+  if(client == NULL || client->canbus == NULL || !canbus_isconnected(client->canbus)) {
+    return passthru_shadow_j2534_handler_send_error(thing, J2534_PassThruStartPeriodicMsg, ERR_DEVICE_NOT_CONNECTED);
+  }
 
-    shadow_j2534_filter *shadow_filter = vector_get(j2534->filters, i);
-    filters[i].can_id = shadow_filter->can_id;
-    filters[i].can_mask = shadow_filter->can_mask;
+  shadow_j2534_periodic_msg *msg = j2534->periodicMsg;
+  if(msg->interval < J2534_PERIODIC_MIN_INTERVAL || msg->interval > J2534_PERIODIC_MAX_INTERVAL) {
+    return passthru_shadow_j2534_handler_send_error(thing, J2534_PassThruStartPeriodicMsg, ERR_TIME_INTERVAL_NOT_SUPPORTED);
   }
 
-  if(j2534->filters->count) {
-    canbus_filter(client->canbus, filters, j2534->filters->count);
+  if(client->periodicMsgs->count >= J2534_MAX_PERIODIC_MSGS) {
+    return passthru_shadow_j2534_handler_send_error(thing, J2534_PassThruStartPeriodicMsg, ERR_EXCEEDED_LIMIT);
   }
 
-  passthru_shadow_j2534_handler_send_report(J2534_PassThruStartMsgFilter);
+  PASSTHRU_MSG passthru_msg;
+  memset(&passthru_msg, 0, sizeof(PASSTHRU_MSG));
+  passthru_msg.ProtocolID = client->protocolId;
+  passthru_msg.TxFlags = msg->txFlags;
+  passthru_msg.DataLength = msg->dataLength;
+  passthru_msg.DataBuffer = msg->data;
+  passthru_msg.DataBufferSize = sizeof(msg->data);
+
+  j2534_periodic_msg *periodic = malloc(sizeof(j2534_periodic_msg));
+  periodic->id = msg->id;
+  periodic->interval = msg->interval;
+  if(j2534_msg_to_canbus_frame(&passthru_msg, &periodic->frame) != STATUS_NOERROR) {
+    free(periodic);
+    return passthru_shadow_j2534_handler_send_error(thing, J2534_PassThruStartPeriodicMsg, ERR_INVALID_MSG);
+  }
+
+  if(client->bcm == NULL) {
+    client->bcm = malloc(sizeof(canbus_client));
+    client->bcm->iface = NULL;
+    canbus_iface_split(thing->params->iface, &client->bcm->iface, 1);
+    canbus_init(client->bcm);
+    client->bcm->capture = CANBUS_CAPTURE_BCM;
+    if(canbus_connect(client->bcm) != 0) {
+      syslog(LOG_ERR, "passthru_shadow_j2534_handler_desired_startPeriodicMsg: unable to open CAN_BCM socket");
+      free(periodic);
+      passthru_shadow_j2534_handler_close_bcm(client);
+      return passthru_shadow_j2534_handler_send_error(thing, J2534_PassThruStartPeriodicMsg, ERR_FAILED);
+    }
+  }
+
+  if(canbus_bcm_tx_setup(client->bcm, &periodic->frame, periodic->interval) != 0) {
+    free(periodic);
+    return passthru_shadow_j2534_handler_send_error(thing, J2534_PassThruStartPeriodicMsg, ERR_FAILED);
+  }
+
+  vector_add(client->periodicMsgs, periodic);
+  client->state = J2534_PassThruStartPeriodicMsg;
+  passthru_shadow_j2534_handler_send_periodic_report(J2534_PassThruStartPeriodicMsg, msg);
+}
+
+void passthru_shadow_j2534_handler_desired_stopPeriodicMsg(passthru_thing *thing, shadow_j2534 *j2534) {
+
+  j2534_client *client = passthru_shadow_j2534_handler_get_client(thing, j2534->deviceId);
+  if(client == NULL || client->bcm == NULL) {
+    return passthru_shadow_j2534_handler_send_error(thing, J2534_PassThruStopPeriodicMsg, ERR_INVALID_MSG_ID);
+  }
+
+  int i, index = -1;
+  j2534_periodic_msg *periodic = NULL;
+  for(i=0; i<client->periodicMsgs->count; i++) {
+    periodic = vector_get(client->periodicMsgs, i);
+    if(periodic->id == j2534->periodicMsg->id) {
+      index = i;
+      break;
+    }
+  }
+
+  if(index == -1) {
+    return passthru_shadow_j2534_handler_send_error(thing, J2534_PassThruStopPeriodicMsg, ERR_INVALID_MSG_ID);
+  }
+
+  vector_delete(client->periodicMsgs, index);
+
+  // BCM keys transmissions by CAN ID; keep it running if another message still uses the ID
+  bool shared = false;
+  for(i=0; i<client->periodicMsgs->count; i++) {
+    j2534_periodic_msg *other = vector_get(client->periodicMsgs, i);
+    if(other->frame.frame.can_id == periodic->frame.frame.can_id && other->frame.flags == periodic->frame.flags) {
+      shared = true;
+      canbus_bcm_tx_setup(client->bcm, &other->frame, other->interval);
+      break;
+    }
+  }
+  if(!shared) {
+    canbus_bcm_tx_delete(client->bcm, &periodic->frame);
+  }
+  free(periodic);
+
+  client->state = J2534_PassThruStopPeriodicMsg;
+  passthru_shadow_j2534_handler_send_periodic_report(J2534_PassThruStopPeriodicMsg, j2534->periodicMsg);
 }
 
 void passthru_shadow_j2534_handler_handle_desired_state(passthru_thing *thing, shadow_j2534 *j2534) {
 
   if(j2534->error != 0) return; // prevent endless message loop; fix!
 
+  // a second periodic message leaves state unchanged, so the delta only carries periodicMsg
+  if(j2534->periodicMsg != NULL && (j2534->state == NULL ||
+     j2534->state == J2534_PassThruStartPeriodicMsg || j2534->state == J2534_PassThruStopPeriodicMsg)) {
+    if(j2534->periodicMsg->interval == 0) {
+      return passthru_shadow_j2534_handler_desired_stopPeriodicMsg(thing, j2534);
+    }
+    return passthru_shadow_j2534_handler_desired_startPeriodicMsg(thing, j2534);
+  }
+
+  if(j2534->filtersInvalid) {
+    syslog(LOG_ERR, "passthru_shadow_j2534_handler_handle_desired_state: rejecting malformed filter list");
+    return passthru_shadow_j2534_handler_send_error(thing,
+      j2534->state == J2534_PassThruStopMsgFilter ? J2534_PassThruStopMsgFilter : J2534_PassThruStartMsgFilter, ERR_INVALID_MSG);
+  }
+
+  // the complete filter list is published on every change; without a state change only filters arrive
+  if(j2534->filters != NULL && (j2534->state == NULL ||
+     j2534->state == J2534_PassThruStartMsgFilter || j2534->state == J2534_PassThruStopMsgFilter)) {
+    if(j2534->state == J2534_PassThruStopMsgFilter) {
+      return passthru_shadow_j2534_handler_desired_stopMsgFilter(thing, j2534);
+    }
+    return passthru_shadow_j2534_handler_desired_startMsgFilter(thing, j2534);
+  }
+
   syslog(LOG_ERR, "passthru_shadow_j2534_handler_handle_desired_state: routing state: %d", j2534->state);
 
   if(j2534->state == J2534_PassThruOpen) {
@@ -269,9 +624,6 @@ void passthru_shadow_j2534_handler_handle_desired_state(passthru_thing *thing, s
     return passthru_shadow_j2534_handler_desired_select(thing, j2534);
   }
 
-  if(j2534->state == J2534_PassThruStartMsgFilter) {
-    return passthru_shadow_j2534_handler_desired_startMsgFilter(thing, j2534);
-  }
 
   syslog(LOG_ERR, "passthru_shadow_j2534_handler_handle_desired_state: invalid state: %d", j2534->state);
 }
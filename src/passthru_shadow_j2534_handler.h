@@ -24,6 +24,8 @@
 #include "myint.h"
 #include "vector.h"
 #include "canbus.h"
+#include "canbus_bcm.h"
+#include "canbus_filter.h"
 #include "j2534.h"
 #include "passthru_thing.h"
 
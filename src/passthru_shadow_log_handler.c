@@ -20,6 +20,10 @@
 
 canbus_logger *logger = NULL;
 
+void passthru_shadow_log_handler_send_stats(const char *json) {
+  passthru_thing_send_report(json);
+}
+
 void passthru_shadow_log_handler_init(passthru_thing *thing) {
 
   if(logger != NULL) {
@@ -32,34 +36,73 @@ void passthru_shadow_log_handler_init(passthru_thing *thing) {
   logger->iface = thing->params->iface;
   logger->logdir = thing->params->logdir;
   logger->certDir = thing->params->certDir;
-
-  logger->canbus = malloc(sizeof(canbus_client));
-  logger->canbus->iface = thing->params->iface;
-
-  if(logger->iface != NULL) {
-    logger->canbus->iface = logger->iface;
-  }
+  logger->cacheDir = thing->params->cacheDir;
+  logger->filter_count = 0;
+  logger->log_format = CANBUS_LOG_FORMAT_TEXT;
+  logger->fsync_ms = thing->params->fsync_ms;
+  logger->segment_bytes = (uint64_t)thing->params->segment_mb * 1024 * 1024;
+  logger->segment_ms = thing->params->segment_sec * 1000U;
+  logger->publish_frames = thing->params->publish_frames;
+  logger->publish_ms = thing->params->publish_ms;
+  logger->spool_mode = thing->params->spool_mode;
+  logger->spool_bytes = (uint64_t)thing->params->spool_mb * 1024 * 1024;
+  logger->spool_rate = thing->params->spool_kbps * 1024U;
+  logger->canbus_thread = NULL;
+  logger->canbus_thread_state = CANBUS_LOGTHREAD_STOPPED;
+  logger->onstats = &passthru_shadow_log_handler_send_stats;
 
   if(logger->logdir == NULL) {
     logger->logdir = malloc(2);
     strcpy(logger->logdir, ".");
   }
 
-  canbus_init(logger->canbus);
+  char *ifaces[CANBUS_LOGGER_MAX_IFACES];
+  logger->canbus_count = canbus_iface_split(logger->iface, ifaces, CANBUS_LOGGER_MAX_IFACES);
+  if(logger->canbus_count == 0) {
+    ifaces[0] = NULL;
+    logger->canbus_count = 1;
+  }
+
+  int i;
+  for(i=0; i<logger->canbus_count; i++) {
+    logger->canbus[i] = malloc(sizeof(canbus_client));
+    logger->canbus[i]->iface = ifaces[i];
+    canbus_init(logger->canbus[i]);
+    logger->canbus[i]->rcvbuf = thing->params->rcvbuf;
+    logger->canbus[i]->stats = malloc(sizeof(canbus_stats));
+    canbus_stats_init(logger->canbus[i]->stats, 0, 0);
+  }
+
+  canbus_reactor_init(&logger->reactor);
 }
 
 void passthru_shadow_log_handler_send_report(shadow_log *slog) {
   unsigned int json_len = 255;
   char json[json_len];
   if(slog->file) {
-    snprintf(json, json_len, "{\"log\":{\"type\":%i, \"file\": \"%s\" }}", slog->type, slog->file);
+    snprintf(json, json_len, "{\"log\":{\"type\":%i, \"file\": \"%s\", \"format\":%i }}", slog->type, slog->file, slog->format);
   }
   else {
-   snprintf(json, json_len, "{\"log\":{\"type\":%i }}", slog->type);
+   snprintf(json, json_len, "{\"log\":{\"type\":%i, \"format\":%i }}", slog->type, slog->format);
   }
   passthru_thing_send_report(json);
 }
 
+/**
+ * Copies the desired filter list onto the logger; canbus_logger_run applies
+ * it to every interface after connect. NULL leaves the logger capturing all frames.
+ */
+void passthru_shadow_log_handler_set_filters(vector *filters) {
+  if(filters == NULL) {
+    return;
+  }
+  int i;
+  for(i=0; i<filters->count; i++) {
+    logger->filters[i] = *(shadow_j2534_filter *)vector_get(filters, i);
+  }
+  logger->filter_count = filters->count;
+}
+
 void passthru_shadow_log_handler_handle(passthru_thing *thing, shadow_log *slog) {
 
    syslog(LOG_DEBUG, "passthru_shadow_log_handler_handle: iface=%s, logidr=%s, log->type=%d, log->file=%s",
@@ -85,7 +128,22 @@ void passthru_shadow_log_handler_handle(passthru_thing *thing, shadow_log *slog)
     return;
   }
 
+  if(slog->filtersInvalid) {
+    syslog(LOG_ERR, "passthru_shadow_log_handler_handle: invalid log filters! aborting");
+    return;
+  }
+
+  if(slog->filters != NULL && slog->filters->count > CANBUS_FILTER_MAX) {
+    syslog(LOG_ERR, "passthru_shadow_log_handler_handle: too many log filters. count=%i, CANBUS_FILTER_MAX=%d",
+      slog->filters->count, CANBUS_FILTER_MAX);
+    return;
+  }
+
   passthru_shadow_log_handler_init(thing);
+  passthru_shadow_log_handler_set_filters(slog->filters);
+  if(canbus_log_backend_get(slog->format) != NULL) {
+    logger->log_format = slog->format;
+  }
 
   if(slog->type == PASSTHRU_LOGTYPE_FILE) {
     logger->type = CANBUS_LOGTYPE_FILE;
@@ -94,6 +152,20 @@ void passthru_shadow_log_handler_handle(passthru_thing *thing, shadow_log *slog)
     return;
   }
 
+  if(slog->type == PASSTHRU_LOGTYPE_FILE_MMAP) {
+    logger->type = CANBUS_LOGTYPE_FILE_MMAP;
+    canbus_logger_run(logger);
+    passthru_shadow_log_handler_send_report(slog);
+    return;
+  }
+
+  if(slog->type == PASSTHRU_LOGTYPE_FILE_ONCHANGE) {
+    logger->type = CANBUS_LOGTYPE_FILE_ONCHANGE;
+    canbus_logger_run(logger);
+    passthru_shadow_log_handler_send_report(slog);
+    return;
+  }
+
   if(slog->type == PASSTHRU_LOGTYPE_AWSIOT) {
     logger->type = CANBUS_LOGTYPE_AWSIOT;
     canbus_awsiotlogger_init(logger);
@@ -120,9 +192,15 @@ void passthru_shadow_log_handler_handle(passthru_thing *thing, shadow_log *slog)
 }
 
 void passthru_shadow_log_handler_free() {
-  canbus_free(logger->canbus);
-  logger->canbus = NULL;
   if(logger != NULL) {
+    int i;
+    for(i=0; i<logger->canbus_count; i++) {
+      canbus_free(logger->canbus[i]);
+      free(logger->canbus[i]->stats);
+      free(logger->canbus[i]);
+      logger->canbus[i] = NULL;
+    }
+    canbus_reactor_free(&logger->reactor);
     free(logger);
     logger = NULL;
   }
@@ -25,6 +25,7 @@
 #include "passthru_thing.h"
 #include "passthru_shadow.h"
 #include "canbus_logger.h"
+#include "canbus_log.h"
 
 void passthru_shadow_log_handler_handle(passthru_thing *thing, shadow_log *log);
 
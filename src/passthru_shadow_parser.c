@@ -16,6 +16,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <ctype.h>
 #include "passthru_shadow_parser.h"
 
 void passthru_shadow_parser_parse_reported(json_t *obj, shadow_message *message);
@@ -33,24 +34,36 @@ shadow_message* passthru_shadow_parser_parse_state(const char *json) {
   message->state->reported->log = malloc(sizeof(shadow_log));
   message->state->reported->log->type = 0;
   message->state->reported->log->file = NULL;
+  message->state->reported->log->format = 0;
+  message->state->reported->log->filters = NULL;
+  message->state->reported->log->filtersInvalid = false;
   message->state->reported->j2534 = malloc(sizeof(shadow_j2534));
   message->state->reported->j2534->state = 0;
   message->state->reported->j2534->error = 0;
   message->state->reported->j2534->data = NULL;
   message->state->reported->j2534->deviceId = NULL;
+  message->state->reported->j2534->protocolId = NULL;
+  message->state->reported->j2534->periodicMsg = NULL;
+  message->state->reported->j2534->filters = NULL;
+  message->state->reported->j2534->filtersInvalid = false;
   message->state->reported->connection = NULL;
 
   message->state->desired = malloc(sizeof(shadow_desired));
   message->state->desired->log = malloc(sizeof(shadow_log));
   message->state->desired->log->type = 0;
   message->state->desired->log->file = NULL;
+  message->state->desired->log->format = 0;
+  message->state->desired->log->filters = NULL;
+  message->state->desired->log->filtersInvalid = false;
   message->state->desired->j2534 = malloc(sizeof(shadow_j2534));
   message->state->desired->j2534->state = 0;
   message->state->desired->j2534->error = 0;
   message->state->desired->j2534->data = NULL;
   message->state->desired->j2534->deviceId = NULL;
-  message->state->desired->j2534->filters = malloc(sizeof(vector));
-  vector_init(message->state->desired->j2534->filters);
+  message->state->desired->j2534->protocolId = NULL;
+  message->state->desired->j2534->periodicMsg = NULL;
+  message->state->desired->j2534->filters = NULL;
+  message->state->desired->j2534->filtersInvalid = false;
   message->state->desired->connection = NULL;
 
   root = json_loads(json, 0, &error);
@@ -85,6 +98,90 @@ shadow_message* passthru_shadow_parser_parse_state(const char *json) {
   return message;
 }
 
+static void passthru_shadow_parser_free_filters(vector *filters) {
+  int i;
+  for(i=0; i<filters->count; i++) {
+    free(vector_get(filters, i));
+  }
+  vector_free(filters);
+  free(filters);
+}
+
+/**
+ * Parses a complete filter list. Returns NULL when the delta carries none,
+ * and also, with *invalid set, when any element is malformed: the whole delta
+ * is rejected so the handler reports an error instead of applying a subset
+ * of the rules.
+ */
+static vector *passthru_shadow_parser_parse_filters(json_t *filters, bool *invalid) {
+
+  if(filters == NULL) {
+    return NULL;
+  }
+
+  if(!json_is_array(filters)) {
+    syslog(LOG_ERR, "passthru_shadow_parser_parse_filters: filters is not an array");
+    *invalid = true;
+    return NULL;
+  }
+
+  vector *list = malloc(sizeof(vector));
+  vector_init(list);
+
+  long filter_count = (unsigned long) json_array_size(filters);
+
+  int i;
+  for(i=0; i<filter_count; i++) {
+
+    json_t *filter, *filterId, *filterMask, *filterType;
+    filter = json_array_get(filters, i);
+
+    if(!json_is_object(filter)) {
+      syslog(LOG_ERR, "passthru_shadow_parser_parse_filters: filter element is not an object");
+      break;
+    }
+
+    filterId = json_object_get(filter, "id");
+    if(!json_is_string(filterId)) {
+      syslog(LOG_ERR, "passthru_shadow_parser_parse_filters: filter id is not a string");
+      break;
+    }
+
+    filterMask = json_object_get(filter, "mask");
+    if(!json_is_string(filterMask)) {
+      syslog(LOG_ERR, "passthru_shadow_parser_parse_filters: filter mask is not a string");
+      break;
+    }
+
+    shadow_j2534_filter *rule = malloc(sizeof(shadow_j2534_filter));
+    memset(rule, 0, sizeof(shadow_j2534_filter));
+    rule->can_id = strtoul(json_string_value(filterId), NULL, 16);
+    rule->can_mask = strtoul(json_string_value(filterMask), NULL, 16);
+
+    // filters published before type/data existed are pass filters on the ID
+    filterType = json_object_get(filter, "type");
+    rule->type = json_is_integer(filterType) ? json_integer_value(filterType) : CANBUS_FILTER_PASS;
+
+    int data_len = passthru_shadow_parser_parse_hex(json_object_get(filter, "data"), rule->data, CAN_MAX_DLEN);
+    int mask_len = passthru_shadow_parser_parse_hex(json_object_get(filter, "dataMask"), rule->data_mask, CAN_MAX_DLEN);
+    if(data_len < 0 || mask_len < 0 || data_len != mask_len) {
+      syslog(LOG_ERR, "passthru_shadow_parser_parse_filters: invalid filter data. data_len=%d, mask_len=%d", data_len, mask_len);
+      free(rule);
+      break;
+    }
+    rule->data_len = data_len;
+
+    vector_add(list, rule);
+  }
+
+  if(i < filter_count) {
+    passthru_shadow_parser_free_filters(list);
+    *invalid = true;
+    return NULL;
+  }
+  return list;
+}
+
 shadow_desired* passthru_shadow_parser_parse_delta(const char *json) {
 
   syslog(LOG_DEBUG, "passthru_shadow_parser_parse_delta: json=%s", json);
@@ -96,13 +193,18 @@ shadow_desired* passthru_shadow_parser_parse_delta(const char *json) {
   desired->log = malloc(sizeof(shadow_log));;
   desired->log->type = NULL;
   desired->log->file = NULL;
+  desired->log->format = 0;
+  desired->log->filters = NULL;
+  desired->log->filtersInvalid = false;
   desired->j2534 = malloc(sizeof(shadow_j2534));
   desired->j2534->deviceId = NULL;
+  desired->j2534->protocolId = NULL;
+  desired->j2534->periodicMsg = NULL;
   desired->j2534->state = NULL;
   desired->j2534->error = NULL;
   desired->j2534->data = NULL;
-  desired->j2534->filters = malloc(sizeof(vector));
-  vector_init(desired->j2534->filters);
+  desired->j2534->filters = NULL;
+  desired->j2534->filtersInvalid = false;
   desired->connection = NULL;
 
   root = json_loads(json, 0, &error);
@@ -122,8 +224,11 @@ shadow_desired* passthru_shadow_parser_parse_delta(const char *json) {
   if(json_is_object(jslog)) {
     json_t *type = json_object_get(jslog, "type");
     json_t *file = json_object_get(jslog, "file");
+    json_t *format = json_object_get(jslog, "format");
     desired->log->type = json_integer_value(type);
     desired->log->file = json_string_value(file);
+    desired->log->format = json_integer_value(format);
+    desired->log->filters = passthru_shadow_parser_parse_filters(json_object_get(jslog, "filters"), &desired->log->filtersInvalid);
   }
 
   json_t *j2534 = json_object_get(root, "j2534");
@@ -133,47 +238,16 @@ shadow_desired* passthru_shadow_parser_parse_delta(const char *json) {
     json_t *error = json_object_get(j2534, "error");
     json_t *data = json_object_get(j2534, "data");
     json_t *deviceId = json_object_get(j2534, "deviceId");
-    json_t *filters = json_object_get(j2534, "filters");
+    json_t *protocolId = json_object_get(j2534, "protocolId");
     desired->j2534->state = json_integer_value(state);
     desired->j2534->error = json_string_value(error);
     desired->j2534->data = json_string_value(data);
     desired->j2534->deviceId = json_integer_value(deviceId);
+    desired->j2534->protocolId = json_integer_value(protocolId);
+    desired->j2534->periodicMsg = passthru_shadow_parser_parse_periodic_msg(json_object_get(j2534, "periodicMsg"));
 
-    if(!json_is_array(filters)) {
-      syslog(LOG_ERR, "passthru_shadow_parser_parse_delta: J2534 filters is not an array");
-      return desired;
-    }
-
-    long j2534_filter_count = (unsigned long) json_array_size(filters);
-
-    int i;
-    for(i=0; i<j2534_filter_count; i++) {
-
-      json_t *filter, *filterId, *filterMask;
-      filter = json_array_get(filters, i);
-
-      if(!json_is_object(filter)) {
-        syslog(LOG_ERR, "passthru_shadow_parser_parse_delta: J2534 filter element is not an object");
-        return desired;
-      }
-
-      filterId = json_object_get(filter, "id");
-      if(!json_is_string(filterId)) {
-        syslog(LOG_ERR, "passthru_shadow_parser_parse_delta: filter id is not a string");
-        return desired;
-      }
-
-      filterMask = json_object_get(filter, "mask");
-      if(!json_is_string(filterMask)) {
-        syslog(LOG_ERR, "passthru_shadow_parser_parse_delta: filter mask is not a string");
-        return desired;
-      }
-
-      shadow_j2534_filter *j2534_filter = malloc(sizeof(shadow_j2534_filter));
-      j2534_filter->can_id = strtoul(json_string_value(filterId), NULL, 16);
-      j2534_filter->can_mask = strtoul(json_string_value(filterMask), NULL, 16);
-      vector_add(desired->j2534->filters, j2534_filter);
-    }
+    // filters stays NULL unless this delta changes the filter list
+    desired->j2534->filters = passthru_shadow_parser_parse_filters(json_object_get(j2534, "filters"), &desired->j2534->filtersInvalid);
   }
 
   return desired;
@@ -199,8 +273,10 @@ void passthru_shadow_parser_parse_reported(json_t *obj, shadow_message *message)
     if(strncmp(key, "log", strlen(key)) == 0) {
       json_t *type = json_object_get(value, "type");
       json_t *file = json_object_get(value, "file");
+      json_t *format = json_object_get(value, "format");
       message->state->reported->log->type = json_integer_value(type);
       message->state->reported->log->file = json_integer_value(file);
+      message->state->reported->log->format = json_integer_value(format);
     }
 
     if(strncmp(key, "j2534", strlen(key)) == 0) {
@@ -208,10 +284,12 @@ void passthru_shadow_parser_parse_reported(json_t *obj, shadow_message *message)
       json_t *error = json_object_get(value, "error");
       json_t *data = json_object_get(value, "data");
       json_t *deviceId = json_object_get(value, "deviceId");
+      json_t *protocolId = json_object_get(value, "protocolId");
       message->state->reported->j2534->state = json_integer_value(state);
       message->state->reported->j2534->error = json_integer_value(error);
       message->state->reported->j2534->data = json_string_value(data);
       message->state->reported->j2534->deviceId = json_integer_value(deviceId);
+      message->state->reported->j2534->protocolId = json_integer_value(protocolId);
     }
 
   }
@@ -237,8 +315,10 @@ void passthru_shadow_parser_parse_desired(json_t *obj, shadow_message *message)
     if(strncmp(key, "log", strlen(key)) == 0) {
       json_t *type = json_object_get(value, "type");
       json_t *file = json_object_get(value, "file");
+      json_t *format = json_object_get(value, "format");
       message->state->desired->log->type = json_integer_value(type);
       message->state->desired->log->file = json_integer_value(file);
+      message->state->desired->log->format = json_integer_value(format);
     }
 
     if(strncmp(key, "j2534", strlen(key)) == 0) {
@@ -246,14 +326,73 @@ void passthru_shadow_parser_parse_desired(json_t *obj, shadow_message *message)
       json_t *error = json_object_get(value, "error");
       json_t *data = json_object_get(value, "data");
       json_t *deviceId = json_object_get(value, "deviceId");
+      json_t *protocolId = json_object_get(value, "protocolId");
       message->state->desired->j2534->state = json_integer_value(state);
       message->state->desired->j2534->error = json_integer_value(error);
       message->state->desired->j2534->data = json_string_value(data);
       message->state->desired->j2534->deviceId = json_integer_value(deviceId);
+      message->state->desired->j2534->protocolId = json_integer_value(protocolId);
+      message->state->desired->j2534->periodicMsg = passthru_shadow_parser_parse_periodic_msg(json_object_get(value, "periodicMsg"));
     }
   }
 }
 
+/**
+ * Decodes a hex string into at most max bytes. Returns the byte count (0 when
+ * obj is not a string) or -1 when the string is malformed or too long.
+ */
+int passthru_shadow_parser_parse_hex(json_t *obj, unsigned char *out, size_t max) {
+  if(!json_is_string(obj)) return 0;
+  const char *hex = json_string_value(obj);
+  size_t hex_len = strlen(hex);
+  if(hex_len % 2 || hex_len / 2 > max) {
+    return -1;
+  }
+  int i;
+  for(i=0; i<hex_len; i++) {
+    if(!isxdigit((unsigned char)hex[i])) return -1;
+  }
+  char byte[3] = { 0, 0, 0 };
+  for(i=0; i<hex_len/2; i++) {
+    byte[0] = hex[i*2];
+    byte[1] = hex[i*2+1];
+    out[i] = strtoul(byte, NULL, 16);
+  }
+  return hex_len / 2;
+}
+
+/**
+ * {"id":1,"interval":100,"txFlags":0,"data":"000007e00201"} starts a periodic
+ * message; {"id":1} on its own stops it. data is the hex encoded J2534
+ * DataBuffer (4 byte CAN ID followed by the payload).
+ */
+shadow_j2534_periodic_msg* passthru_shadow_parser_parse_periodic_msg(json_t *obj) {
+
+  if(!json_is_object(obj)) return NULL;
+
+  json_t *id = json_object_get(obj, "id");
+  if(!json_is_integer(id)) {
+    syslog(LOG_ERR, "passthru_shadow_parser_parse_periodic_msg: periodicMsg id is not an integer");
+    return NULL;
+  }
+
+  shadow_j2534_periodic_msg *msg = malloc(sizeof(shadow_j2534_periodic_msg));
+  memset(msg, 0, sizeof(shadow_j2534_periodic_msg));
+  msg->id = json_integer_value(id);
+  msg->interval = json_integer_value(json_object_get(obj, "interval"));
+  msg->txFlags = json_integer_value(json_object_get(obj, "txFlags"));
+
+  int data_len = passthru_shadow_parser_parse_hex(json_object_get(obj, "data"), msg->data, sizeof(msg->data));
+  if(data_len < 0) {
+    syslog(LOG_ERR, "passthru_shadow_parser_parse_periodic_msg: invalid data");
+    free(msg);
+    return NULL;
+  }
+  msg->dataLength = data_len;
+
+  return msg;
+}
+
 void passthru_shadow_parser_free_desired(shadow_desired *desired) {
   if(desired == NULL) return;
   if(desired->log) {
@@ -261,14 +400,8 @@ void passthru_shadow_parser_free_desired(shadow_desired *desired) {
     desired->log = NULL;
   }
   if(desired->j2534 != NULL) {
-    if(desired->j2534->filters != NULL) {
-      int i;
-      for(i=0; i<desired->j2534->filters->count; i++) {
-        free(vector_get(desired->j2534->filters, i));
-      }
-      vector_free(desired->j2534->filters);
-      desired->j2534->filters = NULL;
-    }
+    passthru_shadow_parser_free_filters(desired->j2534);
+    free(desired->j2534->periodicMsg);
     free(desired->j2534);
     desired->j2534 = NULL;
   }
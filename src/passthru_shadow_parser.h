@@ -75,5 +75,7 @@ void passthru_shadow_parser_free_message(shadow_message *message);
 
 shadow_desired* passthru_shadow_parser_parse_delta(const char *json);
 void passthru_shadow_parser_free_desired(shadow_desired *message);
+shadow_j2534_periodic_msg* passthru_shadow_parser_parse_periodic_msg(json_t *obj);
+int passthru_shadow_parser_parse_hex(json_t *obj, unsigned char *out, size_t max);
 
 #endif
@@ -39,6 +39,8 @@ typedef struct passthru_thing passthru_thing;
 #define PASSTHRU_LOGTYPE_FILE           2
 #define PASSTHRU_LOGTYPE_AWSIOT         3
 #define PASSTHRU_LOGTYPE_AWSIOT_REPLAY  4
+#define PASSTHRU_LOGTYPE_FILE_MMAP      5
+#define PASSTHRU_LOGTYPE_FILE_ONCHANGE  6
 
 #define THING_STATE_INITIALIZING        (1 << 0)
 #define THING_STATE_CONNECTING          (1 << 1)
@@ -57,6 +59,15 @@ typedef struct {
   char *logdir;
   char *certDir;
   char *cacheDir;
+  int rcvbuf;               // CAN socket receive buffer in bytes, 0 keeps the kernel default
+  int fsync_ms;             // log file fdatasync interval, 0 syncs only when the log is closed
+  int segment_mb;           // log segment size limit, 0 = one file per session
+  int segment_sec;          // log segment duration limit, 0 = one file per session
+  int publish_frames;       // frames per AWS IoT data logger publish, 0 = default
+  int publish_ms;           // longest an AWS IoT data logger batch waits, 0 = default
+  int spool_mode;           // CANBUS_AWSIOTLOGGER_SPOOL_* of the AWS IoT data logger
+  int spool_mb;             // its spool size, 0 = default
+  int spool_kbps;           // rate its spool drains at, 0 = default
 } passthru_thing_params;
 
 typedef struct {
@@ -46,7 +46,7 @@ void vector_delete(vector *v, int index) {
     return;
   }
   int i, j;
-  for(i = index, j = index; i < v->count; i++) {
+  for(i = index + 1, j = index; i < v->count; i++) {
     v->data[j] = v->data[i];
     j++;
   }
@@ -0,0 +1,1564 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <check.h>
+#include <linux/can/error.h>
+#include "canbus_filter.h"
+#include "canbus_log.h"
+#include "canbus_blocklog.h"
+#include "canbus_crc32c.h"
+#include "canbus_spool.h"
+#include "canbus_logwriter.h"
+#include "canbus_logreader.h"
+#include "canbus_logquery.h"
+
+#define CHECK_FRAMES 300
+
+static char check_dir[] = "/tmp/check_canbus_XXXXXX";
+
+/**
+ * Path of name in a scratch directory created on first use.
+ */
+static const char *check_path(const char *name) {
+  static char path[CANBUS_LOG_FILENAME_LEN];
+  if(check_dir[strlen(check_dir) - 1] == 'X') {
+    ck_assert_ptr_ne(mkdtemp(check_dir), NULL);
+  }
+  snprintf(path, sizeof(path), "%s/%s", check_dir, name);
+  return path;
+}
+
+/**
+ * Frames with 11 and 29 bit IDs, remote requests and (with fd) FD frames, at
+ * whole microseconds so every format can hold the timestamps exactly.
+ */
+static void check_sample_frames(canbus_frame *frames, unsigned int count, bool fd) {
+  unsigned int i, j;
+  memset(frames, 0, sizeof(canbus_frame) * count);
+  for(i=0; i<count; i++) {
+    frames[i].ts.tv_sec = 1700000000 + i / 1000;
+    frames[i].ts.tv_nsec = 123456000 + (i % 1000) * 731000;
+    frames[i].frame.can_id = (i % 3 == 0) ? (0x18daf100 + i) | CAN_EFF_FLAG : 0x700 + (i % 0x100);
+    frames[i].frame.len = i % (CAN_MAX_DLEN + 1);
+    if(i % 17 == 5) {
+      frames[i].frame.can_id |= CAN_RTR_FLAG;
+      frames[i].frame.len = 0;
+    }
+    else if(fd && i % 4 == 1) {
+      frames[i].flags = CANBUS_FRAME_FD;
+      frames[i].frame.flags = CANFD_BRS;
+      frames[i].frame.len = 12 + (i % 4) * 4 + (i % 8 == 1 ? 48 - 16 : 0);
+    }
+    for(j=0; j<frames[i].frame.len; j++) {
+      frames[i].frame.data[j] = i + j * 7;
+    }
+  }
+}
+
+static void check_frames_eq(canbus_frame *expected, canbus_frame *actual, unsigned int count) {
+  unsigned int i;
+  for(i=0; i<count; i++) {
+    ck_assert_msg(expected[i].frame.can_id == actual[i].frame.can_id, "frame %u: can_id %x != %x", i, expected[i].frame.can_id, actual[i].frame.can_id);
+    ck_assert_msg(expected[i].frame.len == actual[i].frame.len, "frame %u: len %u != %u", i, expected[i].frame.len, actual[i].frame.len);
+    ck_assert_msg(memcmp(expected[i].frame.data, actual[i].frame.data, expected[i].frame.len) == 0, "frame %u: data differs", i);
+    ck_assert_msg((expected[i].flags & CANBUS_FRAME_FD) == (actual[i].flags & CANBUS_FRAME_FD), "frame %u: FD flag differs", i);
+    ck_assert_msg(expected[i].ts.tv_sec == actual[i].ts.tv_sec && expected[i].ts.tv_nsec == actual[i].ts.tv_nsec,
+      "frame %u: ts %ld.%09ld != %ld.%09ld", i, (long)expected[i].ts.tv_sec, expected[i].ts.tv_nsec, (long)actual[i].ts.tv_sec, actual[i].ts.tv_nsec);
+  }
+}
+
+/**
+ * Loads name through format detection, expecting format, and reads up to max
+ * frames into out.
+ */
+static unsigned int check_log_read(const char *name, uint8_t format, canbus_frame *out, unsigned int max) {
+  canbus_log log;
+  unsigned int n = 0;
+  int rc;
+
+  ck_assert_int_eq(canbus_log_load(&log, check_path(name)), 0);
+  ck_assert_int_eq(log.backend->format, format);
+  while(n < max && (rc = canbus_log_read_frames(&log, out + n, max - n)) > 0) {
+    n += rc;
+  }
+  canbus_log_close(&log);
+  return n;
+}
+
+/**
+ * Writes frames as format, loads the file back through format detection and
+ * returns the number of frames read into out.
+ */
+static unsigned int check_log_roundtrip(const char *name, uint8_t format, bool fd, canbus_frame *frames, unsigned int count, canbus_frame *out) {
+  canbus_log log;
+
+  ck_assert_int_eq(canbus_log_create(&log, check_path(name), format, "can0", fd), 0);
+  ck_assert_int_eq(canbus_log_write_frames(&log, frames, count), 0);
+  canbus_log_close(&log);
+  return check_log_read(name, format, out, count);
+}
+
+static void check_write_file(const char *name, const void *buf, size_t len) {
+  FILE *file = fopen(check_path(name), "w");
+  ck_assert_ptr_ne(file, NULL);
+  ck_assert_int_eq(fwrite(buf, 1, len, file), len);
+  fclose(file);
+}
+
+static uint8_t *check_put32be(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+  return p + 4;
+}
+
+/**
+ * Runs a compiled socket filter over frame the way the kernel would; only the
+ * instructions canbus_filter_compile emits are implemented.
+ */
+static unsigned int check_bpf_run(canbus_filter_program *prog, struct canfd_frame *frame) {
+  const uint8_t *pkt = (const uint8_t *)frame;
+  uint32_t a = 0;
+  unsigned int pc = 0;
+  while(pc < prog->bpf_len) {
+    struct sock_filter *insn = &prog->bpf[pc++];
+    switch(insn->code) {
+      case BPF_LD | BPF_W | BPF_ABS:
+        a = ((uint32_t)pkt[insn->k] << 24) | (pkt[insn->k + 1] << 16) | (pkt[insn->k + 2] << 8) | pkt[insn->k + 3];
+        break;
+      case BPF_LD | BPF_B | BPF_ABS:
+        a = pkt[insn->k];
+        break;
+      case BPF_ALU | BPF_AND | BPF_K:
+        a &= insn->k;
+        break;
+      case BPF_JMP | BPF_JA:
+        pc += insn->k;
+        break;
+      case BPF_JMP | BPF_JEQ | BPF_K:
+        pc += a == insn->k ? insn->jt : insn->jf;
+        break;
+      case BPF_JMP | BPF_JGT | BPF_K:
+        pc += a > insn->k ? insn->jt : insn->jf;
+        break;
+      case BPF_JMP | BPF_JSET | BPF_K:
+        pc += (a & insn->k) ? insn->jt : insn->jf;
+        break;
+      case BPF_RET | BPF_K:
+        return insn->k;
+      default:
+        ck_abort_msg("unexpected BPF instruction %x", insn->code);
+    }
+  }
+  ck_abort_msg("BPF program fell off the end");
+  return 0;
+}
+
+static void check_filter_rule(struct canbus_filter *rule, uint8_t type, canid_t can_id, canid_t can_mask) {
+  memset(rule, 0, sizeof(struct canbus_filter));
+  rule->type = type;
+  rule->can_id = can_id;
+  rule->can_mask = can_mask;
+}
+
+START_TEST(test_canbus_filter_none)
+{
+  canbus_filter_program prog;
+
+  ck_assert_int_eq(canbus_filter_compile(NULL, 0, 0, &prog), 0);
+  ck_assert_int_eq(prog.can_count, 1);
+  ck_assert_int_eq(prog.can[0].can_mask, 0);
+  ck_assert_int_eq(prog.bpf_len, 0);
+}
+END_TEST
+
+START_TEST(test_canbus_filter_pass_merge)
+{
+  struct canbus_filter rules[2];
+  canbus_filter_program prog;
+
+  check_filter_rule(&rules[0], CANBUS_FILTER_PASS, 0x100, CAN_SFF_MASK);
+  check_filter_rule(&rules[1], CANBUS_FILTER_PASS, 0x101, CAN_SFF_MASK);
+
+  ck_assert_int_eq(canbus_filter_compile(rules, 2, 0, &prog), 0);
+  ck_assert_int_eq(prog.can_count, 1);
+  ck_assert_int_eq(prog.can[0].can_id, 0x100);
+  ck_assert_int_eq(prog.can[0].can_mask, 0x7fe);
+  ck_assert_int_eq(prog.join, 0);
+  ck_assert_int_eq(prog.bpf_len, 0);
+}
+END_TEST
+
+START_TEST(test_canbus_filter_pass_block)
+{
+  struct canbus_filter rules[3];
+  canbus_filter_program prog;
+
+  check_filter_rule(&rules[0], CANBUS_FILTER_PASS, 0x700, 0x700);
+  check_filter_rule(&rules[1], CANBUS_FILTER_BLOCK, 0x7df, CAN_SFF_MASK);
+  check_filter_rule(&rules[2], CANBUS_FILTER_BLOCK, 0x100, CAN_SFF_MASK);  // can't match a passed ID
+
+  ck_assert_int_eq(canbus_filter_compile(rules, 3, 0, &prog), 0);
+  ck_assert_int_eq(prog.can_count, 2);
+  ck_assert_int_eq(prog.can[0].can_id, 0x700);
+  ck_assert_int_eq(prog.can[1].can_id, 0x7df | CAN_INV_FILTER);
+  ck_assert_int_eq(prog.can[1].can_mask, CAN_SFF_MASK);
+  ck_assert_int_eq(prog.join, 1);
+}
+END_TEST
+
+START_TEST(test_canbus_filter_pass_covered)
+{
+  struct canbus_filter rules[2];
+  canbus_filter_program prog;
+
+  check_filter_rule(&rules[0], CANBUS_FILTER_PASS, 0x123, CAN_SFF_MASK);
+  check_filter_rule(&rules[1], CANBUS_FILTER_BLOCK, 0x100, 0x700);
+
+  ck_assert_int_eq(canbus_filter_compile(rules, 2, 0, &prog), 0);
+  ck_assert_int_eq(prog.can_count, 0);
+}
+END_TEST
+
+START_TEST(test_canbus_filter_data)
+{
+  struct canbus_filter rules[2];
+  struct canfd_frame frame;
+  canbus_filter_program prog;
+
+  check_filter_rule(&rules[0], CANBUS_FILTER_PASS, 0x7e8, CAN_SFF_MASK);
+  rules[0].data_len = 2;
+  rules[0].data[1] = 0x40;
+  rules[0].data_mask[1] = 0xf0;
+  check_filter_rule(&rules[1], CANBUS_FILTER_BLOCK, 0x7e8, CAN_SFF_MASK);
+  rules[1].data_len = 1;
+  rules[1].data[0] = 0x7f;
+  rules[1].data_mask[0] = 0xff;
+
+  ck_assert_int_eq(canbus_filter_compile(rules, 2, 0, &prog), 0);
+  ck_assert_int_gt(prog.bpf_len, 0);
+  ck_assert_int_eq(prog.can_count, 1);
+  ck_assert_int_eq(prog.can[0].can_id, 0x7e8);
+
+  memset(&frame, 0, sizeof(frame));
+  frame.can_id = 0x7e8;
+  frame.len = 3;
+  frame.data[0] = 0x03;
+  frame.data[1] = 0x41;
+  ck_assert_int_eq(check_bpf_run(&prog, &frame), CANBUS_FILTER_BPF_ACCEPT);
+
+  frame.data[1] = 0x7f;
+  ck_assert_int_eq(check_bpf_run(&prog, &frame), 0);
+
+  frame.data[0] = 0x7f;
+  frame.data[1] = 0x41;
+  ck_assert_int_eq(check_bpf_run(&prog, &frame), 0);
+
+  frame.len = 1;
+  frame.data[0] = 0x03;
+  ck_assert_int_eq(check_bpf_run(&prog, &frame), 0);
+
+  frame.can_id = 0x7e0;
+  frame.len = 3;
+  frame.data[1] = 0x41;
+  ck_assert_int_eq(check_bpf_run(&prog, &frame), 0);
+
+  // error frames are always received
+  frame.can_id = CAN_ERR_FLAG | CAN_ERR_BUSOFF;
+  ck_assert_int_eq(check_bpf_run(&prog, &frame), CANBUS_FILTER_BPF_ACCEPT);
+}
+END_TEST
+
+START_TEST(test_canbus_filter_invalid)
+{
+  struct canbus_filter rules[CANBUS_FILTER_MAX + 1];
+  canbus_filter_program prog;
+
+  memset(rules, 0, sizeof(rules));
+  ck_assert_int_eq(canbus_filter_compile(rules, CANBUS_FILTER_MAX + 1, 0, &prog), 1);
+
+  check_filter_rule(&rules[0], 3, 0x100, CAN_SFF_MASK);
+  ck_assert_int_eq(canbus_filter_compile(rules, 1, 0, &prog), 2);
+
+  check_filter_rule(&rules[0], CANBUS_FILTER_PASS, 0x100, CAN_SFF_MASK);
+  rules[0].data_len = CAN_MAX_DLEN + 1;
+  ck_assert_int_eq(canbus_filter_compile(rules, 1, 0, &prog), 3);
+}
+END_TEST
+
+START_TEST(test_canbus_log_binary)
+{
+  canbus_frame frames[CHECK_FRAMES], out[CHECK_FRAMES];
+
+  check_sample_frames(frames, CHECK_FRAMES, false);
+  ck_assert_int_eq(check_log_roundtrip("classic.bin", CANBUS_LOG_FORMAT_BINARY, false, frames, CHECK_FRAMES, out), CHECK_FRAMES);
+  check_frames_eq(frames, out, CHECK_FRAMES);
+}
+END_TEST
+
+START_TEST(test_canbus_log_binary_fd)
+{
+  canbus_frame frames[CHECK_FRAMES], out[CHECK_FRAMES];
+  canbus_binlog_reader reader;
+
+  check_sample_frames(frames, CHECK_FRAMES, true);
+  ck_assert_int_eq(check_log_roundtrip("fd.bin", CANBUS_LOG_FORMAT_BINARY, true, frames, CHECK_FRAMES, out), CHECK_FRAMES);
+  check_frames_eq(frames, out, CHECK_FRAMES);
+
+  // the mapped reader indexes records directly
+  ck_assert_int_eq(canbus_binlog_open(&reader, check_path("fd.bin")), 0);
+  ck_assert_int_eq(reader.count, CHECK_FRAMES);
+  ck_assert_int_eq(canbus_binlog_read(&reader, 97, out, 4), 4);
+  check_frames_eq(&frames[97], out, 4);
+  ck_assert_int_eq(canbus_binlog_read(&reader, CHECK_FRAMES - 1, out, 4), 1);
+  canbus_binlog_close(&reader);
+}
+END_TEST
+
+START_TEST(test_canbus_binlog_header)
+{
+  canbus_binlog_header header;
+  uint8_t buf[sizeof(canbus_binlog_header)];
+  FILE *file = fmemopen(buf, sizeof(buf), "w");
+
+  ck_assert_int_eq(canbus_binlog_write_header(file, "can1", true), 0);
+  fclose(file);
+
+  ck_assert_int_eq(canbus_binlog_parse_header(buf, sizeof(buf), &header), 0);
+  ck_assert_int_eq(header.version, CANBUS_BINLOG_VERSION);
+  ck_assert_int_eq(header.record_len, canbus_binlog_record_len(true));
+  ck_assert_int_eq(header.flags & CANBUS_BINLOG_FD, CANBUS_BINLOG_FD);
+  ck_assert_str_eq(header.iface, "can1");
+
+  ck_assert_int_eq(canbus_binlog_parse_header(buf, sizeof(buf) - 1, &header), EINVAL);
+
+  buf[CANBUS_BINLOG_MAGIC_LEN] = CANBUS_BINLOG_VERSION + 1;
+  ck_assert_int_eq(canbus_binlog_parse_header(buf, sizeof(buf), &header), ENOTSUP);
+
+  buf[0] ^= 0xff;
+  ck_assert_int_eq(canbus_binlog_parse_header(buf, sizeof(buf), &header), EINVAL);
+}
+END_TEST
+
+START_TEST(test_canbus_binlog_record)
+{
+  canbus_frame frames[CHECK_FRAMES], frame;
+  uint8_t record[sizeof(canbus_binlog_record) + CANFD_MAX_DLEN];
+  uint16_t record_len = canbus_binlog_record_len(true);
+  unsigned int i;
+
+  check_sample_frames(frames, CHECK_FRAMES, true);
+  for(i=0; i<CHECK_FRAMES; i++) {
+    canbus_binlog_encode(&frames[i], record, record_len);
+    canbus_binlog_decode(record, record_len, &frame);
+    check_frames_eq(&frames[i], &frame, 1);
+  }
+}
+END_TEST
+
+START_TEST(test_canbus_log_candump)
+{
+  canbus_frame frames[CHECK_FRAMES], out[CHECK_FRAMES];
+
+  check_sample_frames(frames, CHECK_FRAMES, true);
+  ck_assert_int_eq(check_log_roundtrip("fd.log", CANBUS_LOG_FORMAT_CANDUMP, true, frames, CHECK_FRAMES, out), CHECK_FRAMES);
+  check_frames_eq(frames, out, CHECK_FRAMES);
+}
+END_TEST
+
+START_TEST(test_canbus_log_candump_parse)
+{
+  const char *text =
+    "(1480000000.123456) can0 123#1122334455667788\n"
+    "(1480000000.200000) vcan1 12345678#R\n"
+    "not a frame\n"
+    "(1480000001.000001) can0 456##3AABB\n";
+  canbus_frame out[4];
+
+  check_write_file("known.log", text, strlen(text));
+  ck_assert_int_eq(check_log_read("known.log", CANBUS_LOG_FORMAT_CANDUMP, out, 4), 3);
+
+  ck_assert_int_eq(out[0].ts.tv_sec, 1480000000);
+  ck_assert_int_eq(out[0].ts.tv_nsec, 123456000);
+  ck_assert_int_eq(out[0].frame.can_id, 0x123);
+  ck_assert_int_eq(out[0].frame.len, 8);
+  ck_assert_int_eq(out[0].frame.data[0], 0x11);
+  ck_assert_int_eq(out[0].frame.data[7], 0x88);
+
+  ck_assert_int_eq(out[1].frame.can_id, 0x12345678 | CAN_EFF_FLAG | CAN_RTR_FLAG);
+  ck_assert_int_eq(out[1].frame.len, 0);
+
+  ck_assert_int_eq(out[2].flags & CANBUS_FRAME_FD, CANBUS_FRAME_FD);
+  ck_assert_int_eq(out[2].frame.flags, CANFD_BRS | CANFD_ESI);
+  ck_assert_int_eq(out[2].frame.can_id, 0x456);
+  ck_assert_int_eq(out[2].frame.len, 2);
+  ck_assert_int_eq(out[2].frame.data[1], 0xbb);
+}
+END_TEST
+
+START_TEST(test_canbus_log_asc)
+{
+  canbus_frame frames[CHECK_FRAMES], out[CHECK_FRAMES];
+
+  check_sample_frames(frames, CHECK_FRAMES, true);
+  ck_assert_int_eq(check_log_roundtrip("fd.asc", CANBUS_LOG_FORMAT_ASC, true, frames, CHECK_FRAMES, out), CHECK_FRAMES);
+  check_frames_eq(frames, out, CHECK_FRAMES);
+}
+END_TEST
+
+START_TEST(test_canbus_log_asc_parse)
+{
+  const char *text =
+    "date Thu Nov 24 01:00:00.000 pm 2016\n"
+    "base hex  timestamps absolute\n"
+    "internal events logged\n"
+    "Begin Triggerblock Thu Nov 24 01:00:00.000 pm 2016\n"
+    "   0.000000 Start of measurement\n"
+    "   0.001234 1  123             Rx   d 8 11 22 33 44 55 66 77 88\n"
+    "   0.001300 1  18DAF110x       Rx   r 0\n"
+    "   0.001400 CANFD   1 Rx        7E8                                   1 0 9 12 00 01 02 03 04 05 06 07 08 09 0A 0B\n"
+    "   2.500000 1  ErrorFrame\n"
+    "End TriggerBlock\n";
+  canbus_frame out[5];
+
+  check_write_file("known.asc", text, strlen(text));
+  ck_assert_int_eq(check_log_read("known.asc", CANBUS_LOG_FORMAT_ASC, out, 5), 4);
+
+  // Thu Nov 24 13:00:00 UTC 2016
+  ck_assert_int_eq(out[0].ts.tv_sec, 1479992400);
+  ck_assert_int_eq(out[0].ts.tv_nsec, 1234000);
+  ck_assert_int_eq(out[0].frame.can_id, 0x123);
+  ck_assert_int_eq(out[0].frame.len, 8);
+  ck_assert_int_eq(out[0].frame.data[7], 0x88);
+
+  ck_assert_int_eq(out[1].frame.can_id, 0x18daf110 | CAN_EFF_FLAG | CAN_RTR_FLAG);
+
+  ck_assert_int_eq(out[2].flags & CANBUS_FRAME_FD, CANBUS_FRAME_FD);
+  ck_assert_int_eq(out[2].frame.flags, CANFD_BRS);
+  ck_assert_int_eq(out[2].frame.can_id, 0x7e8);
+  ck_assert_int_eq(out[2].frame.len, 12);
+  ck_assert_int_eq(out[2].frame.data[11], 0x0b);
+
+  ck_assert_int_eq(out[3].frame.can_id & CAN_ERR_FLAG, CAN_ERR_FLAG);
+  ck_assert_int_eq(out[3].ts.tv_sec, 1479992402);
+  ck_assert_int_eq(out[3].ts.tv_nsec, 500000000);
+}
+END_TEST
+
+START_TEST(test_canbus_log_pcapng)
+{
+  canbus_frame frames[CHECK_FRAMES], out[CHECK_FRAMES];
+
+  check_sample_frames(frames, CHECK_FRAMES, true);
+  ck_assert_int_eq(check_log_roundtrip("fd.pcapng", CANBUS_LOG_FORMAT_PCAPNG, true, frames, CHECK_FRAMES, out), CHECK_FRAMES);
+  check_frames_eq(frames, out, CHECK_FRAMES);
+}
+END_TEST
+
+START_TEST(test_canbus_log_pcapng_parse)
+{
+  // big endian section, default microsecond if_tsresol, one classic frame
+  uint8_t buf[28 + 20 + 48], *p = buf;
+  canbus_frame out[2];
+  uint64_t ts = 1480000000123456ULL;
+
+  p = check_put32be(p, 0x0A0D0D0A);
+  p = check_put32be(p, 28);
+  p = check_put32be(p, 0x1A2B3C4D);
+  p = check_put32be(p, 0x00010000);
+  p = check_put32be(p, 0xffffffff);
+  p = check_put32be(p, 0xffffffff);
+  p = check_put32be(p, 28);
+
+  p = check_put32be(p, 1);
+  p = check_put32be(p, 20);
+  p = check_put32be(p, 227 << 16);
+  p = check_put32be(p, CAN_MTU);
+  p = check_put32be(p, 20);
+
+  p = check_put32be(p, 6);
+  p = check_put32be(p, 48);
+  p = check_put32be(p, 0);
+  p = check_put32be(p, ts >> 32);
+  p = check_put32be(p, ts);
+  p = check_put32be(p, CAN_MTU);
+  p = check_put32be(p, CAN_MTU);
+  p = check_put32be(p, 0x18daf110 | CAN_EFF_FLAG);
+  p = check_put32be(p, 3 << 24);
+  p = check_put32be(p, 0xdeadbeef);
+  p = check_put32be(p, 0);
+  p = check_put32be(p, 48);
+  ck_assert_int_eq(p - buf, sizeof(buf));
+
+  check_write_file("known.pcapng", buf, sizeof(buf));
+  ck_assert_int_eq(check_log_read("known.pcapng", CANBUS_LOG_FORMAT_PCAPNG, out, 2), 1);
+  ck_assert_int_eq(out[0].ts.tv_sec, 1480000000);
+  ck_assert_int_eq(out[0].ts.tv_nsec, 123456000);
+  ck_assert_int_eq(out[0].frame.can_id, 0x18daf110 | CAN_EFF_FLAG);
+  ck_assert_int_eq(out[0].flags & CANBUS_FRAME_FD, 0);
+  ck_assert_int_eq(out[0].frame.len, 3);
+  ck_assert_int_eq(out[0].frame.data[0], 0xde);
+  ck_assert_int_eq(out[0].frame.data[2], 0xbe);
+}
+END_TEST
+
+START_TEST(test_canbus_lz4)
+{
+  static uint8_t src[8192], dst[CANBUS_LZ4_BOUND(8192)], out[8192];
+  size_t lens[] = {0, 1, 15, 300, 8192};
+  uint32_t x = 2463534242U;
+  size_t i, j, len, n;
+
+  for(i=0; i<2; i++) {
+    for(j=0; j<sizeof(src); j++) {
+      if(i == 0) {
+        src[j] = "ecutools "[j % 9] + (j / 700);    // repeats, compresses
+      }
+      else {
+        x ^= x << 13;   // xorshift noise, does not
+        x ^= x >> 17;
+        x ^= x << 5;
+        src[j] = x;
+      }
+    }
+    for(j=0; j<sizeof(lens) / sizeof(lens[0]); j++) {
+      len = lens[j];
+      n = canbus_lz4_compress(src, len, dst, CANBUS_LZ4_BOUND(len));
+      ck_assert_msg(n > 0 && n <= CANBUS_LZ4_BOUND(len), "len %zu: compressed to %zu", len, n);
+      if(i == 0 && len == sizeof(src)) {
+        ck_assert_msg(n < len / 4, "compressed %zu to %zu", len, n);
+      }
+      ck_assert_int_eq(canbus_lz4_decompress(dst, n, out, sizeof(out)), len);
+      ck_assert(memcmp(src, out, len) == 0);
+      if(len > 1) {
+        ck_assert_int_eq(canbus_lz4_decompress(dst, n, out, len - 1), -1);
+      }
+    }
+  }
+}
+END_TEST
+
+START_TEST(test_canbus_blocklog_block)
+{
+  static uint8_t block[CANBUS_BLOCKLOG_BLOCK_MAX];
+  canbus_frame frames[CHECK_FRAMES], out[CHECK_FRAMES];
+  canbus_blocklog_block header;
+  unsigned int count;
+  size_t raw = 0, len;
+
+  check_sample_frames(frames, CHECK_FRAMES, true);
+  for(count=0; count<CHECK_FRAMES; count++) {
+    len = canbus_blocklog_raw_len(&frames[count], count > 0 ? &frames[count - 1] : NULL);
+    if(raw + len > CANBUS_BLOCKLOG_RAW_LEN) break;
+    raw += len;
+  }
+
+  len = canbus_blocklog_encode(frames, count, block);
+  ck_assert_int_eq(canbus_blocklog_parse_block(block, len, &header), 0);
+  ck_assert_int_eq(canbus_blocklog_block_len(&header), len);
+  ck_assert_int_eq(header.frames, count);
+  ck_assert_int_eq(header.raw_len, raw);
+  ck_assert_msg(header.comp_len < raw / 2, "compressed %zu to %u", raw, header.comp_len);
+
+  ck_assert_int_eq(canbus_blocklog_decode(block, len, out, CHECK_FRAMES), count);
+  check_frames_eq(frames, out, count);
+  ck_assert_int_eq(canbus_blocklog_decode(block, len, out, count - 1), -1);
+
+  block[sizeof(canbus_blocklog_block) + header.comp_len / 2] ^= 0x01;
+  ck_assert_int_eq(canbus_blocklog_decode(block, len, out, CHECK_FRAMES), -1);
+}
+END_TEST
+
+START_TEST(test_canbus_log_compressed)
+{
+  canbus_frame frames[CHECK_FRAMES], out[CHECK_FRAMES];
+
+  check_sample_frames(frames, CHECK_FRAMES, true);
+  ck_assert_int_eq(check_log_roundtrip("fd" CANBUS_BLOCKLOG_EXT, CANBUS_LOG_FORMAT_COMPRESSED, true, frames, CHECK_FRAMES, out), CHECK_FRAMES);
+  check_frames_eq(frames, out, CHECK_FRAMES);
+}
+END_TEST
+
+START_TEST(test_canbus_crc32c)
+{
+  int kernels[] = {CANBUS_CRC32C_TABLE, CANBUS_CRC32C_SSE42, CANBUS_CRC32C_ARMV8};
+  uint8_t zeros[32], ones[32], inc[32], buf[1031];
+  uint32_t expected[sizeof(buf)];
+  size_t i, len;
+
+  memset(zeros, 0, sizeof(zeros));
+  memset(ones, 0xff, sizeof(ones));
+  for(i=0; i<sizeof(inc); i++) inc[i] = i;
+  for(i=0; i<sizeof(buf); i++) buf[i] = i * 31 + (i >> 3);
+
+  for(i=0; i<sizeof(kernels) / sizeof(kernels[0]); i++) {
+    if(canbus_crc32c_kernel(kernels[i]) != kernels[i]) continue;   // not on this CPU
+
+    ck_assert_msg(canbus_crc32c(0, "123456789", 9) == 0xe3069283, "%s: check value", canbus_crc32c_kernel_name(kernels[i]));
+    ck_assert_msg(canbus_crc32c(0, "", 0) == 0, "%s: empty", canbus_crc32c_kernel_name(kernels[i]));
+    // RFC 3720 B.4
+    ck_assert_msg(canbus_crc32c(0, zeros, sizeof(zeros)) == 0x8a9136aa, "%s: 32 zeros", canbus_crc32c_kernel_name(kernels[i]));
+    ck_assert_msg(canbus_crc32c(0, ones, sizeof(ones)) == 0x62a8ab43, "%s: 32 ones", canbus_crc32c_kernel_name(kernels[i]));
+    ck_assert_msg(canbus_crc32c(0, inc, sizeof(inc)) == 0x46dd794e, "%s: incrementing", canbus_crc32c_kernel_name(kernels[i]));
+    ck_assert_msg(canbus_crc32c(canbus_crc32c(0, "1234", 4), "56789", 5) == 0xe3069283, "%s: continued", canbus_crc32c_kernel_name(kernels[i]));
+
+    // every length and alignment agrees with the table kernel
+    for(len=0; len<sizeof(buf); len++) {
+      if(kernels[i] == CANBUS_CRC32C_TABLE) {
+        expected[len] = canbus_crc32c(0, buf + len % 8, len - len % 8);
+      }
+      else {
+        ck_assert_msg(canbus_crc32c(0, buf + len % 8, len - len % 8) == expected[len], "%s: length %zu", canbus_crc32c_kernel_name(kernels[i]), len);
+      }
+    }
+  }
+  canbus_crc32c_kernel(CANBUS_CRC32C_AUTO);
+}
+END_TEST
+
+/**
+ * Cuts bytes off the end of name, as a crash mid-write would.
+ */
+static off_t check_truncate(const char *name, off_t bytes) {
+  struct stat st;
+  ck_assert_int_eq(stat(check_path(name), &st), 0);
+  ck_assert_int_eq(truncate(check_path(name), st.st_size - bytes), 0);
+  return st.st_size - bytes;
+}
+
+START_TEST(test_canbus_log_recover)
+{
+  canbus_frame frames[CHECK_FRAMES], out[CHECK_FRAMES];
+  struct stat st;
+  off_t dropped;
+
+  check_sample_frames(frames, CHECK_FRAMES, true);
+
+  ck_assert_int_eq(check_log_roundtrip("recover.bin", CANBUS_LOG_FORMAT_BINARY, true, frames, CHECK_FRAMES, out), CHECK_FRAMES);
+  check_truncate("recover.bin", 5);
+  ck_assert_int_eq(canbus_log_recover(check_path("recover.bin"), &dropped), 0);
+  ck_assert_int_eq(dropped, canbus_binlog_record_len(true) - 5);
+  ck_assert_int_eq(check_log_read("recover.bin", CANBUS_LOG_FORMAT_BINARY, out, CHECK_FRAMES), CHECK_FRAMES - 1);
+  check_frames_eq(frames, out, CHECK_FRAMES - 1);
+
+  ck_assert_int_eq(check_log_roundtrip("recover.log", CANBUS_LOG_FORMAT_CANDUMP, true, frames, CHECK_FRAMES, out), CHECK_FRAMES);
+  check_truncate("recover.log", 3);
+  ck_assert_int_eq(canbus_log_recover(check_path("recover.log"), &dropped), 0);
+  ck_assert_int_gt(dropped, 0);
+  ck_assert_int_eq(check_log_read("recover.log", CANBUS_LOG_FORMAT_CANDUMP, out, CHECK_FRAMES), CHECK_FRAMES - 1);
+  check_frames_eq(frames, out, CHECK_FRAMES - 1);
+
+  // an intact log is left as it is
+  ck_assert_int_eq(canbus_log_recover(check_path("recover.log"), &dropped), 0);
+  ck_assert_int_eq(dropped, 0);
+
+  // a file that is not a log is not cut
+  check_write_file("notes.txt", "not a log\nat all", 16);
+  ck_assert_int_eq(canbus_log_recover(check_path("notes.txt"), &dropped), EINVAL);
+  ck_assert_int_eq(stat(check_path("notes.txt"), &st), 0);
+  ck_assert_int_eq(st.st_size, 16);
+}
+END_TEST
+
+START_TEST(test_canbus_log_segment_names)
+{
+  char filename[CANBUS_LOG_FILENAME_LEN];
+
+  canbus_log_segment_name("/var/log/can0.bin", CANBUS_LOG_FORMAT_BINARY, 2, filename, sizeof(filename));
+  ck_assert_str_eq(filename, "/var/log/can0_0002.bin");
+  canbus_log_segment_manifest("/var/log/can0.bin", CANBUS_LOG_FORMAT_BINARY, filename, sizeof(filename));
+  ck_assert_str_eq(filename, "/var/log/can0.manifest");
+
+  // a session without the backend's extension is numbered at its end
+  canbus_log_segment_name("/var/log/can0", CANBUS_LOG_FORMAT_CANDUMP, 13, filename, sizeof(filename));
+  ck_assert_str_eq(filename, "/var/log/can0_0013");
+  canbus_log_segment_manifest("/var/log/can0", CANBUS_LOG_FORMAT_CANDUMP, filename, sizeof(filename));
+  ck_assert_str_eq(filename, "/var/log/can0.manifest");
+}
+END_TEST
+
+START_TEST(test_canbus_log_segments)
+{
+  canbus_frame frames[CHECK_FRAMES], out[CHECK_FRAMES];
+  char session[CANBUS_LOG_FILENAME_LEN], filename[CANBUS_LOG_FILENAME_LEN], line[512], name[64], expected[64];
+  long first_sec, first_usec, last_sec, last_usec;
+  unsigned long long count;
+  long long bytes;
+  unsigned int i, seq = 0, read = 0;
+  canbus_log log;
+  struct stat st;
+  FILE *manifest;
+
+  check_sample_frames(frames, CHECK_FRAMES, true);
+  snprintf(session, sizeof(session), "%s", check_path("session" CANBUS_BINLOG_EXT));
+
+  // segments roll over between batches once they hold 100 records
+  ck_assert_int_eq(canbus_log_create_segmented(&log, session, CANBUS_LOG_FORMAT_BINARY, "can0", true, 100 * canbus_binlog_record_len(true), 0), 0);
+  for(i=0; i<CHECK_FRAMES; i+=CANBUS_BATCH_SIZE) {
+    ck_assert_int_eq(canbus_log_write_frames(&log, frames + i, CHECK_FRAMES - i < CANBUS_BATCH_SIZE ? CHECK_FRAMES - i : CANBUS_BATCH_SIZE), 0);
+  }
+  canbus_log_close(&log);
+
+  canbus_log_segment_manifest(session, CANBUS_LOG_FORMAT_BINARY, filename, sizeof(filename));
+  manifest = fopen(filename, "r");
+  ck_assert_ptr_ne(manifest, NULL);
+  ck_assert_ptr_ne(fgets(line, sizeof(line), manifest), NULL);
+  ck_assert_str_eq(line, "# segment\tfirst\tlast\tframes\tbytes\n");
+
+  // every segment is listed once closed, with the frames it holds
+  while(fgets(line, sizeof(line), manifest) != NULL) {
+    ck_assert_int_eq(sscanf(line, "%63s %ld.%ld %ld.%ld %llu %lld", name, &first_sec, &first_usec, &last_sec, &last_usec, &count, &bytes), 7);
+    canbus_log_segment_name(session, CANBUS_LOG_FORMAT_BINARY, ++seq, filename, sizeof(filename));
+    snprintf(expected, sizeof(expected), "session_%04u" CANBUS_BINLOG_EXT, seq);
+    ck_assert_str_eq(name, expected);
+    ck_assert_int_gt(count, 0);
+    ck_assert_int_le(read + count, CHECK_FRAMES);
+    ck_assert_int_eq(first_sec, frames[read].ts.tv_sec);
+    ck_assert_int_eq(first_usec, frames[read].ts.tv_nsec / 1000);
+    ck_assert_int_eq(last_sec, frames[read + count - 1].ts.tv_sec);
+    ck_assert_int_eq(last_usec, frames[read + count - 1].ts.tv_nsec / 1000);
+
+    ck_assert_int_eq(stat(filename, &st), 0);
+    ck_assert_int_eq(st.st_size, bytes);
+
+    ck_assert_int_eq(check_log_read(name, CANBUS_LOG_FORMAT_BINARY, out, CHECK_FRAMES), count);
+    check_frames_eq(frames + read, out, count);
+    read += count;
+  }
+  fclose(manifest);
+  ck_assert_int_gt(seq, 1);
+  ck_assert_int_eq(read, CHECK_FRAMES);
+}
+END_TEST
+
+#define CHECK_INDEX_FRAMES (3 * CANBUS_LOG_INDEX_FRAMES + 500)
+
+/**
+ * Writes frames as an indexed log, a batch at a time.
+ */
+static void check_log_indexed(const char *name, uint8_t format, canbus_frame *frames, unsigned int count) {
+  canbus_log log;
+  unsigned int i;
+
+  ck_assert_int_eq(canbus_log_create(&log, check_path(name), format, "can0", true), 0);
+  ck_assert_int_eq(canbus_log_index_create(&log), 0);
+  for(i=0; i<count; i+=CANBUS_BATCH_SIZE) {
+    ck_assert_int_eq(canbus_log_write_frames(&log, frames + i, count - i < CANBUS_BATCH_SIZE ? count - i : CANBUS_BATCH_SIZE), 0);
+  }
+  canbus_log_close(&log);
+}
+
+/**
+ * Reads what filter passes out of name, expecting it to have an index or not.
+ */
+static unsigned int check_log_filtered(const char *name, bool indexed, canbus_log_filter *filter, canbus_frame *out, unsigned int max) {
+  canbus_log log;
+  unsigned int n = 0;
+  int rc;
+
+  ck_assert_int_eq(canbus_log_load(&log, check_path(name)), 0);
+  ck_assert_int_eq(log.index != NULL, indexed);
+  while(n < max && (rc = canbus_log_read_filtered(&log, filter, out + n, max - n)) > 0) {
+    n += rc;
+  }
+  canbus_log_close(&log);
+  return n;
+}
+
+/**
+ * The frames filter passes, picked out of frames by hand.
+ */
+static unsigned int check_filter_frames(canbus_log_filter *filter, canbus_frame *frames, unsigned int count, canbus_frame *out) {
+  unsigned int i, n = 0;
+  for(i=0; i<count; i++) {
+    if(canbus_log_filter_match(filter, &frames[i])) {
+      out[n++] = frames[i];
+    }
+  }
+  return n;
+}
+
+START_TEST(test_canbus_log_index)
+{
+  canbus_frame *frames = malloc(sizeof(canbus_frame) * CHECK_INDEX_FRAMES);
+  canbus_frame *out = malloc(sizeof(canbus_frame) * CHECK_INDEX_FRAMES);
+  uint8_t formats[] = { CANBUS_LOG_FORMAT_BINARY, CANBUS_LOG_FORMAT_COMPRESSED };
+  const char *names[] = { "indexed" CANBUS_BINLOG_EXT, "indexed" CANBUS_BLOCKLOG_EXT };
+  canbus_log_filter filter;
+  struct timespec end;
+  canbus_log log;
+  unsigned int i, j, frame_count;
+
+  check_sample_frames(frames, CHECK_INDEX_FRAMES, true);
+  for(i=0; i<sizeof(formats); i++) {
+    check_log_indexed(names[i], formats[i], frames, CHECK_INDEX_FRAMES);
+
+    // entries cover at least CANBUS_LOG_INDEX_FRAMES frames each, and every frame once
+    ck_assert_int_eq(canbus_log_load(&log, check_path(names[i])), 0);
+    ck_assert_ptr_ne(log.index, NULL);
+    ck_assert_int_ge(log.index->count, 3);
+    ck_assert_int_le(log.index->count, 4);
+    for(j=0, frame_count=0; j<log.index->count; j++) {
+      ck_assert_int_eq(le64toh(log.index->entries[j].offset) + le64toh(log.index->entries[j].len),
+        j + 1 < log.index->count ? le64toh(log.index->entries[j + 1].offset) : log.index->tail);
+      frame_count += le32toh(log.index->entries[j].frames);
+    }
+    ck_assert_int_eq(frame_count, CHECK_INDEX_FRAMES);
+    ck_assert(canbus_log_index_end(&log, &end));
+    ck_assert_int_eq(end.tv_sec, frames[CHECK_INDEX_FRAMES - 1].ts.tv_sec);
+    ck_assert_int_eq(end.tv_nsec, frames[CHECK_INDEX_FRAMES - 1].ts.tv_nsec);
+    canbus_log_close(&log);
+
+    // an open filter reads the whole log through the index
+    memset(&filter, 0, sizeof(filter));
+    ck_assert_int_eq(check_log_filtered(names[i], true, &filter, out, CHECK_INDEX_FRAMES), CHECK_INDEX_FRAMES);
+    check_frames_eq(frames, out, CHECK_INDEX_FRAMES);
+  }
+  free(frames);
+  free(out);
+}
+END_TEST
+
+START_TEST(test_canbus_log_index_seek)
+{
+  canbus_frame *frames = malloc(sizeof(canbus_frame) * CHECK_INDEX_FRAMES);
+  canbus_frame *out = malloc(sizeof(canbus_frame) * CHECK_INDEX_FRAMES);
+  canbus_frame *expected = malloc(sizeof(canbus_frame) * CHECK_INDEX_FRAMES);
+  uint32_t ids[] = { 0x700 + 0x42, (0x18daf100 + 3 * 2000) | CAN_EFF_FLAG };
+  canbus_log_filter filter;
+  unsigned int n;
+
+  check_sample_frames(frames, CHECK_INDEX_FRAMES, true);
+  check_log_indexed("seek.bin", CANBUS_LOG_FORMAT_BINARY, frames, CHECK_INDEX_FRAMES);
+  check_log_roundtrip("seek_unindexed.bin", CANBUS_LOG_FORMAT_BINARY, true, frames, CHECK_INDEX_FRAMES, out);
+
+  // a time window inside the second entry
+  memset(&filter, 0, sizeof(filter));
+  filter.from = frames[CANBUS_LOG_INDEX_FRAMES + 100].ts;
+  filter.to = frames[CANBUS_LOG_INDEX_FRAMES + 400].ts;
+  n = check_filter_frames(&filter, frames, CHECK_INDEX_FRAMES, expected);
+  ck_assert_int_eq(n, 301);
+  ck_assert_int_eq(check_log_filtered("seek.bin", true, &filter, out, CHECK_INDEX_FRAMES), n);
+  check_frames_eq(expected, out, n);
+  ck_assert_int_eq(check_log_filtered("seek_unindexed.bin", false, &filter, out, CHECK_INDEX_FRAMES), n);
+  check_frames_eq(expected, out, n);
+
+  // ids alone, and ids within an open ended window
+  filter.nids = 2;
+  filter.ids = ids;
+  memset(&filter.from, 0, sizeof(filter.from));
+  memset(&filter.to, 0, sizeof(filter.to));
+  n = check_filter_frames(&filter, frames, CHECK_INDEX_FRAMES, expected);
+  ck_assert_int_gt(n, 1);
+  ck_assert_int_eq(check_log_filtered("seek.bin", true, &filter, out, CHECK_INDEX_FRAMES), n);
+  check_frames_eq(expected, out, n);
+  ck_assert_int_eq(check_log_filtered("seek_unindexed.bin", false, &filter, out, CHECK_INDEX_FRAMES), n);
+  check_frames_eq(expected, out, n);
+
+  filter.from = frames[2 * CANBUS_LOG_INDEX_FRAMES].ts;
+  n = check_filter_frames(&filter, frames, CHECK_INDEX_FRAMES, expected);
+  ck_assert_int_eq(check_log_filtered("seek.bin", true, &filter, out, CHECK_INDEX_FRAMES), n);
+  check_frames_eq(expected, out, n);
+
+  // a window past the end of the log
+  memset(&filter, 0, sizeof(filter));
+  filter.from.tv_sec = frames[CHECK_INDEX_FRAMES - 1].ts.tv_sec + 60;
+  ck_assert_int_eq(check_log_filtered("seek.bin", true, &filter, out, CHECK_INDEX_FRAMES), 0);
+
+  free(frames);
+  free(out);
+  free(expected);
+}
+END_TEST
+
+START_TEST(test_canbus_log_index_truncated)
+{
+  canbus_frame *frames = malloc(sizeof(canbus_frame) * CHECK_INDEX_FRAMES);
+  canbus_frame *out = malloc(sizeof(canbus_frame) * CHECK_INDEX_FRAMES);
+  canbus_frame *expected = malloc(sizeof(canbus_frame) * CHECK_INDEX_FRAMES);
+  canbus_log_filter filter;
+  canbus_log log;
+  struct stat st;
+  unsigned int n, kept;
+  off_t dropped;
+
+  check_sample_frames(frames, CHECK_INDEX_FRAMES, true);
+  check_log_indexed("truncated.bin", CANBUS_LOG_FORMAT_BINARY, frames, CHECK_INDEX_FRAMES);
+
+  // cut the log inside its third entry; recovery leaves the index alone
+  check_truncate("truncated.bin", (CHECK_INDEX_FRAMES - 2 * CANBUS_LOG_INDEX_FRAMES - 100) * canbus_binlog_record_len(true) + 7);
+  ck_assert_int_eq(canbus_log_recover(check_path("truncated.bin"), &dropped), 0);
+  ck_assert_int_eq(dropped, canbus_binlog_record_len(true) - 7);
+  kept = 2 * CANBUS_LOG_INDEX_FRAMES + 99;
+
+  // the entries past the new end are dropped on load and the rest is scanned
+  ck_assert_int_eq(canbus_log_load(&log, check_path("truncated.bin")), 0);
+  ck_assert_ptr_ne(log.index, NULL);
+  ck_assert_int_eq(log.index->count, 2);
+  canbus_log_close(&log);
+
+  memset(&filter, 0, sizeof(filter));
+  ck_assert_int_eq(check_log_filtered("truncated.bin", true, &filter, out, CHECK_INDEX_FRAMES), kept);
+  check_frames_eq(frames, out, kept);
+
+  filter.from = frames[2 * CANBUS_LOG_INDEX_FRAMES - 50].ts;
+  n = check_filter_frames(&filter, frames, kept, expected);
+  ck_assert_int_eq(n, 50 + 99);
+  ck_assert_int_eq(check_log_filtered("truncated.bin", true, &filter, out, CHECK_INDEX_FRAMES), n);
+  check_frames_eq(expected, out, n);
+
+  // rewriting what is left, as ecutools-logconv -x does, indexes all of it again
+  check_log_indexed("rebuilt.bin", CANBUS_LOG_FORMAT_BINARY, frames, kept);
+  ck_assert_int_eq(canbus_log_load(&log, check_path("rebuilt.bin")), 0);
+  ck_assert_ptr_ne(log.index, NULL);
+  ck_assert_int_eq(log.index->count, 3);
+  ck_assert_int_eq(le32toh(log.index->entries[2].frames), 99);
+  ck_assert_int_eq(fstat(fileno(log.file), &st), 0);
+  ck_assert_int_eq(log.index->tail, st.st_size);
+  canbus_log_close(&log);
+
+  free(frames);
+  free(out);
+  free(expected);
+}
+END_TEST
+
+/**
+ * Frames a canbus_logreader hands over, appended in the order onframes gets them.
+ */
+typedef struct {
+  canbus_frame *frames;
+  unsigned int count;
+  unsigned int max;
+  bool ordered;
+} check_logreader_out;
+
+static void check_logreader_onframes(canbus_frame *frames, unsigned int nframes, unsigned int worker, void *arg) {
+  check_logreader_out *out = arg;
+  unsigned int n = __atomic_fetch_add(&out->count, nframes, __ATOMIC_RELAXED);
+  ck_assert(!out->ordered || worker == 0);
+  ck_assert_int_le(n + nframes, out->max);
+  memcpy(out->frames + n, frames, nframes * sizeof(canbus_frame));
+}
+
+/**
+ * Reads name through a canbus_logreader with threads workers.
+ */
+static unsigned int check_logreader_read(const char *name, unsigned int threads, unsigned int flags, canbus_frame *frames, unsigned int max) {
+  check_logreader_out out = { frames, 0, max, (flags & CANBUS_LOGREADER_UNORDERED) == 0 };
+  canbus_logreader reader;
+  canbus_log log;
+
+  ck_assert_int_eq(canbus_log_load(&log, check_path(name)), 0);
+  ck_assert_int_eq(canbus_logreader_open(&reader, &log, threads, flags), 0);
+  ck_assert_int_eq(canbus_logreader_run(&reader, check_logreader_onframes, &out), 0);
+  ck_assert_int_eq(reader.stats.frames, out.count);
+  canbus_logreader_close(&reader);
+  canbus_log_close(&log);
+  return out.count;
+}
+
+static int check_frame_ts_cmp(const void *a, const void *b) {
+  const canbus_frame *x = a, *y = b;
+  if(x->ts.tv_sec != y->ts.tv_sec) return x->ts.tv_sec < y->ts.tv_sec ? -1 : 1;
+  if(x->ts.tv_nsec != y->ts.tv_nsec) return x->ts.tv_nsec < y->ts.tv_nsec ? -1 : 1;
+  return 0;
+}
+
+START_TEST(test_canbus_logreader)
+{
+  canbus_frame *frames = malloc(sizeof(canbus_frame) * CHECK_INDEX_FRAMES);
+  canbus_frame *expected = malloc(sizeof(canbus_frame) * CHECK_INDEX_FRAMES);
+  canbus_frame *out = malloc(sizeof(canbus_frame) * CHECK_INDEX_FRAMES);
+  uint8_t formats[] = { CANBUS_LOG_FORMAT_BINARY, CANBUS_LOG_FORMAT_CANDUMP, CANBUS_LOG_FORMAT_ASC,
+    CANBUS_LOG_FORMAT_PCAPNG, CANBUS_LOG_FORMAT_COMPRESSED };
+  char name[32];
+  unsigned int i, threads, n;
+
+  check_sample_frames(frames, CHECK_INDEX_FRAMES, true);
+  for(i=0; i<sizeof(formats); i++) {
+    snprintf(name, sizeof(name), "reader%s", canbus_log_backend_get(formats[i])->ext);
+    n = check_log_roundtrip(name, formats[i], true, frames, CHECK_INDEX_FRAMES, expected);
+    ck_assert_int_eq(n, CHECK_INDEX_FRAMES);
+
+    // several chunks, split on record boundaries, come back as the sequential reader reads them
+    for(threads=1; threads<=4; threads*=2) {
+      ck_assert_int_eq(check_logreader_read(name, threads, 0, out, CHECK_INDEX_FRAMES), n);
+      check_frames_eq(expected, out, n);
+    }
+
+    // unordered, every frame still arrives once
+    ck_assert_int_eq(check_logreader_read(name, 4, CANBUS_LOGREADER_UNORDERED, out, CHECK_INDEX_FRAMES), n);
+    qsort(out, n, sizeof(canbus_frame), check_frame_ts_cmp);
+    check_frames_eq(expected, out, n);
+  }
+  free(frames);
+  free(expected);
+  free(out);
+}
+END_TEST
+
+START_TEST(test_canbus_logreader_filter)
+{
+  canbus_frame *frames = malloc(sizeof(canbus_frame) * CHECK_INDEX_FRAMES);
+  canbus_frame *expected = malloc(sizeof(canbus_frame) * CHECK_INDEX_FRAMES);
+  canbus_frame *out = malloc(sizeof(canbus_frame) * CHECK_INDEX_FRAMES);
+  check_logreader_out collected = { out, 0, CHECK_INDEX_FRAMES, true };
+  canbus_log_filter filter;
+  canbus_logreader reader;
+  canbus_log log;
+  unsigned int i, n, kept;
+
+  check_sample_frames(frames, CHECK_INDEX_FRAMES, true);
+  check_log_indexed("reader_indexed.bin", CANBUS_LOG_FORMAT_BINARY, frames, CHECK_INDEX_FRAMES);
+
+  memset(&filter, 0, sizeof(filter));
+  filter.from = frames[2 * CANBUS_LOG_INDEX_FRAMES + 10].ts;
+  filter.to = frames[2 * CANBUS_LOG_INDEX_FRAMES + 20].ts;
+  n = check_filter_frames(&filter, frames, CHECK_INDEX_FRAMES, expected);
+
+  // only the index entry holding the window is read
+  ck_assert_int_eq(canbus_log_load(&log, check_path("reader_indexed.bin")), 0);
+  ck_assert_int_eq(canbus_logreader_open(&reader, &log, 2, 0), 0);
+  canbus_logreader_filter(&reader, &filter);
+  ck_assert_int_eq(canbus_logreader_run(&reader, check_logreader_onframes, &collected), 0);
+  ck_assert_int_le(collected.count, CHECK_INDEX_FRAMES - 2 * CANBUS_LOG_INDEX_FRAMES);
+  ck_assert_int_lt(reader.stats.bytes, reader.size / 2);
+  canbus_logreader_close(&reader);
+  canbus_log_close(&log);
+
+  for(i=0, kept=0; i<collected.count; i++) {
+    if(canbus_log_filter_match(&filter, &out[i])) {
+      out[kept++] = out[i];
+    }
+  }
+  ck_assert_int_eq(kept, n);
+  check_frames_eq(expected, out, n);
+
+  free(frames);
+  free(expected);
+  free(out);
+}
+END_TEST
+
+/**
+ * The ID rules the logq tests query with: one exact 11 bit id, a range of
+ * 11 bit ids and a masked range of 29 bit ids.
+ */
+static const uint32_t check_logquery_ids[] = { 0x701, 0x780, 0x18daf100 | CAN_EFF_FLAG };
+static const uint32_t check_logquery_masks[] = { 0x7ff, 0x7c0, 0x1ffffff0 };
+
+static void check_logquery_init(canbus_logquery *query, uint8_t action) {
+  unsigned int i;
+  canbus_logquery_init(query, action);
+  query->threads = 2;
+  for(i=0; i<3; i++) {
+    ck_assert_int_eq(canbus_logquery_add_id(query, check_logquery_ids[i], check_logquery_masks[i]), 0);
+  }
+}
+
+/**
+ * Whether frame passes the rules above and the time window, worked out by hand.
+ */
+static bool check_logquery_pass(canbus_frame *frame, struct timespec *from, struct timespec *to) {
+  uint64_t ts = (uint64_t)frame->ts.tv_sec * 1000000000ULL + frame->ts.tv_nsec;
+  unsigned int i;
+  if(from->tv_sec != 0 && ts < (uint64_t)from->tv_sec * 1000000000ULL + from->tv_nsec) return false;
+  if(to->tv_sec != 0 && ts > (uint64_t)to->tv_sec * 1000000000ULL + to->tv_nsec) return false;
+  for(i=0; i<3; i++) {
+    uint32_t mask = check_logquery_masks[i] | CAN_EFF_FLAG | CAN_ERR_FLAG;
+    if((frame->frame.can_id & mask) == (check_logquery_ids[i] & mask)) return true;
+  }
+  return false;
+}
+
+START_TEST(test_canbus_logquery_kernels)
+{
+  canbus_frame frames[CANBUS_LOGQUERY_BATCH];
+  uint16_t sel[CANBUS_LOGQUERY_BATCH], expected[CANBUS_LOGQUERY_BATCH];
+  struct timespec open = { 0, 0 };
+  canbus_logquery query;
+  int kernels[] = { CANBUS_LOGQUERY_SCALAR, CANBUS_LOGQUERY_SSE2, CANBUS_LOGQUERY_AVX2 };
+  unsigned int i, j, n, count = 0;
+
+  check_sample_frames(frames, CANBUS_LOGQUERY_BATCH, true);
+  check_logquery_init(&query, CANBUS_LOGQUERY_TOTAL);
+  for(i=0; i<CANBUS_LOGQUERY_BATCH; i++) {
+    if(check_logquery_pass(&frames[i], &open, &open)) expected[count++] = i;
+  }
+  ck_assert_int_gt(count, 32);
+
+  // every kernel the CPU has picks the same frames; the ones it lacks fall back
+  for(i=0; i<3; i++) {
+    ck_assert_int_le(canbus_logquery_kernel(kernels[i]), kernels[i]);
+    n = canbus_logquery_match(&query, frames, CANBUS_LOGQUERY_BATCH, sel);
+    ck_assert_int_eq(n, count);
+    ck_assert(memcmp(sel, expected, count * sizeof(uint16_t)) == 0);
+
+    // an odd count leaves a remainder for the scalar tail
+    n = canbus_logquery_match(&query, frames + 3, CANBUS_LOGQUERY_BATCH - 5, sel);
+    ck_assert_int_eq(n, count - 2);
+    for(j=0; j<n; j++) {
+      ck_assert_int_eq(sel[j] + 3, expected[j + 2]);
+    }
+  }
+  canbus_logquery_kernel(CANBUS_LOGQUERY_AUTO);
+  canbus_logquery_free(&query);
+}
+END_TEST
+
+/**
+ * Runs a TOTAL query with the window from, to over name.
+ */
+static uint64_t check_logquery_total(const char *name, struct timespec *from, struct timespec *to) {
+  canbus_logquery query;
+  uint64_t matched;
+
+  check_logquery_init(&query, CANBUS_LOGQUERY_TOTAL);
+  query.from = *from;
+  query.to = *to;
+  ck_assert_int_eq(canbus_logquery_run(&query, check_path(name)), 0);
+  matched = canbus_logquery_matched(&query);
+  canbus_logquery_free(&query);
+  return matched;
+}
+
+START_TEST(test_canbus_logquery_window)
+{
+  canbus_frame *frames = malloc(sizeof(canbus_frame) * CHECK_INDEX_FRAMES);
+  canbus_frame *out = malloc(sizeof(canbus_frame) * CHECK_INDEX_FRAMES);
+  struct timespec from = { 0, 0 }, to = { 0, 0 };
+  canbus_logquery_count *counts;
+  canbus_logquery query;
+  unsigned int i, n, expected, ncounts;
+  uint64_t first = 0, last = 0;
+
+  check_sample_frames(frames, CHECK_INDEX_FRAMES, true);
+  check_log_indexed("query.bin", CANBUS_LOG_FORMAT_BINARY, frames, CHECK_INDEX_FRAMES);
+  check_log_roundtrip("query_unindexed.bin", CANBUS_LOG_FORMAT_BINARY, true, frames, CHECK_INDEX_FRAMES, out);
+
+  // ids alone
+  for(i=0, expected=0; i<CHECK_INDEX_FRAMES; i++) {
+    expected += check_logquery_pass(&frames[i], &from, &to);
+  }
+  ck_assert_int_eq(check_logquery_total("query.bin", &from, &to), expected);
+  ck_assert_int_eq(check_logquery_total("query_unindexed.bin", &from, &to), expected);
+
+  // ids within a window across an index entry boundary, the index skipping the rest
+  from = frames[CANBUS_LOG_INDEX_FRAMES - 700].ts;
+  to = frames[CANBUS_LOG_INDEX_FRAMES + 900].ts;
+  for(i=0, expected=0; i<CHECK_INDEX_FRAMES; i++) {
+    expected += check_logquery_pass(&frames[i], &from, &to);
+  }
+  ck_assert_int_gt(expected, 0);
+  ck_assert_int_eq(check_logquery_total("query.bin", &from, &to), expected);
+  ck_assert_int_eq(check_logquery_total("query_unindexed.bin", &from, &to), expected);
+
+  // the per id counts add up to the same frames, with their time range
+  check_logquery_init(&query, CANBUS_LOGQUERY_COUNT);
+  query.from = from;
+  query.to = to;
+  ck_assert_int_eq(canbus_logquery_run(&query, check_path("query.bin")), 0);
+  counts = canbus_logquery_counts(&query, &ncounts);
+  ck_assert_ptr_ne(counts, NULL);
+  for(i=0, n=0; i<ncounts; i++) {
+    n += counts[i].frames;
+    if(counts[i].can_id == 0x701) {
+      first = counts[i].first_ns;
+      last = counts[i].last_ns;
+    }
+  }
+  ck_assert_int_eq(n, expected);
+  for(i=CHECK_INDEX_FRAMES; i-->0;) {
+    if(frames[i].frame.can_id == 0x701 && check_logquery_pass(&frames[i], &from, &to)) {
+      ck_assert_int_eq(last, (uint64_t)frames[i].ts.tv_sec * 1000000000ULL + frames[i].ts.tv_nsec);
+      break;
+    }
+  }
+  for(i=0; i<CHECK_INDEX_FRAMES; i++) {
+    if(frames[i].frame.can_id == 0x701 && check_logquery_pass(&frames[i], &from, &to)) {
+      ck_assert_int_eq(first, (uint64_t)frames[i].ts.tv_sec * 1000000000ULL + frames[i].ts.tv_nsec);
+      break;
+    }
+  }
+  free(counts);
+  canbus_logquery_free(&query);
+
+  free(frames);
+  free(out);
+}
+END_TEST
+
+START_TEST(test_canbus_logquery_last)
+{
+  canbus_frame *frames = malloc(sizeof(canbus_frame) * CHECK_INDEX_FRAMES);
+  canbus_frame *out = malloc(sizeof(canbus_frame) * CHECK_INDEX_FRAMES);
+  struct timespec from, to = { 0, 0 };
+  canbus_logquery query;
+  unsigned int i, expected;
+
+  check_sample_frames(frames, CHECK_INDEX_FRAMES, true);
+  check_log_indexed("last.bin", CANBUS_LOG_FORMAT_BINARY, frames, CHECK_INDEX_FRAMES);
+  check_log_roundtrip("last_unindexed.bin", CANBUS_LOG_FORMAT_BINARY, true, frames, CHECK_INDEX_FRAMES, out);
+
+  // -l 1.5: the window ends at the last frame the index knows
+  from = frames[CHECK_INDEX_FRAMES - 1].ts;
+  from.tv_sec -= 1;
+  from.tv_nsec -= 500000000;
+  if(from.tv_nsec < 0) {
+    from.tv_sec--;
+    from.tv_nsec += 1000000000;
+  }
+  for(i=0, expected=0; i<CHECK_INDEX_FRAMES; i++) {
+    expected += check_logquery_pass(&frames[i], &from, &to);
+  }
+  ck_assert_int_gt(expected, 0);
+
+  check_logquery_init(&query, CANBUS_LOGQUERY_TOTAL);
+  query.last.tv_sec = 1;
+  query.last.tv_nsec = 500000000;
+  ck_assert_int_eq(canbus_logquery_run(&query, check_path("last.bin")), 0);
+  ck_assert_int_eq(canbus_logquery_matched(&query), expected);
+  ck_assert_int_lt(query.scanned, CHECK_INDEX_FRAMES);
+
+  // without an index there is no end to count back from
+  ck_assert_int_eq(canbus_logquery_run(&query, check_path("last_unindexed.bin")), ENOENT);
+  ck_assert_int_eq(canbus_logquery_matched(&query), expected);
+  ck_assert_int_eq(query.from.tv_sec, 0);
+  ck_assert_int_eq(query.to.tv_sec, 0);
+  canbus_logquery_free(&query);
+
+  free(frames);
+  free(out);
+}
+END_TEST
+
+/**
+ * Extracts what the rules pass in the window from, to out of name as CSV
+ * into a file of its own and returns its size.
+ */
+static long check_logquery_csv(const char *name, const char *csv, struct timespec *from, struct timespec *to) {
+  canbus_logquery query;
+  long size;
+
+  check_logquery_init(&query, CANBUS_LOGQUERY_FRAMES);
+  query.from = *from;
+  query.to = *to;
+  query.out = fopen(check_path(csv), "w+");
+  ck_assert_ptr_ne(query.out, NULL);
+  ck_assert_int_eq(canbus_logquery_run(&query, check_path(name)), 0);
+  size = ftell(query.out);
+  fclose(query.out);
+  canbus_logquery_free(&query);
+  return size;
+}
+
+START_TEST(test_canbus_logquery_csv)
+{
+  canbus_frame *frames = malloc(sizeof(canbus_frame) * CHECK_INDEX_FRAMES);
+  canbus_frame *out = malloc(sizeof(canbus_frame) * CHECK_INDEX_FRAMES);
+  struct timespec from, to;
+  char *indexed, *unindexed;
+  long size;
+  FILE *file;
+
+  check_sample_frames(frames, CHECK_INDEX_FRAMES, true);
+  check_log_indexed("csv.bin", CANBUS_LOG_FORMAT_BINARY, frames, CHECK_INDEX_FRAMES);
+  check_log_roundtrip("csv_unindexed.bin", CANBUS_LOG_FORMAT_BINARY, true, frames, CHECK_INDEX_FRAMES, out);
+  from = frames[500].ts;
+  to = frames[2 * CANBUS_LOG_INDEX_FRAMES + 500].ts;
+
+  // indexed and unindexed logs extract the same frames in the same order
+  size = check_logquery_csv("csv.bin", "indexed.csv", &from, &to);
+  ck_assert_int_gt(size, 0);
+  ck_assert_int_eq(check_logquery_csv("csv_unindexed.bin", "unindexed.csv", &from, &to), size);
+
+  indexed = malloc(size);
+  unindexed = malloc(size);
+  ck_assert_ptr_ne(file = fopen(check_path("indexed.csv"), "r"), NULL);
+  ck_assert_int_eq(fread(indexed, 1, size, file), size);
+  fclose(file);
+  ck_assert_ptr_ne(file = fopen(check_path("unindexed.csv"), "r"), NULL);
+  ck_assert_int_eq(fread(unindexed, 1, size, file), size);
+  fclose(file);
+  ck_assert(memcmp(indexed, unindexed, size) == 0);
+
+  free(indexed);
+  free(unindexed);
+  free(frames);
+  free(out);
+}
+END_TEST
+
+/**
+ * Writes frames through a canbus_logwriter using io, a batch at a time the
+ * way the reactor does. Returns false when the kernel can not do io.
+ */
+static bool check_logwriter_write(const char *name, uint8_t format, uint8_t io, canbus_frame *frames, unsigned int count) {
+  canbus_log log;
+  canbus_logwriter writer;
+  struct stat st;
+  unsigned int i;
+
+  ck_assert_int_eq(canbus_log_create(&log, check_path(name), format, "can0", true), 0);
+  ck_assert_int_eq(canbus_logwriter_init(&writer, &log, 1024, 0), 0);
+  if(io == CANBUS_LOGWRITER_IO_URING && writer.io != CANBUS_LOGWRITER_IO_URING) {
+    canbus_logwriter_free(&writer);
+    canbus_log_close(&log);
+    return false;
+  }
+  writer.io = io;
+  ck_assert_int_eq(canbus_logwriter_start(&writer), 0);
+  for(i=0; i<count; i+=CANBUS_BATCH_SIZE) {
+    ck_assert_int_eq(canbus_logwriter_push(&writer, frames + i, count - i < CANBUS_BATCH_SIZE ? count - i : CANBUS_BATCH_SIZE), 0);
+  }
+
+  // stop writes out the partly filled buffer and leaves the FILE at its end
+  canbus_logwriter_stop(&writer);
+  ck_assert_int_eq(writer.stats.frames, count);
+  ck_assert_int_eq(writer.stats.dropped + writer.stats.lost, 0);
+  ck_assert_int_eq(fstat(fileno(log.file), &st), 0);
+  ck_assert_int_eq(ftello(log.file), st.st_size);
+  ck_assert_int_eq(writer.stats.bytes, st.st_size - writer.base);
+  canbus_logwriter_free(&writer);
+  canbus_log_close(&log);
+  return true;
+}
+
+START_TEST(test_canbus_logwriter_roundtrip)
+{
+  canbus_frame frames[CHECK_FRAMES], out[CHECK_FRAMES];
+  uint8_t formats[] = { CANBUS_LOG_FORMAT_BINARY, CANBUS_LOG_FORMAT_CANDUMP };
+  unsigned int i;
+
+  check_sample_frames(frames, CHECK_FRAMES, true);
+  for(i=0; i<sizeof(formats); i++) {
+    ck_assert(check_logwriter_write("writer.pwritev", formats[i], CANBUS_LOGWRITER_IO_PWRITEV, frames, CHECK_FRAMES));
+    ck_assert_int_eq(check_log_read("writer.pwritev", formats[i], out, CHECK_FRAMES), CHECK_FRAMES);
+    check_frames_eq(frames, out, CHECK_FRAMES);
+
+    // io_uring writes the same file as the pwritev fallback
+    if(check_logwriter_write("writer.uring", formats[i], CANBUS_LOGWRITER_IO_URING, frames, CHECK_FRAMES)) {
+      ck_assert_int_eq(check_log_read("writer.uring", formats[i], out, CHECK_FRAMES), CHECK_FRAMES);
+      check_frames_eq(frames, out, CHECK_FRAMES);
+    }
+  }
+}
+END_TEST
+
+START_TEST(test_canbus_logwriter_overflow)
+{
+  canbus_frame frames[CHECK_FRAMES], out[CHECK_FRAMES];
+  canbus_log log;
+  canbus_logwriter writer;
+
+  check_sample_frames(frames, CHECK_FRAMES, true);
+  ck_assert_int_eq(canbus_log_create(&log, check_path("overflow.bin"), CANBUS_LOG_FORMAT_BINARY, "can0", true), 0);
+  ck_assert_int_eq(canbus_logwriter_init(&writer, &log, CANBUS_BATCH_SIZE + 1, 0), EINVAL);
+  ck_assert_int_eq(canbus_logwriter_init(&writer, &log, CANBUS_BATCH_SIZE, 0), 0);
+
+  // with the writer not yet started the ring fills; what does not fit is refused and counted
+  ck_assert_int_eq(canbus_logwriter_push(&writer, frames, 20), 0);
+  ck_assert_int_eq(canbus_logwriter_push(&writer, frames + 20, 20), 20 + 20 - CANBUS_BATCH_SIZE);
+  ck_assert_int_eq(canbus_logwriter_push(&writer, frames + 40, 10), 10);
+  ck_assert_int_eq(writer.stats.dropped, 40 + 10 - CANBUS_BATCH_SIZE);
+  ck_assert_int_eq(writer.stats.max_queued, CANBUS_BATCH_SIZE);
+
+  ck_assert_int_eq(canbus_logwriter_start(&writer), 0);
+  canbus_logwriter_stop(&writer);
+  ck_assert_int_eq(writer.stats.frames, CANBUS_BATCH_SIZE);
+  ck_assert_int_eq(writer.stats.lost, 0);
+  canbus_logwriter_free(&writer);
+  canbus_log_close(&log);
+
+  // the frames that were accepted are the ones in the file
+  ck_assert_int_eq(check_log_read("overflow.bin", CANBUS_LOG_FORMAT_BINARY, out, CHECK_FRAMES), CANBUS_BATCH_SIZE);
+  check_frames_eq(frames, out, CANBUS_BATCH_SIZE);
+}
+END_TEST
+
+/**
+ * Appends count messages numbered from first, message i carrying i frames.
+ */
+static void check_spool_fill(canbus_spool *spool, unsigned int first, unsigned int count, size_t len) {
+  char topic[CANBUS_SPOOL_TOPIC_LEN], payload[2048];
+  unsigned int i;
+  for(i=first; i<first+count; i++) {
+    snprintf(topic, sizeof(topic), "ecutools/test/%u", i);
+    memset(payload, 'a' + i % 26, len);
+    snprintf(payload, len, "message %u", i);
+    ck_assert_int_eq(canbus_spool_append(spool, topic, payload, len, i, i % 256), 0);
+  }
+}
+
+/**
+ * Peeks the oldest message, expects it to be number i and consumes it.
+ */
+static void check_spool_take(canbus_spool *spool, unsigned int i, size_t len) {
+  char topic[CANBUS_SPOOL_TOPIC_LEN], payload[2048], expected[CANBUS_SPOOL_TOPIC_LEN];
+  ck_assert_int_eq(canbus_spool_peek(spool, topic, payload, sizeof(payload)), len);
+  snprintf(expected, sizeof(expected), "ecutools/test/%u", i);
+  ck_assert_str_eq(topic, expected);
+  snprintf(expected, sizeof(expected), "message %u", i);
+  ck_assert_str_eq(payload, expected);
+  ck_assert_int_eq(payload[len - 1], 'a' + i % 26);
+  canbus_spool_consume(spool);
+}
+
+START_TEST(test_canbus_spool_drain)
+{
+  char topic[CANBUS_SPOOL_TOPIC_LEN], payload[128];
+  canbus_spool spool;
+  unsigned int i;
+
+  ck_assert_int_eq(canbus_spool_open(&spool, check_path("drain"), 1024 * 1024), 0);
+  ck_assert_int_eq(canbus_spool_peek(&spool, topic, payload, sizeof(payload)), 0);
+  ck_assert(!canbus_spool_wait(&spool, 0));
+
+  check_spool_fill(&spool, 1, 50, 100);
+  ck_assert_int_eq(canbus_spool_frames(&spool), 50 * 51 / 2);
+  ck_assert(canbus_spool_wait(&spool, 0));
+
+  // peek alone leaves the message where it is
+  ck_assert_int_eq(canbus_spool_peek(&spool, topic, payload, sizeof(payload)), 100);
+  ck_assert_str_eq(topic, "ecutools/test/1");
+  for(i=1; i<=50; i++) {
+    check_spool_take(&spool, i, 100);
+  }
+  ck_assert_int_eq(canbus_spool_frames(&spool), 0);
+  ck_assert_int_eq(canbus_spool_peek(&spool, topic, payload, sizeof(payload)), 0);
+  ck_assert_int_eq(spool.dropped, 0);
+  canbus_spool_close(&spool);
+}
+END_TEST
+
+START_TEST(test_canbus_spool_reopen)
+{
+  canbus_spool spool;
+  unsigned int i;
+
+  ck_assert_int_eq(canbus_spool_open(&spool, check_path("reopen"), 1024 * 1024), 0);
+  check_spool_fill(&spool, 1, 10, 200);
+  for(i=1; i<=3; i++) {
+    check_spool_take(&spool, i, 200);
+  }
+  canbus_spool_sync(&spool);
+  canbus_spool_close(&spool);
+
+  ck_assert_int_eq(canbus_spool_open(&spool, check_path("reopen"), 1024 * 1024), 0);
+  ck_assert_int_eq(canbus_spool_frames(&spool), 55 - 6);
+  check_spool_fill(&spool, 11, 2, 200);
+  for(i=4; i<=12; i++) {
+    check_spool_take(&spool, i, 200);
+  }
+  ck_assert(!canbus_spool_wait(&spool, 0));
+  canbus_spool_close(&spool);
+}
+END_TEST
+
+static void check_spool_ondrop(void *arg, uint8_t tag, unsigned int frames) {
+  unsigned int *dropped = arg;
+  ck_assert_int_eq(tag, frames % 256);
+  dropped[0]++;
+  dropped[1] += frames;
+}
+
+START_TEST(test_canbus_spool_ondrop)
+{
+  canbus_spool spool;
+  unsigned int dropped[2] = {0, 0}, i;
+  uint64_t frames = 0;
+
+  ck_assert_int_eq(canbus_spool_open(&spool, check_path("ondrop"), 64 * 1024), 0);
+  spool.ondrop = check_spool_ondrop;
+  spool.ondrop_arg = dropped;
+  check_spool_fill(&spool, 1, 200, 1000);
+
+  // the oldest messages went to make room, the newest are all still there
+  ck_assert_int_gt(dropped[0], 0);
+  ck_assert_int_eq(spool.dropped, dropped[1]);
+  ck_assert_int_eq(dropped[1], dropped[0] * (dropped[0] + 1) / 2);
+  ck_assert_int_le(spool.bytes, 64 * 1024);
+  for(i=dropped[0]+1; i<=200; i++) {
+    frames += i;
+  }
+  ck_assert_int_eq(canbus_spool_frames(&spool), frames);
+  for(i=dropped[0]+1; i<=200; i++) {
+    check_spool_take(&spool, i, 1000);
+  }
+  canbus_spool_close(&spool);
+}
+END_TEST
+
+Suite * create_suite(void) {
+    Suite *suite = suite_create("canbus");
+
+    TCase *tc_filter = tcase_create("filter");
+    tcase_add_test(tc_filter, test_canbus_filter_none);
+    tcase_add_test(tc_filter, test_canbus_filter_pass_merge);
+    tcase_add_test(tc_filter, test_canbus_filter_pass_block);
+    tcase_add_test(tc_filter, test_canbus_filter_pass_covered);
+    tcase_add_test(tc_filter, test_canbus_filter_data);
+    tcase_add_test(tc_filter, test_canbus_filter_invalid);
+    suite_add_tcase(suite, tc_filter);
+
+    TCase *tc_log = tcase_create("log");
+    tcase_add_test(tc_log, test_canbus_log_binary);
+    tcase_add_test(tc_log, test_canbus_log_binary_fd);
+    tcase_add_test(tc_log, test_canbus_binlog_header);
+    tcase_add_test(tc_log, test_canbus_binlog_record);
+    tcase_add_test(tc_log, test_canbus_log_candump);
+    tcase_add_test(tc_log, test_canbus_log_candump_parse);
+    tcase_add_test(tc_log, test_canbus_log_asc);
+    tcase_add_test(tc_log, test_canbus_log_asc_parse);
+    tcase_add_test(tc_log, test_canbus_log_pcapng);
+    tcase_add_test(tc_log, test_canbus_log_pcapng_parse);
+    tcase_add_test(tc_log, test_canbus_lz4);
+    tcase_add_test(tc_log, test_canbus_blocklog_block);
+    tcase_add_test(tc_log, test_canbus_log_compressed);
+    tcase_add_test(tc_log, test_canbus_crc32c);
+    tcase_add_test(tc_log, test_canbus_log_recover);
+    tcase_add_test(tc_log, test_canbus_log_segment_names);
+    tcase_add_test(tc_log, test_canbus_log_segments);
+    tcase_add_test(tc_log, test_canbus_log_index);
+    tcase_add_test(tc_log, test_canbus_log_index_seek);
+    tcase_add_test(tc_log, test_canbus_log_index_truncated);
+    tcase_add_test(tc_log, test_canbus_logreader);
+    tcase_add_test(tc_log, test_canbus_logreader_filter);
+    suite_add_tcase(suite, tc_log);
+
+    TCase *tc_spool = tcase_create("spool");
+    tcase_add_test(tc_spool, test_canbus_spool_drain);
+    tcase_add_test(tc_spool, test_canbus_spool_reopen);
+    tcase_add_test(tc_spool, test_canbus_spool_ondrop);
+    suite_add_tcase(suite, tc_spool);
+
+    TCase *tc_logwriter = tcase_create("logwriter");
+    tcase_add_test(tc_logwriter, test_canbus_logwriter_roundtrip);
+    tcase_add_test(tc_logwriter, test_canbus_logwriter_overflow);
+    suite_add_tcase(suite, tc_logwriter);
+
+    TCase *tc_logquery = tcase_create("logquery");
+    tcase_add_test(tc_logquery, test_canbus_logquery_kernels);
+    tcase_add_test(tc_logquery, test_canbus_logquery_window);
+    tcase_add_test(tc_logquery, test_canbus_logquery_last);
+    tcase_add_test(tc_logquery, test_canbus_logquery_csv);
+    suite_add_tcase(suite, tc_logquery);
+
+    return suite;
+}
+
+int main( void ) {
+    openlog("ecutools-testsuite", LOG_CONS | LOG_PERROR, LOG_USER);
+    syslog(LOG_DEBUG, "starting ecutools-canbus-testsuite");
+    int num_fail;
+    Suite *suite = create_suite();
+    SRunner *sr = srunner_create(suite);
+    srunner_run_all(sr, CK_NORMAL);
+    num_fail = srunner_ntests_failed(sr);
+    srunner_free (sr);
+    closelog();
+    return (num_fail == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
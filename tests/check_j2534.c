@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 #include <check.h>
 #include "j2534.h"
 
@@ -47,12 +48,67 @@ START_TEST(test_j2534_PassThruOpen)
 }
 END_TEST
 
+START_TEST(test_j2534_msg_to_canbus_frame)
+{
+  unsigned char data[12] = { 0x18, 0xda, 0xf1, 0x10, 0x02, 0x10, 0x03, 0, 0, 0, 0, 0 };
+  PASSTHRU_MSG msg = { .ProtocolID = CAN, .TxFlags = CAN_29BIT_ID, .DataLength = 7, .DataBuffer = data, .DataBufferSize = 12 };
+  canbus_frame frame;
+
+  ck_assert_int_eq(j2534_msg_to_canbus_frame(&msg, &frame), STATUS_NOERROR);
+  ck_assert_int_eq(frame.frame.can_id, 0x18daf110 | CAN_EFF_FLAG);
+  ck_assert_int_eq(frame.frame.len, 3);
+  ck_assert_int_eq(frame.flags, 0);
+
+  unsigned char out[12];
+  PASSTHRU_MSG rx = { .DataBuffer = out, .DataBufferSize = 12 };
+  ck_assert_int_eq(j2534_canbus_frame_to_msg(&frame, CAN, &rx), STATUS_NOERROR);
+  ck_assert_int_eq(rx.DataLength, 7);
+  ck_assert_int_eq(memcmp(out, data, 7), 0);
+
+  // 11 bit IDs must fit CAN_SFF_MASK; CAN FD payloads must match a DLC
+  msg.TxFlags = 0;
+  ck_assert_int_eq(j2534_msg_to_canbus_frame(&msg, &frame), ERR_INVALID_MSG);
+  msg.TxFlags = CAN_29BIT_ID | J2534_CAN_FD_FORMAT;
+  msg.DataLength = 4 + 9;
+  ck_assert_int_eq(j2534_msg_to_canbus_frame(&msg, &frame), ERR_INVALID_MSG);
+}
+END_TEST
+
+START_TEST(test_j2534_msg_to_canbus_filter)
+{
+  unsigned char mask_data[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0x00 };
+  unsigned char pattern_data[6] = { 0x00, 0x00, 0x07, 0xe8, 0x41, 0x00 };
+  PASSTHRU_MSG mask = { .ProtocolID = CAN, .DataLength = 6, .DataBuffer = mask_data };
+  PASSTHRU_MSG pattern = { .ProtocolID = CAN, .DataLength = 6, .DataBuffer = pattern_data };
+  struct canbus_filter filter;
+
+  ck_assert_int_eq(j2534_msg_to_canbus_filter(PASS_FILTER, &mask, &pattern, &filter), STATUS_NOERROR);
+  ck_assert_int_eq(filter.type, CANBUS_FILTER_PASS);
+  ck_assert_int_eq(filter.can_id, 0x7e8);
+  ck_assert_int_eq(filter.can_mask, CAN_SFF_MASK | CAN_EFF_FLAG);
+  ck_assert_int_eq(filter.data_len, 1);
+  ck_assert_int_eq(filter.data[0], 0x41);
+
+  // ID only: the unmasked trailing byte is dropped; 29 bit IDs keep CAN_EFF_FLAG
+  mask_data[4] = 0x00;
+  pattern.TxFlags = CAN_29BIT_ID;
+  ck_assert_int_eq(j2534_msg_to_canbus_filter(BLOCK_FILTER, &mask, &pattern, &filter), STATUS_NOERROR);
+  ck_assert_int_eq(filter.can_id, 0x7e8 | CAN_EFF_FLAG);
+  ck_assert_int_eq(filter.data_len, 0);
+
+  pattern.DataLength = 5;
+  ck_assert_int_eq(j2534_msg_to_canbus_filter(PASS_FILTER, &mask, &pattern, &filter), ERR_INVALID_MSG);
+}
+END_TEST
+
 Suite * create_suite(void) {
     Suite *suite = suite_create("ecutools");
 
     TCase *tc_core = tcase_create("j2534");
     tcase_add_test(tc_core, test_j2534_PassThruScanForDevices);
     tcase_add_test(tc_core, test_j2534_PassThruOpen);
+    tcase_add_test(tc_core, test_j2534_msg_to_canbus_frame);
+    tcase_add_test(tc_core, test_j2534_msg_to_canbus_filter);
     suite_add_tcase(suite, tc_core);
 
     return suite;